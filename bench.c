@@ -0,0 +1,775 @@
+//
+// Protocol comparison benchmark.
+// Every protocol the device claims, plus native SBC commands, runs the same matrix of transfer sizes and queue depths
+// with random aligned LBAs. A row starts with a data check against READ SECTORS, so a SATL which completes a protocol
+// with GOOD but wrong data is told apart from a slow one. The qd_scaling column is IOPS relative to the first depth,
+// it stays around 1 when a bridge or HBA serializes queued commands.
+// The last row runs the same matrix on the block device of the drive with O_DIRECT and io_uring, so the cost or
+// gain of pass-through over the block layer is in the same table.
+// The durable write benchmark compares FUA writes with group commit, N cached writes then one FLUSH CACHE.
+// The priority benchmark runs random foreground reads against a sequential background scan, first as they come,
+// then through the priority scheduler
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "blkdev.h"
+#include "queue.h"
+#include "sched.h"
+#include "stats.h"
+
+#define BENCH_CHECK_SECTORS 8
+#define BENCH_SCAN_SECTORS  256         // background scan command size
+
+typedef struct _BENCH_RESULT {
+  unsigned int completed;
+  unsigned int errors;
+  double seconds;
+  LAT_STATS lat;
+} BENCH_RESULT;
+
+typedef struct _DURABLE_RESULT {
+  unsigned int writes;            // completed, failed ones included
+  unsigned int failed;            // writes which completed with an error
+  unsigned int errors;            // failed writes, writes which couldn't be sent and failed flushes
+  double seconds;
+  LAT_STATS write_lat;
+  LAT_STATS flush_lat;
+  LAT_STATS commit_lat;           // first write of a group is sent ~ the group is on the media
+} DURABLE_RESULT;
+
+///////////////
+// PROTOTYPE
+///////////////
+static int bench_cell(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg, unsigned int sectors, unsigned int depth, BENCH_RESULT *res);
+static const char *bench_check(DEVICE_CONTEXT *dev, unsigned char *reference);
+static int blk_cell(BLK_ENGINE *e, BENCH_CONFIG *cfg, unsigned long long span, unsigned int sectors, unsigned int depth, BENCH_RESULT *res);
+static void bench_blkdev(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg, unsigned char *reference);
+static int durable_run(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg, unsigned int group, unsigned int flags, unsigned int depth, DURABLE_RESULT *res);
+static int priority_run(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg, IO_SCHED *s, unsigned int background, double *seconds);
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+void bench_default_config(BENCH_CONFIG *cfg)
+{
+  static const unsigned int sizes[] = { 1, 8, 64, 256 };
+  static const unsigned int depths[] = { 1, 4, 32 };
+  static const unsigned int groups[] = { 1, 8, 64, 256 };
+
+  memset(cfg, 0, sizeof(BENCH_CONFIG));
+  memcpy(cfg->sizes, sizes, sizeof(sizes));
+  cfg->nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  memcpy(cfg->depths, depths, sizeof(depths));
+  cfg->ndepths = sizeof(depths) / sizeof(depths[0]);
+  memcpy(cfg->groups, groups, sizeof(groups));
+  cfg->ngroups = sizeof(groups) / sizeof(groups[0]);
+  cfg->commands = 256;
+  cfg->output = stdout;
+}
+
+// Comma separated list of numbers, e.g. "1,8,256"
+int bench_parse_list(const char *str, unsigned int *list, unsigned int *num)
+{
+  char *end;
+  unsigned long value;
+
+  *num = 0;
+  while (*str)
+  {
+    value = strtoul(str, &end, 0);
+    if (end == str || value == 0 || *num >= BENCH_MAX_POINTS)
+      return -1;
+
+    list[(*num)++] = value;
+    str = end;
+    if (*str == ',')
+      str++;
+    else if (*str)
+      return -1;
+  }
+
+  return *num ? 0 : -1;
+}
+
+static int is_queued(DEVICE_CONTEXT *dev)
+{
+  return dev->path == PATH_SBC || dev->protocol == RW_DMA_QUEUED || dev->protocol == RW_FPDMA;
+}
+
+// Keep depth commands in flight until cfg->commands are completed
+static int bench_cell(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg, unsigned int sectors, unsigned int depth, BENCH_RESULT *res)
+{
+  IO_QUEUE *q;
+  IO_REQUEST *req;
+  char *buffers;
+  unsigned int issued = 0;
+  unsigned long long span = device_capacity(dev);
+  unsigned long long slots;
+  unsigned long long start;
+  unsigned long bytes = (unsigned long)sectors * dev->sector_size;
+  unsigned int i;
+
+  memset(res, 0, sizeof(BENCH_RESULT));
+
+  if (cfg->span && cfg->span < span)
+    span = cfg->span;
+  slots = span / sectors;
+  if (slots == 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  q = (IO_QUEUE *)malloc(sizeof(IO_QUEUE));
+  buffers = (char *)malloc(bytes * depth);
+  if (q == NULL || buffers == NULL || ioq_init(q, dev, depth) != 0)
+  {
+    free(q);
+    free(buffers);
+    return -1;
+  }
+
+  // every tag owns a buffer
+  for (i = 0; i < bytes * depth; i++)
+    buffers[i] = (i % dev->sector_size) ^ 0x5A;
+
+  start = now_ns();
+  while (res->completed < cfg->commands)
+  {
+    while (issued < cfg->commands && (req = ioq_get(q)) != NULL)
+    {
+      req->isread = !cfg->iswrite;
+      req->startlba = (stats_random() % slots) * sectors;
+      req->sectors = sectors;
+      req->databuffer = buffers + req->tag * bytes;
+      issued++;
+
+      if (ioq_submit(q, req) != 0)
+      {
+        ioq_put(q, req);
+        res->completed++;
+        res->errors++;
+      }
+    }
+
+    req = ioq_reap(q);
+    if (req == NULL)
+    {
+      // the device stopped completing commands, the rest can't be done
+      if (q->inflight)
+      {
+        res->errors += cfg->commands - res->completed;
+        res->completed = cfg->commands;
+        break;
+      }
+      if (issued >= cfg->commands)
+        break;
+      continue;
+    }
+
+    stats_add(&res->lat, req->complete_ns - req->submit_ns);
+    res->completed++;
+    if (req->status != 0)
+      res->errors++;
+    ioq_put(q, req);
+  }
+  res->seconds = (now_ns() - start) / 1e9;
+
+  ioq_drain(q);
+  free(buffers);
+  free(q);
+
+  return 0;
+}
+
+// Read the first sectors with the current protocol and compare with the reference
+static const char *bench_check(DEVICE_CONTEXT *dev, unsigned char *reference)
+{
+  char buffer[BENCH_CHECK_SECTORS * MAX_SECTOR_SIZE];
+
+  memset(buffer, 0, sizeof(buffer));
+  if (device_readwrite(dev, 1, 0, 0, BENCH_CHECK_SECTORS, buffer) != 0)
+    return "failed";
+
+  return memcmp(buffer, reference, BENCH_CHECK_SECTORS * dev->sector_size) ? "mismatch" : "ok";
+}
+
+int bench_protocols(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg)
+{
+  CMD_PATH saved_path = dev->path;
+  RW_PROTOCOL saved_protocol = dev->protocol;
+  unsigned char reference[BENCH_CHECK_SECTORS * MAX_SECTOR_SIZE];
+  BENCH_RESULT res;
+  const char *name;
+  const char *check;
+  double base_iops;
+  double iops;
+  unsigned int row;
+  unsigned int s, d;
+
+  // reference data by the simplest command of the device
+  if (dev->ata_valid && dev->path == PATH_ATA)
+    dev->protocol = RW_PIO;
+  if (device_readwrite(dev, 1, 0, 0, BENCH_CHECK_SECTORS, (char *)reference) != 0)
+  {
+    printf("ERROR, %s: reference read failed\n", __func__);
+    dev->protocol = saved_protocol;
+    return -1;
+  }
+
+  fprintf(cfg->output, "device,path,protocol,check,sectors,qd,commands,errors,seconds,mbps,iops,"
+                       "lat_avg_us,lat_p50_us,lat_p99_us,lat_max_us,qd_scaling\n");
+
+  // rows RW_PIO ~ RW_FPDMA on ATA path, the last row is SBC
+  for (row = RW_PIO; row <= RW_PROTOCOL_NUM; row++)
+  {
+    if (row < RW_PROTOCOL_NUM)
+    {
+      if (saved_path != PATH_ATA || !device_protocol_supported(dev, row))
+        continue;
+      dev->path = PATH_ATA;
+      dev->protocol = row;
+      name = rw_protocol_name(row);
+    }
+    else
+    {
+      if (device_select_path(dev, PATH_SBC) != 0)
+        continue;
+      name = "sbc";
+    }
+
+    check = bench_check(dev, reference);
+    printf("benchmark %s %s, data check %s\n", cmd_path_name(dev->path), name, check);
+    if (strcmp(check, "failed") == 0)
+      continue;
+
+    for (s = 0; s < cfg->nsizes; s++)
+    {
+      if (cfg->sizes[s] > dev->max_sectors)
+      {
+        printf("%u sectors is over the max transfer %u, skipped\n", cfg->sizes[s], dev->max_sectors);
+        continue;
+      }
+
+      base_iops = 0;
+      for (d = 0; d < cfg->ndepths; d++)
+      {
+        if (cfg->depths[d] > 1 && !is_queued(dev))
+          continue;
+        if (cfg->depths[d] > 1 && dev->path == PATH_ATA && cfg->depths[d] > (unsigned int)dev->ata.queuedepth)
+          continue;
+
+        if (bench_cell(dev, cfg, cfg->sizes[s], cfg->depths[d], &res) != 0)
+          continue;
+
+        iops = res.seconds > 0 ? (res.completed - res.errors) / res.seconds : 0;
+        if (base_iops == 0)
+          base_iops = iops;
+
+        fprintf(cfg->output, "%s,%s,%s,%s,%u,%u,%u,%u,%.6f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f\n",
+                dev->dev_path, cmd_path_name(dev->path), name, check, cfg->sizes[s], cfg->depths[d],
+                res.completed, res.errors, res.seconds,
+                iops * cfg->sizes[s] * dev->sector_size / 1e6, iops,
+                stats_mean(&res.lat) / 1e3, stats_percentile(&res.lat, 50) / 1e3,
+                stats_percentile(&res.lat, 99) / 1e3, res.lat.max / 1e3,
+                base_iops > 0 ? iops / base_iops : 0);
+        fflush(cfg->output);
+
+        if (isDebug)
+          printf("DEBUG, %s %u sectors qd %u : %.1f IOPS, %u errors\n", name, cfg->sizes[s], cfg->depths[d], iops, res.errors);
+      }
+    }
+  }
+
+  dev->path = saved_path;
+  dev->protocol = saved_protocol;
+
+  if (cfg->blkdev == NULL || strcmp(cfg->blkdev, "none"))
+    bench_blkdev(dev, cfg, reference);
+
+  return 0;
+}
+
+// The matrix of one size and depth on the io_uring engine, the same random aligned LBAs as bench_cell()
+static int blk_cell(BLK_ENGINE *e, BENCH_CONFIG *cfg, unsigned long long span, unsigned int sectors, unsigned int depth, BENCH_RESULT *res)
+{
+  unsigned int freeslots[BLK_MAX_DEPTH];
+  unsigned int nfree = depth;
+  unsigned int issued = 0, inflight = 0;
+  unsigned long long slots = span / sectors;
+  unsigned long long start, ns;
+  unsigned int slot, i;
+  int ret;
+
+  memset(res, 0, sizeof(BENCH_RESULT));
+  if (slots == 0 || depth > e->depth)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+  for (i = 0; i < depth; i++)
+    freeslots[i] = depth - 1 - i;
+
+  start = now_ns();
+  while (res->completed < cfg->commands)
+  {
+    while (issued < cfg->commands && nfree)
+    {
+      slot = freeslots[--nfree];
+      issued++;
+      if (blk_submit(e, slot, !cfg->iswrite, (stats_random() % slots) * sectors, sectors) != 0)
+      {
+        freeslots[nfree++] = slot;
+        res->completed++;
+        res->errors++;
+        continue;
+      }
+      inflight++;
+    }
+
+    if (inflight == 0)
+      break;
+    if (blk_reap(e, &slot, &ret, &ns) != 0)
+      return -1;
+    inflight--;
+    freeslots[nfree++] = slot;
+
+    stats_add(&res->lat, ns);
+    res->completed++;
+    if (ret != (int)(sectors * e->sector_size))
+      res->errors++;
+  }
+  res->seconds = (now_ns() - start) / 1e9;
+
+  return 0;
+}
+
+// io_uring row, the block device of the drive with O_DIRECT
+static void bench_blkdev(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg, unsigned char *reference)
+{
+  BLK_ENGINE *e;
+  BENCH_RESULT res;
+  char path[256];
+  char buffer[BENCH_CHECK_SECTORS * MAX_SECTOR_SIZE];
+  const char *check;
+  unsigned long long span;
+  unsigned int maxsize = 0, maxdepth = 1;
+  double base_iops;
+  double iops;
+  unsigned int s, d;
+
+  if (cfg->blkdev)
+    snprintf(path, sizeof(path), "%s", cfg->blkdev);
+  else if (blk_find_path(dev, path, sizeof(path)) != 0)
+  {
+    printf("benchmark io_uring skipped, no block device of %s\n", dev->dev_path);
+    return;
+  }
+
+  for (s = 0; s < cfg->nsizes; s++)
+    maxsize = cfg->sizes[s] > maxsize ? cfg->sizes[s] : maxsize;
+  for (d = 0; d < cfg->ndepths; d++)
+    maxdepth = cfg->depths[d] > maxdepth ? cfg->depths[d] : maxdepth;
+  if (maxdepth > BLK_MAX_DEPTH)
+    maxdepth = BLK_MAX_DEPTH;
+
+  e = (BLK_ENGINE *)malloc(sizeof(BLK_ENGINE));
+  if (e == NULL)
+    return;
+  if (blk_open(e, path, maxdepth, (unsigned long)maxsize * dev->sector_size) != 0)
+  {
+    printf("benchmark io_uring skipped, %s can't be used\n", path);
+    free(e);
+    return;
+  }
+  if (e->sector_size != dev->sector_size)
+  {
+    printf("benchmark io_uring skipped, %s has %u byte sectors, the device %u\n", path, e->sector_size, dev->sector_size);
+    blk_close(e);
+    free(e);
+    return;
+  }
+
+  span = device_capacity(dev) < e->capacity ? device_capacity(dev) : e->capacity;
+  if (cfg->span && cfg->span < span)
+    span = cfg->span;
+
+  check = "failed";
+  if (blk_rw(e, 1, 0, BENCH_CHECK_SECTORS, buffer) == 0)
+    check = memcmp(buffer, reference, BENCH_CHECK_SECTORS * dev->sector_size) ? "mismatch" : "ok";
+  printf("benchmark block %s io_uring, data check %s\n", path, check);
+
+  for (s = 0; s < cfg->nsizes && strcmp(check, "failed"); s++)
+  {
+    base_iops = 0;
+    for (d = 0; d < cfg->ndepths; d++)
+    {
+      if (cfg->depths[d] > maxdepth || blk_cell(e, cfg, span, cfg->sizes[s], cfg->depths[d], &res) != 0)
+        continue;
+
+      iops = res.seconds > 0 ? (res.completed - res.errors) / res.seconds : 0;
+      if (base_iops == 0)
+        base_iops = iops;
+
+      fprintf(cfg->output, "%s,%s,%s,%s,%u,%u,%u,%u,%.6f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f\n",
+              dev->dev_path, "block", "io_uring", check, cfg->sizes[s], cfg->depths[d],
+              res.completed, res.errors, res.seconds,
+              iops * cfg->sizes[s] * dev->sector_size / 1e6, iops,
+              stats_mean(&res.lat) / 1e3, stats_percentile(&res.lat, 50) / 1e3,
+              stats_percentile(&res.lat, 99) / 1e3, res.lat.max / 1e3,
+              base_iops > 0 ? iops / base_iops : 0);
+      fflush(cfg->output);
+
+      if (isDebug)
+        printf("DEBUG, io_uring %u sectors qd %u : %.1f IOPS, %u errors\n", cfg->sizes[s], cfg->depths[d], iops, res.errors);
+    }
+  }
+
+  blk_close(e);
+  free(e);
+}
+
+// Durable writes of one mode. group ZERO : every write with FUA and no flush,
+// otherwise group writes go to the cache with up to depth in flight, then one flush makes them durable
+static int durable_run(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg, unsigned int group, unsigned int flags, unsigned int depth, DURABLE_RESULT *res)
+{
+  IO_QUEUE *q;
+  IO_REQUEST *req;
+  char *buffers;
+  unsigned int sectors = cfg->sizes[0];
+  unsigned int pergroup = group ? group : 1;
+  unsigned int issued, completed;
+  unsigned int sent = 0;
+  unsigned long long span = device_capacity(dev);
+  unsigned long long slots;
+  unsigned long long start, group_start, t;
+  unsigned long bytes = (unsigned long)sectors * dev->sector_size;
+  unsigned int i;
+
+  memset(res, 0, sizeof(DURABLE_RESULT));
+
+  if (cfg->span && cfg->span < span)
+    span = cfg->span;
+  slots = span / sectors;
+  if (slots == 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  if (depth > pergroup)
+    depth = pergroup;
+
+  q = (IO_QUEUE *)malloc(sizeof(IO_QUEUE));
+  buffers = (char *)malloc(bytes * depth);
+  if (q == NULL || buffers == NULL || ioq_init(q, dev, depth) != 0)
+  {
+    free(q);
+    free(buffers);
+    return -1;
+  }
+
+  for (i = 0; i < bytes * depth; i++)
+    buffers[i] = (i % dev->sector_size) ^ 0xA5;
+
+  start = now_ns();
+  while (sent < cfg->commands)
+  {
+    group_start = now_ns();
+    issued = 0;
+    completed = 0;
+
+    while (completed < pergroup)
+    {
+      while (issued < pergroup && (req = ioq_get(q)) != NULL)
+      {
+        req->isread = 0;
+        req->flags = flags;
+        req->startlba = (stats_random() % slots) * sectors;
+        req->sectors = sectors;
+        req->databuffer = buffers + req->tag * bytes;
+        issued++;
+
+        if (ioq_submit(q, req) != 0)
+        {
+          ioq_put(q, req);
+          completed++;
+          res->errors++;
+        }
+      }
+
+      req = ioq_reap(q);
+      if (req == NULL)
+        break;
+
+      stats_add(&res->write_lat, req->complete_ns - req->submit_ns);
+      if (group == 0)
+        stats_add(&res->commit_lat, req->complete_ns - req->submit_ns);
+      if (req->status != 0)
+      {
+        res->errors++;
+        res->failed++;
+      }
+      res->writes++;
+      completed++;
+      ioq_put(q, req);
+    }
+    sent += pergroup;
+    if (completed < pergroup)
+    {
+      printf("ERROR, %s: line %d\n", __func__, __LINE__);
+      break;
+    }
+
+    if (group)
+    {
+      t = now_ns();
+      if (device_flush(dev) != 0)
+        res->errors++;
+      stats_add(&res->flush_lat, now_ns() - t);
+      stats_add(&res->commit_lat, now_ns() - group_start);
+    }
+  }
+  res->seconds = (now_ns() - start) / 1e9;
+
+  ioq_drain(q);
+  free(buffers);
+  free(q);
+
+  return 0;
+}
+
+// Durable write throughput by FUA writes and by group commit, every group size of cfg->groups is a row.
+// The size is the first of cfg->sizes, queued protocols keep up to the last of cfg->depths writes in flight
+int bench_durable(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg)
+{
+  DURABLE_RESULT res;
+  unsigned int depth = 1;
+  unsigned int row;
+  unsigned int group;
+  double iops;
+  double base_iops = 0;
+  const char *name = dev->path == PATH_SBC ? "sbc" : rw_protocol_name(dev->protocol);
+
+  if (cfg->sizes[0] > dev->max_sectors)
+  {
+    printf("%u sectors is over the max transfer %u\n", cfg->sizes[0], dev->max_sectors);
+    return -1;
+  }
+
+  if (is_queued(dev))
+  {
+    depth = cfg->depths[cfg->ndepths - 1];
+    if (dev->path == PATH_ATA && depth > (unsigned int)dev->ata.queuedepth)
+      depth = dev->ata.queuedepth;
+  }
+
+  if (dev->path == PATH_ATA && dev->ata.wcache_feat && !dev->ata.wcache_enabled)
+    printf("write cache is disabled, every write goes to the media\n");
+
+  fprintf(cfg->output, "device,path,protocol,mode,group,sectors,qd,writes,errors,seconds,mbps,durable_iops,"
+                       "write_lat_avg_us,write_lat_p99_us,flush_lat_avg_us,flush_lat_p99_us,"
+                       "commit_lat_avg_us,commit_lat_p99_us,speedup\n");
+
+  // the first row is FUA, the others are group commit
+  for (row = 0; row <= cfg->ngroups; row++)
+  {
+    group = row ? cfg->groups[row - 1] : 0;
+
+    if (group == 0 && !device_fua_native(dev))
+    {
+      printf("%s has no FUA write command, FUA row skipped\n", name);
+      continue;
+    }
+
+    if (durable_run(dev, cfg, group, group ? 0 : RW_FLAG_FUA, depth, &res) != 0)
+      continue;
+
+    iops = res.seconds > 0 ? (res.writes - res.failed) / res.seconds : 0;
+    if (base_iops == 0)
+      base_iops = iops;
+
+    fprintf(cfg->output, "%s,%s,%s,%s,%u,%u,%u,%u,%u,%.6f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f\n",
+            dev->dev_path, cmd_path_name(dev->path), name, group ? "group" : "fua", group, cfg->sizes[0],
+            depth > (group ? group : 1) ? (group ? group : 1) : depth, res.writes, res.errors, res.seconds,
+            iops * cfg->sizes[0] * dev->sector_size / 1e6, iops,
+            stats_mean(&res.write_lat) / 1e3, stats_percentile(&res.write_lat, 99) / 1e3,
+            stats_mean(&res.flush_lat) / 1e3, stats_percentile(&res.flush_lat, 99) / 1e3,
+            stats_mean(&res.commit_lat) / 1e3, stats_percentile(&res.commit_lat, 99) / 1e3,
+            base_iops > 0 ? iops / base_iops : 0);
+    fflush(cfg->output);
+
+    printf("%s %u : %.1f durable writes/s, commit latency p99 %.1f us\n", group ? "group" : "fua", group, iops,
+           stats_percentile(&res.commit_lat, 99) / 1e3);
+  }
+
+  return 0;
+}
+
+// One foreground read in flight at a time, the background scan fills the rest of the queue
+static int priority_run(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg, IO_SCHED *s, unsigned int background, double *seconds)
+{
+  IO_REQUEST *req;
+  char *buffers;
+  unsigned int fg_sectors = cfg->sizes[0];
+  unsigned int bg_sectors = BENCH_SCAN_SECTORS < dev->max_sectors ? BENCH_SCAN_SECTORS : dev->max_sectors;
+  unsigned int fg_issued = 0, fg_done = 0, fg_inflight = 0;
+  unsigned long long capacity = device_capacity(dev);
+  unsigned long long span = capacity;
+  unsigned long long scanlba = 0;
+  unsigned long long start;
+  unsigned long bytes = (unsigned long)(fg_sectors > bg_sectors ? fg_sectors : bg_sectors) * dev->sector_size;
+  unsigned int depth = s->q->depth;
+
+  if (cfg->span && cfg->span < span)
+    span = cfg->span;
+  if (span / fg_sectors == 0 || capacity < bg_sectors)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  buffers = (char *)malloc(bytes * depth);
+  if (buffers == NULL)
+    return -1;
+
+  start = now_ns();
+  while (fg_done < cfg->commands)
+  {
+    if (!fg_inflight && fg_issued < cfg->commands && (req = sched_get(s, IOC_FOREGROUND)) != NULL)
+    {
+      req->isread = 1;
+      req->startlba = (stats_random() % (span / fg_sectors)) * fg_sectors;
+      req->sectors = fg_sectors;
+      req->databuffer = buffers + req->tag * bytes;
+      fg_issued++;
+      if (sched_submit(s, req) != 0)
+      {
+        sched_put(s, req);
+        fg_done++;
+        continue;
+      }
+      fg_inflight = 1;
+    }
+
+    while (background && (req = sched_get(s, IOC_BACKGROUND)) != NULL)
+    {
+      if (scanlba + bg_sectors > capacity)
+        scanlba = 0;
+      req->isread = 1;
+      req->startlba = scanlba;
+      req->sectors = bg_sectors;
+      req->databuffer = buffers + req->tag * bytes;
+      scanlba += bg_sectors;
+      if (sched_submit(s, req) != 0)
+      {
+        sched_put(s, req);
+        break;
+      }
+    }
+
+    req = sched_reap(s);
+    if (req == NULL)
+      break;
+
+    if ((IO_CLASS)(unsigned long)req->priv == IOC_FOREGROUND)
+    {
+      fg_done++;
+      fg_inflight = 0;
+    }
+    sched_put(s, req);
+  }
+  *seconds = (now_ns() - start) / 1e9;
+
+  while ((req = sched_reap(s)) != NULL)
+    sched_put(s, req);
+  free(buffers);
+
+  return 0;
+}
+
+// Foreground read latency alone, under a background scan, and under the scan through the priority scheduler.
+// Foreground reads are cfg->sizes[0] sectors, the queue is the last of cfg->depths
+int bench_priority(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg)
+{
+  static const char *scenarios[] = { "alone", "mixed", "scheduled" };
+  IO_QUEUE *q;
+  IO_SCHED s;
+  unsigned int depth = 1;
+  unsigned int scenario;
+  unsigned int use_prio;
+  int cls;
+  double seconds;
+  const char *name = dev->path == PATH_SBC ? "sbc" : rw_protocol_name(dev->protocol);
+
+  if (cfg->sizes[0] > dev->max_sectors)
+  {
+    printf("%u sectors is over the max transfer %u\n", cfg->sizes[0], dev->max_sectors);
+    return -1;
+  }
+
+  if (is_queued(dev))
+  {
+    depth = cfg->depths[cfg->ndepths - 1];
+    if (dev->path == PATH_ATA && depth > (unsigned int)dev->ata.queuedepth)
+      depth = dev->ata.queuedepth;
+  }
+  if (depth < 2)
+  {
+    printf("%s can't have foreground and background commands in flight together\n", name);
+    return -1;
+  }
+
+  if (device_prio_supported(dev))
+    printf("foreground reads are tagged NCQ high priority\n");
+  else
+    printf("NCQ priority is NOT available with %s, the scheduler only keeps a tag for foreground\n", name);
+
+  q = (IO_QUEUE *)malloc(sizeof(IO_QUEUE));
+  if (q == NULL)
+    return -1;
+
+  fprintf(cfg->output, "device,path,protocol,scenario,prio,class,commands,errors,iops,"
+                       "lat_avg_us,lat_p50_us,lat_p99_us,lat_max_us\n");
+
+  for (scenario = 0; scenario < sizeof(scenarios) / sizeof(scenarios[0]); scenario++)
+  {
+    use_prio = scenario == 2 && device_prio_supported(dev);
+
+    if (ioq_init(q, dev, depth) != 0)
+      break;
+    sched_init(&s, q, use_prio, scenario == 2 ? 1 : 0);
+
+    if (priority_run(dev, cfg, &s, scenario != 0, &seconds) != 0)
+      continue;
+
+    for (cls = 0; cls < IOC_NUM; cls++)
+    {
+      if (s.lat[cls].count == 0)
+        continue;
+
+      fprintf(cfg->output, "%s,%s,%s,%s,%s,%s,%llu,%u,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+              dev->dev_path, cmd_path_name(dev->path), name, scenarios[scenario], use_prio ? "high" : "none",
+              io_class_name(cls), s.lat[cls].count, s.errors[cls], seconds > 0 ? s.lat[cls].count / seconds : 0,
+              stats_mean(&s.lat[cls]) / 1e3, stats_percentile(&s.lat[cls], 50) / 1e3,
+              stats_percentile(&s.lat[cls], 99) / 1e3, s.lat[cls].max / 1e3);
+    }
+    fflush(cfg->output);
+
+    printf("%s : foreground p99 %.1f us, background %.1f MB/s\n", scenarios[scenario],
+           stats_percentile(&s.lat[IOC_FOREGROUND], 99) / 1e3,
+           seconds > 0 ? s.lat[IOC_BACKGROUND].count * (double)(BENCH_SCAN_SECTORS < dev->max_sectors ? BENCH_SCAN_SECTORS : dev->max_sectors) * dev->sector_size / seconds / 1e6 : 0);
+  }
+
+  free(q);
+  return 0;
+}
@@ -0,0 +1,37 @@
+//
+// Protocol comparison benchmark, latency and throughput of every data transfer protocol
+// over a matrix of transfer sizes and queue depths, durable write throughput of FUA and group commit,
+// and foreground latency under a background scan
+//
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdio.h>
+
+#include "device.h"
+
+#define BENCH_MAX_POINTS  16
+
+typedef struct _BENCH_CONFIG {
+  unsigned int sizes[BENCH_MAX_POINTS];     // sectors per command
+  unsigned int nsizes;
+  unsigned int depths[BENCH_MAX_POINTS];    // commands in flight, only queued protocols go beyond 1
+  unsigned int ndepths;
+  unsigned int commands;                    // commands per cell
+  unsigned int iswrite;
+  unsigned int groups[BENCH_MAX_POINTS];    // writes per flush of the durable write benchmark
+  unsigned int ngroups;
+  unsigned long long span;                  // LBAs are random in [0, span), ZERO : whole device
+  const char *blkdev;                       // block device of the io_uring row, NULL : the one of the sg device,
+                                            // "none" : no io_uring row
+  FILE *output;                             // CSV table
+} BENCH_CONFIG;
+
+void bench_default_config(BENCH_CONFIG *cfg);
+int  bench_parse_list(const char *str, unsigned int *list, unsigned int *num);
+int  bench_protocols(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg);
+int  bench_durable(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg);
+int  bench_priority(DEVICE_CONTEXT *dev, BENCH_CONFIG *cfg);
+
+#endif
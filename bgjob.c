@@ -0,0 +1,186 @@
+//
+// Background jobs, scan / verify / wipe over a range of LBAs.
+// Commands are sent in LBA order through the request queue, the number in flight comes from the
+// adaptive queue depth controller when a latency target is given.
+// VERIFY of ATA is a non-queued command, it can't be mixed with FPDMA / DMA QUEUED ones, so on a queued
+// ATA protocol the verify job reads the data and drops it
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bgjob.h"
+#include "queue.h"
+#include "qdctl.h"
+#include "stats.h"
+#include "retry.h"
+#include "sense.h"
+
+#define BGJOB_REPORT_NS    1000000000ULL     // progress once per second
+#define BGJOB_CHUNK        256               // default sectors per command
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+static const char *bg_job_names[] = {
+  "scan",
+  "verify",
+  "wipe"
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+const char *bg_job_name(BG_JOB_TYPE type)
+{
+  return type <= BG_WIPE ? bg_job_names[type] : "unknown";
+}
+
+static int job_queued(DEVICE_CONTEXT *dev)
+{
+  return dev->path == PATH_SBC || dev->protocol == RW_DMA_QUEUED || dev->protocol == RW_FPDMA;
+}
+
+int bgjob_run(DEVICE_CONTEXT *dev, BG_JOB *job)
+{
+  IO_QUEUE *q;
+  IO_REQUEST *req;
+  QD_CONTROL qdc;
+  LAT_STATS lat;
+  RETRY_COUNTERS retry;
+  SENSE_INFO sense;
+  unsigned long long bad_lba;
+  char *buffers = NULL;
+  unsigned long long capacity = device_capacity(dev);
+  unsigned long long lba = job->startlba;
+  unsigned long long endlba;
+  unsigned long long done = 0;
+  unsigned long long start, last_report, now;
+  unsigned long long depth_sum = 0, depth_samples = 0;
+  unsigned int chunk = job->chunk ? job->chunk : BGJOB_CHUNK;
+  unsigned int max_depth = 1;
+  unsigned int errors = 0;
+  unsigned int usedata = job->type != BG_VERIFY || (dev->path == PATH_ATA && job_queued(dev));
+  unsigned long bytes;
+  double seconds;
+
+  if (capacity == 0 || job->startlba >= capacity)
+  {
+    printf("ERROR, %s: start lba 0x%llx is out of the device\n", __func__, job->startlba);
+    return -1;
+  }
+  endlba = job->sectors ? job->startlba + job->sectors : capacity;
+  if (endlba > capacity)
+    endlba = capacity;
+  chunk = device_align_sectors(dev, chunk);   // whole physical sectors within one command
+  if (chunk == 0)
+  {
+    printf("ERROR, %s: %u sectors per command can't hold a physical sector of %u\n", __func__, dev->max_sectors,
+           dev->phys_sectors);
+    return -1;
+  }
+
+  if (job_queued(dev))
+  {
+    max_depth = IOQ_MAX_DEPTH;
+    if (dev->path == PATH_ATA && (unsigned int)dev->ata.queuedepth < max_depth)
+      max_depth = dev->ata.queuedepth;
+    if (job->max_depth && job->max_depth < max_depth)
+      max_depth = job->max_depth;
+  }
+
+  // without a target the controller stays at max_depth
+  qdc_init(&qdc, job->target_ns ? 1 : max_depth, max_depth, job->target_ns);
+  stats_reset(&lat);
+
+  q = (IO_QUEUE *)malloc(sizeof(IO_QUEUE));
+  bytes = (unsigned long)chunk * dev->sector_size;
+  if (usedata)
+    buffers = (char *)calloc(max_depth, bytes);
+  if (q == NULL || (usedata && buffers == NULL) || ioq_init(q, dev, max_depth) != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(q);
+    free(buffers);
+    return -1;
+  }
+
+  printf("%s lba 0x%llx ~ 0x%llx, %u sectors per command, queue depth up to %u", bg_job_name(job->type),
+         job->startlba, endlba - 1, chunk, max_depth);
+  if (job->target_ns)
+    printf(", p99 target %llu us", job->target_ns / 1000);
+  printf("\n");
+
+  start = now_ns();
+  last_report = start;
+  while (lba < endlba || q->inflight)
+  {
+    while (lba < endlba && q->inflight < qdc_depth(&qdc) && (req = ioq_get(q)) != NULL)
+    {
+      req->isread = job->type != BG_WIPE;
+      req->isverify = !usedata;
+      req->startlba = lba;
+      req->sectors = endlba - lba < chunk ? endlba - lba : chunk;
+      req->databuffer = usedata ? buffers + req->tag * bytes : NULL;
+      lba += req->sectors;
+
+      if (ioq_submit(q, req) != 0)
+      {
+        printf("ERROR, %s: lba 0x%lx, sectors %u can't be sent\n", __func__, req->startlba, req->sectors);
+        errors++;
+        ioq_put(q, req);
+      }
+    }
+    depth_sum += q->inflight;
+    depth_samples++;
+
+    req = ioq_reap(q);
+    if (req == NULL)
+      break;
+
+    stats_add(&lat, req->complete_ns - req->submit_ns);
+    qdc_complete(&qdc, req->complete_ns - req->submit_ns);
+    if (req->status != 0)
+    {
+      printf("ERROR, %s: lba 0x%lx, sectors %u", bg_job_name(job->type), req->startlba, req->sectors);
+      if (sense_decode(req->sense_b, req->io_hdr.sb_len_wr, &sense) == 0)
+      {
+        printf(", %s", sense_key_string(sense.sk));
+        if (sense_error_lba(&sense, &bad_lba) == 0)
+          printf(" at lba 0x%llx", bad_lba);
+      }
+      printf("\n");
+      errors++;
+    }
+    done += req->sectors;
+    ioq_put(q, req);
+
+    now = now_ns();
+    if (now - last_report >= BGJOB_REPORT_NS)
+    {
+      printf("%s lba 0x%llx, %.1f%%, %.1f MB/s, depth %u, p99 %.1f us\n", bg_job_name(job->type), lba,
+             100.0 * (lba - job->startlba) / (endlba - job->startlba),
+             done * dev->sector_size / ((now - start) / 1e9) / 1e6, qdc_depth(&qdc), qdc.last_p99 / 1e3);
+      last_report = now;
+    }
+  }
+  seconds = (now_ns() - start) / 1e9;
+
+  ioq_drain(q);
+  free(buffers);
+  free(q);
+
+  printf("%s done, %llu sectors, %u errors, %.3f s, %.1f MB/s\n", bg_job_name(job->type), done, errors, seconds,
+         seconds > 0 ? done * dev->sector_size / seconds / 1e6 : 0);
+  printf("latency avg %.1f us, p99 %.1f us, max %.1f us, average depth %.1f, %u increases, %u decreases\n",
+         stats_mean(&lat) / 1e3, stats_percentile(&lat, 99) / 1e3, lat.max / 1e3,
+         depth_samples ? (double)depth_sum / depth_samples : 0, qdc.increases, qdc.decreases);
+  policy_counters(&retry);
+  printf("%llu commands, %llu retries, %llu timeouts, %llu failed without retry\n", retry.commands, retry.retries,
+         retry.timeouts, retry.fastfails);
+
+  return errors ? -1 : 0;
+}
@@ -0,0 +1,28 @@
+//
+// Background jobs over a range of LBAs, queue depth adapted to a latency target
+//
+
+#ifndef _BGJOB_H_
+#define _BGJOB_H_
+
+#include "device.h"
+
+typedef enum _BG_JOB_TYPE {
+  BG_SCAN = 0,           // read and drop the data
+  BG_VERIFY,             // verify on the media
+  BG_WIPE                // write ZERO
+} BG_JOB_TYPE;
+
+typedef struct _BG_JOB {
+  BG_JOB_TYPE type;
+  unsigned long long startlba;
+  unsigned long long sectors;     // ZERO : to the end of the device
+  unsigned int chunk;             // sectors per command, ZERO : 256, limited by the max transfer
+  unsigned int max_depth;         // ZERO : queue depth of the device
+  unsigned long long target_ns;   // p99 latency target, ZERO : max_depth all the time
+} BG_JOB;
+
+int  bgjob_run(DEVICE_CONTEXT *dev, BG_JOB *job);
+const char *bg_job_name(BG_JOB_TYPE type);
+
+#endif
@@ -0,0 +1,361 @@
+//
+// Block device engine.
+// The sd block device behind the sg device is opened with O_DIRECT, so the page cache is out of the way and
+// every request reaches the drive, and driven through io_uring by the raw system calls. The file is registered
+// as a fixed file and every slot of the queue owns a registered buffer, READ_FIXED / WRITE_FIXED skip the
+// file lookup and the page pinning per request. What is left over pass-through is the block layer and the
+// SCSI disk driver, which is what the benchmark wants to see
+//
+#define _GNU_SOURCE               // O_DIRECT
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+#include "blkdev.h"
+#include "stats.h"
+
+#define BLK_BUFFER_ALIGN  4096
+
+///////////////
+// LOCALS
+///////////////
+static int lasterror;
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// The block device of the sg device, the device path itself when it is a block device already
+int blk_find_path(DEVICE_CONTEXT *dev, char *path, unsigned int len)
+{
+  struct stat f_stat;
+  char dirpath[256];
+  DIR *dir;
+  struct dirent *entry;
+  int found = 0;
+
+  if (fstat(dev->fd, &f_stat) < 0)
+    return -1;
+
+  if (S_ISBLK(f_stat.st_mode))
+  {
+    snprintf(path, len, "%s", dev->dev_path);
+    return 0;
+  }
+  if (!S_ISCHR(f_stat.st_mode))
+    return -1;
+
+  snprintf(dirpath, sizeof(dirpath), "/sys/dev/char/%u:%u/device/block", major(f_stat.st_rdev), minor(f_stat.st_rdev));
+  dir = opendir(dirpath);
+  if (dir == NULL)
+    return -1;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, len, "/dev/%s", entry->d_name);
+    found = 1;
+    break;
+  }
+  closedir(dir);
+
+  return found ? 0 : -1;
+}
+
+static int blk_map_rings(BLK_ENGINE *e, struct io_uring_params *p)
+{
+  e->sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+  e->cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (e->cq_size > e->sq_size)
+      e->sq_size = e->cq_size;
+    e->cq_size = e->sq_size;
+  }
+
+  e->sq_ptr = mmap(NULL, e->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQ_RING);
+  if (e->sq_ptr == MAP_FAILED)
+  {
+    e->sq_ptr = NULL;
+    return -1;
+  }
+  if (p->features & IORING_FEAT_SINGLE_MMAP)
+    e->cq_ptr = e->sq_ptr;
+  else
+  {
+    e->cq_ptr = mmap(NULL, e->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_CQ_RING);
+    if (e->cq_ptr == MAP_FAILED)
+    {
+      e->cq_ptr = NULL;
+      return -1;
+    }
+  }
+
+  e->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+  e->sqes = (struct io_uring_sqe *)mmap(NULL, e->sqes_size, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, e->ring_fd, IORING_OFF_SQES);
+  if (e->sqes == MAP_FAILED)
+  {
+    e->sqes = NULL;
+    return -1;
+  }
+
+  e->sq_head = (unsigned int *)((char *)e->sq_ptr + p->sq_off.head);
+  e->sq_tail = (unsigned int *)((char *)e->sq_ptr + p->sq_off.tail);
+  e->sq_mask = (unsigned int *)((char *)e->sq_ptr + p->sq_off.ring_mask);
+  e->sq_array = (unsigned int *)((char *)e->sq_ptr + p->sq_off.array);
+  e->cq_head = (unsigned int *)((char *)e->cq_ptr + p->cq_off.head);
+  e->cq_tail = (unsigned int *)((char *)e->cq_ptr + p->cq_off.tail);
+  e->cq_mask = (unsigned int *)((char *)e->cq_ptr + p->cq_off.ring_mask);
+  e->cqes = (struct io_uring_cqe *)((char *)e->cq_ptr + p->cq_off.cqes);
+
+  return 0;
+}
+
+// Open path with O_DIRECT and set up a ring of depth slots with a registered buffer of bytes each
+int blk_open(BLK_ENGINE *e, const char *path, unsigned int depth, unsigned long bytes)
+{
+  struct io_uring_params params;
+  struct iovec iov[BLK_MAX_DEPTH];
+  struct stat f_stat;
+  unsigned long long size = 0;
+  int ssz = 512;
+  unsigned int i;
+
+  memset(e, 0, sizeof(BLK_ENGINE));
+  e->fd = -1;
+  e->ring_fd = -1;
+  snprintf(e->path, sizeof(e->path), "%s", path);
+  if (depth == 0 || depth > BLK_MAX_DEPTH)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  e->fd = open(path, O_RDWR | O_DIRECT);
+  if (e->fd < 0)
+  {
+    lasterror = errno;
+    printf("Open %s failed (%d) - %s\n", path, lasterror, strerror(lasterror));
+    return -1;
+  }
+
+  // a regular file stands in for a block device, e.g. to try the engine without a drive
+  if (fstat(e->fd, &f_stat) == 0 && S_ISREG(f_stat.st_mode))
+    size = f_stat.st_size;
+  else if (ioctl(e->fd, BLKGETSIZE64, &size) < 0 || ioctl(e->fd, BLKSSZGET, &ssz) < 0)
+  {
+    lasterror = errno;
+    printf("Get size of %s failed (%d) - %s\n", path, lasterror, strerror(lasterror));
+    blk_close(e);
+    return -1;
+  }
+  e->sector_size = ssz;
+  e->capacity = size / ssz;
+  e->depth = depth;
+  e->bytes = (bytes + BLK_BUFFER_ALIGN - 1) / BLK_BUFFER_ALIGN * BLK_BUFFER_ALIGN;
+
+  // O_DIRECT wants the buffers aligned to the logical block size, a page covers every size
+  if (posix_memalign((void **)&e->buffers, BLK_BUFFER_ALIGN, e->bytes * depth) != 0)
+  {
+    e->buffers = NULL;
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    blk_close(e);
+    return -1;
+  }
+  memset(e->buffers, 0, e->bytes * depth);
+
+  memset(&params, 0, sizeof(params));
+  e->ring_fd = io_uring_setup(depth, &params);
+  if (e->ring_fd < 0)
+  {
+    lasterror = errno;
+    printf("io_uring_setup failed (%d) - %s\n", lasterror, strerror(lasterror));
+    blk_close(e);
+    return -1;
+  }
+  if (blk_map_rings(e, &params) != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    blk_close(e);
+    return -1;
+  }
+
+  for (i = 0; i < depth; i++)
+  {
+    iov[i].iov_base = e->buffers + i * e->bytes;
+    iov[i].iov_len = e->bytes;
+  }
+  if (io_uring_register(e->ring_fd, IORING_REGISTER_FILES, &e->fd, 1) < 0 ||
+      io_uring_register(e->ring_fd, IORING_REGISTER_BUFFERS, iov, depth) < 0)
+  {
+    lasterror = errno;
+    printf("io_uring_register failed (%d) - %s\n", lasterror, strerror(lasterror));
+    blk_close(e);
+    return -1;
+  }
+
+  if (isDebug)
+    printf("DEBUG, %s: %llu sectors of %u bytes, %u slots of %lu bytes\n", path, e->capacity, e->sector_size, depth, e->bytes);
+
+  return 0;
+}
+
+void blk_close(BLK_ENGINE *e)
+{
+  if (e->sqes)
+    munmap(e->sqes, e->sqes_size);
+  if (e->cq_ptr && e->cq_ptr != e->sq_ptr)
+    munmap(e->cq_ptr, e->cq_size);
+  if (e->sq_ptr)
+    munmap(e->sq_ptr, e->sq_size);
+  if (e->ring_fd >= 0)
+    close(e->ring_fd);
+  if (e->fd >= 0)
+    close(e->fd);
+  free(e->buffers);
+
+  e->sqes = NULL;
+  e->sq_ptr = NULL;
+  e->cq_ptr = NULL;
+  e->buffers = NULL;
+  e->ring_fd = -1;
+  e->fd = -1;
+}
+
+// Hand the entries up to the SQ tail to the kernel, waiting for min_complete completions
+static int blk_enter(BLK_ENGINE *e, unsigned int min_complete)
+{
+  int ret;
+
+  while (1)
+  {
+    ret = io_uring_enter(e->ring_fd, e->unsubmitted, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0);
+    if (ret >= 0)
+    {
+      e->unsubmitted -= ret;
+      return 0;
+    }
+    if (errno != EINTR)
+    {
+      lasterror = errno;
+      return -1;
+    }
+  }
+}
+
+char *blk_buffer(BLK_ENGINE *e, unsigned int slot)
+{
+  return e->buffers + (unsigned long)slot * e->bytes;
+}
+
+// Queue one read or write on the registered buffer of slot, the slot comes back from blk_reap().
+// Once the entry is in the ring the slot is in flight, an entry the kernel doesn't take now goes with the next enter
+int blk_submit(BLK_ENGINE *e, unsigned int slot, unsigned int isread, unsigned long long lba, unsigned int sectors)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int tail, index;
+
+  if (slot >= e->depth || (unsigned long)sectors * e->sector_size > e->bytes)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  tail = *e->sq_tail;
+  index = tail & *e->sq_mask;
+  sqe = &e->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = isread ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = 0;                                    // index of the registered file
+  sqe->addr = (unsigned long)blk_buffer(e, slot);
+  sqe->len = sectors * e->sector_size;
+  sqe->off = lba * e->sector_size;
+  sqe->buf_index = slot;
+  sqe->user_data = slot;
+  e->sq_array[index] = index;
+
+  // the kernel reads the entry once it sees the new tail
+  __atomic_store_n(e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  e->unsubmitted++;
+
+  e->submit_ns[slot] = now_ns();
+  if (blk_enter(e, 0) != 0 && lasterror != EAGAIN && lasterror != EBUSY)
+    printf("io_uring_enter failed (%d) - %s\n", lasterror, strerror(lasterror));
+  return 0;
+}
+
+// Wait for a completion, res is the byte count or -errno of it and ns its latency
+int blk_reap(BLK_ENGINE *e, unsigned int *slot, int *res, unsigned long long *ns)
+{
+  struct io_uring_cqe *cqe;
+  unsigned int head;
+
+  head = *e->cq_head;
+  while (head == __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE))
+  {
+    if (blk_enter(e, 1) != 0 && lasterror != EAGAIN && lasterror != EBUSY)
+    {
+      printf("io_uring_enter failed (%d) - %s\n", lasterror, strerror(lasterror));
+      return -1;
+    }
+  }
+
+  cqe = &e->cqes[head & *e->cq_mask];
+  *slot = cqe->user_data;
+  *res = cqe->res;
+  *ns = now_ns() - e->submit_ns[*slot];
+  __atomic_store_n(e->cq_head, head + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+// One synchronous transfer through slot 0
+int blk_rw(BLK_ENGINE *e, unsigned int isread, unsigned long long lba, unsigned int sectors, char *databuffer)
+{
+  unsigned long bytes = (unsigned long)sectors * e->sector_size;
+  unsigned long long ns;
+  unsigned int slot;
+  int res;
+
+  if (!isread)
+    memcpy(blk_buffer(e, 0), databuffer, bytes);
+  if (blk_submit(e, 0, isread, lba, sectors) != 0 || blk_reap(e, &slot, &res, &ns) != 0)
+    return -1;
+  if (res != (int)bytes)
+  {
+    printf("%s lba 0x%llx, sectors %u failed, %d\n", isread ? "read" : "write", lba, sectors, res);
+    return -1;
+  }
+  if (isread)
+    memcpy(databuffer, blk_buffer(e, 0), bytes);
+  return 0;
+}
@@ -0,0 +1,52 @@
+//
+// Block device engine, O_DIRECT reads and writes through io_uring, to compare the block layer with pass-through
+//
+
+#ifndef _BLKDEV_H_
+#define _BLKDEV_H_
+
+#include <linux/io_uring.h>
+
+#include "device.h"
+
+#define BLK_MAX_DEPTH     32
+
+typedef struct _BLK_ENGINE {
+  char path[256];
+  int fd;
+  int ring_fd;
+  unsigned int depth;
+  unsigned int sector_size;       // logical sector size of the block device
+  unsigned long long capacity;    // in sectors
+  unsigned long bytes;            // registered buffer of every slot
+
+  // rings mapped from io_uring_setup()
+  void *sq_ptr;
+  void *cq_ptr;
+  unsigned long sq_size;
+  unsigned long cq_size;
+  unsigned long sqes_size;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned int unsubmitted;       // entries up to the SQ tail which the kernel hasn't taken yet
+
+  char *buffers;
+  unsigned long long submit_ns[BLK_MAX_DEPTH];
+} BLK_ENGINE;
+
+int  blk_find_path(DEVICE_CONTEXT *dev, char *path, unsigned int len);
+int  blk_open(BLK_ENGINE *e, const char *path, unsigned int depth, unsigned long bytes);
+void blk_close(BLK_ENGINE *e);
+char *blk_buffer(BLK_ENGINE *e, unsigned int slot);
+int  blk_submit(BLK_ENGINE *e, unsigned int slot, unsigned int isread, unsigned long long lba, unsigned int sectors);
+int  blk_reap(BLK_ENGINE *e, unsigned int *slot, int *res, unsigned long long *ns);
+int  blk_rw(BLK_ENGINE *e, unsigned int isread, unsigned long long lba, unsigned int sectors, char *databuffer);
+
+#endif
@@ -0,0 +1,354 @@
+//
+// IDENTIFY DEVICE and SMART READ DATA decoder.
+// Both are 512 bytes with a checksum in the last byte which makes the sum of all of them ZERO, IDENTIFY data has
+// the signature A5h next to it. Every field is decoded in one pass into a fixed struct.
+// The bulk mode goes through files of concatenated blobs, or directories of them, as they were captured from a
+// fleet, and writes one CSV row per blob:
+//   identify,file,offset,serial,model,firmware,sectors,logical,physical,rpm,major,sata,ncq,smart,trim,wwn
+//   smart,file,offset,revision,selftest,offline,attributes as id:value:worst:raw separated by spaces
+//   unknown,file,offset
+// Files are mapped rather than read, the checksum is summed 16 bytes at a time and the strings are swapped and
+// trimmed with SSE2 in ata_string(), the rest is loads and shifts, so the CSV output is what costs
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "blob.h"
+#include "command.h"
+#include "stats.h"
+
+#define BLOB_MAX_DEPTH     8           // subdirectories followed
+#define BLOB_OUTPUT_BUFFER (1 << 20)
+
+typedef struct _BLOB_COUNTS {
+  unsigned long long files;
+  unsigned long long identify;
+  unsigned long long smart;
+  unsigned long long unknown;
+  unsigned long long bytes;
+  unsigned long long partial;     // files which don't end on a blob boundary
+} BLOB_COUNTS;
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+static int lasterror;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static unsigned char blob_sum(const unsigned char *blob)
+{
+  unsigned int i;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+
+  // two 64-bit sums of 8 bytes each for every 16 bytes
+  for (i = 0; i < BLOB_SIZE; i += 16)
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(blob + i)), _mm_setzero_si128()));
+  acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+  return (unsigned char)_mm_cvtsi128_si32(acc);
+#else
+  unsigned char sum = 0;
+
+  for (i = 0; i < BLOB_SIZE; i++)
+    sum += blob[i];
+  return sum;
+#endif
+}
+
+BLOB_KIND blob_kind(const unsigned char *blob)
+{
+  if (blob_sum(blob) != 0)
+    return BLOB_UNKNOWN;
+  if (blob[510] == 0xA5)
+    return BLOB_IDENTIFY;
+  // a blob of ZEROs, or of any byte 256 times over, sums up too. SMART data has a revision, 0001h ~ 00FFh in practice
+  if (blob[0] && !blob[1])
+    return BLOB_SMART;
+  return BLOB_UNKNOWN;
+}
+
+static unsigned int word(const unsigned char *blob, unsigned int n)
+{
+  return blob[n * 2] | blob[n * 2 + 1] << 8;
+}
+
+void identify_decode(const unsigned char *blob, IDENTIFY_INFO *info)
+{
+  unsigned short *iden = (unsigned short *)blob;
+  unsigned int w;
+
+  ata_string(info->serial, iden, 10, 10);
+  ata_string(info->firmware, iden, 23, 4);
+  ata_string(info->model, iden, 27, 20);
+
+  // 48-bit Address feature set, bit 10 of WORD 83 & 86
+  info->lba48 = (word(blob, 83) & (1 << 10)) && (word(blob, 86) & (1 << 10));
+  if (info->lba48)
+    info->sectors = (unsigned long long)word(blob, 103) << 48 | (unsigned long long)word(blob, 102) << 32 |
+                    (unsigned long long)word(blob, 101) << 16 | word(blob, 100);
+  else
+    info->sectors = (unsigned long long)word(blob, 61) << 16 | word(blob, 60);
+
+  // WORD 106 is valid with bit 15:14 01b, see set_ata_feat()
+  w = word(blob, 106);
+  info->logical_size = 512;
+  info->phys_sectors = 1;
+  if ((w & 0xC000) == 0x4000)
+  {
+    if (w & (1 << 12))
+      info->logical_size = ((unsigned int)word(blob, 118) << 16 | word(blob, 117)) * 2;
+    if (w & (1 << 13))
+      info->phys_sectors = 1 << (w & 0xF);
+  }
+
+  // World wide name, bit 8 of WORD 84 & 87
+  info->wwn = 0;
+  if ((word(blob, 84) & (1 << 8)) && (word(blob, 87) & (1 << 8)))
+    info->wwn = (unsigned long long)word(blob, 108) << 48 | (unsigned long long)word(blob, 109) << 32 |
+                (unsigned long long)word(blob, 110) << 16 | word(blob, 111);
+
+  // Nominal media rotation rate, 0401h ~ FFFEh are rpm
+  w = word(blob, 217);
+  info->rotation = w == 1 || (w >= 0x401 && w <= 0xFFFE) ? w : 0;
+
+  // Major version, bit 4 : ATA/ATAPI-4 ... bit 8 : ATA8-ACS, bit 9 : ACS-2, bit 10 : ACS-3, 0000h / FFFFh : none
+  w = word(blob, 80);
+  info->major = 0;
+  if (w != 0xFFFF && (w & 0x7FF0))
+    info->major = 31 - __builtin_clz(w & 0x7FF0);
+
+  // SATA capabilities, bit 3:1 of WORD 76 are the speeds and bit 8 NCQ, 0000h / FFFFh : not SATA
+  w = word(blob, 76);
+  info->sata_gen = 0;
+  info->queue_depth = 0;
+  if (w != 0 && w != 0xFFFF)
+  {
+    if (w & (1 << 3))
+      info->sata_gen = 3;
+    else if (w & (1 << 2))
+      info->sata_gen = 2;
+    else if (w & (1 << 1))
+      info->sata_gen = 1;
+    if (w & (1 << 8))
+      info->queue_depth = (word(blob, 75) & 0x1F) + 1;
+  }
+
+  // SMART feature set, bit 0 of WORD 82 supported and WORD 85 enabled
+  info->smart = (word(blob, 82) & 1) ? ((word(blob, 85) & 1) ? 2 : 1) : 0;
+  info->trim = word(blob, 169) & 1;
+  info->checksum_ok = blob[510] == 0xA5 && blob_sum(blob) == 0;
+}
+
+void smart_decode(const unsigned char *blob, SMART_INFO *info)
+{
+  const unsigned char *entry;
+  SMART_ATTR *attr;
+  unsigned int i;
+
+  info->revision = word(blob, 0);
+  info->nattrs = 0;
+
+  // 30 entries of 12 bytes from byte 2, ID ZERO : unused
+  for (i = 0; i < SMART_MAX_ATTRS; i++)
+  {
+    entry = blob + 2 + i * 12;
+    if (entry[0] == 0)
+      continue;
+    attr = &info->attrs[info->nattrs++];
+    attr->id = entry[0];
+    attr->flags = entry[1] | entry[2] << 8;
+    attr->value = entry[3];
+    attr->worst = entry[4];
+    attr->raw = (unsigned long long)entry[5] | (unsigned long long)entry[6] << 8 |
+                (unsigned long long)entry[7] << 16 | (unsigned long long)entry[8] << 24 |
+                (unsigned long long)entry[9] << 32 | (unsigned long long)entry[10] << 40;
+  }
+
+  info->offline_status = blob[362];
+  info->selftest_status = blob[363];
+  info->checksum_ok = blob_sum(blob) == 0;
+}
+
+// ATA strings are printable ASCII, but captures are not always clean
+static void csv_string(FILE *fp, const char *str)
+{
+  for (; *str; str++)
+    fputc(*str < 0x20 || *str > 0x7E || *str == ',' || *str == '"' ? '_' : *str, fp);
+}
+
+static void write_blob(FILE *fp, const char *file, unsigned long long offset, const unsigned char *blob,
+                       BLOB_COUNTS *counts)
+{
+  IDENTIFY_INFO iden;
+  SMART_INFO smart;
+  unsigned int i;
+
+  switch (blob_kind(blob))
+  {
+    case BLOB_IDENTIFY:
+      counts->identify++;
+      identify_decode(blob, &iden);
+      fprintf(fp, "identify,%s,%llu,", file, offset);
+      csv_string(fp, iden.serial);
+      fputc(',', fp);
+      csv_string(fp, iden.model);
+      fputc(',', fp);
+      csv_string(fp, iden.firmware);
+      fprintf(fp, ",%llu,%u,%u,%u,%u,%u,%u,%u,%u,%016llx\n", iden.sectors, iden.logical_size, iden.phys_sectors,
+              iden.rotation, iden.major, iden.sata_gen, iden.queue_depth, iden.smart, iden.trim, iden.wwn);
+      break;
+
+    case BLOB_SMART:
+      counts->smart++;
+      smart_decode(blob, &smart);
+      fprintf(fp, "smart,%s,%llu,%u,0x%02x,0x%02x,", file, offset, smart.revision, smart.selftest_status,
+              smart.offline_status);
+      for (i = 0; i < smart.nattrs; i++)
+        fprintf(fp, "%s%u:%u:%u:%llu", i ? " " : "", smart.attrs[i].id, smart.attrs[i].value, smart.attrs[i].worst,
+                smart.attrs[i].raw);
+      fputc('\n', fp);
+      break;
+
+    default:
+      counts->unknown++;
+      fprintf(fp, "unknown,%s,%llu\n", file, offset);
+      break;
+  }
+}
+
+static int parse_file(FILE *fp, const char *file, BLOB_COUNTS *counts)
+{
+  struct stat f_stat;
+  unsigned char *data;
+  unsigned long long offset;
+  int fd;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &f_stat) < 0)
+  {
+    lasterror = errno;
+    printf("Open %s failed (%d) - %s\n", file, lasterror, strerror(lasterror));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  counts->files++;
+  if (f_stat.st_size % BLOB_SIZE)
+    counts->partial++;
+  if (f_stat.st_size < BLOB_SIZE)
+  {
+    close(fd);
+    return 0;
+  }
+
+  data = (unsigned char *)mmap(NULL, f_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+  madvise(data, f_stat.st_size, MADV_SEQUENTIAL);
+
+  for (offset = 0; offset + BLOB_SIZE <= (unsigned long long)f_stat.st_size; offset += BLOB_SIZE)
+    write_blob(fp, file, offset, data + offset, counts);
+  counts->bytes += offset;
+
+  munmap(data, f_stat.st_size);
+  return 0;
+}
+
+static int parse_path(FILE *fp, const char *path, unsigned int depth, BLOB_COUNTS *counts)
+{
+  char child[PATH_MAX];
+  struct dirent *entry;
+  struct stat f_stat;
+  DIR *dir;
+  int ret = 0;
+
+  if (stat(path, &f_stat) < 0)
+  {
+    lasterror = errno;
+    printf("Open %s failed (%d) - %s\n", path, lasterror, strerror(lasterror));
+    return -1;
+  }
+  if (S_ISREG(f_stat.st_mode))
+    return parse_file(fp, path, counts);
+  if (!S_ISDIR(f_stat.st_mode) || depth == BLOB_MAX_DEPTH)
+    return 0;
+
+  dir = opendir(path);
+  if (dir == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+    if (parse_path(fp, child, depth + 1, counts) != 0)
+      ret = -1;
+  }
+  closedir(dir);
+  return ret;
+}
+
+// Every blob of the file, or of the files under the directory, to a CSV row of output, stdout when NULL
+int blob_parse(const char *path, const char *output)
+{
+  BLOB_COUNTS counts;
+  unsigned long long start;
+  double seconds;
+  char *buffer = NULL;
+  FILE *fp = stdout;
+  int ret;
+
+  if (output)
+  {
+    fp = fopen(output, "w");
+    if (fp == NULL)
+    {
+      lasterror = errno;
+      printf("Open %s failed (%d) - %s\n", output, lasterror, strerror(lasterror));
+      return -1;
+    }
+    buffer = (char *)malloc(BLOB_OUTPUT_BUFFER);
+    if (buffer)
+      setvbuf(fp, buffer, _IOFBF, BLOB_OUTPUT_BUFFER);
+  }
+
+  memset(&counts, 0, sizeof(counts));
+  start = now_ns();
+  ret = parse_path(fp, path, 0, &counts);
+  fflush(fp);
+  seconds = (now_ns() - start) / 1e9;
+
+  if (output)
+    fclose(fp);
+  free(buffer);
+
+  printf("%llu files, %llu identify, %llu smart, %llu unknown blobs, %llu files with a partial blob\n", counts.files,
+         counts.identify, counts.smart, counts.unknown, counts.partial);
+  printf("%.3f s, %.0f blobs/s, %.1f MB/s\n", seconds,
+         seconds > 0 ? (counts.identify + counts.smart + counts.unknown) / seconds : 0,
+         seconds > 0 ? counts.bytes / seconds / 1e6 : 0);
+  return ret;
+}
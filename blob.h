@@ -0,0 +1,59 @@
+//
+// Decoder of IDENTIFY DEVICE and SMART READ DATA, live or captured as 512-byte blobs
+//
+
+#ifndef _BLOB_H_
+#define _BLOB_H_
+
+#define BLOB_SIZE            512
+#define SMART_MAX_ATTRS      30
+
+typedef enum _BLOB_KIND {
+  BLOB_UNKNOWN = 0,      // neither checksum holds
+  BLOB_IDENTIFY,         // integrity word with signature A5h, refer to ACS-3 section 7.12.7.91
+  BLOB_SMART             // checksum in byte 511 without the signature, refer to ACS-3 section 7.48.6
+} BLOB_KIND;
+
+// IDENTIFY DEVICE data, refer to ACS-3 section 7.12.7
+typedef struct _IDENTIFY_INFO {
+  char serial[21];                // WORD 10-19
+  char firmware[9];               // WORD 23-26
+  char model[41];                 // WORD 27-46
+  unsigned long long sectors;     // user addressable, WORD 100-103 with 48-bit addresses, WORD 60-61 otherwise
+  unsigned long long wwn;         // WORD 108-111, ZERO : not reported
+  unsigned int logical_size;      // bytes per logical sector
+  unsigned int phys_sectors;      // logical sectors per physical sector
+  unsigned int rotation;          // rpm, 1 : solid state, ZERO : not reported, WORD 217
+  unsigned int major;             // highest ATA/ACS major version of WORD 80, e.g. 10 : ACS-3
+  unsigned int sata_gen;          // highest SATA speed of WORD 76, 1 : 1.5 Gbps, 2 : 3 Gbps, 3 : 6 Gbps
+  unsigned int queue_depth;       // ZERO : no NCQ
+  unsigned int lba48;
+  unsigned int smart;             // 1 : supported, 2 : enabled
+  unsigned int trim;              // DATA SET MANAGEMENT with TRIM, WORD 169
+  unsigned int checksum_ok;       // the integrity word is there and holds
+} IDENTIFY_INFO;
+
+// An attribute of the SMART attribute table, its layout is vendor specific but common to all drives
+typedef struct _SMART_ATTR {
+  unsigned char id;
+  unsigned short flags;
+  unsigned char value;
+  unsigned char worst;
+  unsigned long long raw;         // 48 bits
+} SMART_ATTR;
+
+typedef struct _SMART_INFO {
+  unsigned int revision;
+  SMART_ATTR attrs[SMART_MAX_ATTRS];
+  unsigned int nattrs;
+  unsigned int selftest_status;   // self-test execution status, byte 363
+  unsigned int offline_status;    // off-line data collection status, byte 362
+  unsigned int checksum_ok;
+} SMART_INFO;
+
+BLOB_KIND blob_kind(const unsigned char *blob);
+void identify_decode(const unsigned char *blob, IDENTIFY_INFO *info);
+void smart_decode(const unsigned char *blob, SMART_INFO *info);
+int  blob_parse(const char *path, const char *output);
+
+#endif
@@ -0,0 +1,449 @@
+//
+// Kernel and device time breakdown.
+// A workload runs in phases, sequential and random reads one at a time, then random reads queued. Each phase has
+// three views of the same commands:
+//   host    now_ns() around sg_execute() of sg_command(), or submit ~ reap of the IO queue, what the process waits
+//   driver  io_hdr.duration, from when sg hands the request to the block layer until it completes
+//   disk    /sys/block/<dev>/stat before and after, and /sys/block/<dev>/inflight sampled during the phase
+// host - driver is the process side: system call, copies of data and sense, wake up, and for the queued phase the
+// time a completion waits to be reaped. The block layer holds a request until the SCSI device has a free slot, its
+// queue_depth, and ATA without NCQ has one slot only, so with the average number of requests in the block layer
+// L (Little's law on time_in_queue) and D slots the wait in the kernel queue is (L - D) / L of the driver time.
+// What is left of the driver time is the HBA, the link and the drive.
+// Pass-through requests are counted in /sys/block/<dev>/stat only when queue/iostats_passthrough is 1 (6.13 and
+// later kernels), otherwise L is the depth the phase keeps in flight and the foreign I/O is unknown.
+// io_hdr.duration is in milliseconds, counted in jiffies, its mean over many commands is still the mean time
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "breakdown.h"
+#include "blkdev.h"
+#include "queue.h"
+#include "retry.h"
+#include "stats.h"
+
+#define BREAKDOWN_COMMANDS  2000
+#define BREAKDOWN_SECTORS   8           // 4 KiB of 512 byte sectors
+#define BREAKDOWN_DEPTH     8
+#define BREAKDOWN_SAMPLE    16          // commands per inflight sample
+#define BREAKDOWN_PHASES    3
+
+// /sys/block/<dev>/stat, refer to Documentation/block/stat.rst of linux
+typedef struct _DISK_STAT {
+  unsigned long long ios;         // reads and writes completed
+  unsigned long long ticks_ms;    // time of those requests, summed
+  unsigned long long busy_ms;     // io_ticks, time with a request in flight
+  unsigned long long queue_ms;    // time_in_queue, weighted by the requests in flight
+} DISK_STAT;
+
+typedef struct _DISK_INFO {
+  int valid;                      // 1 : the block device of the sg device is found
+  char name[64];
+  char sysdir[128];
+  char scheduler[32];
+  unsigned int queue_depth;       // device/queue_depth, ZERO : unknown
+  unsigned int nr_requests;
+  int passthrough;                // queue/iostats_passthrough, -1 : no such attribute
+} DISK_INFO;
+
+typedef struct _PHASE {
+  const char *name;
+  unsigned int depth;
+  unsigned int commands;
+  unsigned int errors;
+  LAT_STATS host;
+  unsigned long long driver_ms;
+  double seconds;
+  int stat_valid;
+  DISK_STAT before;
+  DISK_STAT after;
+  unsigned long long inflight_sum;   // /sys/block/<dev>/inflight
+  unsigned long long own_sum;        // commands of the phase in flight at the same moments
+  unsigned int samples;
+} PHASE;
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static int sysfs_uint(DISK_INFO *disk, const char *attr, unsigned int *value)
+{
+  char path[256];
+  FILE *fp;
+  int ret;
+
+  snprintf(path, sizeof(path), "%s/%s", disk->sysdir, attr);
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return -1;
+  ret = fscanf(fp, "%u", value) == 1 ? 0 : -1;
+  fclose(fp);
+  return ret;
+}
+
+// The scheduler in use is the one in brackets, e.g. "none [mq-deadline] kyber"
+static void sysfs_scheduler(DISK_INFO *disk)
+{
+  char path[256];
+  char line[256];
+  char *start, *end;
+  FILE *fp;
+
+  snprintf(disk->scheduler, sizeof(disk->scheduler), "unknown");
+  snprintf(path, sizeof(path), "%s/queue/scheduler", disk->sysdir);
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return;
+  if (fgets(line, sizeof(line), fp) != NULL && (start = strchr(line, '[')) != NULL && (end = strchr(start, ']')) != NULL)
+  {
+    *end = 0;
+    snprintf(disk->scheduler, sizeof(disk->scheduler), "%s", start + 1);
+  }
+  fclose(fp);
+}
+
+static void disk_open(DEVICE_CONTEXT *dev, DISK_INFO *disk)
+{
+  char path[256];
+  unsigned int value;
+  char *name;
+
+  memset(disk, 0, sizeof(DISK_INFO));
+  if (blk_find_path(dev, path, sizeof(path)) != 0)
+    return;
+
+  name = strrchr(path, '/');
+  snprintf(disk->name, sizeof(disk->name), "%.63s", name ? name + 1 : path);
+  snprintf(disk->sysdir, sizeof(disk->sysdir), "/sys/class/block/%s", disk->name);
+  if (sysfs_uint(disk, "inflight", &value) != 0)
+    return;
+  disk->valid = 1;
+
+  sysfs_uint(disk, "device/queue_depth", &disk->queue_depth);
+  sysfs_uint(disk, "queue/nr_requests", &disk->nr_requests);
+  sysfs_scheduler(disk);
+  disk->passthrough = sysfs_uint(disk, "queue/iostats_passthrough", &value) == 0 ? (int)value : -1;
+}
+
+static int disk_stat(DISK_INFO *disk, DISK_STAT *stat)
+{
+  char path[256];
+  unsigned long long v[11];
+  FILE *fp;
+  int n;
+
+  if (!disk->valid)
+    return -1;
+
+  snprintf(path, sizeof(path), "%s/stat", disk->sysdir);
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return -1;
+  n = fscanf(fp, "%llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5],
+             &v[6], &v[7], &v[8], &v[9], &v[10]);
+  fclose(fp);
+  if (n != 11)
+    return -1;
+
+  stat->ios = v[0] + v[4];
+  stat->ticks_ms = v[3] + v[7];
+  stat->busy_ms = v[9];
+  stat->queue_ms = v[10];
+  return 0;
+}
+
+// Requests of the disk in flight now, next to own of the phase
+static void disk_sample(DISK_INFO *disk, PHASE *phase, unsigned int own)
+{
+  char path[256];
+  unsigned int reads, writes;
+  FILE *fp;
+
+  if (!disk->valid)
+    return;
+
+  snprintf(path, sizeof(path), "%s/inflight", disk->sysdir);
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return;
+  if (fscanf(fp, "%u %u", &reads, &writes) == 2)
+  {
+    phase->inflight_sum += reads + writes;
+    phase->own_sum += own;
+    phase->samples++;
+  }
+  fclose(fp);
+}
+
+static void phase_begin(DISK_INFO *disk, PHASE *phase, const char *name, unsigned int depth)
+{
+  memset(phase, 0, sizeof(PHASE));
+  phase->name = name;
+  phase->depth = depth;
+  stats_reset(&phase->host);
+  phase->stat_valid = disk_stat(disk, &phase->before) == 0;
+  phase->seconds = now_ns() / 1e9;
+}
+
+static void phase_end(DISK_INFO *disk, PHASE *phase)
+{
+  phase->seconds = now_ns() / 1e9 - phase->seconds;
+  if (phase->stat_valid)
+    phase->stat_valid = disk_stat(disk, &phase->after) == 0;
+}
+
+// One command at a time through device_readwrite(), sg_command() reports the time of every command
+static void phase_sync(DEVICE_CONTEXT *dev, DISK_INFO *disk, PHASE *phase, BREAKDOWN_CONFIG *config,
+                       unsigned long long span, int sequential, char *buffer)
+{
+  CMD_TIMING timing;
+  unsigned long long lba = device_align_down(dev, stats_random() % span);
+  unsigned int i;
+
+  stats_reset(&timing.host);
+  timing.driver_ms = 0;
+  policy_timing(&timing);
+
+  for (i = 0; i < config->commands; i++)
+  {
+    if (!sequential)
+      lba = device_align_down(dev, stats_random() % span);
+    else if (lba + config->sectors > span)
+      lba = 0;
+
+    if (device_readwrite(dev, 1, 0, lba, config->sectors, buffer) != 0)
+      phase->errors++;
+    else
+      phase->commands++;
+    lba += config->sectors;
+
+    if (i % BREAKDOWN_SAMPLE == 0)
+      disk_sample(disk, phase, 0);
+  }
+
+  policy_timing(NULL);
+  phase->host = timing.host;
+  phase->driver_ms = timing.driver_ms;
+}
+
+// Random reads queued at the depth, the host time is from the first send to the reap
+static void phase_queued(DEVICE_CONTEXT *dev, DISK_INFO *disk, PHASE *phase, BREAKDOWN_CONFIG *config,
+                         unsigned long long span, char *buffer)
+{
+  IO_QUEUE q;
+  IO_REQUEST *req;
+  unsigned int sent = 0;
+  unsigned int done = 0;
+
+  if (ioq_init(&q, dev, phase->depth) != 0)
+    return;
+
+  while (done < config->commands)
+  {
+    while (sent < config->commands && q.nfree > 0)
+    {
+      req = ioq_get(&q);
+      req->isread = 1;
+      req->startlba = device_align_down(dev, stats_random() % span);
+      req->sectors = config->sectors;
+      req->databuffer = buffer + (unsigned long)req->tag * config->sectors * dev->sector_size;
+      sent++;
+      if (ioq_submit(&q, req) != 0)
+      {
+        phase->errors++;
+        done++;
+        ioq_put(&q, req);
+      }
+    }
+
+    req = ioq_reap(&q);
+    if (req == NULL)
+      break;
+    if (req->status != 0)
+      phase->errors++;
+    else
+    {
+      phase->commands++;
+      stats_add(&phase->host, req->complete_ns - req->submit_ns);
+      phase->driver_ms += req->io_hdr.duration;
+    }
+    done++;
+    ioq_put(&q, req);
+
+    if (done % BREAKDOWN_SAMPLE == 0)
+      disk_sample(disk, phase, q.inflight);
+  }
+  ioq_drain(&q);
+}
+
+// Requests the device takes at once, a command beyond it waits in the block layer
+static unsigned int dispatch_slots(DEVICE_CONTEXT *dev, DISK_INFO *disk)
+{
+  unsigned int slots = disk->queue_depth ? disk->queue_depth : IOQ_MAX_DEPTH;
+
+  if (dev->path == PATH_ATA && dev->protocol != RW_DMA_QUEUED && dev->protocol != RW_FPDMA)
+    return 1;
+  if (dev->path == PATH_ATA && dev->ata.queuedepth > 0 && (unsigned int)dev->ata.queuedepth < slots)
+    slots = dev->ata.queuedepth;
+  return slots;
+}
+
+static void phase_report(DEVICE_CONTEXT *dev, DISK_INFO *disk, PHASE *phase)
+{
+  unsigned int slots = dispatch_slots(dev, disk);
+  unsigned long long dios = 0;
+  unsigned long long foreign = 0;
+  double host, driver, process, kqueue, device;
+  double blk = 0, busy = 0, inflight = 0;
+  double waiting;
+  const char *where;
+
+  if (phase->commands == 0)
+  {
+    printf("%-10s failed, %u errors\n", phase->name, phase->errors);
+    return;
+  }
+
+  host = stats_mean(&phase->host) / 1e3;
+  driver = phase->driver_ms * 1e3 / phase->commands;
+  if (driver > host)
+    driver = host;
+  process = host - driver;
+
+  // requests in the block layer on average, by the disk counters when they count pass-through, else what was sent
+  waiting = phase->depth;
+  if (phase->stat_valid)
+    dios = phase->after.ios - phase->before.ios;
+  if (dios)
+  {
+    blk = (double)(phase->after.ticks_ms - phase->before.ticks_ms) * 1e3 / dios;
+    busy = 100.0 * (phase->after.busy_ms - phase->before.busy_ms) / (phase->seconds * 1e3);
+    waiting = (phase->after.queue_ms - phase->before.queue_ms) / (phase->seconds * 1e3);
+    foreign = dios > phase->commands ? dios - phase->commands : 0;
+  }
+  if (phase->samples)
+    inflight = (double)phase->inflight_sum / phase->samples;
+
+  kqueue = waiting > slots ? (waiting - slots) / waiting * driver : 0;
+  device = driver - kqueue;
+
+  printf("%-10s %5u %9.1f %9.1f %9.1f %9.1f %9.1f", phase->name, phase->commands, host, driver, process, kqueue,
+         device);
+  if (dios)
+    printf(" %9.1f %5.1f%% %8.2f %8llu", blk, busy, inflight, foreign);
+  else
+    printf(" %9s %6s %8s %8s", "-", "-", phase->samples ? "0" : "-", "-");
+  if (phase->errors)
+    printf("  %u errors", phase->errors);
+  printf("\n");
+
+  if (process >= kqueue && process >= device)
+    where = "the process: system calls, copies and wake ups, queue more commands or batch them";
+  else if (kqueue >= device && slots == 1 && dev->path == PATH_ATA)
+    where = "the kernel queue: the protocol isn't queued, commands go one by one, use dmaq or fpdma";
+  else if (kqueue >= device && disk->queue_depth && dev->ata.queuedepth > 0 &&
+           disk->queue_depth < (unsigned int)dev->ata.queuedepth)
+    where = "the kernel queue: the HBA queue depth is below the drive's, raise device/queue_depth";
+  else if (kqueue >= device)
+    where = "the kernel queue: more requests than the device takes, lower the depth";
+  else
+    where = "the device: HBA, link and drive";
+  printf("%-10s most time in %s\n", "", where);
+  if (foreign)
+    printf("%-10s %llu requests of others shared the disk\n", "", foreign);
+  if (isDebug && phase->samples)
+    printf("DEBUG, %s: %u inflight samples, disk %.2f, own %.2f\n", phase->name, phase->samples, inflight,
+           (double)phase->own_sum / phase->samples);
+}
+
+int breakdown_run(DEVICE_CONTEXT *dev, BREAKDOWN_CONFIG *config)
+{
+  BREAKDOWN_CONFIG cfg = *config;
+  DISK_INFO disk;
+  PHASE phases[BREAKDOWN_PHASES];
+  unsigned int nphases = 0;
+  unsigned long long span;
+  char qname[16];
+  char *buffer;
+  unsigned int i;
+
+  if (cfg.commands == 0)
+    cfg.commands = BREAKDOWN_COMMANDS;
+  if (cfg.sectors == 0)
+    cfg.sectors = BREAKDOWN_SECTORS;
+  if (cfg.depth == 0)
+    cfg.depth = BREAKDOWN_DEPTH;
+  if (cfg.depth > IOQ_MAX_DEPTH)
+    cfg.depth = IOQ_MAX_DEPTH;
+  cfg.sectors = device_align_sectors(dev, cfg.sectors);
+  if (cfg.sectors == 0)
+  {
+    printf("ERROR, %s: %u sectors per command can't hold a physical sector of %u\n", __func__, dev->max_sectors,
+           dev->phys_sectors);
+    return -1;
+  }
+
+  span = device_capacity(dev);
+  if (cfg.span && cfg.span < span)
+    span = cfg.span;
+  if (span <= cfg.sectors)
+  {
+    printf("ERROR, %s: the capacity of the device is unknown or too small\n", __func__);
+    return -1;
+  }
+  span -= cfg.sectors;
+
+  buffer = (char *)malloc((unsigned long)cfg.depth * cfg.sectors * dev->sector_size);
+  if (buffer == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  disk_open(dev, &disk);
+  if (disk.valid)
+  {
+    printf("block device %s, scheduler %s, nr_requests %u, device queue_depth %u", disk.name, disk.scheduler,
+           disk.nr_requests, disk.queue_depth);
+    if (dev->path == PATH_ATA && dev->ata.ncq_feat)
+      printf(", drive NCQ depth %d", dev->ata.queuedepth);
+    printf(", pass-through statistics %s\n", disk.passthrough == 1 ? "on" : (disk.passthrough == 0 ? "off" : "unknown"));
+    if (disk.passthrough == 0)
+      printf("echo 1 > %s/queue/iostats_passthrough counts these commands in the disk statistics\n", disk.sysdir);
+  }
+  else
+    printf("no block device of %s, the process and driver times only\n", dev->dev_path);
+  printf("%u commands of %u sectors per phase, %s %s\n", cfg.commands, cfg.sectors, cmd_path_name(dev->path),
+         dev->path == PATH_ATA ? rw_protocol_name(dev->protocol) : "");
+
+  phase_begin(&disk, &phases[nphases], "seq qd1", 1);
+  phase_sync(dev, &disk, &phases[nphases], &cfg, span, 1, buffer);
+  phase_end(&disk, &phases[nphases++]);
+
+  phase_begin(&disk, &phases[nphases], "rand qd1", 1);
+  phase_sync(dev, &disk, &phases[nphases], &cfg, span, 0, buffer);
+  phase_end(&disk, &phases[nphases++]);
+
+  if (cfg.depth > 1)
+  {
+    snprintf(qname, sizeof(qname), "rand qd%u", cfg.depth);
+    phase_begin(&disk, &phases[nphases], qname, cfg.depth);
+    phase_queued(dev, &disk, &phases[nphases], &cfg, span, buffer);
+    phase_end(&disk, &phases[nphases++]);
+  }
+
+  printf("%-10s %5s %9s %9s %9s %9s %9s %9s %6s %8s %8s\n", "phase", "cmds", "host us", "driver us", "process",
+         "kqueue", "device", "blk us", "busy", "inflight", "foreign");
+  for (i = 0; i < nphases; i++)
+    phase_report(dev, &disk, &phases[i]);
+
+  free(buffer);
+  return 0;
+}
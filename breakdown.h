@@ -0,0 +1,19 @@
+//
+// Kernel and device time breakdown, where the latency of a command goes: the process, the kernel queue or the device
+//
+
+#ifndef _BREAKDOWN_H_
+#define _BREAKDOWN_H_
+
+#include "device.h"
+
+typedef struct _BREAKDOWN_CONFIG {
+  unsigned int commands;          // commands per phase, ZERO : BREAKDOWN_COMMANDS
+  unsigned int sectors;           // sectors per command, ZERO : BREAKDOWN_SECTORS
+  unsigned int depth;             // commands in flight of the queued phase, ZERO : BREAKDOWN_DEPTH
+  unsigned long long span;        // random LBAs in [0, span), ZERO : whole device
+} BREAKDOWN_CONFIG;
+
+int breakdown_run(DEVICE_CONTEXT *dev, BREAKDOWN_CONFIG *config);
+
+#endif
@@ -3,17 +3,37 @@
 // Send command by ioctl interface
 //
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <string.h>
 #include <scsi/sg.h>
 #include <scsi/scsi.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "command.h"
+#include "transport.h"
+#include "retry.h"
+#include "sense.h"
 
 #define MAX_LENGTH_OUTPUT  512
 #define SENSE_CODE_LENGTH  64
 
+// Allocation lengths which are big enough to get the whole response in one round trip
+#define INQUIRY_ALLOC_LENGTH     0xFF      // standard data, allocation length is 1 byte before SPC-3
+#define MODE_SENSE_ALLOC_LENGTH  0xFFFC    // multiple of 4, some USB bridges reject odd lengths
+#define VPD_ALLOC_LENGTH         0xFFFC
+
+// Designator type of Device Identification VPD page
+#define DESIGNATOR_T10     1
+#define DESIGNATOR_EUI64   2
+#define DESIGNATOR_NAA     3
+
+// driver_status of sg which comes with CHECK CONDITION, refer to include/scsi/scsi.h of linux
+#define DRIVER_SENSE       0x08
+
 // refer to spec ATA Command Pass-Through
 #define PROTOCOL_HARDRESET   0
 #define PROTOCOL_SRST        1
@@ -37,8 +57,12 @@ typedef union _PROBE_HOST_ {
 ///////////////
 int ata_pass_through_data(int fd, int isread, char *cmd, int cmdsize, void *databuffer, int buffersize);
 static int check_status(struct sg_io_hdr *io_hdr, unsigned char *sense_b);
+static void dump_cdb(unsigned char *cmd, unsigned int cmdsize);
 void parse_inquiry_data(unsigned char *buffer, unsigned int len);
-static void parse_mode_page(char *buffer, unsigned int len);
+static void parse_mode_page(unsigned char *buffer, unsigned int len);
+static int scsi_data_in(int fd, unsigned char *cmd, unsigned int cmdsize, void *databuffer, unsigned int buffersize, unsigned int *translen);
+static unsigned int get_be16(unsigned char *p);
+static unsigned int get_be32(unsigned char *p);
 
 ///////////////
 // LOCALS
@@ -51,84 +75,228 @@ unsigned int isDebug = 0;
 
 int ata_pass_through_data(int fd, int isread, char *cmd, int cmdsize, void *databuffer, int buffersize)
 {
-  int ret;
   struct sg_io_hdr io_hdr;
-  unsigned char sense_b[SENSE_CODE_LENGTH];     // buffer size QQQQ:????
+  unsigned char sense_b[SENSE_CODE_LENGTH];
   
-  memset(&io_hdr, 0, sizeof(struct sg_io_hdr));
-  memset(sense_b, 0, SENSE_CODE_LENGTH);
-
-  io_hdr.cmdp = cmd;
-  io_hdr.cmd_len = cmdsize;
-  io_hdr.dxferp = databuffer;
-  io_hdr.dxfer_len = buffersize;
-  io_hdr.dxfer_direction = isread ? SG_DXFER_FROM_DEV : SG_DXFER_TO_DEV;
-
-  io_hdr.interface_id = 'S';     // m:wqeans SCSI Generic driver interface 
-  io_hdr.mx_sb_len = sizeof(sense_b);
-  io_hdr.sbp = sense_b;
-  io_hdr.timeout = 20 * 1000;    // 60 seconds  QQQQ:????
+  // the timeout comes from the class of the command, see sg_command()
+  sg_io_setup(&io_hdr, (unsigned char *)cmd, cmdsize, isread, databuffer, buffersize, sense_b, sizeof(sense_b), 0);
   //io_hdr.pack_id = 0           // User can identify the request by using this field
 
-  // send command
-  ret = ioctl(fd, SG_IO, &io_hdr);
-  if (ret < 0)
+  // send command with retries, check status
+  if (sg_command(fd, &io_hdr) != 0)
+    return -1;
+
+  return 0;
+}
+
+// Non-data command with CK_COND, regs gets the ATA registers the device returned
+int ata_pass_through_regs(int fd, char *cmd, int cmdsize, SENSE_INFO *regs)
+{
+  struct sg_io_hdr io_hdr;
+  unsigned char sense_b[SENSE_CODE_LENGTH];
+
+  memset(regs, 0, sizeof(SENSE_INFO));
+  sg_io_setup(&io_hdr, (unsigned char *)cmd, cmdsize, 0, NULL, 0, sense_b, sizeof(sense_b), 0);
+
+  if (sg_command(fd, &io_hdr) != 0)
+    return -1;
+
+  if (io_hdr.status != 2 || sense_decode(sense_b, io_hdr.sb_len_wr, regs) != 0 || !regs->ata_valid)
   {
-    lasterror = errno;
-//    printf("Send command failed (%d) - %s\n", lasterror, strerror(lasterror));
-    printf("ret %d, Send command failed (%d) - %s\n", ret, lasterror, strerror(lasterror));
+    printf("ERROR, %s: no ATA registers returned\n", __func__);
     return -1;
   }
 
-  // check status
-  if (check_status(&io_hdr, io_hdr.sbp) != 0)
+  return 0;
+}
+
+// Status of a request which completed by sg_receive()
+int sg_io_check(struct sg_io_hdr *io_hdr)
+{
+  return check_status(io_hdr, io_hdr->sbp);
+}
+
+// Sense key and ASC/ASCQ of a CHECK CONDITION, return -1 when there is no sense data of a known format
+int sg_sense(struct sg_io_hdr *io_hdr, unsigned int *sk, unsigned int *asc, unsigned int *ascq)
+{
+  SENSE_INFO info;
+
+  *sk = 0;
+  *asc = 0;
+  *ascq = 0;
+
+  if ((io_hdr->status & 0x7E) != 0x02 || sense_decode(io_hdr->sbp, io_hdr->sb_len_wr, &info) != 0)
     return -1;
 
+  *sk = info.sk;
+  *asc = info.asc;
+  *ascq = info.ascq;
   return 0;
 }
 
-int multi_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned long startlba, unsigned int sectors, char *databuffer)
+static void dump_cdb(unsigned char *cmd, unsigned int cmdsize)
 {
-  int ret;
-  unsigned char cmd[16];
+  unsigned int i;
 
-  int protocol = isread ? PROTOCOL_PIO_DATAIN : PROTOCOL_PIO_DATAOUT;
-  int extend = isext ? 1 : 0;
-  int ck_cond  = 1;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
-  int t_dir = isread ? 1 : 0;      // 1: from device, 0: from controller
-  int byt_blok = 1;   // 0: transfer data is measured by byte, 1: measured by block
-  int t_length = 2;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+  printf("cmd:");
+  for (i = 0; i < cmdsize; i++)
+  {
+    printf("0x%02x ", cmd[i]);
+  }
+  printf("\n");
+}
 
-  memset(cmd, 0, sizeof(cmd));
+// Read / write command blocks are copies of an immutable template with LBA, count, tag and priority patched in,
+// the template holds everything which only depends on the command: protocol, direction, length location,
+// DEVICE and COMMAND. The layout tells where the variable fields go
+#define ATA16_TEMPLATE(protocol, extend, t_dir, t_length, device, command, layout) \
+  { { 0x85, ((protocol) << 1) | (extend), (1 << 5) | ((t_dir) << 3) | (1 << 2) | (t_length), \
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, (device), (command), 0 }, (layout) }
+#define SBC16_TEMPLATE(opcode, fua) \
+  { { (opcode), (fua) << 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, CDB_LAYOUT_SBC16 }
+
+// ck_cond 1, byt_blok 1. t_length 2 : count in SECTOR COUNT, 1 : count in FEATURES and the tag in SECTOR COUNT.
+// FUA without a FUA command uses the plain read / write, the caller flushes. [command set][isext][CDB_OP]
+static const CDB_TEMPLATE cdb_templates[CDB_SET_NUM][2][CDB_OP_NUM] = {
+  // READ / WRITE SECTORS (EXT)
+  { { ATA16_TEMPLATE(PROTOCOL_PIO_DATAIN, 0, 1, 2, 0xE0, 0x20, CDB_LAYOUT_ATA28),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAIN, 0, 1, 2, 0xE0, 0x20, CDB_LAYOUT_ATA28),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAOUT, 0, 0, 2, 0xE0, 0x30, CDB_LAYOUT_ATA28),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAOUT, 0, 0, 2, 0xE0, 0x30, CDB_LAYOUT_ATA28) },
+    { ATA16_TEMPLATE(PROTOCOL_PIO_DATAIN, 1, 1, 2, 0xE0, 0x24, CDB_LAYOUT_ATA48),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAIN, 1, 1, 2, 0xE0, 0x24, CDB_LAYOUT_ATA48),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAOUT, 1, 0, 2, 0xE0, 0x34, CDB_LAYOUT_ATA48),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAOUT, 1, 0, 2, 0xE0, 0x34, CDB_LAYOUT_ATA48) } },
+  // READ / WRITE MULTIPLE (EXT), WRITE MULTIPLE FUA EXT is 48-bit only, refer to ACS-2 section 7.65
+  { { ATA16_TEMPLATE(PROTOCOL_PIO_DATAIN, 0, 1, 2, 0xE0, 0xC4, CDB_LAYOUT_ATA28),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAIN, 0, 1, 2, 0xE0, 0xC4, CDB_LAYOUT_ATA28),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAOUT, 0, 0, 2, 0xE0, 0xC5, CDB_LAYOUT_ATA28),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAOUT, 0, 0, 2, 0xE0, 0xC5, CDB_LAYOUT_ATA28) },
+    { ATA16_TEMPLATE(PROTOCOL_PIO_DATAIN, 1, 1, 2, 0xE0, 0x29, CDB_LAYOUT_ATA48),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAIN, 1, 1, 2, 0xE0, 0x29, CDB_LAYOUT_ATA48),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAOUT, 1, 0, 2, 0xE0, 0x39, CDB_LAYOUT_ATA48),
+      ATA16_TEMPLATE(PROTOCOL_PIO_DATAOUT, 1, 0, 2, 0xE0, 0xCE, CDB_LAYOUT_ATA48) } },
+  // READ / WRITE DMA (EXT), WRITE DMA FUA EXT is 48-bit only, refer to ACS-2 section 7.60
+  { { ATA16_TEMPLATE(PROTOCOL_DMA, 0, 1, 2, 0xE0, 0xC8, CDB_LAYOUT_ATA28),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 0, 1, 2, 0xE0, 0xC8, CDB_LAYOUT_ATA28),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 0, 0, 2, 0xE0, 0xCA, CDB_LAYOUT_ATA28),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 0, 0, 2, 0xE0, 0xCA, CDB_LAYOUT_ATA28) },
+    { ATA16_TEMPLATE(PROTOCOL_DMA, 1, 1, 2, 0xE0, 0x25, CDB_LAYOUT_ATA48),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 1, 1, 2, 0xE0, 0x25, CDB_LAYOUT_ATA48),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 1, 0, 2, 0xE0, 0x35, CDB_LAYOUT_ATA48),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 1, 0, 2, 0xE0, 0x3D, CDB_LAYOUT_ATA48) } },
+  // READ / WRITE DMA QUEUED (EXT), WRITE DMA QUEUED FUA EXT is 48-bit only
+  { { ATA16_TEMPLATE(PROTOCOL_DMA_QUEUED, 0, 1, 1, 0xE0, 0xC7, CDB_LAYOUT_QUEUED28),
+      ATA16_TEMPLATE(PROTOCOL_DMA_QUEUED, 0, 1, 1, 0xE0, 0xC7, CDB_LAYOUT_QUEUED28),
+      ATA16_TEMPLATE(PROTOCOL_DMA_QUEUED, 0, 0, 1, 0xE0, 0xCC, CDB_LAYOUT_QUEUED28),
+      ATA16_TEMPLATE(PROTOCOL_DMA_QUEUED, 0, 0, 1, 0xE0, 0xCC, CDB_LAYOUT_QUEUED28) },
+    { ATA16_TEMPLATE(PROTOCOL_DMA_QUEUED, 1, 1, 1, 0xE0, 0x26, CDB_LAYOUT_QUEUED48),
+      ATA16_TEMPLATE(PROTOCOL_DMA_QUEUED, 1, 1, 1, 0xE0, 0x26, CDB_LAYOUT_QUEUED48),
+      ATA16_TEMPLATE(PROTOCOL_DMA_QUEUED, 1, 0, 1, 0xE0, 0x36, CDB_LAYOUT_QUEUED48),
+      ATA16_TEMPLATE(PROTOCOL_DMA_QUEUED, 1, 0, 1, 0xE0, 0x3E, CDB_LAYOUT_QUEUED48) } },
+  // READ / WRITE FPDMA QUEUED, 48-bit only. The protocol is DMA, DMA QUEUED as indicated in ACS doesn't work.
+  // Bit 6 of DEVICE shall be one, bit 7 is FUA
+  { { ATA16_TEMPLATE(PROTOCOL_DMA, 1, 1, 1, 0x40, 0x60, CDB_LAYOUT_NCQ),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 1, 1, 1, 0xC0, 0x60, CDB_LAYOUT_NCQ),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 1, 0, 1, 0x40, 0x61, CDB_LAYOUT_NCQ),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 1, 0, 1, 0xC0, 0x61, CDB_LAYOUT_NCQ) },
+    { ATA16_TEMPLATE(PROTOCOL_DMA, 1, 1, 1, 0x40, 0x60, CDB_LAYOUT_NCQ),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 1, 1, 1, 0xC0, 0x60, CDB_LAYOUT_NCQ),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 1, 0, 1, 0x40, 0x61, CDB_LAYOUT_NCQ),
+      ATA16_TEMPLATE(PROTOCOL_DMA, 1, 0, 1, 0xC0, 0x61, CDB_LAYOUT_NCQ) } },
+  // READ(16) / WRITE(16), refer to SBC3 section 5.11 & 5.34
+  { { SBC16_TEMPLATE(0x88, 0), SBC16_TEMPLATE(0x88, 1), SBC16_TEMPLATE(0x8A, 0), SBC16_TEMPLATE(0x8A, 1) },
+    { SBC16_TEMPLATE(0x88, 0), SBC16_TEMPLATE(0x88, 1), SBC16_TEMPLATE(0x8A, 0), SBC16_TEMPLATE(0x8A, 1) } }
+};
+
+const CDB_TEMPLATE *cdb_template(CDB_SET set, unsigned int isext, CDB_OP op)
+{
+  return &cdb_templates[set][isext ? 1 : 0][op];
+}
 
-  // build ata pass through command
-  cmd[0] = 0x85;
-  cmd[1] = (protocol << 1) | extend;
-  cmd[2] = (ck_cond << 5) | (t_dir << 3) | (byt_blok << 2) | t_length;
-  cmd[6] = sectors & 0xFF;
-  cmd[8] = startlba & 0xFF;
-  cmd[10] = (startlba >> 8) & 0xFF;
-  cmd[12] = (startlba >> 16) & 0xFF;
-  if (isext)
+CDB_OP cdb_op(unsigned int isread, unsigned int fua)
+{
+  if (isread)
+    return fua ? CDB_READ_FUA : CDB_READ;
+  return fua ? CDB_WRITE_FUA : CDB_WRITE;
+}
+
+// Copy the template and patch the variable fields, no debug output here, this is on the path of every command.
+// tag and prio only go where the layout has them. Returns the size of the command block
+int cdb_encode(const CDB_TEMPLATE *t, unsigned char *cmd, unsigned long long startlba, unsigned int sectors,
+               unsigned int tag, unsigned int prio)
+{
+  memcpy(cmd, t->cdb, 16);
+
+  switch (t->layout)
   {
-    cmd[5]  = (sectors >> 8) & 0xFF;   // hight 8 bit of SECTOR COUNT
-    cmd[7]  = (startlba >> 24) & 0xFF;
-    cmd[9]  = (startlba >> 32) & 0xFF;
-    cmd[11] = (startlba >> 40) & 0xFF;
+    case CDB_LAYOUT_SBC16:
+      cmd[2] = startlba >> 56;
+      cmd[3] = startlba >> 48;
+      cmd[4] = startlba >> 40;
+      cmd[5] = startlba >> 32;
+      cmd[6] = startlba >> 24;
+      cmd[7] = startlba >> 16;
+      cmd[8] = startlba >> 8;
+      cmd[9] = startlba;
+      cmd[10] = sectors >> 24;
+      cmd[11] = sectors >> 16;
+      cmd[12] = sectors >> 8;
+      cmd[13] = sectors;
+      return 16;
+
+    case CDB_LAYOUT_NCQ:
+      cmd[5] = (prio & 0x3) << 6;           // PRIO is bit 15:14 of SECTOR COUNT, 00: normal, 01: isochronous, 10: high
+      // fall through
+    case CDB_LAYOUT_QUEUED48:
+      cmd[7] = startlba >> 24;
+      cmd[9] = startlba >> 32;
+      cmd[11] = startlba >> 40;
+      // fall through
+    case CDB_LAYOUT_QUEUED28:
+      cmd[3] = sectors >> 8;                // count in FEATURES
+      cmd[4] = sectors;
+      cmd[6] = (tag & 0x1F) << 3;           // tag in bit 7:3 of SECTOR COUNT
+      break;
+
+    case CDB_LAYOUT_ATA48:
+      cmd[5] = sectors >> 8;
+      cmd[7] = startlba >> 24;
+      cmd[9] = startlba >> 32;
+      cmd[11] = startlba >> 40;
+      // fall through
+    case CDB_LAYOUT_ATA28:
+    default:
+      cmd[6] = sectors;
+      break;
   }
-  cmd[13] = 0xE0;
-  cmd[14] = isext ? ((isread ? 0x29 : 0x39)) : (isread ? 0xC4 : 0xC5);
+
+  cmd[8] = startlba;
+  cmd[10] = startlba >> 8;
+  cmd[12] = startlba >> 16;
+  if (t->layout == CDB_LAYOUT_ATA28 || t->layout == CDB_LAYOUT_QUEUED28)
+    cmd[13] |= (startlba >> 24) & 0x0F;   // LBA 27:24 in DEVICE 3:0
+
+  return 16;
+}
+
+// The *_cdb functions only build the command block, so that a command can be sent either by ioctl or queued.
+// They return the size of the command block
+
+int multi_cdb(unsigned char *cmd, unsigned int isread, unsigned int isext, unsigned int fua, unsigned long startlba, unsigned int sectors)
+{
+  return cdb_encode(cdb_template(CDB_MULTI, isext, cdb_op(isread, fua)), cmd, startlba, sectors, 0, 0);
+}
+
+int multi_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned long startlba, unsigned int sectors, char *databuffer)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  multi_cdb(cmd, isread, isext, 0, startlba, sectors);
 
   if (isDebug)
-  {
-    int i;
-    printf("cmd:");
-    for (i = 0; i < 16; i++)
-    {
-      printf("0x%02x ", cmd[i]);
-    }
-    printf("\n");
-  }
+    dump_cdb(cmd, sizeof(cmd));
 
   ret = ata_pass_through_data(fd, isread, cmd, sizeof(cmd), databuffer, sectors * 512);
   if (ret != 0)
@@ -140,49 +308,20 @@ int multi_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned lo
   return 0;
 }
 
+int dmaqueued_cdb(unsigned char *cmd, unsigned int isread, unsigned int isext, unsigned int tag, unsigned int fua, unsigned long startlba, unsigned int sectors)
+{
+  return cdb_encode(cdb_template(CDB_DMA_QUEUED, isext, cdb_op(isread, fua)), cmd, startlba, sectors, tag, 0);
+}
+
 int dmaqueued_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned int tag, unsigned long startlba, unsigned int sectors, char *databuffer)
 {
   int ret;
   unsigned char cmd[16];
 
-  int protocol = PROTOCOL_DMA_QUEUED;
-  int extend = isext ? 1 : 0;     // 0: 28-bit command, 1 : 48-bit command
-  int ck_cond  = 1;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
-  int t_dir = isread ? 1 : 0;      // 1: from device, 0: from controller
-  int byt_blok = 1;   // 0: transfer data is measured by byte, 1: measured by block
-  int t_length = 1;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
-
-  memset(cmd, 0, sizeof(cmd));
-
-  // build ata pass through command
-  cmd[0] = 0x85;
-  cmd[1] = (protocol << 1) | extend;
-  cmd[2] = (ck_cond << 5) | (t_dir << 3) | (byt_blok << 2) | t_length;
-  cmd[3] = (sectors >> 8) & 0xFF;
-  cmd[4] = sectors & 0xFF;
-  cmd[6] = (tag & 0x1F) << 3;
-  cmd[8] = startlba & 0xFF;
-  cmd[10] = (startlba >> 8) & 0xFF;
-  cmd[12] = (startlba >> 16) & 0xFF;
-  if (isext)
-  {
-    cmd[7]  = (startlba >> 24) & 0xFF;
-    cmd[9]  = (startlba >> 32) & 0xFF;
-    cmd[11] = (startlba >> 40) & 0xFF;
-  }
-  cmd[13] = 0xE0;
-  cmd[14] = isext ? ((isread ? 0x26 : 0x36)) : (isread ? 0xC7 : 0xCC);
+  dmaqueued_cdb(cmd, isread, isext, tag, 0, startlba, sectors);
 
   if (isDebug)
-  {
-    int i;
-    printf("cmd:");
-    for (i = 0; i < 16; i++)
-    {
-      printf("0x%02x ", cmd[i]);
-    }
-    printf("\n");
-  }
+    dump_cdb(cmd, sizeof(cmd));
 
   ret = ata_pass_through_data(fd, isread, cmd, sizeof(cmd), databuffer, sectors * 512);
   if (ret != 0)
@@ -194,48 +333,20 @@ int dmaqueued_readwrite(int fd, unsigned int isread, unsigned int isext, unsigne
   return 0;
 }
 
+int dma_cdb(unsigned char *cmd, unsigned int isread, unsigned int isext, unsigned int fua, unsigned long startlba, unsigned int sectors)
+{
+  return cdb_encode(cdb_template(CDB_DMA, isext, cdb_op(isread, fua)), cmd, startlba, sectors, 0, 0);
+}
+
 int dma_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned long startlba, unsigned int sectors, char *databuffer)
 {
   int ret;
   unsigned char cmd[16];
 
-  int protocol = PROTOCOL_DMA;
-  int extend = isext ? 1 : 0;     // 0: 28-bit command, 1 : 48-bit command
-  int ck_cond  = 1;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
-  int t_dir = isread ? 1 : 0;      // 1: from device, 0: from controller
-  int byt_blok = 1;   // 0: transfer data is measured by byte, 1: measured by block
-  int t_length = 2;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
-
-  memset(cmd, 0, sizeof(cmd));
-
-  // build ata pass through command
-  cmd[0] = 0x85;
-  cmd[1] = (protocol << 1) | extend;
-  cmd[2] = (ck_cond << 5) | (t_dir << 3) | (byt_blok << 2) | t_length;
-  cmd[6] = sectors & 0xFF;
-  cmd[8] = startlba & 0xFF;
-  cmd[10] = (startlba >> 8) & 0xFF;
-  cmd[12] = (startlba >> 16) & 0xFF;
-  if (isext)
-  {
-    cmd[5]  = (sectors >> 8) & 0xFF;   // hight 8 bit of SECTOR COUNT
-    cmd[7]  = (startlba >> 24) & 0xFF;
-    cmd[9]  = (startlba >> 32) & 0xFF;
-    cmd[11] = (startlba >> 40) & 0xFF;
-  }
-  cmd[13] = 0xE0;
-  cmd[14] = isext ? ((isread ? 0x25 : 0x35)) : (isread ? 0xC8 : 0xCA);
+  dma_cdb(cmd, isread, isext, 0, startlba, sectors);
 
   if (isDebug)
-  {
-    int i;
-    printf("cmd:");
-    for (i = 0; i < 16; i++)
-    {
-      printf("0x%02x ", cmd[i]);
-    }
-    printf("\n");
-  }
+    dump_cdb(cmd, sizeof(cmd));
 
   ret = ata_pass_through_data(fd, isread, cmd, sizeof(cmd), databuffer, sectors * 512);
   if (ret != 0)
@@ -247,50 +358,20 @@ int dma_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned long
   return 0;
 }
 
+int sectors_cdb(unsigned char *cmd, unsigned int isread, unsigned int isext, unsigned long startlba, unsigned int sectors)
+{
+  return cdb_encode(cdb_template(CDB_PIO, isext, cdb_op(isread, 0)), cmd, startlba, sectors, 0, 0);
+}
+
 int sectors_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned long startlba, unsigned int sectors, char *databuffer)
 {
   int ret;
   unsigned char cmd[16];
 
-  int protocol = isread ? PROTOCOL_PIO_DATAIN : PROTOCOL_PIO_DATAOUT;
-  int extend = isext ? 1 : 0;
-  int ck_cond  = 1;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
-  int t_dir = isread ? 1 : 0;      // 1: from device, 0: from controller
-  int byt_blok = 1;   // 0: transfer data is measured by byte, 1: measured by block
-  int t_length = 2;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
-
-  memset(cmd, 0, sizeof(cmd));
-
-  // build ata pass through command
-  cmd[0] = 0x85;
-  cmd[1] = (protocol << 1) | extend;
-  cmd[2] = (ck_cond << 5) | (t_dir << 3) | (byt_blok << 2) | t_length;
-  cmd[6] = sectors & 0xFF;
-  cmd[8] = startlba & 0xFF;
-  cmd[10] = (startlba >> 8) & 0xFF;
-  cmd[12] = (startlba >> 16) & 0xFF;
-  if (isext)
-  {
-    cmd[5]  = (sectors >> 8) & 0xFF;   // hight 8 bit of SECTOR COUNT
-    cmd[7]  = (startlba >> 24) & 0xFF;
-    cmd[9]  = (startlba >> 32) & 0xFF;
-    cmd[11] = (startlba >> 40) & 0xFF;
-  }
-  cmd[13] = 0xE0;
-//  cmd[14] = isread ? 0x20 : 0x30;
-  cmd[14] = isread ? 0x24 : 0x34;
-  cmd[14] = isext ? ((isread ? 0x24 : 0x34)) : (isread ? 0x20 : 0x30);
+  sectors_cdb(cmd, isread, isext, startlba, sectors);
 
   if (isDebug)
-  {
-    int i;
-    printf("cmd:");
-    for (i = 0; i < 16; i++)
-    {
-      printf("0x%02x ", cmd[i]);
-    }
-    printf("\n");
-  }
+    dump_cdb(cmd, sizeof(cmd));
 
   ret = ata_pass_through_data(fd, isread, cmd, sizeof(cmd), databuffer, sectors * 512);
   if (ret != 0)
@@ -302,38 +383,21 @@ int sectors_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned
   return 0;
 }
 
+int fpdma_cdb(unsigned char *cmd, unsigned int isread, unsigned int ncqtag, unsigned int prio, unsigned int fua, unsigned long startlba, unsigned int sectors)
+{
+  return cdb_encode(cdb_template(CDB_FPDMA, 1, cdb_op(isread, fua)), cmd, startlba, sectors, ncqtag, prio);
+}
+
 int fpdma_readwrite(int fd, unsigned int isread, unsigned int ncqtag, unsigned long startlba, unsigned int sectors, char *databuffer)
 {
   int ret;
   unsigned char cmd[16];
 
-//  unsigned int protocol = 7;   // DMA Queued, QQQQ: It is DMA QUEUED command as indicated in ACS spec, but it doesn't work
-  unsigned int protocol = PROTOCOL_DMA;   // DMA
-  unsigned int extend = 1;     // lba48, refer to ACS, READ FPDMA QUEUED section, the high 8 bits is used(15:14 PRIO)
-//  unsigned int ck_cond  = 0;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
-  unsigned int ck_cond  = 1;   // SATL always return with CHECK CONDITION
-  unsigned int t_dir = isread ? 1 : 0;      // 1: from device, 0: from controller
-  unsigned int byt_blok = 1;   // 0: transfer data is measured by byte, 1: measured by block
-  unsigned int t_length = 1;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
-  unsigned int prio = 0;       // 00: normal, 01: Isochronous deadline-dependent priority, 10: hight priority, 11: reserved
-  unsigned int fua = 0;        // 1: force to use data from non-volatile media
+  fpdma_cdb(cmd, isread, ncqtag, NCQ_PRIO_NORMAL, 0, startlba, sectors);
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
 
-  memset(cmd, 0, sizeof(cmd));
-  
-  // build ata pass through command
-  cmd[0] = 0x85;
-  cmd[1] = (protocol << 1) | extend;
-  cmd[2] = (ck_cond << 5) | (t_dir << 3) | (byt_blok << 2) | t_length;
-  cmd[3] = (sectors >> 8) & 0xFF;        // transferred secotors size, FEATURES high byte
-  cmd[4] = sectors & 0xFF;               // transferred sectors size, FEATURES low byte
-  cmd[5] = prio << 14;
-  cmd[6] = ncqtag << 3;
-  cmd[8] = startlba & 0xFF;
-  cmd[10] = (startlba >> 8) & 0xFF;
-  cmd[12] = (startlba >> 16) & 0xFF;
-  cmd[13] = (fua << 7) | (1 << 6);       // bit 6 shall be set to one
-  cmd[14] = isread ? 0x60 : 0x61;        // 0x60: read fpdma, 0x61 write fpdma
-  
   ret = ata_pass_through_data(fd, isread, cmd, sizeof(cmd), databuffer, sectors * 512);
   if (ret != 0)
   {
@@ -414,6 +478,41 @@ int smart_readdata(int fd, char *databuffer)
 }
 
 
+// SMART EXECUTE OFF-LINE IMMEDIATE, refer to ACS-3 section 7.48.5. subcommand goes to LBA 7:0
+int smart_offline_immediate(int fd, unsigned int subcommand)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  int protocol = PROTOCOL_NONDATA;
+  int ck_cond  = 0;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_length = 0;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = protocol << 1;
+  cmd[2] = (ck_cond << 5) | t_length;
+  cmd[4] = 0xD4;      // SMART EXECUTE OFF-LINE IMMEDIATE
+  cmd[8] = subcommand;
+  cmd[10] = 0x4F;     // LBA MID
+  cmd[12] = 0xC2;     // LBA HIGH
+  cmd[14] = 0xB0;     // SMART
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
 int identify_func(int fd, char *databuffer)
 {
   int ret;
@@ -446,153 +545,717 @@ int identify_func(int fd, char *databuffer)
   return 0;
 }
 
-int ioctl_test(int fd)
+// Native SBC commands, they go to SAS drives as they are and SATL translates them for ATA drives.
+// Refer to SBC3 section 5
+
+int sbc_readcapacity16(int fd, CAPACITY *capacity)
 {
-  int ret;
-  int version;
- 
-  if (ioctl(fd, SG_GET_VERSION_NUM, &version) != 0)
-  {
-    lasterror = errno;
-    printf("Ioctl SG_GET_VERSION_NUM failed (%d) - %s\n", lasterror, strerror(lasterror));
-    return -1;
-  }
+  unsigned char cmd[16];
+  unsigned char databuffer[32];
+  unsigned int translen = 0;
 
-  printf("Version number %o\n", version);
-  // SCSI_IOCTL_PROBE_HOST
-  PROBE_HOST probe_host;
-  probe_host.length = MAX_LENGTH_OUTPUT;
-  ret = ioctl(fd, SCSI_IOCTL_PROBE_HOST, &probe_host);
-  if (ret < 0) // 1 : host present, 0 : host is not present
+  memset(cmd, 0, sizeof(cmd));
+  memset(databuffer, 0, sizeof(databuffer));
+  memset(capacity, 0, sizeof(CAPACITY));
+
+  // READ CAPACITY(16) is a service action of SERVICE ACTION IN(16), refer to SBC3 section 5.16
+  cmd[0] = 0x9E;
+  cmd[1] = 0x10;
+  cmd[13] = sizeof(databuffer);     // allocation length
+
+  if (scsi_data_in(fd, cmd, sizeof(cmd), databuffer, sizeof(databuffer), &translen) != 0)
   {
-    lasterror = errno;
-    printf("Ioctl SCSI_IO_PROBE_HOST failed (%d) - %s\n", lasterror, strerror(lasterror));
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
     return -1;
   }
-  else if (ret == 0)
-  {
-    printf("Host is not present\n");
-    return 0;
-  }
 
-  printf("host info %s\n", probe_host.buffer);
+  capacity->lastlba = (unsigned long long)get_be32(databuffer) << 32 | get_be32(databuffer + 4);
+  capacity->blocksize = get_be32(databuffer + 8);
+  capacity->prot_en = databuffer[12] & 0x1;
+  capacity->lbppbe = databuffer[13] & 0xF;      // logical blocks per physical block exponent
+  capacity->lbpme = (databuffer[14] >> 7) & 0x1;
+  capacity->lowest_aligned = (databuffer[14] & 0x3F) << 8 | databuffer[15];
+
+  if (isDebug)
+    printf("DEBUG, last lba 0x%llx, block size %u, lbppbe %u, lowest aligned %u\n", capacity->lastlba, capacity->blocksize, capacity->lbppbe, capacity->lowest_aligned);
 
   return 0;
 }
 
-// This is a draft version of mode sense function
-// It need be reorganized later
-int sg_mode(int fd)
+int sbc_rw16_cdb(unsigned char *cmd, unsigned int isread, unsigned int fua, unsigned long startlba, unsigned int sectors)
 {
-  struct sg_io_hdr io_hdr;
-  unsigned char cmd[6];
-  unsigned char sense_b[64];
-  unsigned char databuffer[1024];
-  unsigned int  datalength = 4;
+  return cdb_encode(cdb_template(CDB_SBC, 1, cdb_op(isread, fua)), cmd, startlba, sectors, 0, 0);
+}
 
-  unsigned int  dbd = 0;   // disable block decriptors bit
-  unsigned int  llbaa = 0; // Long LBA Accepted bit
-  unsigned int  pc = 0;    // page control, 00 : current value
-  unsigned int  pagecode = 0x3f;
-  unsigned int  subpagecode = 0;
-  unsigned int  control = 0;
+int sbc_readwrite16(int fd, unsigned int isread, unsigned long startlba, unsigned int sectors, char *databuffer)
+{
+  int ret;
+  unsigned char cmd[16];
 
-  memset(sense_b, 0, 64);
-  memset(databuffer, 0, 1024);
-  memset(&io_hdr, 0, sizeof(struct sg_io_hdr));
+  sbc_rw16_cdb(cmd, isread, 0, startlba, sectors);
 
-  // build mode sense 10 command, refer to SPC4, section 6.12 MODE SENSE(10) command
-  cmd[0] = 0x5A;
-  cmd[1] = (dbd ? 0x10 : 0) | (llbaa ? 0x8 : 0);
-  cmd[2] = pc << 6 | pagecode;
-  cmd[3] = subpagecode;
-  cmd[7] = (datalength >> 8) & 0xFF;
-  cmd[8] = datalength & 0xFF;
-  cmd[9] = control;
-  
-  // build sg_io_hdr
-  io_hdr.cmdp = cmd;
-  io_hdr.cmd_len = sizeof(cmd);
-  io_hdr.dxferp = databuffer;
-  io_hdr.dxfer_len = datalength;
-  io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-
-  io_hdr.interface_id = 'S';    // ????
-  io_hdr.mx_sb_len = 64;        // sizeof(sense_b)
-  io_hdr.sbp = sense_b;
-  io_hdr.pack_id = 0;           // ????
-  io_hdr.timeout = 60 * 1000;   // 60 seconds
-
-  // send command
-  if (ioctl(fd, SG_IO, &io_hdr) < 0)
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  ret = ata_pass_through_data(fd, isread, cmd, sizeof(cmd), databuffer, sectors * 512);
+  if (ret != 0)
   {
-    lasterror = errno;
-    printf("Send command failed (%d) - %s\n", lasterror, strerror(lasterror));
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
     return -1;
   }
 
-  // check status
-  if (check_status(&io_hdr, io_hdr.sbp) != 0)
+  return 0;
+}
+
+int sbc_verify16_cdb(unsigned char *cmd, unsigned long startlba, unsigned int sectors)
+{
+  unsigned int bytchk = 0;  // 0: medium verification only, no data out
+
+  memset(cmd, 0, 16);
+
+  // VERIFY(16), refer to SBC3 section 5.27
+  cmd[0] = 0x8F;
+  cmd[1] = bytchk << 1;
+  cmd[2] = (startlba >> 56) & 0xFF;
+  cmd[3] = (startlba >> 48) & 0xFF;
+  cmd[4] = (startlba >> 40) & 0xFF;
+  cmd[5] = (startlba >> 32) & 0xFF;
+  cmd[6] = (startlba >> 24) & 0xFF;
+  cmd[7] = (startlba >> 16) & 0xFF;
+  cmd[8] = (startlba >> 8) & 0xFF;
+  cmd[9] = startlba & 0xFF;
+  cmd[10] = (sectors >> 24) & 0xFF;
+  cmd[11] = (sectors >> 16) & 0xFF;
+  cmd[12] = (sectors >> 8) & 0xFF;
+  cmd[13] = sectors & 0xFF;
+
+  return 16;
+}
+
+int sbc_verify16(int fd, unsigned long startlba, unsigned int sectors)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  sbc_verify16_cdb(cmd, startlba, sectors);
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
     return -1;
-  
-  datalength = (databuffer[0] << 8 | databuffer[1]) + 2;
-  if (datalength > 4)
-  {
-    cmd[7] = (datalength >> 8) & 0xFF;
-    cmd[8] = datalength & 0xFF;
-    // build sg_io_hdr
-    io_hdr.cmdp = cmd;
-    io_hdr.cmd_len = sizeof(cmd);
-    io_hdr.dxferp = databuffer;
-    io_hdr.dxfer_len = datalength;
-    io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-
-    io_hdr.interface_id = 'S';    // ????
-    io_hdr.mx_sb_len = 64;        // sizeof(sense_b)
-    io_hdr.sbp = sense_b;
-    io_hdr.pack_id = 0;           // ????
-    io_hdr.timeout = 60 * 1000;   // 60 seconds
-
-    // send command
-    if (ioctl(fd, SG_IO, &io_hdr) < 0)
+  }
+
+  return 0;
+}
+
+int sbc_synccache(int fd)
+{
+  int ret;
+  unsigned char cmd[10];
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // SYNCHRONIZE CACHE(10), refer to SBC3 section 5.22. LBA and NUMBER OF LOGICAL BLOCKS ZERO means the whole medium.
+  // (10) rather than (16) since quite a few USB bridges only know the former
+  cmd[0] = 0x35;
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// READ VERIFY SECTORS (EXT), the ATA counterpart of VERIFY(16), refer to ACS-2 section 7.36
+int verify_cdb(unsigned char *cmd, unsigned int isext, unsigned long startlba, unsigned int sectors)
+{
+  int protocol = PROTOCOL_NONDATA;
+  int extend = isext ? 1 : 0;
+  int ck_cond  = 1;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_length = 0;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, 16);
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = (protocol << 1) | extend;
+  cmd[2] = (ck_cond << 5) | t_length;
+  cmd[6] = sectors & 0xFF;
+  cmd[8] = startlba & 0xFF;
+  cmd[10] = (startlba >> 8) & 0xFF;
+  cmd[12] = (startlba >> 16) & 0xFF;
+  if (isext)
+  {
+    cmd[5]  = (sectors >> 8) & 0xFF;   // hight 8 bit of SECTOR COUNT
+    cmd[7]  = (startlba >> 24) & 0xFF;
+    cmd[9]  = (startlba >> 32) & 0xFF;
+    cmd[11] = (startlba >> 40) & 0xFF;
+  }
+  cmd[13] = isext ? 0xE0 : 0xE0 | ((startlba >> 24) & 0x0F);   // LBA 27:24 in DEVICE 3:0 of 28-bit
+  cmd[14] = isext ? 0x42 : 0x40;
+
+  return 16;
+}
+
+int verify_sectors(int fd, unsigned int isext, unsigned long startlba, unsigned int sectors)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  verify_cdb(cmd, isext, startlba, sectors);
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// FLUSH CACHE (EXT), refer to ACS-2 section 7.14 & 7.15. The drive writes all the cached data to the media,
+// it may take long when much data is dirty, so the timeout is longer than for data transfer
+int flush_cache(int fd, unsigned int isext)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  int protocol = PROTOCOL_NONDATA;
+  int extend = isext ? 1 : 0;
+  int ck_cond  = 1;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_length = 0;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = (protocol << 1) | extend;
+  cmd[2] = (ck_cond << 5) | t_length;
+  cmd[13] = 0xE0;
+  cmd[14] = isext ? 0xEA : 0xE7;
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// SET FEATURES, refer to ACS-2 section 7.48. feature goes to FEATURE, e.g. 02h enable / 82h disable volatile write cache
+int set_features(int fd, unsigned int feature, unsigned int count)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  int protocol = PROTOCOL_NONDATA;
+  int ck_cond  = 1;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_length = 0;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = protocol << 1;
+  cmd[2] = (ck_cond << 5) | t_length;
+  cmd[4] = feature & 0xFF;
+  cmd[6] = count & 0xFF;
+  cmd[13] = 0xE0;
+  cmd[14] = 0xEF;
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// REPORT ZONES EXT, refer to ZAC section 5.2.1. pages of 512 bytes are read from the zone of zonelba on,
+// options is REPORTING OPTIONS, partial stops the ZONE LIST LENGTH at the buffer
+int report_zones_ext(int fd, unsigned long startlba, unsigned int options, unsigned int partial, void *databuffer, unsigned int pages)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  int protocol = PROTOCOL_DMA;
+  int extend = 1;
+  int ck_cond  = 0;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_dir = 1;      // 1: from device, 0: from controller
+  int byt_blok = 1;   // 0: transfer data is measured by byte, 1: measured by block
+  int t_length = 2;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = (protocol << 1) | extend;
+  cmd[2] = (ck_cond << 5) | (t_dir << 3) | (byt_blok << 2) | t_length;
+  cmd[3] = (partial ? 0x80 : 0) | (options & 0x3F);
+  cmd[4] = ZAC_REPORT_ZONES;
+  cmd[5] = (pages >> 8) & 0xFF;
+  cmd[6] = pages & 0xFF;
+  cmd[7] = (startlba >> 24) & 0xFF;
+  cmd[8] = startlba & 0xFF;
+  cmd[9] = (startlba >> 32) & 0xFF;
+  cmd[10] = (startlba >> 8) & 0xFF;
+  cmd[11] = (startlba >> 40) & 0xFF;
+  cmd[12] = (startlba >> 16) & 0xFF;
+  cmd[13] = 0x40;
+  cmd[14] = 0x4A;     // ZAC MANAGEMENT IN
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  ret = ata_pass_through_data(fd, 1, cmd, sizeof(cmd), databuffer, pages * 512);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// CLOSE ZONE / FINISH ZONE / OPEN ZONE / RESET WRITE POINTER EXT, refer to ZAC section 5.2.2 ~ 5.2.5.
+// The zone is the one which starts at zonelba, all applies the action to every zone it makes sense for
+int zac_management_out(int fd, unsigned int action, unsigned long zonelba, unsigned int all)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  int protocol = PROTOCOL_NONDATA;
+  int extend = 1;
+  int ck_cond  = 0;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_length = 0;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = (protocol << 1) | extend;
+  cmd[2] = (ck_cond << 5) | t_length;
+  cmd[3] = all ? 1 : 0;
+  cmd[4] = action & 0xFF;
+  if (!all)
+  {
+    cmd[7] = (zonelba >> 24) & 0xFF;
+    cmd[8] = zonelba & 0xFF;
+    cmd[9] = (zonelba >> 32) & 0xFF;
+    cmd[10] = (zonelba >> 8) & 0xFF;
+    cmd[11] = (zonelba >> 40) & 0xFF;
+    cmd[12] = (zonelba >> 16) & 0xFF;
+  }
+  cmd[13] = 0x40;
+  cmd[14] = 0x9F;     // ZAC MANAGEMENT OUT
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// READ / WRITE STREAM DMA EXT, refer to ATA8-ACS section 7.37 and 7.66. cctl is the COMMAND COMPLETION TIME LIMIT
+// in units of the streaming performance granularity, ZERO : the default of CONFIGURE STREAM.
+// CK_COND is set, the caller needs the status register to tell a stream error from a clean completion
+int stream_cdb(unsigned char *cmd, unsigned int isread, unsigned int streamid, unsigned int cctl, unsigned int options, unsigned long startlba, unsigned int sectors)
+{
+  int protocol = PROTOCOL_DMA;
+  int extend = 1;
+  int ck_cond  = 1;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_dir = isread ? 1 : 0;      // 1: from device, 0: from controller
+  int byt_blok = 1;   // 0: transfer data is measured by byte, 1: measured by block
+  int t_length = 2;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, 16);
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = (protocol << 1) | extend;
+  cmd[2] = (ck_cond << 5) | (t_dir << 3) | (byt_blok << 2) | t_length;
+  cmd[3] = cctl & 0xFF;
+  cmd[4] = (options & (STREAM_OPT_CONTINUOUS | STREAM_OPT_NOT_SEQ)) | (streamid & 0x7);
+  cmd[5] = (sectors >> 8) & 0xFF;
+  cmd[6] = sectors & 0xFF;
+  cmd[7] = (startlba >> 24) & 0xFF;
+  cmd[8] = startlba & 0xFF;
+  cmd[9] = (startlba >> 32) & 0xFF;
+  cmd[10] = (startlba >> 8) & 0xFF;
+  cmd[11] = (startlba >> 40) & 0xFF;
+  cmd[12] = (startlba >> 16) & 0xFF;
+  cmd[13] = 0x40;
+  cmd[14] = isread ? 0x2A : 0x3A;
+
+  return 16;
+}
+
+// CONFIGURE STREAM, refer to ATA8-ACS section 7.6. add 1 : add or replace streamid, 0 : remove it.
+// cctl is the default time limit of the stream, allocation the ALLOCATION UNIT in sectors
+int configure_stream(int fd, unsigned int streamid, unsigned int add, unsigned int cctl, unsigned int allocation)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  int protocol = PROTOCOL_NONDATA;
+  int extend = 1;
+  int ck_cond  = 0;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_length = 0;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = (protocol << 1) | extend;
+  cmd[2] = (ck_cond << 5) | t_length;
+  cmd[3] = cctl & 0xFF;
+  cmd[4] = (add ? 0x80 : 0) | (streamid & 0x7);
+  cmd[5] = (allocation >> 8) & 0xFF;
+  cmd[6] = allocation & 0xFF;
+  cmd[13] = 0x40;
+  cmd[14] = 0x51;
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// STANDBY IMMEDIATE / IDLE IMMEDIATE, refer to ACS-3 section 7.52 and 7.16
+int power_immediate(int fd, unsigned int standby)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  int protocol = PROTOCOL_NONDATA;
+  int ck_cond  = 0;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_length = 0;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = protocol << 1;
+  cmd[2] = (ck_cond << 5) | t_length;
+  cmd[13] = 0x40;
+  cmd[14] = standby ? 0xE0 : 0xE1;
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// CHECK POWER MODE, refer to ACS-3 section 7.3. mode is the COUNT the device returns, POWER_MODE_*
+int check_power_mode(int fd, unsigned int *mode)
+{
+  unsigned char cmd[16];
+  SENSE_INFO regs;
+
+  int protocol = PROTOCOL_NONDATA;
+  int ck_cond  = 1;   // the result is in COUNT
+  int t_length = 0;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = protocol << 1;
+  cmd[2] = (ck_cond << 5) | t_length;
+  cmd[13] = 0x40;
+  cmd[14] = 0xE5;
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  if (ata_pass_through_regs(fd, cmd, sizeof(cmd), &regs) != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  *mode = regs.ata_count & 0xFF;
+  return 0;
+}
+
+// SET FEATURES Extended Power Conditions, refer to ACS-3 section 7.45.19. subcommand goes to LBA 3:0,
+// condition, the power condition ID, to COUNT
+int epc_set_features(int fd, unsigned int subcommand, unsigned int condition)
+{
+  int ret;
+  unsigned char cmd[16];
+
+  int protocol = PROTOCOL_NONDATA;
+  int ck_cond  = 0;   // SATL shall terminate the command with CHECK CONDITION only if an error occurs
+  int t_length = 0;   // 0: no daa is transfer, 1: length is specified in FEATURE, 2: specified in SECTOR_COUNT, 3: specified in STPSIU
+
+  memset(cmd, 0, sizeof(cmd));
+
+  // build ata pass through command
+  cmd[0] = 0x85;
+  cmd[1] = protocol << 1;
+  cmd[2] = (ck_cond << 5) | t_length;
+  cmd[4] = 0x4A;
+  cmd[6] = condition & 0xFF;
+  cmd[8] = subcommand & 0xF;
+  cmd[13] = 0x40;
+  cmd[14] = 0xEF;
+
+  if (isDebug)
+    dump_cdb(cmd, sizeof(cmd));
+
+  ret = ata_pass_through_data(fd, 0, cmd, sizeof(cmd), NULL, 0);
+  if (ret != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// ATA strings are pairs of characters swapped in each word, refer to ACS-2 section 3.3.10.
+// dst shall hold nwords * 2 + 1 bytes, leading and trailing spaces are dropped.
+// With SSE2, 8 words are swapped at a time and the padding is found by a compare mask of the last 16 bytes,
+// which matters when millions of captured IDENTIFY data are decoded, see blob.c
+void ata_string(char *dst, unsigned short *iden, unsigned int word, unsigned int nwords)
+{
+  unsigned int i = 0;
+  int len = nwords * 2;
+  int start = 0;
+#ifdef __SSE2__
+  __m128i v, pad;
+  unsigned int mask;
+
+  for (; i + 8 <= nwords; i += 8)
+  {
+    v = _mm_loadu_si128((const __m128i *)(iden + word + i));
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(dst + i * 2), v);
+  }
+#endif
+
+  for (; i < nwords; i++)
+  {
+    dst[i * 2] = iden[word + i] >> 8;
+    dst[i * 2 + 1] = iden[word + i] & 0xFF;
+  }
+
+#ifdef __SSE2__
+  // a bit for every byte of the last 16 which is padding, the string ends after the highest byte which isn't
+  while (len >= 16)
+  {
+    v = _mm_loadu_si128((const __m128i *)(dst + len - 16));
+    pad = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    mask = ~_mm_movemask_epi8(pad) & 0xFFFF;
+    if (mask)
     {
-      lasterror = errno;
-      printf("Send command failed (%d) - %s\n", lasterror, strerror(lasterror));
-      return -1;
+      len = len - 16 + 32 - __builtin_clz(mask);
+      break;
     }
+    len -= 16;
+  }
+#endif
+  while (len > 0 && (dst[len - 1] == ' ' || dst[len - 1] == 0))
+    len--;
 
-    // check status
-    if (check_status(&io_hdr, io_hdr.sbp) != 0)
-      return -1;
+#ifdef __SSE2__
+  // the same mask from the front, the string starts at the lowest byte which isn't padding
+  while (start + 16 <= len)
+  {
+    v = _mm_loadu_si128((const __m128i *)(dst + start));
+    pad = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    mask = ~_mm_movemask_epi8(pad) & 0xFFFF;
+    if (mask)
+    {
+      start += __builtin_ctz(mask);
+      break;
+    }
+    start += 16;
+  }
+#endif
+  while (start < len && (dst[start] == ' ' || dst[start] == 0))
+    start++;
+  memmove(dst, dst + start, len - start);
+  dst[len - start] = 0;
+}
+
+int ioctl_test(int fd)
+{
+  int ret;
+  int version;
+  char info[MAX_LENGTH_OUTPUT];
+ 
+  if (ioctl(fd, SG_GET_VERSION_NUM, &version) != 0)
+  {
+    lasterror = errno;
+    printf("Ioctl SG_GET_VERSION_NUM failed (%d) - %s\n", lasterror, strerror(lasterror));
+    return -1;
+  }
+
+  printf("Version number %o\n", version);
+  ret = probe_host(fd, info, sizeof(info));
+  if (ret < 0)
+  {
+    printf("Ioctl SCSI_IO_PROBE_HOST failed (%d) - %s\n", lasterror, strerror(lasterror));
+    return -1;
+  }
+  else if (ret == 0)
+  {
+    printf("Host is not present\n");
+    return 0;
+  }
+
+  printf("host info %s\n", info);
+
+  return 0;
+}
+
+// Name of the host adapter driver of fd by SCSI_IOCTL_PROBE_HOST, 1 : host present, 0 : host is not present
+int probe_host(int fd, char *info, unsigned int len)
+{
+  PROBE_HOST probe_host;
+  int ret;
+
+  probe_host.length = MAX_LENGTH_OUTPUT;
+  ret = ioctl(fd, SCSI_IOCTL_PROBE_HOST, &probe_host);
+  if (ret < 0)
+  {
+    lasterror = errno;
+    return -1;
+  }
+
+  probe_host.buffer[MAX_LENGTH_OUTPUT - 1] = 0;
+  snprintf(info, len, "%s", ret ? probe_host.buffer : "");
+  return ret;
+}
+
+static int scsi_data_in(int fd, unsigned char *cmd, unsigned int cmdsize, void *databuffer, unsigned int buffersize, unsigned int *translen)
+{
+  struct sg_io_hdr io_hdr;
+  unsigned char sense_b[SENSE_CODE_LENGTH];
+
+  sg_io_setup(&io_hdr, cmd, cmdsize, 1, databuffer, buffersize, sense_b, sizeof(sense_b), 0);
+
+  // send command with retries, check status
+  if (sg_command(fd, &io_hdr) != 0)
+    return -1;
+
+  // resid is the number of bytes the device didn't fill in, i.e. allocation length - actual response length
+  if (translen)
+    *translen = (io_hdr.resid > 0 && io_hdr.resid < buffersize) ? buffersize - io_hdr.resid : buffersize;
+
+  return 0;
+}
+
+// MODE SENSE(10) of all pages in one round trip, the allocation length is big enough for any mode data
+// so it isn't needed to probe MODE DATA LENGTH with a short command first
+int sg_mode(int fd)
+{
+  unsigned char cmd[10];
+  unsigned char *databuffer;
+  unsigned int  datalength = MODE_SENSE_ALLOC_LENGTH;
+  unsigned int  translen = 0;
+
+  unsigned int  dbd = 0;   // disable block decriptors bit
+  unsigned int  llbaa = 0; // Long LBA Accepted bit
+  unsigned int  pc = 0;    // page control, 00 : current value
+  unsigned int  pagecode = 0x3f;
+  unsigned int  subpagecode = 0;
+  unsigned int  control = 0;
+
+  databuffer = (unsigned char *)malloc(datalength);
+  if (databuffer == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+  memset(databuffer, 0, datalength);
+  memset(cmd, 0, sizeof(cmd));
+
+  // build mode sense 10 command, refer to SPC4, section 6.12 MODE SENSE(10) command
+  cmd[0] = 0x5A;
+  cmd[1] = (dbd ? 0x08 : 0) | (llbaa ? 0x10 : 0);
+  cmd[2] = pc << 6 | pagecode;
+  cmd[3] = subpagecode;
+  cmd[7] = (datalength >> 8) & 0xFF;
+  cmd[8] = datalength & 0xFF;
+  cmd[9] = control;
+
+  if (scsi_data_in(fd, cmd, sizeof(cmd), databuffer, datalength, &translen) != 0)
+  {
+    free(databuffer);
+    return -1;
   }
 
-  printf("QQQQ datalength %d\n", datalength);
+  // MODE DATA LENGTH doesn't include itself
+  datalength = (databuffer[0] << 8 | databuffer[1]) + 2;
+  if (datalength > translen)
+    datalength = translen;
+
+  if (isDebug)
+    printf("DEBUG, mode data length %d, transferred %d\n", datalength, translen);
   parse_mode_page(databuffer, datalength);
-  
+
+  free(databuffer);
   return 0;
 }
 
-static void parse_mode_page(char *buffer, unsigned int len)
+static void parse_mode_page(unsigned char *buffer, unsigned int len)
 {
-  printf("mode data length 0x%x%x\n", buffer[0], buffer[1]);
+  printf("mode data length 0x%x\n", buffer[0] << 8 | buffer[1]);
   printf("medium type 0x%x\n", buffer[2]);
   printf("device-specific parameter 0x%x\n", buffer[3]);
-  printf("longlba %x\n", buffer[4]);
-  printf("block descriptro length 0x%x%x\n", buffer[6], buffer[7]);
+  printf("longlba %x\n", buffer[4] & 0x1);
+  printf("block descriptor length 0x%x\n", buffer[6] << 8 | buffer[7]);
 }
 
 
+// Standard INQUIRY in one round trip. The allocation length is 0xFF rather than 36 so that the whole standard data,
+// including version descriptors, comes back at once. Byte 3 is kept ZERO since it is reserved before SPC-3
 int sg_inquiry(int fd)
 {
-  struct sg_io_hdr io_hdr;
   unsigned char cmd[6];
-  unsigned char databuffer[512];
-  unsigned char sense_b[64];
-  unsigned int datalength = 36;
+  unsigned char databuffer[INQUIRY_ALLOC_LENGTH];
+  unsigned int datalength = INQUIRY_ALLOC_LENGTH;
+  unsigned int translen = 0;
 
-  memset(sense_b, 0, 64);
-  memset(databuffer, 0, 512);
-  memset(&io_hdr, 0, sizeof(struct sg_io_hdr));
+  memset(databuffer, 0, sizeof(databuffer));
 
   // build inquiry command, refer to SPC3, section 6.4 INQUIRY command
   cmd[0] = 0x12;     // INQUIRY command
@@ -602,138 +1265,288 @@ int sg_inquiry(int fd)
   cmd[4] = datalength;       // low byte of allocation length
   cmd[5] = 0;        // control byte
 
-  // build sg_io_hdr
-  io_hdr.cmdp = cmd;
-  io_hdr.cmd_len = sizeof(cmd);
-  io_hdr.dxferp = databuffer;
-  io_hdr.dxfer_len = datalength;
-  io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+  if (scsi_data_in(fd, cmd, sizeof(cmd), databuffer, datalength, &translen) != 0)
+    return -1;
+
+  if (isDebug)
+    printf("DEBUG, inquiry additional length %d, transferred %d\n", databuffer[4], translen);
+
+  // parse inquiry data
+  parse_inquiry_data(databuffer, translen);
+
+  return 0;
+}
+
+// Read one VPD page with INQUIRY EVPD = 1, refer to SPC4, section 6.6 INQUIRY command.
+// buffersize is used as allocation length, so one round trip is enough as long as the buffer is VPD_ALLOC_LENGTH.
+// Return the length of the page (header included) or -1
+int sg_inquiry_vpd(int fd, unsigned int pagecode, unsigned char *databuffer, unsigned int buffersize)
+{
+  unsigned char cmd[6];
+  unsigned int pagelength;
+  unsigned int translen = 0;
+
+  memset(databuffer, 0, buffersize);
+
+  cmd[0] = 0x12;     // INQUIRY command
+  cmd[1] = 1;        // bit 0 EVPD
+  cmd[2] = pagecode;
+  cmd[3] = (buffersize >> 8) & 0xFF;   // high byte of allocation length
+  cmd[4] = buffersize & 0xFF;          // low byte of allocation length
+  cmd[5] = 0;        // control byte
 
-  io_hdr.interface_id = 'S';    // ????
-  io_hdr.mx_sb_len = 64;        // sizeof(sense_b)
-  io_hdr.sbp = sense_b;
-  io_hdr.pack_id = 0;           // ????
-  io_hdr.timeout = 60 * 1000;   // 60 seconds
+  if (scsi_data_in(fd, cmd, sizeof(cmd), databuffer, buffersize, &translen) != 0)
+    return -1;
 
-  // send command
-  if (ioctl(fd, SG_IO, &io_hdr) < 0)
+  // some devices answer with the standard data or another page when the page isn't supported
+  if (databuffer[1] != pagecode)
   {
-    lasterror = errno;
-    printf("Send command failed (%d) - %s\n", lasterror, strerror(lasterror));
+    if (isDebug)
+      printf("DEBUG, VPD page 0x%02x returned page code 0x%02x\n", pagecode, databuffer[1]);
     return -1;
   }
 
-  // check status
-  if (check_status(&io_hdr, io_hdr.sbp) != 0)
-    return -1;
-  
-  datalength = databuffer[4] + 5;
-  if (datalength > 36)
-  {
-    memset(sense_b, 0, 64);
-    memset(databuffer, 0, 512);
-    memset(&io_hdr, 0, sizeof(struct sg_io_hdr));
-
-    // build inquiry command, refer to SPC3, section 6.4 INQUIRY command
-    cmd[0] = 0x12;     // INQUIRY command
-    cmd[1] = 0;        // bit 0 EVPD is ZERO
-    cmd[2] = 0;        // page code is ZERO
-    cmd[3] = 0;        // high byte of allocation length
-    cmd[4] = datalength;       // low byte of allocation length
-    cmd[5] = 0;        // control byte
-
-    // build sg_io_hdr
-    io_hdr.cmdp = cmd;
-    io_hdr.cmd_len = sizeof(cmd);
-    io_hdr.dxferp = databuffer;
-    io_hdr.dxfer_len = datalength;
-    io_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-
-    io_hdr.interface_id = 'S';    // ????
-    io_hdr.mx_sb_len = 64;        // sizeof(sense_b)
-    io_hdr.sbp = sense_b;
-    io_hdr.pack_id = 0;           // ????
-    io_hdr.timeout = 60 * 1000;   // 60 seconds
-
-    // send command
-    if (ioctl(fd, SG_IO, &io_hdr) < 0)
+  // PAGE LENGTH doesn't include the 4 bytes header
+  pagelength = (databuffer[2] << 8 | databuffer[3]) + 4;
+  if (pagelength > translen)
+    pagelength = translen;
+
+  return pagelength;
+}
+
+// Copy an ASCII field, drop leading and trailing spaces and terminate it
+static void copy_ascii(char *dst, unsigned char *src, unsigned int len)
+{
+  unsigned int start = 0;
+
+  while (start < len && (src[start] == ' ' || src[start] == 0))
+    start++;
+  while (len > start && (src[len - 1] == ' ' || src[len - 1] == 0))
+    len--;
+
+  memcpy(dst, src + start, len - start);
+  dst[len - start] = 0;
+}
+
+static unsigned int get_be16(unsigned char *p)
+{
+  return p[0] << 8 | p[1];
+}
+
+static unsigned int get_be32(unsigned char *p)
+{
+  return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void decode_device_id(VPD_INFO *vpd, unsigned char *buffer, unsigned int len)
+{
+  unsigned int offset = 4;
+
+  // Designation descriptor list, refer to SPC4, section 7.8.6 Device Identification VPD page
+  while (offset + 4 <= len)
+  {
+    unsigned int association = (buffer[offset + 1] >> 4) & 0x3;
+    unsigned int type = buffer[offset + 1] & 0xF;
+    unsigned int idlen = buffer[offset + 3];
+
+    if (offset + 4 + idlen > len)
+      break;
+
+    // Only designators of the logical unit (association 0) are kept, NAA is preferred over EUI-64 and T10 vendor ID
+    if (association == 0 && (type == DESIGNATOR_NAA || type == DESIGNATOR_EUI64 || type == DESIGNATOR_T10))
     {
-      lasterror = errno;
-      printf("Send command failed (%d) - %s\n", lasterror, strerror(lasterror));
-      return -1;
+      if (vpd->lu_id_type == 0 || type == DESIGNATOR_NAA || (type == DESIGNATOR_EUI64 && vpd->lu_id_type == DESIGNATOR_T10))
+      {
+        vpd->lu_id_type = type;
+        vpd->lu_id_len = idlen > sizeof(vpd->lu_id) ? sizeof(vpd->lu_id) : idlen;
+        memcpy(vpd->lu_id, buffer + offset + 4, vpd->lu_id_len);
+      }
     }
-    // check status
-    if (check_status(&io_hdr, io_hdr.sbp) != 0)
-      return -1;
+
+    offset += 4 + idlen;
   }
+}
 
-  // parse inquiry data
-  parse_inquiry_data(io_hdr.dxferp, io_hdr.dxfer_len);
+static void decode_ata_info(VPD_INFO *vpd, unsigned char *buffer, unsigned int len)
+{
+  // ATA Information VPD page, refer to SAT-3, section 10.4.4
+  if (len < 60 + 512)
+    return;
+
+  vpd->ata_info = 1;
+  copy_ascii(vpd->sat_vendor, buffer + 8, 8);
+  copy_ascii(vpd->sat_product, buffer + 16, 16);
+  copy_ascii(vpd->sat_revision, buffer + 32, 4);
+  memcpy(vpd->ata_signature, buffer + 36, sizeof(vpd->ata_signature));
+  vpd->ata_command = buffer[56];            // 0xEC : IDENTIFY DEVICE, 0xA1 : IDENTIFY PACKET DEVICE
+  memcpy(vpd->identify, buffer + 60, sizeof(vpd->identify));
+}
 
+static void decode_block_limits(VPD_INFO *vpd, unsigned char *buffer, unsigned int len)
+{
+  // Block Limits VPD page, refer to SBC3, section 6.5.3
+  if (len < 16)
+    return;
+
+  vpd->block_limits = 1;
+  vpd->opt_xfer_gran = get_be16(buffer + 6);
+  vpd->max_xfer_len = get_be32(buffer + 8);
+  vpd->opt_xfer_len = get_be32(buffer + 12);
+  if (len >= 32)
+  {
+    vpd->max_prefetch_len = get_be32(buffer + 16);
+    vpd->max_unmap_lba = get_be32(buffer + 20);
+    vpd->max_unmap_desc = get_be32(buffer + 24);
+    vpd->opt_unmap_gran = get_be32(buffer + 28);
+  }
+  if (len >= 44)
+    vpd->max_write_same_len = (unsigned long long)get_be32(buffer + 36) << 32 | get_be32(buffer + 40);
+}
+
+static void decode_block_dev_char(VPD_INFO *vpd, unsigned char *buffer, unsigned int len)
+{
+  // Block Device Characteristics VPD page, refer to SBC4, section 6.6.2
+  if (len < 9)
+    return;
+
+  vpd->block_dev_char = 1;
+  vpd->rotation_rate = get_be16(buffer + 4);   // 1 : non-rotating medium, 0x0401 ~ 0xFFFE : rpm
+  vpd->form_factor = buffer[7] & 0xF;
+  vpd->zoned = (buffer[8] >> 4) & 0x3;         // 0 : not reported, 1 : host aware, 2 : device managed
+}
+
+// Read Supported VPD Pages and then every page in it which VPD_INFO knows about, one round trip per page
+int sg_vpd_info(int fd, VPD_INFO *vpd)
+{
+  unsigned char *databuffer;
+  int len;
+  int i;
+
+  memset(vpd, 0, sizeof(VPD_INFO));
+
+  databuffer = (unsigned char *)malloc(VPD_ALLOC_LENGTH);
+  if (databuffer == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  len = sg_inquiry_vpd(fd, VPD_SUPPORTED_PAGES, databuffer, VPD_ALLOC_LENGTH);
+  if (len < 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(databuffer);
+    return -1;
+  }
+
+  for (i = 4; i < len; i++)
+    vpd->pages[databuffer[i]] = 1;
+  vpd->pages[VPD_SUPPORTED_PAGES] = 1;
+
+  if (vpd->pages[VPD_UNIT_SERIAL] && (len = sg_inquiry_vpd(fd, VPD_UNIT_SERIAL, databuffer, VPD_ALLOC_LENGTH)) > 4)
+    copy_ascii(vpd->serial, databuffer + 4, (len - 4) >= sizeof(vpd->serial) ? sizeof(vpd->serial) - 1 : len - 4);
+
+  if (vpd->pages[VPD_DEVICE_ID] && (len = sg_inquiry_vpd(fd, VPD_DEVICE_ID, databuffer, VPD_ALLOC_LENGTH)) > 4)
+    decode_device_id(vpd, databuffer, len);
+
+  if (vpd->pages[VPD_ATA_INFO] && (len = sg_inquiry_vpd(fd, VPD_ATA_INFO, databuffer, VPD_ALLOC_LENGTH)) > 4)
+    decode_ata_info(vpd, databuffer, len);
+
+  if (vpd->pages[VPD_BLOCK_LIMITS] && (len = sg_inquiry_vpd(fd, VPD_BLOCK_LIMITS, databuffer, VPD_ALLOC_LENGTH)) > 4)
+    decode_block_limits(vpd, databuffer, len);
+
+  if (vpd->pages[VPD_BLOCK_DEV_CHAR] && (len = sg_inquiry_vpd(fd, VPD_BLOCK_DEV_CHAR, databuffer, VPD_ALLOC_LENGTH)) > 4)
+    decode_block_dev_char(vpd, databuffer, len);
+
+  free(databuffer);
   return 0;
 }
 
-static int check_status(struct sg_io_hdr *io_hdr, unsigned char *sense_b)
+void parse_vpd_info(VPD_INFO *vpd)
 {
   int i;
-  int response_code;
-  unsigned int sk;
-  unsigned int asc;
-  unsigned int ascq;
 
-  if (io_hdr->status == 2)
+  printf("Supported VPD pages ");
+  for (i = 0; i < 256; i++)
   {
-    response_code = 0x7F & sense_b[0];
-    switch (response_code)
-    {
-      // Fixed format sense data, refer to spc-4 section 4.5.3
-      case 0x70:
-      case 0x71:
-        sk = sense_b[2] & 0xF;
-        asc = sense_b[12];
-        ascq = sense_b[13];
-        break;
-
-      // Descriptor format sense data, refer to spc-4 section 4.5.2
-      case 0x72:
-      case 0x73:
-        sk = sense_b[1] & 0xF;
-        asc = sense_b[2];
-        ascq = sense_b[3];
-        break;
-
-      default:
-        printf("unsupported format sense data\n");
-        break;
+    if (vpd->pages[i])
+      printf("0x%02x ", i);
+  }
+  printf("\n");
 
-    }
+  if (vpd->pages[VPD_UNIT_SERIAL])
+    printf("Unit serial number %s\n", vpd->serial);
 
-    if (isDebug)
+  if (vpd->lu_id_len)
+  {
+    printf("Logical unit designator (type %d) ", vpd->lu_id_type);
+    for (i = 0; i < vpd->lu_id_len; i++)
     {
-      printf("host status %x | driver status %x | status %x\n", io_hdr->host_status, io_hdr->driver_status, io_hdr->status);
-      printf("sense code : ");
-      printf("response code %x | ", response_code);
-      printf("sense key %x | ", sk);
-      printf("additional sense code %x | ", asc);
-      printf("additional sense code Q %x\n", ascq);
-//      for (i = 0; i < SENSE_CODE_LENGTH; i++)
-//      {
-//        printf("%d: 0x%x | ", i, sense_b[i]);
-//      }
-//      printf("\n");
+      if (vpd->lu_id_type == DESIGNATOR_T10)
+        printf("%c", vpd->lu_id[i]);
+      else
+        printf("%02x", vpd->lu_id[i]);
     }
-    
-    if (sk != 0 && sk != 1)
-      return -1;
+    printf("\n");
+  }
+
+  if (vpd->ata_info)
+  {
+    printf("SAT vendor %s, product %s, revision %s\n", vpd->sat_vendor, vpd->sat_product, vpd->sat_revision);
+    printf("ATA command code 0x%02x, device signature ", vpd->ata_command);
+    for (i = 0; i < sizeof(vpd->ata_signature); i++)
+      printf("%02x ", vpd->ata_signature[i]);
+    printf("\n");
+  }
+
+  if (vpd->block_limits)
+  {
+    printf("Optimal transfer length granularity %u blocks\n", vpd->opt_xfer_gran);
+    printf("Maximum transfer length %u blocks\n", vpd->max_xfer_len);
+    printf("Optimal transfer length %u blocks\n", vpd->opt_xfer_len);
+    printf("Maximum prefetch length %u blocks\n", vpd->max_prefetch_len);
+    printf("Maximum unmap LBA count %u, descriptor count %u, optimal unmap granularity %u\n", vpd->max_unmap_lba, vpd->max_unmap_desc, vpd->opt_unmap_gran);
+    printf("Maximum write same length %llu blocks\n", vpd->max_write_same_len);
   }
-  else
+
+  if (vpd->block_dev_char)
   {
+    if (vpd->rotation_rate == 1)
+      printf("Medium rotation rate : non-rotating medium\n");
+    else
+      printf("Medium rotation rate %u rpm\n", vpd->rotation_rate);
+    printf("Nominal form factor %x\n", vpd->form_factor);
+    printf("Zoned %x\n", vpd->zoned);
+  }
+}
+
+static int check_status(struct sg_io_hdr *io_hdr, unsigned char *sense_b)
+{
+  SENSE_INFO info;
+
+  if (isDebug)
+    printf("host status %x | driver status %x | status %x\n", io_hdr->host_status, io_hdr->driver_status, io_hdr->status);
+
+  if (io_hdr->host_status != 0 || (io_hdr->driver_status & ~DRIVER_SENSE))
+    return -1;
+
+  // CHECK CONDITION, RECOVERED ERROR is a success which reports something, e.g. the ATA registers of CK_COND
+  if (io_hdr->status == 2)
+  {
+    if (sense_decode(sense_b, io_hdr->sb_len_wr, &info) != 0)
+    {
+      printf("unsupported format sense data\n");
+      return -1;
+    }
+
     if (isDebug)
-      printf("host status %x | driver status %x | status %x\n", io_hdr->host_status, io_hdr->driver_status, io_hdr->status);
-    
-    if (io_hdr->host_status != 0 || io_hdr->driver_status != 0 || io_hdr->status != 0)
+      sense_print(&info);
+
+    if (info.sk != SK_NO_SENSE && info.sk != SK_RECOVERED_ERROR)
       return -1;
   }
+  else if (io_hdr->status != 0)
+    return -1;
 
   return 0;
 }
@@ -5,9 +5,170 @@
 #ifndef _COMMAND_H_
 #define _COMMAND_H_
 
+// VPD page codes, refer to SPC4 section 7.8 and SBC3 section 6.5
+#define VPD_SUPPORTED_PAGES  0x00
+#define VPD_UNIT_SERIAL      0x80
+#define VPD_DEVICE_ID        0x83
+#define VPD_ATA_INFO         0x89
+#define VPD_BLOCK_LIMITS     0xB0
+#define VPD_BLOCK_DEV_CHAR   0xB1
+
+// PRIO of READ/WRITE FPDMA QUEUED, refer to ACS-3 section 7.22
+#define NCQ_PRIO_NORMAL      0
+#define NCQ_PRIO_ISOCHRONOUS 1
+#define NCQ_PRIO_HIGH        2
+
+// Actions of ZAC MANAGEMENT IN / OUT, refer to ZAC section 5.2
+#define ZAC_REPORT_ZONES     0x00
+#define ZAC_CLOSE_ZONE       0x01
+#define ZAC_FINISH_ZONE      0x02
+#define ZAC_OPEN_ZONE        0x03
+#define ZAC_RESET_WP         0x04
+
+// FEATURE 7:0 of READ / WRITE STREAM DMA EXT, refer to ATA8-ACS section 7.37 and 7.66
+#define STREAM_OPT_CONTINUOUS 0x40       // RC / WC, complete in time even if the data isn't perfect
+#define STREAM_OPT_NOT_SEQ    0x20       // NS of read, the next read of the stream isn't sequential
+#define STREAM_MAX_ID         7
+
+// COUNT of CHECK POWER MODE, refer to ACS-3 section 7.3, and power condition IDs of EPC, section 4.9
+#define POWER_MODE_STANDBY_Z  0x00       // Standby, Standby_z with EPC
+#define POWER_MODE_STANDBY_Y  0x01
+#define POWER_MODE_IDLE       0x80
+#define POWER_MODE_IDLE_A     0x81
+#define POWER_MODE_IDLE_B     0x82
+#define POWER_MODE_IDLE_C     0x83
+#define POWER_MODE_ACTIVE     0xFF       // Active or Idle
+
+// SET FEATURES subcommands of APM and EPC, refer to ACS-3 section 7.45
+#define SF_ENABLE_APM         0x05
+#define SF_DISABLE_APM        0x85
+#define EPC_RESTORE           0x0
+#define EPC_GO_TO_CONDITION   0x1
+
+// SMART EXECUTE OFF-LINE IMMEDIATE subcommands in off-line mode, refer to ACS-3 section 7.48.5, the drive keeps
+// serving commands while the test runs
+#define SELFTEST_SHORT        0x01
+#define SELFTEST_EXTENDED     0x02
+#define SELFTEST_CONVEYANCE   0x03
+#define SELFTEST_ABORT        0x7F
+
+// SMART READ DATA, refer to ACS-3 section 7.48.6, and the SMART self-test log, section A.16
+#define SMART_SELFTEST_STATUS 363        // self-test execution status, result in 7:4, percent remaining / 10 in 3:0
+#define SMART_OFFLINE_CAP     367        // bit 4 : self-test, bit 5 : conveyance self-test
+#define SMART_SHORT_MINUTES   372        // recommended polling times
+#define SMART_EXT_MINUTES     373        // FFh : the word at 375 has it
+#define SMART_CONV_MINUTES    374
+#define SMART_EXT_MINUTES_W   375
+#define SMART_LOG_SELFTEST    0x06
+#define SELFTEST_IN_PROGRESS  0xF
+
+// Decoded VPD pages, a field is ZERO when its page isn't supported
+typedef struct _VPD_INFO {
+  unsigned char pages[256];          // 1 : page code is listed in Supported VPD Pages
+
+  // Unit Serial Number, 0x80
+  char serial[256];
+
+  // Device Identification, 0x83. The logical unit designator, NAA is preferred
+  unsigned int  lu_id_type;
+  unsigned int  lu_id_len;
+  unsigned char lu_id[32];
+
+  // ATA Information, 0x89
+  int  ata_info;
+  char sat_vendor[9];
+  char sat_product[17];
+  char sat_revision[5];
+  unsigned char ata_signature[20];
+  unsigned int  ata_command;
+  unsigned char identify[512];       // IDENTIFY (PACKET) DEVICE data returned by SATL
+
+  // Block Limits, 0xB0. Lengths are in logical blocks, ZERO means no limit reported
+  int  block_limits;
+  unsigned int opt_xfer_gran;
+  unsigned int max_xfer_len;
+  unsigned int opt_xfer_len;
+  unsigned int max_prefetch_len;
+  unsigned int max_unmap_lba;
+  unsigned int max_unmap_desc;
+  unsigned int opt_unmap_gran;
+  unsigned long long max_write_same_len;
+
+  // Block Device Characteristics, 0xB1
+  int  block_dev_char;
+  unsigned int rotation_rate;
+  unsigned int form_factor;
+  unsigned int zoned;
+} VPD_INFO;
+
+// READ CAPACITY(16) parameter data
+typedef struct _CAPACITY {
+  unsigned long long lastlba;
+  unsigned int blocksize;
+  unsigned int prot_en;
+  unsigned int lbppbe;             // logical blocks per physical block exponent
+  unsigned int lbpme;              // logical block provisioning management enabled
+  unsigned int lowest_aligned;     // lowest aligned LBA
+} CAPACITY;
+
+// Command sets of the read / write command templates
+typedef enum _CDB_SET {
+  CDB_PIO = 0,           // READ/WRITE SECTORS (EXT)
+  CDB_MULTI,             // READ/WRITE MULTIPLE (EXT)
+  CDB_DMA,               // READ/WRITE DMA (EXT)
+  CDB_DMA_QUEUED,        // READ/WRITE DMA QUEUED (EXT)
+  CDB_FPDMA,             // READ/WRITE FPDMA QUEUED
+  CDB_SBC,               // READ/WRITE(16)
+  CDB_SET_NUM
+} CDB_SET;
+
+typedef enum _CDB_OP {
+  CDB_READ = 0,
+  CDB_READ_FUA,
+  CDB_WRITE,
+  CDB_WRITE_FUA,
+  CDB_OP_NUM
+} CDB_OP;
+
+// Where the LBA, count and tag of a template go
+typedef enum _CDB_LAYOUT {
+  CDB_LAYOUT_ATA28 = 0,  // count in SECTOR COUNT 7:0
+  CDB_LAYOUT_ATA48,      // count in SECTOR COUNT 15:0
+  CDB_LAYOUT_QUEUED28,   // count in FEATURES, tag in SECTOR COUNT
+  CDB_LAYOUT_QUEUED48,
+  CDB_LAYOUT_NCQ,        // QUEUED48 with PRIO in SECTOR COUNT
+  CDB_LAYOUT_SBC16
+} CDB_LAYOUT;
+
+typedef struct _CDB_TEMPLATE {
+  unsigned char cdb[16];
+  CDB_LAYOUT layout;
+} CDB_TEMPLATE;
+
+struct sg_io_hdr;
+struct _SENSE_INFO;
+
 int ioctl_test(int fd);
+int probe_host(int fd, char *info, unsigned int len);
+int ata_pass_through_data(int fd, int isread, char *cmd, int cmdsize, void *databuffer, int buffersize);
+int ata_pass_through_regs(int fd, char *cmd, int cmdsize, struct _SENSE_INFO *regs);
+int sg_io_check(struct sg_io_hdr *io_hdr);
+int sg_sense(struct sg_io_hdr *io_hdr, unsigned int *sk, unsigned int *asc, unsigned int *ascq);
+const CDB_TEMPLATE *cdb_template(CDB_SET set, unsigned int isext, CDB_OP op);
+CDB_OP cdb_op(unsigned int isread, unsigned int fua);
+int cdb_encode(const CDB_TEMPLATE *t, unsigned char *cmd, unsigned long long startlba, unsigned int sectors,
+               unsigned int tag, unsigned int prio);
+int multi_cdb(unsigned char *cmd, unsigned int isread, unsigned int isext, unsigned int fua, unsigned long startlba, unsigned int sectors);
+int dmaqueued_cdb(unsigned char *cmd, unsigned int isread, unsigned int isext, unsigned int tag, unsigned int fua, unsigned long startlba, unsigned int sectors);
+int dma_cdb(unsigned char *cmd, unsigned int isread, unsigned int isext, unsigned int fua, unsigned long startlba, unsigned int sectors);
+int sectors_cdb(unsigned char *cmd, unsigned int isread, unsigned int isext, unsigned long startlba, unsigned int sectors);
+int fpdma_cdb(unsigned char *cmd, unsigned int isread, unsigned int ncqtag, unsigned int prio, unsigned int fua, unsigned long startlba, unsigned int sectors);
+int verify_cdb(unsigned char *cmd, unsigned int isext, unsigned long startlba, unsigned int sectors);
+int sbc_verify16_cdb(unsigned char *cmd, unsigned long startlba, unsigned int sectors);
+int sbc_rw16_cdb(unsigned char *cmd, unsigned int isread, unsigned int fua, unsigned long startlba, unsigned int sectors);
 int sg_inquiry(int fd);
 int smart_readdata(int fd, char *databuffer);
+int smart_offline_immediate(int fd, unsigned int subcommand);
 int identify_func(int fd, char *databuffer);
 int smart_readwritelog(int fd, unsigned int isread, unsigned int logaddr, void *databuffer, unsigned int pagenum);
 int fpdma_readwrite(int fd, unsigned int isread, unsigned int ncqtag, unsigned long startlba, unsigned int sectors, char *databuffer);
@@ -16,5 +177,23 @@ int dmaqueued_readwrite(int fd, unsigned int isread, unsigned int isext, unsigne
 int dma_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned long startlba, unsigned int sectors, char *databuffer);
 int multi_readwrite(int fd, unsigned int isread, unsigned int isext, unsigned long startlba, unsigned int sectors, char *databuffer);
 int sg_mode(int fd);
+int verify_sectors(int fd, unsigned int isext, unsigned long startlba, unsigned int sectors);
+int sbc_readcapacity16(int fd, CAPACITY *capacity);
+int sbc_readwrite16(int fd, unsigned int isread, unsigned long startlba, unsigned int sectors, char *databuffer);
+int sbc_verify16(int fd, unsigned long startlba, unsigned int sectors);
+int sbc_synccache(int fd);
+int flush_cache(int fd, unsigned int isext);
+int set_features(int fd, unsigned int feature, unsigned int count);
+int report_zones_ext(int fd, unsigned long startlba, unsigned int options, unsigned int partial, void *databuffer, unsigned int pages);
+int zac_management_out(int fd, unsigned int action, unsigned long zonelba, unsigned int all);
+int stream_cdb(unsigned char *cmd, unsigned int isread, unsigned int streamid, unsigned int cctl, unsigned int options, unsigned long startlba, unsigned int sectors);
+int configure_stream(int fd, unsigned int streamid, unsigned int add, unsigned int cctl, unsigned int allocation);
+int power_immediate(int fd, unsigned int standby);
+int check_power_mode(int fd, unsigned int *mode);
+int epc_set_features(int fd, unsigned int subcommand, unsigned int condition);
+void ata_string(char *dst, unsigned short *iden, unsigned int word, unsigned int nwords);
+int sg_inquiry_vpd(int fd, unsigned int pagecode, unsigned char *databuffer, unsigned int buffersize);
+int sg_vpd_info(int fd, VPD_INFO *vpd);
+void parse_vpd_info(VPD_INFO *vpd);
 
 #endif
@@ -0,0 +1,380 @@
+//
+// Host CPU cost per command.
+// Commands go to a null transport which completes every request with GOOD at once, so what is measured is only
+// what the host spends on a command: building the command block, the sg_io_hdr, the retry policy and the queue.
+// Every command set runs the stages one after another, each stage includes the work of the one before it:
+//   encode   the command block from the template of the command set
+//   setup    encode and the sg_io_hdr
+//   sync     device_readwrite(), one command at a time through the retry policy
+//   queued   IO queue at full depth, submit and receive one request per call
+//   batched  IO queue at full depth, the transport takes and returns many requests per call
+// Instructions are counted in user space by a perf event, they are n/a when perf events are not allowed,
+// e.g. kernel.perf_event_paranoid > 2 or a virtual machine without a PMU
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "cpucost.h"
+#include "command.h"
+#include "transport.h"
+#include "queue.h"
+#include "stats.h"
+
+#define CPU_COST_COMMANDS   1000000
+#define CPU_COST_SECTORS    8           // 4 KiB of 512 byte sectors
+#define CPU_COST_SPAN       (1ULL << 24)
+#define NULL_RING           (IOQ_MAX_DEPTH * 2)
+
+typedef enum _CPU_STAGE {
+  STAGE_ENCODE = 0,
+  STAGE_SETUP,
+  STAGE_SYNC,
+  STAGE_QUEUED,
+  STAGE_BATCHED,
+  STAGE_NUM
+} CPU_STAGE;
+
+typedef struct _CPU_COST {
+  double ns;                      // per command
+  double instructions;            // per command, < 0 : not counted
+  unsigned int errors;
+} CPU_COST;
+
+///////////////
+// PROTOTYPE
+///////////////
+static int null_execute(int fd, struct sg_io_hdr *io_hdr);
+static int null_submit(int fd, struct sg_io_hdr *io_hdr);
+static int null_receive(int fd, struct sg_io_hdr *io_hdr);
+static int null_submit_batch(int fd, struct sg_io_hdr **io_hdrs, unsigned int n);
+static int null_receive_batch(int fd, struct sg_io_hdr *io_hdrs, unsigned int max);
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+static const SG_TRANSPORT null_transport = {
+  "null", null_execute, null_submit, null_receive
+};
+
+static const SG_TRANSPORT null_batch_transport = {
+  "null batch", null_execute, null_submit, null_receive, null_submit_batch, null_receive_batch
+};
+
+// completed requests waiting to be received, first in first out
+static struct sg_io_hdr null_ring[NULL_RING];
+static unsigned int null_head;
+static unsigned int null_count;
+
+static const char *stage_names[STAGE_NUM] = {
+  "encode", "setup", "sync", "queued", "batched"
+};
+
+static volatile unsigned char cpu_sink;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static void null_complete(struct sg_io_hdr *io_hdr)
+{
+  io_hdr->status = 0;
+  io_hdr->masked_status = 0;
+  io_hdr->host_status = 0;
+  io_hdr->driver_status = 0;
+  io_hdr->sb_len_wr = 0;
+  io_hdr->resid = 0;
+  io_hdr->duration = 0;
+  io_hdr->info = 0;
+}
+
+static int null_execute(int fd, struct sg_io_hdr *io_hdr)
+{
+  null_complete(io_hdr);
+  return 0;
+}
+
+static int null_submit(int fd, struct sg_io_hdr *io_hdr)
+{
+  struct sg_io_hdr *slot;
+
+  if (null_count == NULL_RING)
+    return -1;
+
+  slot = &null_ring[(null_head + null_count++) % NULL_RING];
+  *slot = *io_hdr;
+  null_complete(slot);
+  return 0;
+}
+
+static int null_receive(int fd, struct sg_io_hdr *io_hdr)
+{
+  if (null_count == 0)
+    return -1;
+
+  *io_hdr = null_ring[null_head];
+  null_head = (null_head + 1) % NULL_RING;
+  null_count--;
+  return 0;
+}
+
+static int null_submit_batch(int fd, struct sg_io_hdr **io_hdrs, unsigned int n)
+{
+  unsigned int i;
+
+  if (null_count + n > NULL_RING)
+    return -1;
+
+  for (i = 0; i < n; i++)
+    null_submit(fd, io_hdrs[i]);
+  return n;
+}
+
+static int null_receive_batch(int fd, struct sg_io_hdr *io_hdrs, unsigned int max)
+{
+  unsigned int n = 0;
+
+  while (n < max && null_receive(fd, &io_hdrs[n]) == 0)
+    n++;
+  return n ? (int)n : -1;
+}
+
+// Instructions retired in user space by this thread, -1 when perf events are not available
+static int counter_open(void)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static unsigned long long counter_read(int fd)
+{
+  unsigned long long count = 0;
+
+  if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+    return 0;
+  return count;
+}
+
+// LBAs walk the span in steps of a command, aligned to physical sectors
+static unsigned long long cpu_lba(DEVICE_CONTEXT *dev, unsigned int i, unsigned int sectors, unsigned long long span)
+{
+  return device_align_down(dev, (unsigned long long)i * sectors % span);
+}
+
+static unsigned int cpu_queue(DEVICE_CONTEXT *dev, unsigned int commands, unsigned int sectors,
+                              unsigned long long span, char *buffer)
+{
+  IO_QUEUE q;
+  IO_REQUEST *req;
+  unsigned int errors = 0;
+  unsigned int i;
+
+  if (ioq_init(&q, dev, IOQ_MAX_DEPTH) != 0)
+    return commands;
+
+  for (i = 0; i < commands; i++)
+  {
+    if (q.nfree == 0)
+    {
+      req = ioq_reap(&q);
+      if (req == NULL)
+        return errors + commands - i;
+      if (req->status != 0)
+        errors++;
+      ioq_put(&q, req);
+    }
+
+    req = ioq_get(&q);
+    req->isread = 1;
+    req->startlba = cpu_lba(dev, i, sectors, span);
+    req->sectors = sectors;
+    req->databuffer = buffer;
+    if (ioq_submit(&q, req) != 0)
+    {
+      errors++;
+      ioq_put(&q, req);
+    }
+  }
+
+  while ((req = ioq_reap(&q)) != NULL)
+  {
+    if (req->status != 0)
+      errors++;
+    ioq_put(&q, req);
+  }
+
+  return errors;
+}
+
+// Run commands of one stage, how many failed
+static unsigned int cpu_stage(DEVICE_CONTEXT *dev, CPU_STAGE stage, unsigned int commands, unsigned int sectors,
+                              unsigned long long span, char *buffer)
+{
+  struct sg_io_hdr io_hdr;
+  unsigned char cmd[16];
+  unsigned char sense_b[64];
+  unsigned long long lba;
+  unsigned int errors = 0;
+  unsigned int i;
+  int cmdsize;
+
+  switch (stage)
+  {
+    case STAGE_ENCODE:
+      for (i = 0; i < commands; i++)
+      {
+        lba = cpu_lba(dev, i, sectors, span);
+        cmdsize = device_rw_cdb(dev, 1, i % IOQ_MAX_DEPTH, 0, lba, sectors, cmd);
+        cpu_sink ^= cmd[cmdsize - 1];
+      }
+      break;
+
+    case STAGE_SETUP:
+      for (i = 0; i < commands; i++)
+      {
+        lba = cpu_lba(dev, i, sectors, span);
+        cmdsize = device_rw_cdb(dev, 1, i % IOQ_MAX_DEPTH, 0, lba, sectors, cmd);
+        sg_io_setup(&io_hdr, cmd, cmdsize, 1, buffer, sectors * dev->sector_size, sense_b, sizeof(sense_b), 0);
+        cpu_sink ^= io_hdr.cmd_len;
+      }
+      break;
+
+    case STAGE_SYNC:
+      for (i = 0; i < commands; i++)
+      {
+        if (device_readwrite(dev, 1, 0, cpu_lba(dev, i, sectors, span), sectors, buffer) != 0)
+          errors++;
+      }
+      break;
+
+    case STAGE_QUEUED:
+    case STAGE_BATCHED:
+      transport_register(dev->fd, stage == STAGE_BATCHED ? &null_batch_transport : &null_transport);
+      errors = cpu_queue(dev, commands, sectors, span, buffer);
+      break;
+
+    default:
+      break;
+  }
+
+  return errors;
+}
+
+static void cpu_measure(DEVICE_CONTEXT *dev, CPU_STAGE stage, unsigned int commands, unsigned int sectors,
+                        unsigned long long span, char *buffer, int counter, CPU_COST *cost)
+{
+  unsigned long long start, instructions;
+
+  // warm up the caches and the branch predictors first
+  cpu_stage(dev, stage, commands / 10 + 1, sectors, span, buffer);
+
+  instructions = counter_read(counter);
+  start = now_ns();
+  cost->errors = cpu_stage(dev, stage, commands, sectors, span, buffer);
+  cost->ns = (double)(now_ns() - start) / commands;
+  cost->instructions = counter < 0 ? -1 : (double)(counter_read(counter) - instructions) / commands;
+}
+
+int cpu_cost_run(DEVICE_CONTEXT *dev, CPU_COST_CONFIG *config)
+{
+  static const CDB_SET sets[] = { CDB_PIO, CDB_MULTI, CDB_DMA, CDB_DMA_QUEUED, CDB_FPDMA, CDB_SBC };
+  static const RW_PROTOCOL protocols[] = { RW_PIO, RW_MULTI, RW_DMA, RW_DMA_QUEUED, RW_FPDMA, RW_PIO };
+  DEVICE_CONTEXT *nulldev;
+  CPU_COST cost[STAGE_NUM];
+  char *buffer;
+  char instr[16];
+  unsigned int commands = config->commands ? config->commands : CPU_COST_COMMANDS;
+  unsigned int sectors = config->sectors ? config->sectors : CPU_COST_SECTORS;
+  unsigned long long span = device_capacity(dev) > sectors ? device_capacity(dev) : CPU_COST_SPAN;
+  int fd, counter;
+  unsigned int i, s;
+
+  sectors = device_align_sectors(dev, sectors);
+  if (sectors == 0)
+  {
+    printf("ERROR, %s: %u sectors per command can't hold a physical sector of %u\n", __func__, dev->max_sectors,
+           dev->phys_sectors);
+    return -1;
+  }
+
+  nulldev = (DEVICE_CONTEXT *)malloc(sizeof(DEVICE_CONTEXT));
+  buffer = (char *)malloc((unsigned long)sectors * dev->sector_size);
+  fd = open("/dev/null", O_RDWR);
+  if (nulldev == NULL || buffer == NULL || fd < 0 || fd >= MAX_TRANSPORT_FD)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(nulldev);
+    free(buffer);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  // the geometry and features of the device, the commands go nowhere
+  *nulldev = *dev;
+  nulldev->fd = fd;
+  if (nulldev->max_sectors < sectors)
+    nulldev->max_sectors = sectors;
+
+  counter = counter_open();
+  if (counter < 0)
+    printf("perf events are not available, instructions are not counted\n");
+
+  printf("host cost per command, %u commands per stage, %u sectors per command, queue depth %d, %s\n", commands,
+         sectors, IOQ_MAX_DEPTH, dev->isext ? "48-bit" : "28-bit");
+  printf("%-8s", "set");
+  for (s = 0; s < STAGE_NUM; s++)
+    printf(" %9s %7s", stage_names[s], "instr");
+  printf("\n");
+
+  for (i = 0; i < sizeof(sets) / sizeof(sets[0]); i++)
+  {
+    nulldev->path = sets[i] == CDB_SBC ? PATH_SBC : PATH_ATA;
+    nulldev->protocol = protocols[i];
+    transport_register(fd, &null_transport);
+
+    for (s = 0; s < STAGE_NUM; s++)
+      cpu_measure(nulldev, (CPU_STAGE)s, commands, sectors, span, buffer, counter, &cost[s]);
+
+    printf("%-8s", sets[i] == CDB_SBC ? "sbc" : rw_protocol_name(protocols[i]));
+    for (s = 0; s < STAGE_NUM; s++)
+    {
+      if (cost[s].instructions < 0)
+        snprintf(instr, sizeof(instr), "n/a");
+      else
+        snprintf(instr, sizeof(instr), "%.0f", cost[s].instructions);
+      printf(" %7.1fns %7s", cost[s].ns, instr);
+    }
+    printf("\n");
+
+    for (s = 0; s < STAGE_NUM; s++)
+    {
+      if (cost[s].errors)
+        printf("ERROR, %s %s: %u commands failed\n", rw_protocol_name(protocols[i]), stage_names[s], cost[s].errors);
+    }
+    if (isDebug)
+      printf("DEBUG, %s sink %02x\n", rw_protocol_name(protocols[i]), cpu_sink);
+  }
+
+  if (counter >= 0)
+    close(counter);
+  transport_unregister(fd);
+  close(fd);
+  free(nulldev);
+  free(buffer);
+  return 0;
+}
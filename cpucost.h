@@ -0,0 +1,17 @@
+//
+// Host CPU cost per command, time and instructions the host spends on a command which the device never sees
+//
+
+#ifndef _CPUCOST_H_
+#define _CPUCOST_H_
+
+#include "device.h"
+
+typedef struct _CPU_COST_CONFIG {
+  unsigned int commands;          // commands per stage, ZERO : CPU_COST_COMMANDS
+  unsigned int sectors;           // sectors per command, ZERO : CPU_COST_SECTORS
+} CPU_COST_CONFIG;
+
+int cpu_cost_run(DEVICE_CONTEXT *dev, CPU_COST_CONFIG *config);
+
+#endif
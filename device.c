@@ -0,0 +1,826 @@
+//
+// Per device context, discovery of the transfer size and splitting of large requests
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <scsi/sg.h>
+
+#include "device.h"
+#include "transport.h"
+#include "retry.h"
+
+#define SECTOR_SIZE   512
+#define PROBE_ROUNDS  17        // first try plus bisection of 1 ~ 65536 sectors
+
+// Calibration reads the same small region with every protocol, the region is in the drive cache after the first pass
+// so the difference is the cost of the protocol through the SATL rather than the media
+#define CALIBRATE_SECTORS  128
+#define CALIBRATE_ROUNDS   8
+#define CALIBRATE_MARGIN   0.05    // throughput within 5% is a tie, the more capable protocol wins
+#define CALIBRATE_FILL     0xA5    // the buffer before a validation read, a read which transfers nothing keeps it
+
+///////////////
+// PROTOTYPE
+///////////////
+static int device_rw_chunk(DEVICE_CONTEXT *dev, unsigned int isread, unsigned int flags, unsigned long startlba, unsigned int sectors, char *databuffer);
+static int read_sysfs_uint(const char *path, unsigned int *value);
+static int sysfs_max_sectors(int fd, unsigned int sector_size, unsigned int *sectors);
+static int reserved_max_sectors(int fd, unsigned int sector_size, unsigned int wanted, unsigned int *sectors);
+static int probe_max_sectors(DEVICE_CONTEXT *dev, unsigned int *sectors);
+static void protocol_cache_key(DEVICE_CONTEXT *dev, char *key, unsigned int len);
+static RW_PROTOCOL protocol_cache_load(const char *cachefile, const char *key);
+static void protocol_cache_save(const char *cachefile, const char *key, RW_PROTOCOL protocol);
+
+static const char *rw_protocol_names[RW_PROTOCOL_NUM] = {
+  "auto", "pio", "multi", "dma", "dmaq", "fpdma"
+};
+
+///////////////
+// LOCALS
+///////////////
+static int lasterror;
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+void device_init(DEVICE_CONTEXT *dev, int fd, const char *dev_path)
+{
+  memset(dev, 0, sizeof(DEVICE_CONTEXT));
+  dev->fd = fd;
+  strncpy(dev->dev_path, dev_path, sizeof(dev->dev_path) - 1);
+  dev->path = PATH_ATA;
+  dev->protocol = RW_PIO;
+  dev->isext = 1;
+  dev->max_sectors = 1;
+  dev->max_sectors_src = XFER_DEFAULT;
+  dev->sector_size = SECTOR_SIZE;
+  dev->phys_sectors = 1;
+}
+
+const char *cmd_path_name(CMD_PATH path)
+{
+  switch (path)
+  {
+    case PATH_ATA:  return "ATA pass-through";
+    case PATH_SBC:  return "SBC";
+    default:        return "auto";
+  }
+}
+
+const char *rw_protocol_name(RW_PROTOCOL protocol)
+{
+  if (protocol >= RW_PROTOCOL_NUM)
+    return "unknown";
+
+  return rw_protocol_names[protocol];
+}
+
+RW_PROTOCOL rw_protocol_by_name(const char *name)
+{
+  int i;
+
+  for (i = 0; i < RW_PROTOCOL_NUM; i++)
+  {
+    if (strcmp(name, rw_protocol_names[i]) == 0)
+      return i;
+  }
+
+  return RW_PROTOCOL_NUM;
+}
+
+const char *xfer_source_name(XFER_SOURCE src)
+{
+  switch (src)
+  {
+    case XFER_PROTOCOL:     return "command sector count";
+    case XFER_BLOCK_LIMITS: return "Block Limits VPD";
+    case XFER_SYSFS:        return "max_sectors_kb";
+    case XFER_RESERVED:     return "sg reserved size";
+    case XFER_PROBE:        return "probe";
+    default:                return "default";
+  }
+}
+
+// Choose the command set for data transfer. ATA PASS-THROUGH is kept for ATA devices since it exposes the ATA protocols,
+// anything else, e.g. SAS drives or bridges which reject pass-through, goes with native SBC commands.
+// dev->ata_valid shall be set by the caller once IDENTIFY DEVICE succeeded
+int device_select_path(DEVICE_CONTEXT *dev, CMD_PATH path)
+{
+  if (path == PATH_AUTO)
+    path = (dev->ata_valid && dev->ata.isata) ? PATH_ATA : PATH_SBC;
+
+  if (path == PATH_SBC && !dev->capacity_valid)
+  {
+    if (sbc_readcapacity16(dev->fd, &dev->capacity) != 0)
+    {
+      printf("ERROR, %s: READ CAPACITY(16) failed\n", __func__);
+      return -1;
+    }
+    dev->capacity_valid = 1;
+  }
+
+  // sector geometry of the command set, READ CAPACITY(16) for SBC and IDENTIFY DEVICE for ATA
+  if (path == PATH_SBC)
+  {
+    dev->sector_size = dev->capacity.blocksize;
+    dev->phys_sectors = 1 << dev->capacity.lbppbe;
+    dev->align_lba = dev->capacity.lowest_aligned;
+  }
+  else if (dev->ata_valid)
+  {
+    dev->sector_size = dev->ata.logical_size;
+    dev->phys_sectors = dev->ata.phys_sectors;
+    dev->align_lba = dev->ata.align_lba;
+  }
+
+  if (dev->sector_size < MIN_SECTOR_SIZE || dev->sector_size > MAX_SECTOR_SIZE ||
+      (dev->sector_size & (dev->sector_size - 1)))
+  {
+    printf("Logical block size %u is NOT supported\n", dev->sector_size);
+    return -1;
+  }
+  if (dev->phys_sectors == 0 || dev->align_lba >= dev->phys_sectors)
+  {
+    dev->phys_sectors = 1;
+    dev->align_lba = 0;
+  }
+
+  dev->path = path;
+  return 0;
+}
+
+// Determine the largest transfer per command. Every source can only lower the limit,
+// the ATA sector count is the upper bound. Probing is only done when neither the device nor
+// the kernel tells anything, which is typical for USB bridges
+int device_discover_xfer(DEVICE_CONTEXT *dev)
+{
+  unsigned int limit;
+  unsigned int value;
+  XFER_SOURCE  src;
+  int authoritative = 0;
+
+  if (dev->path == PATH_SBC)
+    limit = SBC_MAX_SECTORS;
+  else
+    limit = dev->isext ? ATA_EXT_MAX_SECTORS : ATA_MAX_SECTORS;
+  src = XFER_PROTOCOL;
+
+  // Block Limits VPD page, MAXIMUM TRANSFER LENGTH is in logical blocks
+  if (!dev->vpd_valid && sg_vpd_info(dev->fd, &dev->vpd) == 0)
+    dev->vpd_valid = 1;
+  if (dev->vpd_valid && dev->vpd.block_limits && dev->vpd.max_xfer_len)
+  {
+    authoritative = 1;
+    if (dev->vpd.max_xfer_len < limit)
+    {
+      limit = dev->vpd.max_xfer_len;
+      src = XFER_BLOCK_LIMITS;
+    }
+  }
+
+  // Kernel limit of the request queue
+  if (sysfs_max_sectors(dev->fd, dev->sector_size, &value) == 0)
+  {
+    authoritative = 1;
+    if (value && value < limit)
+    {
+      limit = value;
+      src = XFER_SYSFS;
+    }
+  }
+
+  // sg driver caps reserved buffer to the queue limit, it is also the largest buffer which needn't be allocated per command
+  if (reserved_max_sectors(dev->fd, dev->sector_size, limit, &value) == 0 && value && value < limit)
+  {
+    limit = value;
+    src = XFER_RESERVED;
+  }
+
+  // whole physical sectors, so that the commands of a split aligned request stay aligned
+  if (limit > dev->phys_sectors)
+    limit -= limit % dev->phys_sectors;
+  dev->max_sectors = limit;
+  dev->max_sectors_src = src;
+
+  if (!authoritative)
+  {
+    if (probe_max_sectors(dev, &value) != 0)
+    {
+      dev->max_sectors = 1;
+      dev->max_sectors_src = XFER_DEFAULT;
+      return -1;
+    }
+    if (value < dev->max_sectors)
+    {
+      dev->max_sectors = value;
+      dev->max_sectors_src = XFER_PROBE;
+    }
+  }
+
+  if (isDebug)
+    printf("DEBUG, max transfer %u sectors (%s)\n", dev->max_sectors, xfer_source_name(dev->max_sectors_src));
+
+  return 0;
+}
+
+// Transfer any number of sectors, split into commands of max_sectors. An unaligned request is split at the first
+// physical sector boundary so that only its first and last command are unaligned.
+// RW_FLAG_FUA without a FUA command for the protocol is done by a flush after the last write
+int device_readwrite(DEVICE_CONTEXT *dev, unsigned int isread, unsigned int flags, unsigned long startlba, unsigned int sectors, char *databuffer)
+{
+  IO_PLAN plan;
+  unsigned int chunk;
+  unsigned int flush = !isread && (flags & RW_FLAG_FUA) && !device_fua_native(dev);
+
+  device_plan(dev, startlba, sectors, &plan);
+  if (!isread && (plan.head || plan.tail))
+    printf("write lba 0x%lx, %u sectors isn't aligned to %u byte physical sectors, the drive reads them first\n",
+           startlba, sectors, dev->sector_size * dev->phys_sectors);
+
+  while (sectors)
+  {
+    chunk = sectors > dev->max_sectors ? dev->max_sectors : sectors;
+    if (device_align_down(dev, startlba) != startlba && device_align_up(dev, startlba) - startlba < chunk)
+      chunk = device_align_up(dev, startlba) - startlba;
+
+    if (device_rw_chunk(dev, isread, flags, startlba, chunk, databuffer) != 0)
+    {
+      printf("ERROR, %s: lba 0x%lx, sectors %u\n", __func__, startlba, chunk);
+      return -1;
+    }
+
+    startlba += chunk;
+    sectors -= chunk;
+    databuffer += (unsigned long)chunk * dev->sector_size;
+  }
+
+  if (flush)
+    return device_flush(dev);
+
+  return 0;
+}
+
+// Verify any number of sectors on the media, no data is transferred
+int device_verify(DEVICE_CONTEXT *dev, unsigned long startlba, unsigned int sectors)
+{
+  unsigned int chunk;
+  int ret;
+
+  while (sectors)
+  {
+    chunk = sectors > dev->max_sectors ? dev->max_sectors : sectors;
+
+    if (dev->path == PATH_SBC)
+      ret = sbc_verify16(dev->fd, startlba, chunk);
+    else
+      ret = verify_sectors(dev->fd, dev->isext, startlba, chunk);
+    if (ret != 0)
+    {
+      printf("ERROR, %s: lba 0x%lx, sectors %u\n", __func__, startlba, chunk);
+      return -1;
+    }
+
+    startlba += chunk;
+    sectors -= chunk;
+  }
+
+  return 0;
+}
+
+// Build the data transfer command of the path and protocol of the device, return the size of the command block.
+// tag is used by DMA QUEUED and FPDMA QUEUED only. RW_FLAG_FUA is dropped when device_fua_native() is 0,
+// the caller shall flush instead
+int device_rw_cdb(DEVICE_CONTEXT *dev, unsigned int isread, unsigned int tag, unsigned int flags, unsigned long startlba, unsigned int sectors, unsigned char *cmd)
+{
+  unsigned int fua = !isread && (flags & RW_FLAG_FUA) && device_fua_native(dev);
+  unsigned int prio = ((flags & RW_FLAG_HIPRI) && device_prio_supported(dev)) ? NCQ_PRIO_HIGH : NCQ_PRIO_NORMAL;
+
+  return cdb_encode(cdb_template(device_cdb_set(dev), dev->isext, cdb_op(isread, fua)), cmd, startlba, sectors, tag, prio);
+}
+
+// Command set of the read / write templates for the path and protocol
+CDB_SET device_cdb_set(DEVICE_CONTEXT *dev)
+{
+  if (dev->path == PATH_SBC)
+    return CDB_SBC;
+
+  switch (dev->protocol)
+  {
+    case RW_MULTI:      return CDB_MULTI;
+    case RW_DMA:        return CDB_DMA;
+    case RW_DMA_QUEUED: return CDB_DMA_QUEUED;
+    case RW_FPDMA:      return CDB_FPDMA;
+    case RW_PIO:
+    default:            return CDB_PIO;
+  }
+}
+
+// Build the verify command of the path, no data is transferred
+int device_verify_cdb(DEVICE_CONTEXT *dev, unsigned long startlba, unsigned int sectors, unsigned char *cmd)
+{
+  if (dev->path == PATH_SBC)
+    return sbc_verify16_cdb(cmd, startlba, sectors);
+
+  return verify_cdb(cmd, dev->isext, startlba, sectors);
+}
+
+// commands are issued one by one, so tag 0 is always free
+static int device_rw_chunk(DEVICE_CONTEXT *dev, unsigned int isread, unsigned int flags, unsigned long startlba, unsigned int sectors, char *databuffer)
+{
+  unsigned char cmd[16];
+  int cmdsize;
+
+  cmdsize = device_rw_cdb(dev, isread, 0, flags, startlba, sectors, cmd);
+
+  return ata_pass_through_data(dev->fd, isread, cmd, cmdsize, databuffer, sectors * dev->sector_size);
+}
+
+// Number of logical sectors of the device, ZERO when unknown
+unsigned long long device_capacity(DEVICE_CONTEXT *dev)
+{
+  if (dev->path == PATH_SBC)
+    return dev->capacity_valid ? dev->capacity.lastlba + 1 : 0;
+
+  return dev->ata_valid ? dev->ata.totalsec : 0;
+}
+
+// Physical sector boundary at or below lba
+unsigned long long device_align_down(DEVICE_CONTEXT *dev, unsigned long long lba)
+{
+  if (lba < dev->align_lba)
+    return 0;
+  return lba - (lba - dev->align_lba) % dev->phys_sectors;
+}
+
+// Physical sector boundary at or above lba
+unsigned long long device_align_up(DEVICE_CONTEXT *dev, unsigned long long lba)
+{
+  unsigned long long down = device_align_down(dev, lba);
+
+  if (lba < dev->align_lba)
+    return dev->align_lba;
+  return down == lba ? lba : down + dev->phys_sectors;
+}
+
+// Sectors per command within max_sectors, rounded down to whole physical sectors, one physical sector at least.
+// ZERO when max_sectors is less than a physical sector, no command can then be aligned
+unsigned int device_align_sectors(DEVICE_CONTEXT *dev, unsigned int sectors)
+{
+  if (sectors > dev->max_sectors)
+    sectors = dev->max_sectors;
+  if (sectors < dev->phys_sectors)
+    return dev->phys_sectors <= dev->max_sectors ? dev->phys_sectors : 0;
+  return sectors - sectors % dev->phys_sectors;
+}
+
+// Lay a request onto physical sectors, head and tail are the logical sectors the drive has to read back
+// to write it, ZERO both when it is aligned
+void device_plan(DEVICE_CONTEXT *dev, unsigned long long startlba, unsigned long long sectors, IO_PLAN *plan)
+{
+  unsigned long long end = startlba + sectors;
+
+  plan->startlba = device_align_down(dev, startlba);
+  plan->sectors = device_align_up(dev, end) - plan->startlba;
+  plan->head = startlba - plan->startlba;
+  plan->tail = plan->startlba + plan->sectors - end;
+}
+
+// Whether a write with FUA can be sent as one command. FPDMA has the FUA bit, DMA / MULTIPLE / DMA QUEUED
+// have FUA EXT commands, PIO has none. The SATL translates FUA of WRITE(16), so SBC always has it
+int device_fua_native(DEVICE_CONTEXT *dev)
+{
+  if (dev->path == PATH_SBC)
+    return 1;
+
+  switch (dev->protocol)
+  {
+    case RW_FPDMA:
+      return 1;
+    case RW_MULTI:
+    case RW_DMA:
+    case RW_DMA_QUEUED:
+      return dev->isext && dev->ata.fua_feat;
+    default:
+      return 0;
+  }
+}
+
+// Whether high priority can be tagged on commands, only FPDMA QUEUED carries PRIO
+int device_prio_supported(DEVICE_CONTEXT *dev)
+{
+  return dev->path == PATH_ATA && dev->protocol == RW_FPDMA && dev->ata.ncq_prio_feat;
+}
+
+// Write the volatile cache of the device to the media
+int device_flush(DEVICE_CONTEXT *dev)
+{
+  if (dev->path == PATH_SBC)
+    return sbc_synccache(dev->fd);
+
+  return flush_cache(dev->fd, dev->isext && dev->ata.flush_ext_feat);
+}
+
+// Enable or disable the volatile write cache by SET FEATURES, ATA path only. SBC needs MODE SELECT of Caching page
+int device_set_write_cache(DEVICE_CONTEXT *dev, unsigned int enable)
+{
+  if (dev->path != PATH_ATA || !dev->ata_valid)
+  {
+    printf("write cache can only be changed through ATA pass-through\n");
+    return -1;
+  }
+
+  if (!dev->ata.wcache_feat)
+  {
+    printf("volatile write cache is NOT supported\n");
+    return -1;
+  }
+
+  if (set_features(dev->fd, enable ? 0x02 : 0x82, 0) != 0)
+    return -1;
+
+  dev->ata.wcache_enabled = enable ? 1 : 0;
+  return 0;
+}
+
+// Whether IDENTIFY data says the protocol can be used
+int device_protocol_supported(DEVICE_CONTEXT *dev, RW_PROTOCOL protocol)
+{
+  switch (protocol)
+  {
+    case RW_PIO:
+      return 1;
+    case RW_MULTI:
+      return dev->ata.secperdrq > 0;
+    case RW_DMA:
+      return dev->ata.dma_feat;
+    case RW_DMA_QUEUED:
+      return dev->ata.tcq_feat;
+    case RW_FPDMA:
+      return dev->ata.ncq_feat && dev->ata.ext_feat && dev->isext;
+    default:
+      return 0;
+  }
+}
+
+static double elapsed_sec(struct timespec *start, struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Validation read of the calibration region, it fails when the SATL reports GOOD but leaves data untransferred
+static int calibrate_read(DEVICE_CONTEXT *dev, unsigned int sectors, char *databuffer)
+{
+  struct sg_io_hdr io_hdr;
+  unsigned char cmd[16];
+  unsigned char sense_b[64];
+  unsigned int bytes = sectors * dev->sector_size;
+  int cmdsize;
+
+  memset(databuffer, CALIBRATE_FILL, bytes);
+  cmdsize = device_rw_cdb(dev, 1, 0, 0, 0, sectors, cmd);
+  sg_io_setup(&io_hdr, cmd, cmdsize, 1, databuffer, bytes, sense_b, sizeof(sense_b), 0);
+  if (sg_command(dev->fd, &io_hdr) != 0)
+    return -1;
+
+  return io_hdr.resid == 0 ? 0 : -1;
+}
+
+// Read the calibration region with every protocol the device claims. A protocol is dropped when a command fails
+// or the data differs from what READ SECTORS returned, since some SATLs complete unsupported protocols with GOOD
+// status and garbage data. The fastest one is kept in dev->protocol
+int device_calibrate_protocol(DEVICE_CONTEXT *dev, double *mbps)
+{
+  char *reference;
+  char *databuffer;
+  unsigned int sectors;
+  unsigned int bytes;
+  RW_PROTOCOL protocol;
+  RW_PROTOCOL best = RW_PIO;
+  double best_mbps = 0;
+  struct timespec start, end;
+  int round;
+
+  sectors = dev->max_sectors < CALIBRATE_SECTORS ? dev->max_sectors : CALIBRATE_SECTORS;
+  bytes = sectors * dev->sector_size;
+
+  reference = (char *)malloc(bytes);
+  databuffer = (char *)malloc(bytes);
+  if (reference == NULL || databuffer == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(reference);
+    free(databuffer);
+    return -1;
+  }
+
+  // READ SECTORS is the reference, it also brings the region into the drive cache
+  dev->protocol = RW_PIO;
+  if (calibrate_read(dev, sectors, reference) != 0)
+  {
+    printf("ERROR, %s: READ SECTORS failed\n", __func__);
+    free(reference);
+    free(databuffer);
+    return -1;
+  }
+
+  for (protocol = RW_PIO; protocol < RW_PROTOCOL_NUM; protocol++)
+  {
+    double result;
+
+    if (!device_protocol_supported(dev, protocol))
+      continue;
+
+    dev->protocol = protocol;
+    if (calibrate_read(dev, sectors, databuffer) != 0 || memcmp(databuffer, reference, bytes) != 0)
+    {
+      printf("protocol %s doesn't work through this SATL\n", rw_protocol_name(protocol));
+      continue;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (round = 0; round < CALIBRATE_ROUNDS; round++)
+    {
+      if (device_rw_chunk(dev, 1, 0, 0, sectors, databuffer) != 0)
+        break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (round < CALIBRATE_ROUNDS)
+    {
+      printf("protocol %s failed during calibration\n", rw_protocol_name(protocol));
+      continue;
+    }
+
+    result = (double)bytes * CALIBRATE_ROUNDS / elapsed_sec(&start, &end) / (1024 * 1024);
+    if (isDebug)
+      printf("DEBUG, protocol %s : %.1f MB/s\n", rw_protocol_name(protocol), result);
+
+    if (result >= best_mbps * (1 - CALIBRATE_MARGIN))
+    {
+      best = protocol;
+      if (result > best_mbps)
+        best_mbps = result;
+    }
+  }
+
+  free(reference);
+  free(databuffer);
+
+  dev->protocol = best;
+  if (mbps)
+    *mbps = best_mbps;
+
+  return 0;
+}
+
+// Use the given protocol, or with RW_AUTO the cached choice for this drive behind this SATL,
+// calibrating when there is none. cachefile may be NULL to calibrate every time
+int device_select_protocol(DEVICE_CONTEXT *dev, RW_PROTOCOL protocol, const char *cachefile)
+{
+  char key[256];
+  double mbps = 0;
+
+  if (dev->path != PATH_ATA)
+    return 0;
+
+  if (protocol != RW_AUTO)
+  {
+    if (!device_protocol_supported(dev, protocol))
+    {
+      printf("protocol %s is NOT supported by the device\n", rw_protocol_name(protocol));
+      return -1;
+    }
+    dev->protocol = protocol;
+    return 0;
+  }
+
+  protocol_cache_key(dev, key, sizeof(key));
+  if (cachefile)
+  {
+    protocol = protocol_cache_load(cachefile, key);
+    if (protocol != RW_AUTO && device_protocol_supported(dev, protocol))
+    {
+      dev->protocol = protocol;
+      if (isDebug)
+        printf("DEBUG, cached protocol %s for %s\n", rw_protocol_name(protocol), key);
+      return 0;
+    }
+  }
+
+  if (device_calibrate_protocol(dev, &mbps) != 0)
+  {
+    dev->protocol = RW_PIO;
+    return -1;
+  }
+  printf("calibrated protocol %s, %.1f MB/s\n", rw_protocol_name(dev->protocol), mbps);
+
+  if (cachefile)
+    protocol_cache_save(cachefile, key, dev->protocol);
+
+  return 0;
+}
+
+// The key is the drive model and serial plus the SATL, the same drive behind another bridge may behave differently
+static void protocol_cache_key(DEVICE_CONTEXT *dev, char *key, unsigned int len)
+{
+  char model[41];
+  char serial[21];
+  unsigned int i;
+
+  ata_string(model, (unsigned short *)dev->identify, 27, 20);
+  ata_string(serial, (unsigned short *)dev->identify, 10, 10);
+
+  if (dev->vpd_valid && dev->vpd.ata_info)
+    snprintf(key, len, "%s/%s/%s_%s", model, serial, dev->vpd.sat_vendor, dev->vpd.sat_product);
+  else
+    snprintf(key, len, "%s/%s", model, serial);
+
+  // the key is the first field of a line
+  for (i = 0; key[i]; i++)
+  {
+    if (key[i] == ' ' || key[i] == '\t')
+      key[i] = '_';
+  }
+}
+
+// Cache file is append only, one "key protocol" per line, the last line of a key wins
+static RW_PROTOCOL protocol_cache_load(const char *cachefile, const char *key)
+{
+  FILE *fp;
+  char line[512];
+  char name[32];
+  char entry[256];
+  RW_PROTOCOL protocol = RW_AUTO;
+
+  fp = fopen(cachefile, "r");
+  if (fp == NULL)
+    return RW_AUTO;
+
+  while (fgets(line, sizeof(line), fp))
+  {
+    if (sscanf(line, "%255s %31s", entry, name) == 2 && strcmp(entry, key) == 0)
+    {
+      protocol = rw_protocol_by_name(name);
+      if (protocol == RW_PROTOCOL_NUM)
+        protocol = RW_AUTO;
+    }
+  }
+  fclose(fp);
+
+  return protocol;
+}
+
+static void protocol_cache_save(const char *cachefile, const char *key, RW_PROTOCOL protocol)
+{
+  FILE *fp;
+
+  fp = fopen(cachefile, "a");
+  if (fp == NULL)
+  {
+    lasterror = errno;
+    printf("Open %s failed (%d) - %s\n", cachefile, lasterror, strerror(lasterror));
+    return;
+  }
+
+  fprintf(fp, "%s %s\n", key, rw_protocol_name(protocol));
+  fclose(fp);
+}
+
+static int read_sysfs_uint(const char *path, unsigned int *value)
+{
+  FILE *fp;
+  int ret;
+
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return -1;
+
+  ret = fscanf(fp, "%u", value);
+  fclose(fp);
+
+  return ret == 1 ? 0 : -1;
+}
+
+// Find the block device behind fd and read max_sectors_kb of its queue.
+// fd may be a block device (/dev/sdX, or a partition) or a sg character device (/dev/sgN)
+static int sysfs_max_sectors(int fd, unsigned int sector_size, unsigned int *sectors)
+{
+  struct stat f_stat;
+  char path[512];
+  unsigned int kb;
+
+  if (fstat(fd, &f_stat) < 0)
+    return -1;
+
+  if (S_ISBLK(f_stat.st_mode))
+  {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/max_sectors_kb", major(f_stat.st_rdev), minor(f_stat.st_rdev));
+    if (read_sysfs_uint(path, &kb) != 0)
+    {
+      // partition, the queue belongs to the whole disk
+      snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/max_sectors_kb", major(f_stat.st_rdev), minor(f_stat.st_rdev));
+      if (read_sysfs_uint(path, &kb) != 0)
+        return -1;
+    }
+  }
+  else if (S_ISCHR(f_stat.st_mode))
+  {
+    DIR *dir;
+    struct dirent *entry;
+    int found = 0;
+
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/block", major(f_stat.st_rdev), minor(f_stat.st_rdev));
+    dir = opendir(path);
+    if (dir == NULL)
+      return -1;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if (entry->d_name[0] == '.')
+        continue;
+      snprintf(path, sizeof(path), "/sys/block/%s/queue/max_sectors_kb", entry->d_name);
+      found = 1;
+      break;
+    }
+    closedir(dir);
+
+    if (!found || read_sysfs_uint(path, &kb) != 0)
+      return -1;
+  }
+  else
+    return -1;
+
+  if (isDebug)
+    printf("DEBUG, %s : %u\n", path, kb);
+
+  *sectors = kb * 1024 / sector_size;
+  return 0;
+}
+
+static int reserved_max_sectors(int fd, unsigned int sector_size, unsigned int wanted, unsigned int *sectors)
+{
+  int size = wanted * sector_size;
+
+  if (ioctl(fd, SG_SET_RESERVED_SIZE, &size) < 0)
+    return -1;
+  if (ioctl(fd, SG_GET_RESERVED_SIZE, &size) < 0)
+    return -1;
+
+  if (isDebug)
+    printf("DEBUG, sg reserved size %d\n", size);
+
+  *sectors = size / sector_size;
+  return 0;
+}
+
+// Bounded bisection with reads of LBA 0, which is harmless for the data on the media.
+// The current max_sectors is tried first so a device which copes with it costs only one command
+static int probe_max_sectors(DEVICE_CONTEXT *dev, unsigned int *sectors)
+{
+  char *databuffer;
+  unsigned int good = 0;
+  unsigned int bad;
+  unsigned int try;
+  int round;
+
+  databuffer = (char *)malloc((unsigned long)dev->max_sectors * dev->sector_size);
+  if (databuffer == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  try = dev->max_sectors;
+  bad = dev->max_sectors + 1;
+  for (round = 0; round < PROBE_ROUNDS && good + 1 < bad; round++)
+  {
+    if (isDebug)
+      printf("DEBUG, probe %u sectors\n", try);
+
+    if (device_rw_chunk(dev, 1, 0, 0, try, databuffer) == 0)
+      good = try;
+    else
+      bad = try;
+
+    try = good + (bad - good) / 2;
+  }
+
+  free(databuffer);
+
+  if (good == 0)
+  {
+    printf("Probing transfer size failed, even 1 sector can't be read\n");
+    return -1;
+  }
+
+  *sectors = good;
+  return 0;
+}
@@ -0,0 +1,138 @@
+//
+// Per device context shared by the data transfer paths
+//
+
+#ifndef _DEVICE_H_
+#define _DEVICE_H_
+
+#include "command.h"
+
+// ATA sector count limits, ZERO in SECTOR COUNT means 256 for 28-bit and 65536 for 48-bit commands
+#define ATA_MAX_SECTORS      256
+#define ATA_EXT_MAX_SECTORS  65536
+
+// Logical sector sizes the data paths take, 512 ~ 4096 bytes in powers of 2
+#define MIN_SECTOR_SIZE      512
+#define MAX_SECTOR_SIZE      4096
+
+typedef struct _ATA_FEATURE {
+  int isata;
+  int packet_feat;
+  int cmdset;
+  int ext_feat;
+  long long totalsec;
+  int tcq_feat;
+  int ncq_feat;
+  int queuedepth;
+  int stream_feat;
+  unsigned int logical_size;      // bytes per logical sector, WORD 106 and 117-118
+  unsigned int phys_sectors;      // logical sectors per physical sector
+  unsigned int align_lba;         // lowest aligned LBA, WORD 209
+  int stream_min_req;    // sectors, a stream command should transfer a multiple of it
+  unsigned int stream_gran;   // microseconds per unit of COMMAND COMPLETION TIME LIMIT
+  int secperdrq;
+  int dma_feat;
+  int wcache_feat;       // volatile write cache can be enabled / disabled
+  int wcache_enabled;
+  int flush_ext_feat;    // FLUSH CACHE EXT
+  int fua_feat;          // WRITE DMA/MULTIPLE FUA EXT
+  int ncq_prio_feat;     // PRIO of FPDMA QUEUED is honored
+  int apm_feat;          // 1 : supported, 2 : enabled
+  int apm_level;         // APM level when enabled
+  int epc_feat;          // 1 : supported, 2 : enabled
+  int zoned;             // 0 : not reported, 1 : host aware, 2 : device managed, host managed report 0 but PDT 14h
+} ATA_FEATURE;
+
+// SBC transfer length is 32-bit, it is bounded like 48-bit ATA so that a probe buffer stays reasonable
+#define SBC_MAX_SECTORS      65536
+
+// Command set used for data transfer
+typedef enum _CMD_PATH {
+  PATH_AUTO = 0,
+  PATH_ATA,              // ATA PASS-THROUGH(16)
+  PATH_SBC               // native READ/WRITE/VERIFY(16)
+} CMD_PATH;
+
+// Data transfer protocol on ATA path, in the order of preference when throughput is equal
+typedef enum _RW_PROTOCOL {
+  RW_AUTO = 0,
+  RW_PIO,                // READ/WRITE SECTORS (EXT)
+  RW_MULTI,              // READ/WRITE MULTIPLE (EXT)
+  RW_DMA,                // READ/WRITE DMA (EXT)
+  RW_DMA_QUEUED,         // READ/WRITE DMA QUEUED (EXT)
+  RW_FPDMA,              // READ/WRITE FPDMA QUEUED
+  RW_PROTOCOL_NUM
+} RW_PROTOCOL;
+
+// Per command flags of device_readwrite() and device_rw_cdb()
+#define RW_FLAG_FUA    (1 << 0)    // the write completes only when the data is on the media
+#define RW_FLAG_HIPRI  (1 << 1)    // NCQ high priority, dropped when the device has no NCQ priority
+
+// Where max_sectors of the device context comes from
+typedef enum _XFER_SOURCE {
+  XFER_DEFAULT = 0,      // nothing known, 1 sector per command
+  XFER_PROTOCOL,         // sector count limit of the command
+  XFER_BLOCK_LIMITS,     // MAXIMUM TRANSFER LENGTH of Block Limits VPD page
+  XFER_SYSFS,            // /sys/block/<dev>/queue/max_sectors_kb
+  XFER_RESERVED,         // sg reserved buffer, kernel caps it to the queue limit
+  XFER_PROBE             // probing reads
+} XFER_SOURCE;
+
+typedef struct _DEVICE_CONTEXT {
+  int  fd;
+  char dev_path[256];
+  int  ata_valid;                 // 1 : IDENTIFY DEVICE through ATA PASS-THROUGH works
+  ATA_FEATURE ata;
+  unsigned char identify[512];
+  int  capacity_valid;
+  CAPACITY capacity;
+  int  vpd_valid;
+  VPD_INFO vpd;
+
+  CMD_PATH path;
+  RW_PROTOCOL protocol;           // valid on PATH_ATA
+  unsigned int isext;             // 1 : use 48-bit commands
+  unsigned int max_sectors;       // largest transfer per command, in sectors
+  XFER_SOURCE  max_sectors_src;
+
+  // Sectors are logical sectors of sector_size bytes everywhere. A write which doesn't cover whole physical
+  // sectors costs the drive a read-modify-write, e.g. 512 byte emulation of 4 KiB physical sectors
+  unsigned int sector_size;
+  unsigned int phys_sectors;      // logical sectors per physical sector
+  unsigned int align_lba;         // the first LBA which starts a physical sector
+} DEVICE_CONTEXT;
+
+// A request laid onto physical sectors, see device_plan()
+typedef struct _IO_PLAN {
+  unsigned long long startlba;    // physical sector boundaries around the request
+  unsigned long long sectors;
+  unsigned int head;              // logical sectors of the first physical sector before the request
+  unsigned int tail;              // logical sectors of the last physical sector after the request
+} IO_PLAN;
+
+void device_init(DEVICE_CONTEXT *dev, int fd, const char *dev_path);
+int  device_select_path(DEVICE_CONTEXT *dev, CMD_PATH path);
+int  device_discover_xfer(DEVICE_CONTEXT *dev);
+int  device_readwrite(DEVICE_CONTEXT *dev, unsigned int isread, unsigned int flags, unsigned long startlba, unsigned int sectors, char *databuffer);
+int  device_verify(DEVICE_CONTEXT *dev, unsigned long startlba, unsigned int sectors);
+int  device_verify_cdb(DEVICE_CONTEXT *dev, unsigned long startlba, unsigned int sectors, unsigned char *cmd);
+int  device_rw_cdb(DEVICE_CONTEXT *dev, unsigned int isread, unsigned int tag, unsigned int flags, unsigned long startlba, unsigned int sectors, unsigned char *cmd);
+CDB_SET device_cdb_set(DEVICE_CONTEXT *dev);
+unsigned long long device_capacity(DEVICE_CONTEXT *dev);
+unsigned long long device_align_down(DEVICE_CONTEXT *dev, unsigned long long lba);
+unsigned long long device_align_up(DEVICE_CONTEXT *dev, unsigned long long lba);
+unsigned int device_align_sectors(DEVICE_CONTEXT *dev, unsigned int sectors);
+void device_plan(DEVICE_CONTEXT *dev, unsigned long long startlba, unsigned long long sectors, IO_PLAN *plan);
+int  device_fua_native(DEVICE_CONTEXT *dev);
+int  device_prio_supported(DEVICE_CONTEXT *dev);
+int  device_flush(DEVICE_CONTEXT *dev);
+int  device_set_write_cache(DEVICE_CONTEXT *dev, unsigned int enable);
+int  device_protocol_supported(DEVICE_CONTEXT *dev, RW_PROTOCOL protocol);
+int  device_select_protocol(DEVICE_CONTEXT *dev, RW_PROTOCOL protocol, const char *cachefile);
+int  device_calibrate_protocol(DEVICE_CONTEXT *dev, double *mbps);
+const char *xfer_source_name(XFER_SOURCE src);
+const char *cmd_path_name(CMD_PATH path);
+const char *rw_protocol_name(RW_PROTOCOL protocol);
+RW_PROTOCOL rw_protocol_by_name(const char *name);
+
+#endif
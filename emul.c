@@ -0,0 +1,1745 @@
+//
+// Emulated SATA drive behind a SATL.
+// The device path is "emul[:key=value,...]", e.g. emul:size=1024,serialize=1
+//   size       capacity in MiB, 1024 by default
+//   qd         NCQ/TCQ queue depth, 32 by default
+//   serialize  1 : the SATL runs queued commands one by one like some USB bridges
+//   maxxfer    MAXIMUM TRANSFER LENGTH of Block Limits VPD page in sectors, ZERO : not reported
+//   bad        LBA of a sector which can't be read, reads and verifies covering it get a MEDIUM ERROR
+//   badlen     sectors which can't be read from bad on, 1 by default
+//   flaky      every flaky-th command is aborted by a link error, a retry of it goes through
+//   slow       first LBA of a weak region, reads and verifies there take EMUL_SLOW_READ_NS more
+//   slowlen    sectors of the weak region, 1 MiB by default
+//   zoned      1 : host aware, 2 : host managed zoned drive (ZAC), the first zone is conventional
+//   zonesz     zone size in MiB, 64 by default
+//   spinup     ms a spin-up out of standby takes, EMUL_SPINUP_MS by default
+//   pss        logical sectors per physical sector as a power of 2, 3 : 512 byte emulation of 4 KiB sectors
+//   align      lowest aligned LBA, with pss
+//   batch      1 : the transport takes batches of requests like the sg v4 driver
+//   topo       where the drive hangs below /sys/devices, e.g. topo=host0/port-0:0/expander-0:0/port-0:0:1
+//   selftest   ms an emulated minute of SMART self-test takes, 60000 by default
+//
+// Host managed zones reject writes which don't start at the write pointer, host aware ones take them at the cost
+// of a read-modify-write in the media cache.
+// READ / WRITE STREAM DMA EXT which can't complete within their time limit end at the limit, aborted with CCTO, or
+// with a stream error when RC / WC is set. Unreadable sectors are a stream error too then.
+// The drive goes to idle or standby by IDLE / STANDBY IMMEDIATE, EPC Go To Power Condition or the APM timers, the
+// next media access pays the wake up of the state. CHECK POWER MODE and power commands don't wake it.
+// A write which doesn't cover whole physical sectors reads the partial ones first.
+// SMART self-tests run in off-line mode while commands go on, the extended one fails with a read element failure
+// when it reaches the unreadable sectors.
+// Commands are executed when they are submitted, the completion time comes from a simple timing model:
+// every command costs the overhead of its protocol plus media access plus link transfer. Non-queued commands
+// hold the whole device, queued ones overlap media access on EMUL_CHANNELS channels and share the link.
+// Writes go to the volatile cache unless FUA is set or the cache is disabled, a flush costs a fixed time
+// plus the dirty data.
+// Data is kept in memory chunks which are allocated on first write, unwritten sectors read as ZERO
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <scsi/sg.h>
+
+#include "emul.h"
+#include "transport.h"
+#include "stats.h"
+
+#define EMUL_SECTOR_SIZE    512
+#define EMUL_CHUNK_SECTORS  2048          // 1 MiB per chunk
+#define EMUL_CHANNELS       8
+#define EMUL_MAX_PENDING    64
+#define EMUL_NO_BAD_LBA     (~0ULL)
+#define EMUL_ZONE_MIB       64
+#define EMUL_STREAM_GRAN_US 100           // streaming performance granularity, IDENTIFY word 98-99
+#define EMUL_STREAMS        8
+#define EMUL_SPINUP_MS      1500
+#define EMUL_SHORT_MINUTES  1             // recommended polling times of the self-tests
+#define EMUL_CONV_MINUTES   2
+#define EMUL_EXT_MB_S       150           // the extended self-test reads the whole media at this rate
+#define EMUL_SELFTEST_LOG   21            // descriptors of the SMART self-test log
+
+// SMART EXECUTE OFF-LINE IMMEDIATE subcommands and the self-test log address, refer to ACS-3 section 7.48.5
+#define EMUL_SELFTEST_SHORT 0x01
+#define EMUL_SELFTEST_EXT   0x02
+#define EMUL_SELFTEST_CONV  0x03
+#define EMUL_SELFTEST_ABORT 0x7F
+#define EMUL_LOG_SELFTEST   0x06
+
+// Power modes are the COUNT of CHECK POWER MODE, refer to ACS-3 section 7.3
+#define EMUL_MODE_STANDBY_Z 0x00
+#define EMUL_MODE_STANDBY_Y 0x01
+#define EMUL_MODE_IDLE      0x80
+#define EMUL_MODE_IDLE_A    0x81
+#define EMUL_MODE_IDLE_B    0x82
+#define EMUL_MODE_IDLE_C    0x83
+#define EMUL_MODE_ACTIVE    0xFF
+#define EMUL_WAKE_IDLE_A_NS 2000000       // electronics partly off
+#define EMUL_WAKE_IDLE_B_NS 50000000      // heads unloaded
+#define EMUL_WAKE_IDLE_C_NS 400000000     // heads unloaded, reduced rpm
+#define EMUL_APM_IDLE_NS    200000000ULL  // APM below FEh unloads the heads after this long without media access
+#define EMUL_APM_STANDBY_NS 1000000000ULL // APM below 80h spins down after this long
+
+// Zone types and conditions, refer to ZAC section 6.4.3
+#define ZONE_TYPE_CONVENTIONAL  0x1
+#define ZONE_TYPE_SWR           0x2       // sequential write required
+#define ZONE_TYPE_SWP           0x3       // sequential write preferred
+#define ZONE_COND_NOT_WP        0x0
+#define ZONE_COND_EMPTY         0x1
+#define ZONE_COND_IMP_OPEN      0x2
+#define ZONE_COND_EXP_OPEN      0x3
+#define ZONE_COND_CLOSED        0x4
+#define ZONE_COND_FULL          0xE
+
+// Timing model in nanoseconds
+#define EMUL_LINK_NS_PER_SECTOR   930     // about 550 MB/s
+#define EMUL_READ_ACCESS_NS       60000
+#define EMUL_WRITE_ACCESS_NS      20000
+#define EMUL_PIO_DRQ_NS           8000    // interrupt and handshake per DRQ data block
+#define EMUL_NONDATA_NS           20000
+#define EMUL_PROGRAM_NS           500000  // write through to the media, FUA or write cache disabled
+#define EMUL_SLOW_READ_NS         3000000 // internal re-reads of a weak region
+#define EMUL_SMR_RMW_NS           10000000 // write off the write pointer of a host aware zone
+#define EMUL_FLUSH_NS             500000
+#define EMUL_DESTAGE_NS_PER_SECTOR 1000   // dirty data written by a flush
+#define EMUL_LINK_FRAME_SECTORS   16      // 8 KiB DATA FIS, high priority data waits for the frame on the link
+
+// SAT protocols
+#define SAT_PIO_DATAIN   4
+#define SAT_PIO_DATAOUT  5
+#define SAT_DMA          6
+#define SAT_DMA_QUEUED   7
+
+// Sense keys and ATA status
+#define SK_RECOVERED_ERROR  0x1
+#define SK_MEDIUM_ERROR     0x3
+#define SK_ILLEGAL_REQUEST  0x5
+#define SK_ABORTED_COMMAND  0xB
+#define ATA_STATUS_GOOD     0x50          // DRDY | DSC
+#define ATA_STATUS_ERR      0x51
+#define ATA_STATUS_SE       0x70          // DRDY | SE | DSC
+#define ATA_ERROR_CCTO      0x01
+#define ATA_ERROR_ABRT      0x04
+#define ATA_ERROR_IDNF      0x10
+#define ATA_ERROR_UNC       0x40
+
+typedef enum _EMUL_CLASS {
+  EMUL_NONDATA = 0,
+  EMUL_PIO,
+  EMUL_MULTI,
+  EMUL_DMA,
+  EMUL_QUEUED
+} EMUL_CLASS;
+
+typedef struct _EMUL_PENDING {
+  struct sg_io_hdr *io_hdr;       // the caller's header, it stays valid until received
+  struct sg_io_hdr result;
+  unsigned long long done_ns;
+} EMUL_PENDING;
+
+typedef struct _EMUL_ZONE {
+  unsigned long long wp;
+  unsigned char type;
+  unsigned char cond;
+  unsigned char nonseq;           // written off the write pointer, host aware only
+} EMUL_ZONE;
+
+typedef struct _EMUL_SELFTEST {
+  unsigned char subcommand;
+  unsigned char status;           // self-test execution status
+  unsigned long long lba;         // first failing LBA
+} EMUL_SELFTEST;
+
+typedef struct _EMUL_DEVICE {
+  int fd;
+  unsigned long long sectors;
+  unsigned char **chunks;
+  unsigned long nchunks;
+  unsigned int queuedepth;
+  unsigned int serialize;
+  unsigned int batch;
+  unsigned int maxxfer;
+  unsigned int secperdrq;
+  unsigned int write_cache;
+  unsigned long long dirty;       // sectors in the write cache
+  unsigned long long bad_lba;     // unreadable sectors, EMUL_NO_BAD_LBA : none
+  unsigned long long bad_len;
+  unsigned int flaky;             // every flaky-th command is aborted once by the link, 0 : never
+  unsigned long long slow_lba;    // weak region, EMUL_NO_BAD_LBA : none
+  unsigned long long slow_len;
+  unsigned int zoned;             // 0 : not zoned, 1 : host aware, 2 : host managed
+  unsigned long long zone_sectors;
+  unsigned long nzones;
+  EMUL_ZONE *zones;
+  unsigned int stream_cctl[EMUL_STREAMS];   // default time limit of CONFIGURE STREAM
+  unsigned int power_mode;        // EMUL_MODE_*
+  unsigned int apm_level;         // 0 : APM disabled
+  unsigned int spinup_ms;
+  unsigned int pss;               // log2 of logical sectors per physical sector
+  unsigned int align_lba;
+  char topology[128];             // sysfs path below /sys/devices of a real drive, e.g. host0/port-0:0/expander-0:0
+  unsigned int selftest_ms;       // ms of an emulated minute of self-test
+  unsigned int selftest_sub;      // subcommand of the running self-test, ZERO : none runs
+  unsigned long long selftest_start;
+  unsigned long long selftest_end;
+  unsigned int selftest_status;   // self-test execution status of the last one
+  EMUL_SELFTEST selftest_log[EMUL_SELFTEST_LOG];
+  unsigned int selftest_index;    // descriptors in the log, the latest is at (index - 1) % EMUL_SELFTEST_LOG
+  unsigned long long media_ns;    // end of the last media access, the APM timers run from it
+  unsigned long long ncommands;
+  unsigned char identify[512];
+
+  unsigned long long busy_until;  // end of the last command
+  unsigned long long link_free;
+  unsigned long long chan_free[EMUL_CHANNELS];
+
+  EMUL_PENDING pending[EMUL_MAX_PENDING];
+  unsigned int npending;
+} EMUL_DEVICE;
+
+// What a command does, filled by the decoders and used by the timing model
+typedef struct _EMUL_CMD {
+  EMUL_CLASS cls;
+  unsigned int isread;
+  unsigned int iswrite;
+  unsigned long long lba;
+  unsigned int sectors;
+  unsigned int ata;               // 1 : ATA PASS-THROUGH
+  unsigned int ck_cond;
+  unsigned int fua;
+  unsigned int flush;
+  unsigned int hipri;             // NCQ high priority
+  unsigned int media;             // reads or verifies lba/sectors on the media
+  unsigned int rmw;               // write off the write pointer of a host aware zone
+  unsigned long long limit_ns;    // time limit of a stream command, ZERO : none
+  unsigned int continuous;        // RC / WC of a stream command
+  unsigned int power;             // a power management command, it doesn't wake the drive
+  unsigned long long wake_ns;     // wake up of the drive before the media access
+} EMUL_CMD;
+
+///////////////
+// PROTOTYPE
+///////////////
+static int emul_execute(int fd, struct sg_io_hdr *io_hdr);
+static int emul_submit(int fd, struct sg_io_hdr *io_hdr);
+static int emul_receive(int fd, struct sg_io_hdr *io_hdr);
+static int emul_submit_batch(int fd, struct sg_io_hdr **io_hdrs, unsigned int n);
+static int emul_receive_batch(int fd, struct sg_io_hdr *io_hdrs, unsigned int max);
+static int emul_ready(int fd);
+static unsigned long long emul_process(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr);
+static int zones_init(EMUL_DEVICE *emul);
+static int zone_write(EMUL_DEVICE *emul, EMUL_CMD *cmd);
+static int zone_action(EMUL_DEVICE *emul, unsigned int action, unsigned long long lba, unsigned int all);
+static void report_zones(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr, unsigned long long lba, unsigned int options,
+                         unsigned int partial);
+static int emul_inject(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr, EMUL_CMD *cmd);
+
+///////////////
+// LOCALS
+///////////////
+static EMUL_DEVICE *emul_devices[MAX_TRANSPORT_FD];
+
+static const SG_TRANSPORT emul_transport = {
+  "emulator", emul_execute, emul_submit, emul_receive, NULL, NULL, emul_ready
+};
+
+static const SG_TRANSPORT emul_batch_transport = {
+  "emulator batch", emul_execute, emul_submit, emul_receive, emul_submit_batch, emul_receive_batch, emul_ready
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+int emul_is_path(const char *path)
+{
+  return strncmp(path, EMUL_PREFIX, strlen(EMUL_PREFIX)) == 0;
+}
+
+static void set_ata_string(unsigned short *iden, unsigned int word, unsigned int nwords, const char *str)
+{
+  unsigned int i;
+  unsigned int len = strlen(str);
+  char c0, c1;
+
+  for (i = 0; i < nwords; i++)
+  {
+    c0 = (i * 2 < len) ? str[i * 2] : ' ';
+    c1 = (i * 2 + 1 < len) ? str[i * 2 + 1] : ' ';
+    iden[word + i] = (unsigned char)c0 << 8 | (unsigned char)c1;
+  }
+}
+
+static void build_identify(EMUL_DEVICE *emul)
+{
+  unsigned short *iden = (unsigned short *)emul->identify;
+  unsigned long long lba28 = emul->sectors > 0x0FFFFFFF ? 0x0FFFFFFF : emul->sectors;
+  unsigned char sum = 0;
+  int i;
+
+  memset(emul->identify, 0, sizeof(emul->identify));
+
+  iden[0] = 0x0040;
+  set_ata_string(iden, 10, 10, "PENGUIN-EMUL-0001");
+  set_ata_string(iden, 23, 4, "1.0");
+  set_ata_string(iden, 27, 20, "Penguin Emulated SATA Drive");
+  iden[47] = 0x8000 | emul->secperdrq;
+  iden[49] = (1 << 9) | (1 << 8);                 // LBA, DMA
+  iden[53] = 0x0006;
+  iden[69] = emul->zoned == 1 ? 0x0001 : 0;       // host aware, host managed drives report ZERO here
+  iden[59] = (1 << 8) | emul->secperdrq;          // multiple setting is valid
+  iden[60] = lba28 & 0xFFFF;
+  iden[61] = (lba28 >> 16) & 0xFFFF;
+  iden[75] = emul->queuedepth - 1;
+  iden[76] = (1 << 12) | (1 << 8) | (1 << 3) | (1 << 2);   // NCQ priority, NCQ, SATA Gen2/Gen3
+  iden[80] = 0x07F0;
+  iden[82] = (1 << 5) | 1;                        // write cache, SMART
+  iden[83] = (1 << 14) | (1 << 13) | (1 << 12) | (1 << 10) | (1 << 3) | (1 << 1);   // FLUSH CACHE EXT, FLUSH CACHE, 48-bit, APM, TCQ
+  iden[84] = (1 << 14) | (1 << 6) | (1 << 4);   // FUA EXT, Streaming
+  iden[85] = (emul->write_cache << 5) | 1;
+  iden[86] = (1 << 13) | (1 << 12) | (1 << 10) | (emul->apm_level ? 1 << 3 : 0) | (1 << 1);
+  iden[87] = (1 << 14) | (1 << 6);
+  iden[88] = 0x407F;
+  iden[91] = emul->apm_level;
+  iden[95] = 8;                                   // stream minimum request size
+  iden[97] = 60;                                  // streaming access latency, 6 ms
+  iden[98] = EMUL_STREAM_GRAN_US;
+  iden[100] = emul->sectors & 0xFFFF;
+  iden[101] = (emul->sectors >> 16) & 0xFFFF;
+  iden[102] = (emul->sectors >> 32) & 0xFFFF;
+  iden[103] = (emul->sectors >> 48) & 0xFFFF;
+  iden[106] = 0x4000 | (emul->pss ? (1 << 13) | emul->pss : 0);   // 2^pss logical sectors per physical sector, 512 bytes
+  iden[119] = (1 << 14) | (1 << 7);               // EPC
+  iden[120] = (1 << 14) | (1 << 7);
+  iden[209] = 0x4000 | (((1 << emul->pss) - emul->align_lba) & ((1 << emul->pss) - 1));   // offset of LBA 0
+  iden[217] = 1;                                  // non-rotating media
+
+  // integrity word, signature A5h and checksum which makes the sum of all bytes ZERO
+  iden[255] = 0x00A5;
+  for (i = 0; i < 511; i++)
+    sum += emul->identify[i];
+  iden[255] |= (unsigned short)((unsigned char)(0 - sum)) << 8;
+}
+
+static void parse_spec(EMUL_DEVICE *emul, const char *spec)
+{
+  const char *p = strchr(spec, ':');
+  char key[32];
+  unsigned long long value;
+  int n;
+
+  while (p && *p)
+  {
+    p++;
+    // the only option with a string value
+    if (strncmp(p, "topo=", 5) == 0 && sscanf(p + 5, "%127[^,]%n", emul->topology, &n) == 1)
+    {
+      p = strchr(p + 5 + n, ',');
+      continue;
+    }
+    if (sscanf(p, "%31[^=]=%lli%n", key, &value, &n) != 2)
+      break;
+
+    if (strcmp(key, "size") == 0)
+      emul->sectors = value * 1024 * 1024 / EMUL_SECTOR_SIZE;
+    else if (strcmp(key, "qd") == 0 && value >= 1 && value <= 32)
+      emul->queuedepth = value;
+    else if (strcmp(key, "serialize") == 0)
+      emul->serialize = value ? 1 : 0;
+    else if (strcmp(key, "maxxfer") == 0)
+      emul->maxxfer = value;
+    else if (strcmp(key, "bad") == 0)
+      emul->bad_lba = value;
+    else if (strcmp(key, "badlen") == 0 && value >= 1)
+      emul->bad_len = value;
+    else if (strcmp(key, "flaky") == 0)
+      emul->flaky = value;
+    else if (strcmp(key, "slow") == 0)
+      emul->slow_lba = value;
+    else if (strcmp(key, "slowlen") == 0)
+      emul->slow_len = value;
+    else if (strcmp(key, "zoned") == 0 && value <= 2)
+      emul->zoned = value;
+    else if (strcmp(key, "zonesz") == 0 && value >= 1)
+      emul->zone_sectors = value * 1024 * 1024 / EMUL_SECTOR_SIZE;
+    else if (strcmp(key, "spinup") == 0)
+      emul->spinup_ms = value;
+    else if (strcmp(key, "pss") == 0 && value <= 3)
+      emul->pss = value;
+    else if (strcmp(key, "align") == 0)
+      emul->align_lba = value;
+    else if (strcmp(key, "batch") == 0)
+      emul->batch = value ? 1 : 0;
+    else if (strcmp(key, "selftest") == 0 && value >= 1)
+      emul->selftest_ms = value;
+    else
+      printf("emulator: unknown option %s\n", key);
+
+    p = strchr(p + n, ',');
+  }
+}
+
+// The fd is a real one so that it can't collide with other files, requests on it never reach the kernel
+int emul_open(const char *spec)
+{
+  EMUL_DEVICE *emul;
+  int fd;
+
+  fd = open("/dev/null", O_RDWR);
+  if (fd < 0 || fd >= MAX_TRANSPORT_FD)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  emul = (EMUL_DEVICE *)calloc(1, sizeof(EMUL_DEVICE));
+  if (emul == NULL)
+  {
+    close(fd);
+    return -1;
+  }
+
+  emul->fd = fd;
+  emul->sectors = 1024ULL * 1024 * 1024 / EMUL_SECTOR_SIZE;
+  emul->queuedepth = 32;
+  emul->secperdrq = 16;
+  emul->write_cache = 1;
+  emul->bad_lba = EMUL_NO_BAD_LBA;
+  emul->bad_len = 1;
+  emul->slow_lba = EMUL_NO_BAD_LBA;
+  emul->slow_len = EMUL_CHUNK_SECTORS;
+  emul->zone_sectors = EMUL_ZONE_MIB * 1024 * 1024 / EMUL_SECTOR_SIZE;
+  emul->power_mode = EMUL_MODE_ACTIVE;
+  emul->spinup_ms = EMUL_SPINUP_MS;
+  emul->selftest_ms = 60000;
+  parse_spec(emul, spec);
+  emul->align_lba &= (1 << emul->pss) - 1;
+
+  emul->nchunks = (emul->sectors + EMUL_CHUNK_SECTORS - 1) / EMUL_CHUNK_SECTORS;
+  emul->chunks = (unsigned char **)calloc(emul->nchunks, sizeof(unsigned char *));
+  if (emul->chunks == NULL)
+  {
+    free(emul);
+    close(fd);
+    return -1;
+  }
+
+  if (emul->zoned && zones_init(emul) != 0)
+  {
+    free(emul->chunks);
+    free(emul);
+    close(fd);
+    return -1;
+  }
+
+  build_identify(emul);
+
+  emul_devices[fd] = emul;
+  transport_register(fd, emul->batch ? &emul_batch_transport : &emul_transport);
+
+  return fd;
+}
+
+// Where the emulated drive hangs in the SAS / ATA topology, -1 : nowhere
+int emul_topology(int fd, char *path, unsigned int len)
+{
+  EMUL_DEVICE *emul = emul_devices[fd];
+
+  if (emul == NULL || emul->topology[0] == 0)
+    return -1;
+
+  snprintf(path, len, "%s", emul->topology);
+  return 0;
+}
+
+void emul_close(int fd)
+{
+  EMUL_DEVICE *emul;
+  unsigned long i;
+
+  if (fd < 0 || fd >= MAX_TRANSPORT_FD || emul_devices[fd] == NULL)
+    return;
+
+  emul = emul_devices[fd];
+  for (i = 0; i < emul->nchunks; i++)
+    free(emul->chunks[i]);
+  free(emul->chunks);
+  free(emul->zones);
+  free(emul);
+
+  emul_devices[fd] = NULL;
+  transport_unregister(fd);
+  close(fd);
+}
+
+static void media_read(EMUL_DEVICE *emul, unsigned long long lba, unsigned int sectors, unsigned char *buffer)
+{
+  while (sectors)
+  {
+    unsigned long chunk = lba / EMUL_CHUNK_SECTORS;
+    unsigned int offset = lba % EMUL_CHUNK_SECTORS;
+    unsigned int n = EMUL_CHUNK_SECTORS - offset;
+
+    if (n > sectors)
+      n = sectors;
+
+    if (emul->chunks[chunk])
+      memcpy(buffer, emul->chunks[chunk] + (unsigned long)offset * EMUL_SECTOR_SIZE, (unsigned long)n * EMUL_SECTOR_SIZE);
+    else
+      memset(buffer, 0, (unsigned long)n * EMUL_SECTOR_SIZE);
+
+    lba += n;
+    sectors -= n;
+    buffer += (unsigned long)n * EMUL_SECTOR_SIZE;
+  }
+}
+
+static int media_write(EMUL_DEVICE *emul, unsigned long long lba, unsigned int sectors, unsigned char *buffer)
+{
+  while (sectors)
+  {
+    unsigned long chunk = lba / EMUL_CHUNK_SECTORS;
+    unsigned int offset = lba % EMUL_CHUNK_SECTORS;
+    unsigned int n = EMUL_CHUNK_SECTORS - offset;
+
+    if (n > sectors)
+      n = sectors;
+
+    if (emul->chunks[chunk] == NULL)
+    {
+      emul->chunks[chunk] = (unsigned char *)calloc(EMUL_CHUNK_SECTORS, EMUL_SECTOR_SIZE);
+      if (emul->chunks[chunk] == NULL)
+        return -1;
+    }
+    memcpy(emul->chunks[chunk] + (unsigned long)offset * EMUL_SECTOR_SIZE, buffer, (unsigned long)n * EMUL_SECTOR_SIZE);
+
+    lba += n;
+    sectors -= n;
+    buffer += (unsigned long)n * EMUL_SECTOR_SIZE;
+  }
+
+  return 0;
+}
+
+// Fixed format sense data for SCSI commands, refer to spc-4 section 4.5.3
+static void set_fixed_sense(struct sg_io_hdr *io_hdr, unsigned int sk, unsigned int asc, unsigned int ascq)
+{
+  unsigned char *sense_b = io_hdr->sbp;
+
+  io_hdr->status = 2;
+  io_hdr->masked_status = 1;
+  if (io_hdr->mx_sb_len < 18)
+    return;
+
+  memset(sense_b, 0, 18);
+  sense_b[0] = 0x70;
+  sense_b[2] = sk;
+  sense_b[7] = 10;
+  sense_b[12] = asc;
+  sense_b[13] = ascq;
+  io_hdr->sb_len_wr = 18;
+}
+
+// Descriptor format sense data with ATA Status Return descriptor, refer to SAT-3 section 12.2.2.6
+static void set_ata_sense(struct sg_io_hdr *io_hdr, unsigned int sk, unsigned int asc, unsigned int ascq,
+                          unsigned int status, unsigned int error, unsigned long long lba, unsigned int count)
+{
+  unsigned char *sense_b = io_hdr->sbp;
+
+  io_hdr->status = 2;
+  io_hdr->masked_status = 1;
+  if (io_hdr->mx_sb_len < 22)
+    return;
+
+  memset(sense_b, 0, 22);
+  sense_b[0] = 0x72;
+  sense_b[1] = sk;
+  sense_b[2] = asc;
+  sense_b[3] = ascq;
+  sense_b[7] = 14;                // additional sense length
+  sense_b[8] = 0x09;              // ATA Status Return
+  sense_b[9] = 0x0C;
+  sense_b[10] = 1;                // EXTEND
+  sense_b[11] = error;
+  sense_b[12] = (count >> 8) & 0xFF;
+  sense_b[13] = count & 0xFF;
+  sense_b[14] = (lba >> 24) & 0xFF;
+  sense_b[15] = lba & 0xFF;
+  sense_b[16] = (lba >> 32) & 0xFF;
+  sense_b[17] = (lba >> 8) & 0xFF;
+  sense_b[18] = (lba >> 40) & 0xFF;
+  sense_b[19] = (lba >> 16) & 0xFF;
+  sense_b[20] = 0x40;             // DEVICE
+  sense_b[21] = status;
+  io_hdr->sb_len_wr = 22;
+}
+
+static void copy_in(struct sg_io_hdr *io_hdr, unsigned char *data, unsigned int len)
+{
+  unsigned int n = len < io_hdr->dxfer_len ? len : io_hdr->dxfer_len;
+
+  memcpy(io_hdr->dxferp, data, n);
+  io_hdr->resid = io_hdr->dxfer_len - n;
+}
+
+static void put_be16(unsigned char *p, unsigned int value)
+{
+  p[0] = (value >> 8) & 0xFF;
+  p[1] = value & 0xFF;
+}
+
+static void put_be32(unsigned char *p, unsigned int value)
+{
+  p[0] = (value >> 24) & 0xFF;
+  p[1] = (value >> 16) & 0xFF;
+  p[2] = (value >> 8) & 0xFF;
+  p[3] = value & 0xFF;
+}
+
+static void put_le64(unsigned char *p, unsigned long long value)
+{
+  int i;
+
+  for (i = 0; i < 8; i++)
+    p[i] = (value >> (i * 8)) & 0xFF;
+}
+
+// The first zone is conventional, the others are sequential and empty
+static int zones_init(EMUL_DEVICE *emul)
+{
+  unsigned long i;
+
+  emul->nzones = (emul->sectors + emul->zone_sectors - 1) / emul->zone_sectors;
+  emul->zones = (EMUL_ZONE *)calloc(emul->nzones, sizeof(EMUL_ZONE));
+  if (emul->zones == NULL)
+    return -1;
+
+  for (i = 0; i < emul->nzones; i++)
+  {
+    emul->zones[i].wp = i * emul->zone_sectors;
+    emul->zones[i].type = i == 0 ? ZONE_TYPE_CONVENTIONAL : (emul->zoned == 2 ? ZONE_TYPE_SWR : ZONE_TYPE_SWP);
+    emul->zones[i].cond = i == 0 ? ZONE_COND_NOT_WP : ZONE_COND_EMPTY;
+  }
+
+  return 0;
+}
+
+static unsigned long long zone_end(EMUL_DEVICE *emul, unsigned long index)
+{
+  unsigned long long end = (index + 1) * emul->zone_sectors;
+
+  return end < emul->sectors ? end : emul->sectors;
+}
+
+// Move the write pointer of a write, -1 when a host managed zone doesn't take it
+static int zone_write(EMUL_DEVICE *emul, EMUL_CMD *cmd)
+{
+  EMUL_ZONE *zone;
+  unsigned long index;
+  unsigned long long end = cmd->lba + cmd->sectors;
+
+  if (!emul->zoned)
+    return 0;
+
+  index = cmd->lba / emul->zone_sectors;
+  zone = &emul->zones[index];
+  if (zone->type == ZONE_TYPE_CONVENTIONAL)
+    return 0;
+
+  if (zone->type == ZONE_TYPE_SWR && (cmd->lba != zone->wp || end > zone_end(emul, index)))
+    return -1;
+
+  if (cmd->lba != zone->wp)
+  {
+    cmd->rmw = 1;
+    zone->nonseq = 1;
+  }
+  if (end > zone_end(emul, index))
+    end = zone_end(emul, index);
+  if (end > zone->wp)
+    zone->wp = end;
+
+  if (zone->wp == zone_end(emul, index))
+    zone->cond = ZONE_COND_FULL;
+  else if (zone->cond == ZONE_COND_EMPTY || zone->cond == ZONE_COND_CLOSED)
+    zone->cond = ZONE_COND_IMP_OPEN;
+
+  return 0;
+}
+
+static void zone_apply(EMUL_DEVICE *emul, unsigned long index, unsigned int action)
+{
+  EMUL_ZONE *zone = &emul->zones[index];
+  unsigned long long start = index * emul->zone_sectors;
+
+  switch (action)
+  {
+    case 0x01:                    // CLOSE ZONE
+      if (zone->cond == ZONE_COND_IMP_OPEN || zone->cond == ZONE_COND_EXP_OPEN)
+        zone->cond = zone->wp == start ? ZONE_COND_EMPTY : ZONE_COND_CLOSED;
+      break;
+    case 0x02:                    // FINISH ZONE
+      zone->wp = zone_end(emul, index);
+      zone->cond = ZONE_COND_FULL;
+      break;
+    case 0x03:                    // OPEN ZONE
+      if (zone->cond != ZONE_COND_FULL)
+        zone->cond = ZONE_COND_EXP_OPEN;
+      break;
+    case 0x04:                    // RESET WRITE POINTER
+      zone->wp = start;
+      zone->cond = ZONE_COND_EMPTY;
+      zone->nonseq = 0;
+      break;
+  }
+}
+
+// ZAC MANAGEMENT OUT, -1 when the action or the zone is invalid
+static int zone_action(EMUL_DEVICE *emul, unsigned int action, unsigned long long lba, unsigned int all)
+{
+  unsigned long i;
+
+  if (action < 0x01 || action > 0x04)
+    return -1;
+
+  if (all)
+  {
+    for (i = 0; i < emul->nzones; i++)
+    {
+      if (emul->zones[i].type == ZONE_TYPE_CONVENTIONAL)
+        continue;
+      // OPEN and FINISH of all zones only apply to the closed ones, refer to ZAC section 5.2.3 / 5.2.4
+      if ((action == 0x02 || action == 0x03) && emul->zones[i].cond != ZONE_COND_CLOSED &&
+          !(action == 0x02 && (emul->zones[i].cond == ZONE_COND_IMP_OPEN || emul->zones[i].cond == ZONE_COND_EXP_OPEN)))
+        continue;
+      zone_apply(emul, i, action);
+    }
+    return 0;
+  }
+
+  if (lba >= emul->sectors || lba % emul->zone_sectors || emul->zones[lba / emul->zone_sectors].type == ZONE_TYPE_CONVENTIONAL)
+    return -1;
+
+  zone_apply(emul, lba / emul->zone_sectors, action);
+  return 0;
+}
+
+static int zone_matches(EMUL_ZONE *zone, unsigned int options)
+{
+  switch (options)
+  {
+    case 0x00: return 1;
+    case 0x01: return zone->cond == ZONE_COND_EMPTY;
+    case 0x02: return zone->cond == ZONE_COND_IMP_OPEN;
+    case 0x03: return zone->cond == ZONE_COND_EXP_OPEN;
+    case 0x04: return zone->cond == ZONE_COND_CLOSED;
+    case 0x05: return zone->cond == ZONE_COND_FULL;
+    case 0x11: return zone->nonseq;
+    case 0x3F: return zone->cond == ZONE_COND_NOT_WP;
+    default:   return 0;
+  }
+}
+
+// REPORT ZONES EXT data, 64 bytes of header and a 64 bytes descriptor per zone, little endian, refer to ZAC section 6.4
+static void report_zones(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr, unsigned long long lba, unsigned int options,
+                         unsigned int partial)
+{
+  unsigned char *data = io_hdr->dxferp;
+  unsigned int len = io_hdr->dxfer_len;
+  unsigned int pos = 64;
+  unsigned long long listlen = 0;
+  unsigned long i;
+
+  memset(data, 0, len);
+  for (i = lba < emul->sectors ? lba / emul->zone_sectors : emul->nzones; i < emul->nzones; i++)
+  {
+    EMUL_ZONE *zone = &emul->zones[i];
+
+    if (!zone_matches(zone, options))
+      continue;
+
+    if (pos + 64 <= len)
+    {
+      data[pos] = zone->type;
+      data[pos + 1] = (zone->cond << 4) | (zone->nonseq << 1);
+      put_le64(data + pos + 8, zone_end(emul, i) - i * emul->zone_sectors);
+      put_le64(data + pos + 16, i * emul->zone_sectors);
+      put_le64(data + pos + 24, zone->type == ZONE_TYPE_CONVENTIONAL ? ~0ULL : zone->wp);
+      pos += 64;
+    }
+    else if (partial)
+      break;
+    listlen += 64;
+  }
+
+  data[0] = listlen & 0xFF;
+  data[1] = (listlen >> 8) & 0xFF;
+  data[2] = (listlen >> 16) & 0xFF;
+  data[3] = (listlen >> 24) & 0xFF;
+  put_le64(data + 8, emul->sectors - 1);
+}
+
+static void emul_inquiry(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr, unsigned char *cdb)
+{
+  unsigned char data[600];
+  unsigned int len;
+  static const unsigned char pages[] = { 0x00, 0x80, 0x83, 0x89, 0xB0, 0xB1 };
+
+  memset(data, 0, sizeof(data));
+
+  if ((cdb[1] & 1) == 0)
+  {
+    data[0] = emul->zoned == 2 ? 0x14 : 0x00;     // host managed zoned block device, direct access block device
+    data[2] = 0x06;               // SPC-4
+    data[3] = 0x02;
+    data[4] = 96 - 5;
+    memcpy(data + 8, "ATA     ", 8);
+    memcpy(data + 16, "Penguin Emulated", 16);
+    memcpy(data + 32, "1.0 ", 4);
+    put_be16(data + 58, 0x0460);  // SPC-4
+    put_be16(data + 60, 0x04C0);  // SBC-3
+    put_be16(data + 62, 0x0D00);  // SAT-3
+    copy_in(io_hdr, data, 96);
+    return;
+  }
+
+  data[1] = cdb[2];
+  switch (cdb[2])
+  {
+    case 0x00:
+      memcpy(data + 4, pages, sizeof(pages));
+      len = sizeof(pages);
+      break;
+
+    case 0x80:
+      memcpy(data + 4, "PENGUIN-EMUL-0001   ", 20);
+      len = 20;
+      break;
+
+    case 0x83:
+      data[4] = 0x01;             // binary
+      data[5] = 0x03;             // logical unit, NAA
+      data[7] = 8;
+      data[8] = 0x50;             // NAA 5
+      data[9] = 0x01;
+      data[10] = 0x23;
+      data[11] = 0x45;
+      data[15] = emul->fd & 0xFF;
+      len = 12;
+      break;
+
+    case 0x89:
+      memcpy(data + 8, "linux   ", 8);
+      memcpy(data + 16, "libata-emul     ", 16);
+      memcpy(data + 32, "1.0 ", 4);
+      data[36] = 0x34;            // signature, D2H register FIS
+      data[56] = 0xEC;
+      memcpy(data + 60, emul->identify, 512);
+      len = 572 - 4;
+      break;
+
+    case 0xB0:
+      put_be32(data + 8, emul->maxxfer);
+      len = 0x3C;
+      break;
+
+    case 0xB1:
+      put_be16(data + 4, 1);      // non-rotating medium
+      data[7] = 0x3;              // 2.5 inch
+      len = 0x3C;
+      break;
+
+    default:
+      set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x24, 0x00);   // INVALID FIELD IN CDB
+      return;
+  }
+
+  put_be16(data + 2, len);
+  copy_in(io_hdr, data, len + 4);
+}
+
+static void emul_mode_sense(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr)
+{
+  unsigned char data[8 + 20];
+
+  memset(data, 0, sizeof(data));
+
+  // header and Caching mode page
+  put_be16(data, sizeof(data) - 2);
+  data[8] = 0x08;
+  data[9] = 0x12;
+  data[3] = 0x10;                        // DPOFUA
+  data[10] = emul->write_cache << 2;     // WCE
+  copy_in(io_hdr, data, sizeof(data));
+}
+
+static unsigned long long ata_lba(unsigned char *cdb, unsigned int extend)
+{
+  unsigned long long lba;
+
+  lba = cdb[8] | cdb[10] << 8 | cdb[12] << 16;
+  if (extend)
+    lba |= (unsigned long long)cdb[7] << 24 | (unsigned long long)cdb[9] << 32 | (unsigned long long)cdb[11] << 40;
+  else
+    lba |= (unsigned long long)(cdb[13] & 0xF) << 24;
+
+  return lba;
+}
+
+static unsigned int selftest_minutes(EMUL_DEVICE *emul, unsigned int subcommand)
+{
+  unsigned long long minutes;
+
+  if (subcommand == EMUL_SELFTEST_SHORT)
+    return EMUL_SHORT_MINUTES;
+  if (subcommand == EMUL_SELFTEST_CONV)
+    return EMUL_CONV_MINUTES;
+  minutes = emul->sectors * EMUL_SECTOR_SIZE / (EMUL_EXT_MB_S * 1000000ULL) / 60 + 2;
+  return minutes > 0xFFFF ? 0xFFFF : minutes;
+}
+
+static void selftest_finish(EMUL_DEVICE *emul, unsigned int status, unsigned long long lba)
+{
+  EMUL_SELFTEST *entry = &emul->selftest_log[emul->selftest_index++ % EMUL_SELFTEST_LOG];
+
+  entry->subcommand = emul->selftest_sub;
+  entry->status = status;
+  entry->lba = lba;
+  emul->selftest_status = status;
+  emul->selftest_sub = 0;
+}
+
+// The running self-test ends when its time is up, or when the extended one reaches the unreadable sectors
+static void selftest_update(EMUL_DEVICE *emul, unsigned long long now)
+{
+  unsigned long long fail_ns;
+
+  if (emul->selftest_sub == 0)
+    return;
+
+  if (emul->selftest_sub == EMUL_SELFTEST_EXT && emul->bad_lba < emul->sectors)
+  {
+    fail_ns = emul->selftest_start + (emul->selftest_end - emul->selftest_start) * emul->bad_lba / emul->sectors;
+    if (now >= fail_ns)
+    {
+      selftest_finish(emul, 0x70 | (unsigned int)(9 - 9 * emul->bad_lba / emul->sectors), emul->bad_lba);
+      return;
+    }
+  }
+  if (now >= emul->selftest_end)
+    selftest_finish(emul, 0x00, EMUL_NO_BAD_LBA);
+}
+
+static void selftest_status(EMUL_DEVICE *emul, unsigned long long now, unsigned char *data)
+{
+  unsigned long long tenths;
+
+  selftest_update(emul, now);
+  if (emul->selftest_sub == 0)
+  {
+    data[363] = emul->selftest_status;
+    return;
+  }
+
+  // percent remaining in tenths, rounded up so that a running test never says ZERO
+  tenths = ((emul->selftest_end - now) * 10 + emul->selftest_end - emul->selftest_start - 1) /
+           (emul->selftest_end - emul->selftest_start);
+  data[363] = 0xF0 | (tenths > 9 ? 9 : tenths);
+}
+
+// SMART EXECUTE OFF-LINE IMMEDIATE, off-line mode only. A new test aborts the running one
+static int selftest_execute(EMUL_DEVICE *emul, unsigned int subcommand)
+{
+  unsigned long long now = now_ns();
+
+  selftest_update(emul, now);
+  if (subcommand != EMUL_SELFTEST_SHORT && subcommand != EMUL_SELFTEST_EXT && subcommand != EMUL_SELFTEST_CONV &&
+      subcommand != EMUL_SELFTEST_ABORT)
+    return -1;
+
+  if (emul->selftest_sub)
+    selftest_finish(emul, 0x10, EMUL_NO_BAD_LBA);
+  if (subcommand == EMUL_SELFTEST_ABORT)
+    return 0;
+
+  emul->selftest_sub = subcommand;
+  emul->selftest_start = now;
+  emul->selftest_end = now + (unsigned long long)selftest_minutes(emul, subcommand) * emul->selftest_ms * 1000000;
+  return 0;
+}
+
+// SMART READ DATA, refer to ACS-3 section 7.48.6
+static void smart_data(EMUL_DEVICE *emul, unsigned char *data)
+{
+  unsigned int ext = selftest_minutes(emul, EMUL_SELFTEST_EXT);
+  unsigned char sum = 0;
+  unsigned int i;
+
+  data[0] = 0x10;                            // revision
+  selftest_status(emul, now_ns(), data);
+  data[367] = 0x31;                          // EXECUTE OFF-LINE IMMEDIATE, self-test, conveyance self-test
+  data[368] = 0x03;                          // SMART data saved before power saving, autosave
+  data[370] = 0x01;                          // error logging
+  data[372] = EMUL_SHORT_MINUTES;
+  data[373] = ext > 0xFE ? 0xFF : ext;
+  data[374] = EMUL_CONV_MINUTES;
+  data[375] = ext & 0xFF;
+  data[376] = ext >> 8;
+  for (i = 0; i < 511; i++)
+    sum += data[i];
+  data[511] = 0 - sum;
+}
+
+// SMART self-test log, refer to ACS-3 section A.16
+static void selftest_log(EMUL_DEVICE *emul, unsigned char *data)
+{
+  EMUL_SELFTEST *entry;
+  unsigned char *desc;
+  unsigned char sum = 0;
+  unsigned int i, n;
+
+  selftest_update(emul, now_ns());
+  data[0] = 0x01;
+  n = emul->selftest_index < EMUL_SELFTEST_LOG ? emul->selftest_index : EMUL_SELFTEST_LOG;
+  for (i = 0; i < n; i++)
+  {
+    entry = &emul->selftest_log[i];
+    desc = data + 2 + i * 24;
+    desc[0] = entry->subcommand;
+    desc[1] = entry->status;
+    if (entry->lba != EMUL_NO_BAD_LBA)
+    {
+      desc[5] = entry->lba & 0xFF;
+      desc[6] = (entry->lba >> 8) & 0xFF;
+      desc[7] = (entry->lba >> 16) & 0xFF;
+      desc[8] = (entry->lba >> 24) & 0xFF;
+    }
+    else
+      memset(desc + 5, 0xFF, 4);
+  }
+  data[508] = n ? (emul->selftest_index - 1) % EMUL_SELFTEST_LOG + 1 : 0;
+  for (i = 0; i < 511; i++)
+    sum += data[i];
+  data[511] = 0 - sum;
+}
+
+// ATA PASS-THROUGH(16), refer to SAT-3 section 12.2.2
+static void emul_ata(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr, unsigned char *cdb, EMUL_CMD *cmd)
+{
+  unsigned int protocol = (cdb[1] >> 1) & 0xF;
+  unsigned int extend = cdb[1] & 1;
+  unsigned int features = cdb[4] | (extend ? cdb[3] << 8 : 0);
+  unsigned int count = cdb[6] | (extend ? cdb[5] << 8 : 0);
+  unsigned int command = cdb[14];
+  unsigned long long lba = ata_lba(cdb, extend);
+  unsigned int isdata = 0;
+
+  cmd->ata = 1;
+  cmd->ck_cond = (cdb[2] >> 5) & 1;
+  cmd->cls = EMUL_NONDATA;
+
+  switch (command)
+  {
+    case 0xEC:                    // IDENTIFY DEVICE
+      cmd->cls = EMUL_PIO;
+      cmd->isread = 1;
+      cmd->sectors = 1;
+      copy_in(io_hdr, emul->identify, 512);
+      break;
+
+    case 0x20: case 0x24:         // READ SECTORS (EXT)
+    case 0x30: case 0x34:         // WRITE SECTORS (EXT)
+      cmd->cls = EMUL_PIO;
+      isdata = 1;
+      break;
+
+    case 0xC4: case 0x29:         // READ MULTIPLE (EXT)
+    case 0xC5: case 0x39:         // WRITE MULTIPLE (EXT)
+    case 0xCE:                    // WRITE MULTIPLE FUA EXT
+      cmd->cls = EMUL_MULTI;
+      isdata = 1;
+      break;
+
+    case 0xC8: case 0x25:         // READ DMA (EXT)
+    case 0xCA: case 0x35:         // WRITE DMA (EXT)
+    case 0x3D:                    // WRITE DMA FUA EXT
+      cmd->cls = EMUL_DMA;
+      isdata = 1;
+      break;
+
+    case 0x2A: case 0x3A:         // READ / WRITE STREAM DMA EXT
+      cmd->cls = EMUL_DMA;
+      isdata = 1;
+      cmd->continuous = (features >> 6) & 1;
+      cmd->limit_ns = (unsigned long long)((features >> 8) ? (features >> 8) : emul->stream_cctl[features & 0x7]) *
+                      EMUL_STREAM_GRAN_US * 1000;
+      break;
+
+    case 0x51:                    // CONFIGURE STREAM
+      emul->stream_cctl[features & 0x7] = (features & 0x80) ? features >> 8 : 0;
+      break;
+
+    case 0xC7: case 0x26:         // READ DMA QUEUED (EXT)
+    case 0xCC: case 0x36:         // WRITE DMA QUEUED (EXT)
+    case 0x3E:                    // WRITE DMA QUEUED FUA EXT
+    case 0x60: case 0x61:         // READ / WRITE FPDMA QUEUED
+      cmd->cls = EMUL_QUEUED;
+      isdata = 1;
+      count = features;           // SECTOR COUNT carries the tag
+      break;
+
+    case 0x40: case 0x42:         // READ VERIFY SECTORS (EXT)
+      cmd->cls = EMUL_NONDATA;
+      cmd->lba = lba;
+      cmd->sectors = count ? count : (extend ? 65536 : 256);
+      cmd->isread = 1;
+      cmd->media = 1;
+      if (lba + cmd->sectors > emul->sectors)
+      {
+        set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_IDNF, lba, count);
+        return;
+      }
+      io_hdr->resid = io_hdr->dxfer_len;
+      break;
+
+    case 0xB0:                    // SMART
+      if (features == 0xD0 || features == 0xD5)
+      {
+        unsigned char data[512];
+
+        memset(data, 0, sizeof(data));
+        if (features == 0xD0)
+          smart_data(emul, data);
+        else if ((lba & 0xFF) == EMUL_LOG_SELFTEST)
+          selftest_log(emul, data);
+        cmd->cls = EMUL_PIO;
+        cmd->isread = 1;
+        cmd->sectors = 1;
+        copy_in(io_hdr, data, sizeof(data));
+      }
+      else if (features == 0xD4 && selftest_execute(emul, lba & 0xFF) != 0)
+      {
+        set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_ABRT, lba, count);
+        return;
+      }
+      break;
+
+    case 0xE7: case 0xEA:         // FLUSH CACHE (EXT)
+      cmd->flush = 1;
+      break;
+
+    case 0x4A:                    // ZAC MANAGEMENT IN
+      if (!emul->zoned || (features & 0xFF) != 0x00 || protocol != SAT_DMA || count * EMUL_SECTOR_SIZE != io_hdr->dxfer_len)
+      {
+        set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_ABRT, lba, count);
+        return;
+      }
+      cmd->cls = EMUL_DMA;
+      cmd->isread = 1;
+      cmd->sectors = count;
+      report_zones(emul, io_hdr, lba, (features >> 8) & 0x3F, (features >> 8) & 0x80);
+      break;
+
+    case 0x9F:                    // ZAC MANAGEMENT OUT
+      if (!emul->zoned || zone_action(emul, features & 0xFF, lba, (features >> 8) & 1) != 0)
+      {
+        set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_ABRT, lba, count);
+        return;
+      }
+      break;
+
+    case 0xEF:                    // SET FEATURES
+      if (features == 0x02 || features == 0x82)
+      {
+        emul->write_cache = features == 0x02;
+        build_identify(emul);
+        if (!emul->write_cache)
+          cmd->flush = 1;
+      }
+      else if (features == 0x05 || features == 0x85)
+      {
+        // APM level 01h ~ FEh
+        if (features == 0x05 && ((count & 0xFF) == 0 || (count & 0xFF) == 0xFF))
+        {
+          set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_ABRT, lba, count);
+          return;
+        }
+        emul->apm_level = features == 0x05 ? count & 0xFF : 0;
+        build_identify(emul);
+        cmd->power = 1;
+      }
+      else if (features == 0x4A)
+      {
+        // EPC, Go To Power Condition and Restore Power Condition Settings
+        unsigned int id = count & 0xFF;
+
+        if ((lba & 0xF) == 0x1 && id != EMUL_MODE_STANDBY_Z && id != EMUL_MODE_STANDBY_Y && id != EMUL_MODE_IDLE_A &&
+            id != EMUL_MODE_IDLE_B && id != EMUL_MODE_IDLE_C)
+        {
+          set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_ABRT, lba, count);
+          return;
+        }
+        if ((lba & 0xF) == 0x1)
+        {
+          if (id <= EMUL_MODE_STANDBY_Y)
+            cmd->flush = 1;
+          emul->power_mode = id;
+        }
+        cmd->power = 1;
+      }
+      break;
+
+    case 0xE0:                    // STANDBY IMMEDIATE, the write cache is written before the spin-down
+      emul->power_mode = EMUL_MODE_STANDBY_Z;
+      cmd->flush = 1;
+      cmd->power = 1;
+      break;
+
+    case 0xE1:                    // IDLE IMMEDIATE
+      emul->power_mode = EMUL_MODE_IDLE;
+      cmd->power = 1;
+      break;
+
+    case 0xE5:                    // CHECK POWER MODE, the mode goes back in COUNT
+      count = emul->power_mode;
+      cmd->power = 1;
+      break;
+
+    default:
+      set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_ABRT, lba, count);
+      return;
+  }
+
+  if (isdata)
+  {
+    cmd->lba = lba;
+    cmd->sectors = count ? count : (extend ? 65536 : 256);
+    cmd->isread = (command == 0x20 || command == 0x24 || command == 0xC4 || command == 0x29 || command == 0xC8 ||
+                   command == 0x25 || command == 0xC7 || command == 0x26 || command == 0x60 || command == 0x2A);
+    cmd->iswrite = !cmd->isread;
+    cmd->fua = command == 0x3D || command == 0xCE || command == 0x3E || (command == 0x61 && (cdb[13] & 0x80));
+    cmd->hipri = (command == 0x60 || command == 0x61) && ((cdb[5] >> 6) & 0x3) == 2;
+    cmd->media = cmd->isread;
+
+    // the SATL rejects a protocol which doesn't fit the command, and a data length which doesn't fit the count
+    if ((cmd->cls == EMUL_PIO || cmd->cls == EMUL_MULTI) && protocol != (cmd->isread ? SAT_PIO_DATAIN : SAT_PIO_DATAOUT))
+    {
+      set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x24, 0x00);
+      return;
+    }
+    if ((cmd->cls == EMUL_DMA || cmd->cls == EMUL_QUEUED) && protocol != SAT_DMA && protocol != SAT_DMA_QUEUED)
+    {
+      set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x24, 0x00);
+      return;
+    }
+    if ((unsigned long)cmd->sectors * EMUL_SECTOR_SIZE != io_hdr->dxfer_len)
+    {
+      set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x24, 0x00);
+      return;
+    }
+    if (lba + cmd->sectors > emul->sectors)
+    {
+      set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_IDNF, lba, count);
+      return;
+    }
+
+    if (cmd->iswrite && zone_write(emul, cmd) != 0)
+    {
+      set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x21, 0x04);    // UNALIGNED WRITE COMMAND
+      return;
+    }
+    if (cmd->isread)
+      media_read(emul, lba, cmd->sectors, io_hdr->dxferp);
+    else if (media_write(emul, lba, cmd->sectors, io_hdr->dxferp) != 0)
+    {
+      set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_ABRT, lba, count);
+      return;
+    }
+  }
+
+  if (emul_inject(emul, io_hdr, cmd) != 0)
+    return;
+
+  // CK_COND asks for the ATA registers even if the command succeeded
+  if (cmd->ck_cond)
+    set_ata_sense(io_hdr, SK_RECOVERED_ERROR, 0x00, 0x1D, ATA_STATUS_GOOD, 0, lba, count);
+}
+
+static unsigned long long scsi_lba16(unsigned char *cdb)
+{
+  unsigned long long lba = 0;
+  int i;
+
+  for (i = 2; i < 10; i++)
+    lba = lba << 8 | cdb[i];
+
+  return lba;
+}
+
+static unsigned int scsi_len16(unsigned char *cdb)
+{
+  return (unsigned int)cdb[10] << 24 | cdb[11] << 16 | cdb[12] << 8 | cdb[13];
+}
+
+static void emul_scsi(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr, unsigned char *cdb, EMUL_CMD *cmd)
+{
+  unsigned char data[32];
+
+  cmd->cls = EMUL_NONDATA;
+
+  switch (cdb[0])
+  {
+    case 0x00:                    // TEST UNIT READY
+      break;
+
+    case 0x12:                    // INQUIRY
+      emul_inquiry(emul, io_hdr, cdb);
+      break;
+
+    case 0x5A:                    // MODE SENSE(10)
+      emul_mode_sense(emul, io_hdr);
+      break;
+
+    case 0x9E:                    // READ CAPACITY(16)
+      if ((cdb[1] & 0x1F) != 0x10)
+      {
+        set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x24, 0x00);
+        break;
+      }
+      memset(data, 0, sizeof(data));
+      put_be32(data, (emul->sectors - 1) >> 32);
+      put_be32(data + 4, (emul->sectors - 1) & 0xFFFFFFFF);
+      put_be32(data + 8, EMUL_SECTOR_SIZE);
+      data[13] = emul->pss;
+      put_be16(data + 14, emul->align_lba);
+      copy_in(io_hdr, data, sizeof(data));
+      break;
+
+    case 0x88:                    // READ(16)
+    case 0x8A:                    // WRITE(16)
+    case 0x8F:                    // VERIFY(16)
+      cmd->lba = scsi_lba16(cdb);
+      cmd->sectors = scsi_len16(cdb);
+      cmd->isread = cdb[0] != 0x8A;
+      cmd->iswrite = cdb[0] == 0x8A;
+      cmd->fua = cdb[0] == 0x8A && (cdb[1] & 0x08);
+      cmd->cls = cdb[0] == 0x8F ? EMUL_NONDATA : EMUL_QUEUED;     // SATL translates to FPDMA
+      cmd->media = cmd->isread;
+
+      if (cmd->lba + cmd->sectors > emul->sectors)
+      {
+        set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x21, 0x00);  // LOGICAL BLOCK ADDRESS OUT OF RANGE
+        break;
+      }
+      if (cdb[0] == 0x8F)
+        break;
+      if ((unsigned long)cmd->sectors * EMUL_SECTOR_SIZE != io_hdr->dxfer_len)
+      {
+        set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x24, 0x00);
+        break;
+      }
+      if (cmd->iswrite && zone_write(emul, cmd) != 0)
+      {
+        set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x21, 0x04);  // UNALIGNED WRITE COMMAND
+        break;
+      }
+      if (cmd->isread)
+        media_read(emul, cmd->lba, cmd->sectors, io_hdr->dxferp);
+      else if (media_write(emul, cmd->lba, cmd->sectors, io_hdr->dxferp) != 0)
+        set_fixed_sense(io_hdr, SK_MEDIUM_ERROR, 0x0C, 0x00);     // WRITE ERROR
+      break;
+
+    case 0x35:                    // SYNCHRONIZE CACHE(10)
+    case 0x91:                    // SYNCHRONIZE CACHE(16)
+      cmd->flush = 1;
+      break;
+
+    default:
+      set_fixed_sense(io_hdr, SK_ILLEGAL_REQUEST, 0x20, 0x00);    // INVALID COMMAND OPERATION CODE
+      break;
+  }
+}
+
+// Whether a write covers whole physical sectors
+static int emul_phys_aligned(EMUL_DEVICE *emul, EMUL_CMD *cmd)
+{
+  unsigned long long mask = (1ULL << emul->pss) - 1;
+
+  return ((cmd->lba + mask + 1 - emul->align_lba) & mask) == 0 && (cmd->sectors & mask) == 0;
+}
+
+// Completion time of the command by the timing model, the state of the device moves on
+static unsigned long long emul_timing(EMUL_DEVICE *emul, EMUL_CMD *cmd, unsigned long long now)
+{
+  unsigned long long overhead;
+  unsigned long long access = 0;
+  unsigned long long xfer;
+  unsigned long long start;
+  unsigned long long done;
+  int queued;
+  int i;
+  int chan = 0;
+
+  xfer = (unsigned long long)cmd->sectors * EMUL_LINK_NS_PER_SECTOR;
+  if (cmd->isread)
+    access = EMUL_READ_ACCESS_NS;
+  if (cmd->rmw)
+    access += EMUL_SMR_RMW_NS;
+  access += cmd->wake_ns;
+  if (cmd->media && emul->slow_lba != EMUL_NO_BAD_LBA && cmd->lba < emul->slow_lba + emul->slow_len &&
+      cmd->lba + cmd->sectors > emul->slow_lba)
+    access += EMUL_SLOW_READ_NS;
+  else if (cmd->iswrite && (cmd->fua || !emul->write_cache))
+    access = EMUL_PROGRAM_NS;
+  else if (cmd->iswrite)
+  {
+    access = EMUL_WRITE_ACCESS_NS;
+    emul->dirty += cmd->sectors;
+  }
+  if (cmd->iswrite && !emul_phys_aligned(emul, cmd))
+    access += EMUL_READ_ACCESS_NS;
+
+  switch (cmd->cls)
+  {
+    case EMUL_PIO:
+      overhead = 30000 + (unsigned long long)cmd->sectors * EMUL_PIO_DRQ_NS;
+      break;
+    case EMUL_MULTI:
+      overhead = 30000 + (unsigned long long)((cmd->sectors + emul->secperdrq - 1) / emul->secperdrq) * EMUL_PIO_DRQ_NS;
+      break;
+    case EMUL_DMA:
+      overhead = 25000;
+      break;
+    case EMUL_QUEUED:
+      overhead = 20000;
+      break;
+    default:
+      overhead = EMUL_NONDATA_NS;
+      xfer = 0;
+      break;
+  }
+
+  if (cmd->flush)
+  {
+    overhead += EMUL_FLUSH_NS + emul->dirty * EMUL_DESTAGE_NS_PER_SECTOR;
+    emul->dirty = 0;
+  }
+
+  queued = cmd->cls == EMUL_QUEUED && !emul->serialize;
+  if (!queued)
+  {
+    // the device is busy with nothing else
+    start = now > emul->busy_until ? now : emul->busy_until;
+    for (i = 0; i < EMUL_CHANNELS; i++)
+    {
+      if (emul->chan_free[i] > start)
+        start = emul->chan_free[i];
+    }
+    if (emul->link_free > start)
+      start = emul->link_free;
+
+    done = start + overhead + access + xfer;
+    emul->busy_until = done;
+    emul->link_free = done;
+    for (i = 0; i < EMUL_CHANNELS; i++)
+      emul->chan_free[i] = done;
+    return done;
+  }
+
+  // queued, media access runs on the first free channel, then the data goes over the shared link
+  for (i = 1; i < EMUL_CHANNELS; i++)
+  {
+    if (emul->chan_free[i] < emul->chan_free[chan])
+      chan = i;
+  }
+  start = now;
+  if (emul->busy_until > start)
+    start = emul->busy_until;
+
+  // high priority only waits for the command the channel is working on, the backlog is pushed back instead
+  if (cmd->hipri)
+  {
+    if (emul->chan_free[chan] > start)
+      start += (emul->chan_free[chan] - start) < EMUL_READ_ACCESS_NS ? (emul->chan_free[chan] - start) : EMUL_READ_ACCESS_NS;
+    done = start + overhead + access;
+    emul->chan_free[chan] = (emul->chan_free[chan] > start ? emul->chan_free[chan] : start) + overhead + access;
+    if (emul->link_free > done)
+    {
+      emul->link_free += xfer;
+      done += EMUL_LINK_NS_PER_SECTOR * EMUL_LINK_FRAME_SECTORS;
+    }
+    else
+      emul->link_free = done + xfer;
+    return done + xfer;
+  }
+
+  if (emul->chan_free[chan] > start)
+    start = emul->chan_free[chan];
+
+  done = start + overhead + access;
+  emul->chan_free[chan] = done;
+  if (emul->link_free > done)
+    done = emul->link_free;
+  done += xfer;
+  emul->link_free = done;
+
+  return done;
+}
+
+// Errors asked for by the spec, on top of a command which went well. Returns 1 if one is injected
+static int emul_inject(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr, EMUL_CMD *cmd)
+{
+  emul->ncommands++;
+
+  // a CRC error on the link, the SATL reports ABORTED COMMAND / INFORMATION UNIT iuCRC ERROR DETECTED
+  if (emul->flaky && emul->ncommands % emul->flaky == 0)
+  {
+    if (cmd->ata)
+      set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x47, 0x03, ATA_STATUS_ERR, ATA_ERROR_ABRT, cmd->lba, cmd->sectors);
+    else
+      set_fixed_sense(io_hdr, SK_ABORTED_COMMAND, 0x47, 0x03);
+    return 1;
+  }
+
+  // UNRECOVERED READ ERROR, every time
+  if (cmd->media && emul->bad_lba != EMUL_NO_BAD_LBA && cmd->lba < emul->bad_lba + emul->bad_len &&
+      cmd->lba + cmd->sectors > emul->bad_lba)
+  {
+    // RC, the data goes to the host as it is
+    if (cmd->continuous)
+      set_ata_sense(io_hdr, SK_RECOVERED_ERROR, 0x00, 0x1D, ATA_STATUS_SE, ATA_ERROR_UNC,
+                    cmd->lba > emul->bad_lba ? cmd->lba : emul->bad_lba, cmd->sectors);
+    else if (cmd->ata)
+      set_ata_sense(io_hdr, SK_MEDIUM_ERROR, 0x11, 0x04, ATA_STATUS_ERR, ATA_ERROR_UNC,
+                    cmd->lba > emul->bad_lba ? cmd->lba : emul->bad_lba, cmd->sectors);
+    else
+      set_fixed_sense(io_hdr, SK_MEDIUM_ERROR, 0x11, 0x00);
+    return 1;
+  }
+
+  return 0;
+}
+
+// Modes the APM timers reached since the last media access
+static void emul_apm(EMUL_DEVICE *emul, unsigned long long now)
+{
+  unsigned long long idle;
+
+  if (emul->apm_level == 0 || emul->apm_level >= 0xFE || emul->power_mode != EMUL_MODE_ACTIVE || now <= emul->media_ns)
+    return;
+
+  idle = now - emul->media_ns;
+  if (emul->apm_level < 0x80 && idle >= EMUL_APM_STANDBY_NS)
+    emul->power_mode = EMUL_MODE_STANDBY_Z;
+  else if (idle >= EMUL_APM_IDLE_NS)
+    emul->power_mode = EMUL_MODE_IDLE_B;
+}
+
+// Time to get back to active out of the power mode
+static unsigned long long emul_wake_ns(EMUL_DEVICE *emul)
+{
+  switch (emul->power_mode)
+  {
+    case EMUL_MODE_STANDBY_Z:
+    case EMUL_MODE_STANDBY_Y:
+      return (unsigned long long)emul->spinup_ms * 1000000;
+    case EMUL_MODE_IDLE:
+    case EMUL_MODE_IDLE_A:
+      return EMUL_WAKE_IDLE_A_NS;
+    case EMUL_MODE_IDLE_B:
+      return EMUL_WAKE_IDLE_B_NS;
+    case EMUL_MODE_IDLE_C:
+      return EMUL_WAKE_IDLE_C_NS;
+    default:
+      return 0;
+  }
+}
+
+// A stream command which runs out of time ends at the limit, stream commands hold the whole device
+static unsigned long long emul_time_limit(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr, EMUL_CMD *cmd,
+                                          unsigned long long limit)
+{
+  int i;
+
+  // it failed before the time ran out, RECOVERED ERROR is only the registers of CK_COND
+  if (io_hdr->status && !cmd->continuous && !(io_hdr->sbp[0] == 0x72 && io_hdr->sbp[1] == SK_RECOVERED_ERROR))
+    return emul->busy_until;
+
+  if (cmd->continuous)
+    set_ata_sense(io_hdr, SK_RECOVERED_ERROR, 0x00, 0x1D, ATA_STATUS_SE, ATA_ERROR_CCTO, cmd->lba, cmd->sectors);
+  else
+    set_ata_sense(io_hdr, SK_ABORTED_COMMAND, 0x00, 0x00, ATA_STATUS_ERR, ATA_ERROR_ABRT | ATA_ERROR_CCTO, cmd->lba,
+                  cmd->sectors);
+
+  emul->busy_until = limit;
+  emul->link_free = limit;
+  for (i = 0; i < EMUL_CHANNELS; i++)
+    emul->chan_free[i] = limit;
+  return limit;
+}
+
+static unsigned long long emul_process(EMUL_DEVICE *emul, struct sg_io_hdr *io_hdr)
+{
+  unsigned char *cdb = io_hdr->cmdp;
+  EMUL_CMD cmd;
+  unsigned long long now = now_ns();
+  unsigned long long done;
+
+  memset(&cmd, 0, sizeof(cmd));
+  io_hdr->status = 0;
+  io_hdr->masked_status = 0;
+  io_hdr->host_status = 0;
+  io_hdr->driver_status = 0;
+  io_hdr->sb_len_wr = 0;
+  io_hdr->resid = 0;
+  io_hdr->info = 0;
+
+  emul_apm(emul, now);
+  if (cdb[0] == 0x85 && io_hdr->cmd_len == 16)
+    emul_ata(emul, io_hdr, cdb, &cmd);
+  else
+    emul_scsi(emul, io_hdr, cdb, &cmd);
+
+  if (!cmd.power && (cmd.media || cmd.iswrite || cmd.flush))
+  {
+    cmd.wake_ns = emul_wake_ns(emul);
+    emul->power_mode = EMUL_MODE_ACTIVE;
+  }
+
+  // ATA PASS-THROUGH injects before it reports the registers of CK_COND
+  if (!cmd.ata && !io_hdr->status)
+    emul_inject(emul, io_hdr, &cmd);
+
+  done = emul_timing(emul, &cmd, now);
+  if (!cmd.power && (cmd.media || cmd.iswrite || cmd.flush))
+    emul->media_ns = done;
+  if (cmd.limit_ns && done - now > cmd.limit_ns)
+    done = emul_time_limit(emul, io_hdr, &cmd, now + cmd.limit_ns);
+
+  if (io_hdr->status)
+    io_hdr->info |= SG_INFO_CHECK;
+
+  return done;
+}
+
+static void wait_until(unsigned long long ns)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  // clock_nanosleep() returns the error rather than setting errno
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+static int emul_execute(int fd, struct sg_io_hdr *io_hdr)
+{
+  EMUL_DEVICE *emul = emul_devices[fd];
+  unsigned long long start = now_ns();
+  unsigned long long done;
+
+  done = emul_process(emul, io_hdr);
+  wait_until(done);
+  // like sg, a difference of a millisecond clock, not a truncated interval, so that its mean is the mean time
+  io_hdr->duration = done / 1000000 - start / 1000000;
+
+  return 0;
+}
+
+static int emul_submit(int fd, struct sg_io_hdr *io_hdr)
+{
+  EMUL_DEVICE *emul = emul_devices[fd];
+  EMUL_PENDING *pending;
+
+  if (emul->npending >= EMUL_MAX_PENDING)
+  {
+    printf("emulator: too many commands in flight\n");
+    return -1;
+  }
+
+  pending = &emul->pending[emul->npending++];
+  pending->io_hdr = io_hdr;
+  pending->result = *io_hdr;
+  pending->done_ns = emul_process(emul, &pending->result);
+  pending->result.duration = pending->done_ns / 1000000 - now_ns() / 1000000;
+
+  return 0;
+}
+
+// Like read() of sg, the header returned is a copy of the submitted one with the status filled in
+static int emul_receive(int fd, struct sg_io_hdr *io_hdr)
+{
+  EMUL_DEVICE *emul = emul_devices[fd];
+  unsigned int first = 0;
+  unsigned int i;
+
+  if (emul->npending == 0)
+    return -1;
+
+  for (i = 1; i < emul->npending; i++)
+  {
+    if (emul->pending[i].done_ns < emul->pending[first].done_ns)
+      first = i;
+  }
+
+  wait_until(emul->pending[first].done_ns);
+  *io_hdr = emul->pending[first].result;
+
+  emul->pending[first] = emul->pending[--emul->npending];
+  return 0;
+}
+
+static int emul_ready(int fd)
+{
+  EMUL_DEVICE *emul = emul_devices[fd];
+  unsigned long long now = now_ns();
+  unsigned int i;
+
+  for (i = 0; i < emul->npending; i++)
+  {
+    if (emul->pending[i].done_ns <= now)
+      return 1;
+  }
+  return 0;
+}
+
+static int emul_submit_batch(int fd, struct sg_io_hdr **io_hdrs, unsigned int n)
+{
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+  {
+    if (emul_submit(fd, io_hdrs[i]) != 0)
+      break;
+  }
+  return i;
+}
+
+// The first completion, then every other one which is completed by then
+static int emul_receive_batch(int fd, struct sg_io_hdr *io_hdrs, unsigned int max)
+{
+  EMUL_DEVICE *emul = emul_devices[fd];
+  unsigned long long now;
+  unsigned int n = 0;
+  unsigned int i = 0;
+
+  if (emul_receive(fd, &io_hdrs[n++]) != 0)
+    return -1;
+
+  now = now_ns();
+  while (n < max && i < emul->npending)
+  {
+    if (emul->pending[i].done_ns <= now)
+    {
+      io_hdrs[n++] = emul->pending[i].result;
+      emul->pending[i] = emul->pending[--emul->npending];
+    }
+    else
+      i++;
+  }
+  return n;
+}
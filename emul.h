@@ -0,0 +1,15 @@
+//
+// Emulated SATA drive behind a SATL, registered as the transport of a fd
+//
+
+#ifndef _EMUL_H_
+#define _EMUL_H_
+
+#define EMUL_PREFIX  "emul"
+
+int  emul_is_path(const char *path);
+int  emul_open(const char *spec);
+void emul_close(int fd);
+int  emul_topology(int fd, char *path, unsigned int len);
+
+#endif
@@ -0,0 +1,249 @@
+//
+// Fast health check.
+// The LBA space is split into strata of equal size and every round reads one random chunk of each stratum, so the
+// sample covers the whole surface evenly however early it stops. With equal strata and equal allocation the
+// stratified estimates are the plain sample proportion and mean.
+// The error rate per read gets a Wilson score interval, which stays meaningful with ZERO errors, the mean latency
+// a normal interval from the running variance. The check stops after a round once the latency interval is within
+// the precision and the error interval is on one side of HEALTH_MAX_ERROR_RATE
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "health.h"
+#include "queue.h"
+#include "stats.h"
+
+#define HEALTH_STRATA           64
+#define HEALTH_MAX_SAMPLES      100000
+#define HEALTH_CHUNK            8           // 4 KiB reads
+#define HEALTH_PRECISION        5
+#define HEALTH_MIN_ROUNDS       4
+#define HEALTH_MAX_ERROR_RATE   0.001
+#define HEALTH_Z                1.96        // 95% two sided
+#define HEALTH_REPORT_NS        1000000000ULL
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+static const char *health_verdict_names[] = {
+  "good",
+  "bad",
+  "unknown"
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+const char *health_verdict_name(HEALTH_VERDICT verdict)
+{
+  return verdict <= HEALTH_UNKNOWN ? health_verdict_names[verdict] : "unknown";
+}
+
+static int health_queued(DEVICE_CONTEXT *dev)
+{
+  return dev->path == PATH_SBC || dev->protocol == RW_DMA_QUEUED || dev->protocol == RW_FPDMA;
+}
+
+// Wilson score interval of errors out of n
+static void wilson(unsigned int errors, unsigned int n, double *low, double *high)
+{
+  double p, z2, center, half;
+
+  if (n == 0)
+  {
+    *low = 0;
+    *high = 1;
+    return;
+  }
+
+  p = (double)errors / n;
+  z2 = HEALTH_Z * HEALTH_Z;
+  center = (p + z2 / (2.0 * n)) / (1 + z2 / n);
+  half = HEALTH_Z * sqrt(p * (1 - p) / n + z2 / (4.0 * n * n)) / (1 + z2 / n);
+  *low = center - half > 0 ? center - half : 0;
+  *high = center + half < 1 ? center + half : 1;
+}
+
+int health_run(DEVICE_CONTEXT *dev, HEALTH_CONFIG *config, HEALTH_RESULT *result)
+{
+  IO_QUEUE *q;
+  IO_REQUEST *req;
+  LAT_STATS lat;
+  char *buffers;
+  unsigned long long capacity = device_capacity(dev);
+  unsigned long long width, slots;
+  unsigned long long start, last_report, now;
+  unsigned int strata = config->strata ? config->strata : HEALTH_STRATA;
+  unsigned int max_samples = config->max_samples ? config->max_samples : HEALTH_MAX_SAMPLES;
+  unsigned int chunk = config->chunk ? config->chunk : HEALTH_CHUNK;
+  double precision = (config->precision ? config->precision : HEALTH_PRECISION) / 100.0;
+  unsigned int depth = 1;
+  unsigned int sent = 0, done = 0, errors = 0;
+  unsigned int min_good;
+  double mean = 0, m2 = 0;        // running mean and sum of squared deviations in microseconds
+  double err_low = 0, err_high = 1, ci = 0;
+  unsigned long bytes;
+
+  memset(result, 0, sizeof(HEALTH_RESULT));
+  result->verdict = HEALTH_UNKNOWN;
+
+  chunk = device_align_sectors(dev, chunk);   // whole physical sectors within one command
+  if (chunk == 0)
+  {
+    printf("ERROR, %s: %u sectors per command can't hold a physical sector of %u\n", __func__, dev->max_sectors,
+           dev->phys_sectors);
+    return -1;
+  }
+  if (capacity < (unsigned long long)strata * chunk)
+  {
+    printf("ERROR, %s: %llu sectors are too few for %u strata\n", __func__, capacity, strata);
+    return -1;
+  }
+  width = capacity / strata;
+  slots = width / chunk;
+  // whole rounds only, so that every stratum has the same weight
+  max_samples = max_samples < strata ? strata : max_samples / strata * strata;
+
+  // with ZERO errors the Wilson upper bound is z^2 / (n + z^2), fewer samples can never be good
+  min_good = (unsigned int)(HEALTH_Z * HEALTH_Z * (1 - HEALTH_MAX_ERROR_RATE) / HEALTH_MAX_ERROR_RATE) + 1;
+  min_good = (min_good + strata - 1) / strata * strata;
+  if (max_samples < min_good)
+  {
+    // a budget given with --samples is kept, the check can then only find bad or stay unknown
+    if (config->max_samples)
+      printf("%u samples can't show an error rate below %.0e, the verdict is bad or unknown, %u samples are needed "
+             "for good\n", max_samples, HEALTH_MAX_ERROR_RATE, min_good);
+    else
+    {
+      printf("%u samples can't show an error rate below %.0e, up to %u samples\n", max_samples,
+             HEALTH_MAX_ERROR_RATE, min_good);
+      max_samples = min_good;
+    }
+  }
+
+  if (health_queued(dev))
+  {
+    depth = IOQ_MAX_DEPTH;
+    if (dev->path == PATH_ATA && (unsigned int)dev->ata.queuedepth < depth)
+      depth = dev->ata.queuedepth;
+    if (config->max_depth && config->max_depth < depth)
+      depth = config->max_depth;
+  }
+
+  q = (IO_QUEUE *)malloc(sizeof(IO_QUEUE));
+  bytes = (unsigned long)chunk * dev->sector_size;
+  buffers = (char *)calloc(depth, bytes);
+  if (q == NULL || buffers == NULL || ioq_init(q, dev, depth) != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(q);
+    free(buffers);
+    return -1;
+  }
+  stats_reset(&lat);
+
+  printf("health check of %llu sectors, %u strata, reads of %u sectors, queue depth %u, up to %u samples\n",
+         capacity, strata, chunk, depth, max_samples);
+
+  start = now_ns();
+  last_report = start;
+  while (done < max_samples)
+  {
+    // sample k reads stratum k % strata, so a round is strata samples in a row
+    while (sent < max_samples && (req = ioq_get(q)) != NULL)
+    {
+      req->isread = 1;
+      req->startlba = device_align_down(dev, (sent % strata) * width + (stats_random() % slots) * chunk);
+      req->sectors = chunk;
+      req->databuffer = buffers + req->tag * bytes;
+      sent++;
+
+      if (ioq_submit(q, req) != 0)
+      {
+        printf("ERROR, %s: lba 0x%lx, sectors %u can't be sent\n", __func__, req->startlba, req->sectors);
+        ioq_put(q, req);
+        ioq_drain(q);
+        free(buffers);
+        free(q);
+        return -1;
+      }
+    }
+
+    req = ioq_reap(q);
+    if (req == NULL)
+      break;
+    done++;
+
+    {
+      unsigned long long ns = req->complete_ns - req->submit_ns;
+      double us = ns / 1e3;
+      double delta = us - mean;
+
+      stats_add(&lat, ns);
+      mean += delta / done;
+      m2 += delta * (us - mean);
+      if (req->status != 0)
+      {
+        errors++;
+        if (isDebug)
+          printf("DEBUG, lba 0x%lx, sectors %u failed\n", req->startlba, req->sectors);
+      }
+    }
+    ioq_put(q, req);
+
+    now = now_ns();
+    if (now - last_report >= HEALTH_REPORT_NS)
+    {
+      printf("health %u samples, %u errors, mean %.1f us\n", done, errors, mean);
+      last_report = now;
+    }
+
+    // the stop rule is only checked at the end of a round
+    if (done % strata || done < strata * HEALTH_MIN_ROUNDS)
+      continue;
+
+    wilson(errors, done, &err_low, &err_high);
+    ci = HEALTH_Z * sqrt(m2 / (done - 1) / done);
+    if (ci > mean * precision)
+      continue;
+    if (err_high < HEALTH_MAX_ERROR_RATE)
+    {
+      result->verdict = HEALTH_GOOD;
+      break;
+    }
+    if (err_low > HEALTH_MAX_ERROR_RATE)
+    {
+      result->verdict = HEALTH_BAD;
+      break;
+    }
+  }
+  ioq_drain(q);
+  free(buffers);
+  free(q);
+
+  wilson(errors, done, &err_low, &err_high);
+  result->samples = done;
+  result->errors = errors;
+  result->error_low = err_low;
+  result->error_high = err_high;
+  result->mean_us = mean;
+  result->mean_ci_us = done > 1 ? HEALTH_Z * sqrt(m2 / (done - 1) / done) : 0;
+  result->p50_us = stats_percentile(&lat, 50) / 1e3;
+  result->p99_us = stats_percentile(&lat, 99) / 1e3;
+  result->seconds = (now_ns() - start) / 1e9;
+
+  printf("health %s, %u samples in %.3f s, %u errors\n", health_verdict_name(result->verdict), done, result->seconds,
+         errors);
+  printf("error rate per read %.2e, 95%% interval %.2e ~ %.2e, limit %.0e\n", done ? (double)errors / done : 0,
+         err_low, err_high, HEALTH_MAX_ERROR_RATE);
+  printf("latency mean %.1f +- %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n", result->mean_us, result->mean_ci_us,
+         result->p50_us, result->p99_us, lat.max / 1e3);
+
+  return 0;
+}
@@ -0,0 +1,40 @@
+//
+// Fast health check, reads of a stratified random sample of LBAs with early stop
+//
+
+#ifndef _HEALTH_H_
+#define _HEALTH_H_
+
+#include "device.h"
+
+typedef enum _HEALTH_VERDICT {
+  HEALTH_GOOD = 0,       // error rate is below HEALTH_MAX_ERROR_RATE with 95% confidence
+  HEALTH_BAD,            // error rate is above it with 95% confidence
+  HEALTH_UNKNOWN         // the sample ran out before either
+} HEALTH_VERDICT;
+
+typedef struct _HEALTH_CONFIG {
+  unsigned int strata;            // ZERO : HEALTH_STRATA
+  unsigned int max_samples;       // ZERO : HEALTH_MAX_SAMPLES
+  unsigned int chunk;             // sectors per read, ZERO : HEALTH_CHUNK
+  unsigned int precision;         // half width of the confidence interval of the mean latency in percent, ZERO : 5
+  unsigned int max_depth;         // ZERO : queue depth of the device
+} HEALTH_CONFIG;
+
+typedef struct _HEALTH_RESULT {
+  unsigned int samples;
+  unsigned int errors;
+  double error_low;               // 95% confidence interval of the error rate
+  double error_high;
+  double mean_us;                 // mean latency and the half width of its 95% confidence interval
+  double mean_ci_us;
+  double p50_us;
+  double p99_us;
+  double seconds;
+  HEALTH_VERDICT verdict;
+} HEALTH_RESULT;
+
+int  health_run(DEVICE_CONTEXT *dev, HEALTH_CONFIG *config, HEALTH_RESULT *result);
+const char *health_verdict_name(HEALTH_VERDICT verdict);
+
+#endif
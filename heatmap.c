@@ -0,0 +1,292 @@
+//
+// LBA latency heatmap.
+// The range is split into regions of equal size, every command is counted in the region of its LBA and in a
+// power of 2 latency bucket. Commands go one at a time by default so that the latency is the service time of
+// the drive and not the wait behind other commands.
+// A region is an outlier when its mean latency is HEAT_OUTLIER_FACTOR times the one of the typical region (the
+// median of the region means), or when HEAT_SLOW_PERCENT of its commands are HEAT_SLOW_FACTOR times slower than
+// the median command so far.
+// Weak heads and marginal media show as slow reads, the drive retries internally long before a read fails
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heatmap.h"
+#include "queue.h"
+#include "stats.h"
+
+#define HEAT_DEFAULT_REGIONS  100
+#define HEAT_CHUNK            128
+#define HEAT_OUTLIER_FACTOR   3
+#define HEAT_SLOW_FACTOR      10
+#define HEAT_SLOW_PERCENT     1
+#define HEAT_SLOW_MIN         2       // one slow command may be the host, not the drive
+#define HEAT_REPORT_NS        1000000000ULL
+#define HEAT_MEDIAN_INTERVAL  64      // commands between updates of the slow threshold
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static unsigned int heat_bucket(unsigned long long ns)
+{
+  unsigned long long us = ns / 1000;
+  unsigned int bucket;
+
+  if (us < 2)
+    return 0;
+  bucket = 63 - __builtin_clzll(us);
+  return bucket < HEAT_LAT_BUCKETS ? bucket : HEAT_LAT_BUCKETS - 1;
+}
+
+// Lower bound of the bucket in microseconds
+static unsigned long long heat_bucket_us(unsigned int bucket)
+{
+  return bucket ? 1ULL << bucket : 0;
+}
+
+static int heat_queued(DEVICE_CONTEXT *dev)
+{
+  return dev->path == PATH_SBC || dev->protocol == RW_DMA_QUEUED || dev->protocol == RW_FPDMA;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+// Mean latency of the typical region, the median of the region means
+static double heat_baseline(HEAT_REGION *regions, unsigned int nregions)
+{
+  double *means;
+  double baseline;
+  unsigned int i, n = 0;
+
+  means = (double *)malloc(nregions * sizeof(double));
+  if (means == NULL)
+    return 0;
+
+  for (i = 0; i < nregions; i++)
+  {
+    if (regions[i].commands)
+      means[n++] = (double)regions[i].sum_ns / regions[i].commands;
+  }
+  qsort(means, n, sizeof(double), compare_double);
+  baseline = n ? means[n / 2] : 0;
+  free(means);
+
+  return baseline;
+}
+
+static int write_csv(const char *path, HEAT_REGION *regions, unsigned int nregions,
+                     unsigned long long startlba, unsigned long long span)
+{
+  FILE *fp;
+  unsigned int i, b;
+
+  fp = fopen(path, "w");
+  if (fp == NULL)
+  {
+    printf("ERROR, %s: can't open %s\n", __func__, path);
+    return -1;
+  }
+
+  fprintf(fp, "region,startlba,endlba,commands,errors,slow,mean_us,max_us");
+  for (b = 0; b < HEAT_LAT_BUCKETS; b++)
+    fprintf(fp, ",us_%llu", heat_bucket_us(b));
+  fprintf(fp, "\n");
+
+  for (i = 0; i < nregions; i++)
+  {
+    HEAT_REGION *r = &regions[i];
+
+    fprintf(fp, "%u,%llu,%llu,%u,%u,%u,%.1f,%.1f", i, startlba + span * i / nregions,
+            startlba + span * (i + 1) / nregions - 1, r->commands, r->errors, r->slow,
+            r->commands ? r->sum_ns / 1e3 / r->commands : 0, r->max_ns / 1e3);
+    for (b = 0; b < HEAT_LAT_BUCKETS; b++)
+      fprintf(fp, ",%u", r->buckets[b]);
+    fprintf(fp, "\n");
+  }
+
+  fclose(fp);
+  printf("heatmap of %u regions written to %s\n", nregions, path);
+  return 0;
+}
+
+int heatmap_run(DEVICE_CONTEXT *dev, HEAT_CONFIG *config)
+{
+  IO_QUEUE *q;
+  IO_REQUEST *req;
+  HEAT_REGION *regions;
+  LAT_STATS lat;
+  char *buffers = NULL;
+  unsigned long long capacity = device_capacity(dev);
+  unsigned long long startlba = config->startlba;
+  unsigned long long span, slots, lba = startlba;
+  unsigned long long start, last_report, now;
+  unsigned long long slow_ns = 0;
+  unsigned int nregions = config->regions ? config->regions : HEAT_DEFAULT_REGIONS;
+  unsigned int chunk = config->chunk ? config->chunk : HEAT_CHUNK;
+  unsigned int depth = config->depth ? config->depth : 1;
+  unsigned int sent = 0, done = 0, total, errors = 0, outliers = 0;
+  unsigned int isverify = config->isverify;
+  unsigned int i;
+  unsigned long bytes;
+  double baseline;
+
+  if (capacity == 0 || startlba >= capacity)
+  {
+    printf("ERROR, %s: start lba 0x%llx is out of the device\n", __func__, startlba);
+    return -1;
+  }
+  span = config->sectors && startlba + config->sectors < capacity ? config->sectors : capacity - startlba;
+  chunk = device_align_sectors(dev, chunk);   // whole physical sectors within one command
+  if (chunk == 0)
+  {
+    printf("ERROR, %s: %u sectors per command can't hold a physical sector of %u\n", __func__, dev->max_sectors,
+           dev->phys_sectors);
+    return -1;
+  }
+  if (chunk > span)
+    chunk = span;
+  slots = span / chunk;
+  if (nregions > HEAT_MAX_REGIONS)
+    nregions = HEAT_MAX_REGIONS;
+  if (nregions > slots)
+    nregions = slots;
+  total = config->samples ? config->samples : (span + chunk - 1) / chunk;
+
+  if (!heat_queued(dev))
+    depth = 1;
+  else if (depth > IOQ_MAX_DEPTH)
+    depth = IOQ_MAX_DEPTH;
+  // VERIFY of ATA can't go with queued commands, see bgjob.c
+  if (isverify && depth > 1 && dev->path == PATH_ATA)
+    isverify = 0;
+
+  regions = (HEAT_REGION *)calloc(nregions, sizeof(HEAT_REGION));
+  q = (IO_QUEUE *)malloc(sizeof(IO_QUEUE));
+  bytes = (unsigned long)chunk * dev->sector_size;
+  if (!isverify)
+    buffers = (char *)calloc(depth, bytes);
+  if (regions == NULL || q == NULL || (!isverify && buffers == NULL) || ioq_init(q, dev, depth) != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(regions);
+    free(q);
+    free(buffers);
+    return -1;
+  }
+  stats_reset(&lat);
+
+  printf("heatmap lba 0x%llx ~ 0x%llx, %u regions, %u %s commands of %u sectors%s, queue depth %u\n", startlba,
+         startlba + span - 1, nregions, total, isverify ? "verify" : "read", chunk,
+         config->samples ? " at random lba" : " in lba order", depth);
+
+  start = now_ns();
+  last_report = start;
+  while (done < total)
+  {
+    while (sent < total && (req = ioq_get(q)) != NULL)
+    {
+      if (config->samples)
+        lba = startlba + (stats_random() % slots) * chunk;
+      req->isread = 1;
+      req->isverify = isverify;
+      req->startlba = lba;
+      req->sectors = startlba + span - lba < chunk ? startlba + span - lba : chunk;
+      req->databuffer = isverify ? NULL : buffers + req->tag * bytes;
+      lba += req->sectors;
+      sent++;
+
+      if (ioq_submit(q, req) != 0)
+      {
+        printf("ERROR, %s: lba 0x%lx, sectors %u can't be sent\n", __func__, req->startlba, req->sectors);
+        ioq_put(q, req);
+        ioq_drain(q);
+        free(regions);
+        free(buffers);
+        free(q);
+        return -1;
+      }
+    }
+
+    req = ioq_reap(q);
+    if (req == NULL)
+      break;
+    done++;
+
+    {
+      HEAT_REGION *r = &regions[(req->startlba - startlba) * nregions / span];
+      unsigned long long ns = req->complete_ns - req->submit_ns;
+
+      r->commands++;
+      r->sum_ns += ns;
+      if (ns > r->max_ns)
+        r->max_ns = ns;
+      r->buckets[heat_bucket(ns)]++;
+      if (slow_ns && ns >= slow_ns)
+        r->slow++;
+      stats_add(&lat, ns);
+      if (lat.count % HEAT_MEDIAN_INTERVAL == 0)
+        slow_ns = stats_percentile(&lat, 50) * HEAT_SLOW_FACTOR;
+      if (req->status != 0)
+      {
+        r->errors++;
+        errors++;
+        if (isDebug)
+          printf("DEBUG, lba 0x%lx, sectors %u failed\n", req->startlba, req->sectors);
+      }
+    }
+    ioq_put(q, req);
+
+    now = now_ns();
+    if (now - last_report >= HEAT_REPORT_NS)
+    {
+      printf("heatmap %.1f%%, %u commands, p99 %.1f us\n", 100.0 * done / total, done, stats_percentile(&lat, 99) / 1e3);
+      last_report = now;
+    }
+  }
+  ioq_drain(q);
+  free(buffers);
+  free(q);
+
+  baseline = heat_baseline(regions, nregions);
+
+  printf("heatmap done, %u commands, %u errors, %.3f s, latency avg %.1f us, p99 %.1f us, max %.1f us\n", done, errors,
+         (now_ns() - start) / 1e9, stats_mean(&lat) / 1e3, stats_percentile(&lat, 99) / 1e3, lat.max / 1e3);
+  printf("typical region mean %.1f us\n", baseline / 1e3);
+
+  for (i = 0; i < nregions; i++)
+  {
+    HEAT_REGION *r = &regions[i];
+    double mean;
+
+    if (r->commands == 0)
+      continue;
+    mean = (double)r->sum_ns / r->commands;
+    if (mean < baseline * HEAT_OUTLIER_FACTOR && (r->slow < HEAT_SLOW_MIN || r->slow * 100 < r->commands * HEAT_SLOW_PERCENT) &&
+        r->errors == 0)
+      continue;
+
+    printf("outlier region %u lba 0x%llx ~ 0x%llx, mean %.1f us (%.1fx), %u of %u commands slow, %u errors, max %.1f us\n",
+           i, startlba + span * i / nregions, startlba + span * (i + 1) / nregions - 1, mean / 1e3,
+           baseline ? mean / baseline : 0, r->slow, r->commands, r->errors, r->max_ns / 1e3);
+    outliers++;
+  }
+  printf("%u outlier regions\n", outliers);
+
+  if (config->output)
+    write_csv(config->output, regions, nregions, startlba, span);
+
+  free(regions);
+  return outliers || errors ? 1 : 0;
+}
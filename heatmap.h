@@ -0,0 +1,35 @@
+//
+// Latency heatmap over the LBA space, region x latency bucket
+//
+
+#ifndef _HEATMAP_H_
+#define _HEATMAP_H_
+
+#include "device.h"
+
+#define HEAT_MAX_REGIONS   4096
+#define HEAT_LAT_BUCKETS   24       // power of 2 microseconds, [1 us, 2 us) ... [4 s, ...)
+
+typedef struct _HEAT_CONFIG {
+  unsigned long long startlba;
+  unsigned long long sectors;     // ZERO : to the end of the device
+  unsigned int regions;           // ZERO : HEAT_DEFAULT_REGIONS
+  unsigned int samples;           // commands at random LBAs, ZERO : sweep the whole range in LBA order
+  unsigned int chunk;             // sectors per command, ZERO : HEAT_CHUNK
+  unsigned int depth;             // ZERO : 1, latency of a command alone
+  int isverify;                   // 1 : VERIFY instead of READ
+  const char *output;             // CSV file of the heatmap, NULL : none
+} HEAT_CONFIG;
+
+typedef struct _HEAT_REGION {
+  unsigned int commands;
+  unsigned int errors;
+  unsigned int slow;              // commands HEAT_SLOW_FACTOR times slower than the median command
+  unsigned long long sum_ns;
+  unsigned long long max_ns;
+  unsigned int buckets[HEAT_LAT_BUCKETS];
+} HEAT_REGION;
+
+int heatmap_run(DEVICE_CONTEXT *dev, HEAT_CONFIG *config);
+
+#endif
@@ -11,67 +11,235 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 #include <time.h>
 
 #include "command.h"
+#include "device.h"
+#include "emul.h"
+#include "bench.h"
+#include "bgjob.h"
+#include "retry.h"
+#include "heatmap.h"
+#include "health.h"
+#include "zone.h"
+#include "stream.h"
+#include "power.h"
+#include "cpucost.h"
+#include "breakdown.h"
+#include "metrics.h"
+#include "transport.h"
+#include "multi.h"
+#include "selftest.h"
+#include "blob.h"
+#include "smartdb.h"
+
+// Calibrated protocol per drive and SATL, see device_select_protocol()
+#define PROTOCOL_CACHE_FILE  "/var/tmp/scsidevinfo.protocol"
+
+// Long options without a short one
+#define OPT_BENCH_SIZES     256
+#define OPT_BENCH_DEPTHS    257
+#define OPT_BENCH_COMMANDS  258
+#define OPT_BENCH_WRITE     259
+#define OPT_GROUPS          260
+#define OPT_WRITE_CACHE     261
+#define OPT_SLO_US          262
+#define OPT_MAX_QD          263
+#define OPT_RETRIES         264
+#define OPT_TIMEOUT_MS      265
+#define OPT_REGIONS         266
+#define OPT_SAMPLES         267
+#define OPT_HEAT_VERIFY     268
+#define OPT_PRECISION       269
+#define OPT_ZONE_ACTION     270
+#define OPT_ALL_ZONES       271
+#define OPT_STREAM_ID       272
+#define OPT_DEADLINE_US     273
+#define OPT_CONTINUOUS      274
+#define OPT_STREAM_RATE     275
+#define OPT_REPEATS         276
+#define OPT_DWELL_MS        277
+#define OPT_APM_LEVELS      278
+#define OPT_BLKDEV          279
+#define OPT_METRICS         280
+#define OPT_METRICS_SOCKET  281
+#define OPT_LINK_LIMIT      282
+#define OPT_SELF_TEST       283
+#define OPT_PER_ENCLOSURE   284
+#define OPT_STORE           285
+#define OPT_SERIAL          286
+#define OPT_RANGE           287
+#define OPT_ATTR            288
+#define OPT_INTERVAL_S      289
 
 typedef enum _OPS {
   OP_READ = 0,
   OP_WRITE,
-  OP_IDENTIFY
+  OP_IDENTIFY,
+  OP_VPD,
+  OP_VERIFY,
+  OP_BENCH,
+  OP_DURABLE,
+  OP_PRIORITY,
+  OP_SCAN,
+  OP_WIPE,
+  OP_HEATMAP,
+  OP_HEALTH,
+  OP_ZONES,
+  OP_ZONE_WRITE,
+  OP_STREAM,
+  OP_STREAM_WRITE,
+  OP_POWER,
+  OP_CPU,
+  OP_BREAKDOWN,
+  OP_MULTISCAN,
+  OP_SELFTEST,
+  OP_PARSE,
+  OP_SMARTLOG,
+  OP_SMARTQUERY
 } OPS;
 
 typedef struct _PARAMETERS {
-  char dev_path[256];
+  char dev_path[256];             // the first -d
+  char dev_paths[MULTI_MAX_DEVICES][256];
+  unsigned int ndevs;             // -d given, more than one only for the multi scan and self-tests
   OPS  operation;
   unsigned long startlba;
+  unsigned int sectors;
+  int sectors_given;              // -n is given, otherwise background jobs run to the end of the device
+  CMD_PATH path;
+  RW_PROTOCOL protocol;
+  char protocol_cache[256];
+  BENCH_CONFIG bench;
+  char output[256];
+  unsigned int flags;             // RW_FLAG_* of read/write
+  int write_cache;                // -1 : unchanged, 0 : disable, 1 : enable
+  unsigned int slo_us;            // p99 latency target of background jobs, ZERO : none
+  unsigned int max_qd;            // queue depth limit of background jobs, ZERO : device queue depth
+  unsigned int regions;           // LBA regions of the heatmap, strata of the health check, ZERO : default
+  unsigned int samples;           // commands of the heatmap, limit of the health check, per stage of the cpu cost,
+                                  // ZERO : default
+  unsigned int heat_verify;
+  unsigned int precision;         // percent of the health check, ZERO : default
+  unsigned int zone_action;       // ZAC_* applied before the zone report, ZERO : none
+  unsigned int all_zones;
+  unsigned int stream_id;
+  unsigned int deadline_us;       // time limit of stream commands, ZERO : default
+  unsigned int continuous;
+  unsigned int stream_rate;       // MB/s of the stream, ZERO : unpaced
+  unsigned int repeats;           // transitions per power state, ZERO : default
+  unsigned int dwell_ms;          // time under an APM level, ZERO : default
+  unsigned int apm_levels[BENCH_MAX_POINTS];
+  unsigned int napm;
+  const char *metrics;            // OpenMetrics file written at exit and on SIGUSR1, NULL : none
+  const char *metrics_socket;     // unix socket the metrics are served on, NULL : none
+  TOPO_LIMIT link_limits[TOPO_MAX_LIMITS];
+  unsigned int nlink_limits;
+  unsigned int self_test;         // SELFTEST_* subcommand
+  unsigned int per_enclosure;     // self-tests at once per enclosure, ZERO : default
+  const char *store;              // directory of the SMART time series
+  const char *serial;             // drive of the SMART query, NULL : all of them
+  unsigned long long from;        // time range of the SMART query in seconds since the epoch, ZERO : open
+  unsigned long long to;
+  unsigned int attr;              // attribute of the SMART query, ZERO : all of them
+  unsigned int interval_s;        // between SMART samples
 } PARAMETER;
 
-typedef struct _ATA_FEATURE {
-  int isata;
-  int packet_feat;
-  int cmdset;
-  int ext_feat;
-  long long totalsec;
-  int tcq_feat;
-  int ncq_feat;
-  int queuedepth;
-  int stream_feat;
-  int secperdrq;
-} ATA_FEATURE;
-
 ///////////////
 // PROTOTYPES
 ///////////////
 void parse_options(PARAMETER *param, int argc, char **argv);
 void print_usage(void);
 void scsi_dev(char* const dev_path);
+int  open_device(const char *dev_path);
+void close_device(int fd, const char *dev_path);
 int  check_file_state(int fd);
 void parse_identify_data(unsigned char *buffer, unsigned int len);
-void set_ata_feat(void *buffer, unsigned int len);
-void get_identifydata(int fd);
+void set_ata_feat(ATA_FEATURE *feat, void *buffer, unsigned int len);
+int  get_identifydata(DEVICE_CONTEXT *dev);
 void list_identifydata(int fd);
 void parse_smart_data(unsigned char *buffer, unsigned int len);
 void get_smartdata(int fd);
 void get_smartlogdir(int fd);
 void parse_smart_log(unsigned char *buffer, unsigned int len);
-void rw_data(int fd);
+void rw_data(DEVICE_CONTEXT *dev);
+void list_vpddata(int fd);
+void verify_data(DEVICE_CONTEXT *dev);
+int  open_data_path(DEVICE_CONTEXT *dev);
+void bench_data(DEVICE_CONTEXT *dev);
+void background_job(DEVICE_CONTEXT *dev);
+void latency_heatmap(DEVICE_CONTEXT *dev);
+void health_check(DEVICE_CONTEXT *dev);
+void zone_report_data(DEVICE_CONTEXT *dev);
+void zone_write_data(DEVICE_CONTEXT *dev);
+void stream_data(DEVICE_CONTEXT *dev);
+void power_data(DEVICE_CONTEXT *dev);
+void cpu_data(DEVICE_CONTEXT *dev);
+void breakdown_data(DEVICE_CONTEXT *dev);
+int  open_devices(DEVICE_CONTEXT *dev, DEVICE_CONTEXT **devs, unsigned int *ndevs, int data_path);
+void close_devices(DEVICE_CONTEXT **devs, unsigned int ndevs);
+void multi_data(DEVICE_CONTEXT *dev);
+void selftest_data(DEVICE_CONTEXT *dev);
+void smartlog_data(DEVICE_CONTEXT *dev);
+void smartquery_data(void);
 
 ///////////////
 // LOCALS
 ///////////////
 static int lasterror;
-const char* const short_options = "hd:o:s:D";
+const char* const short_options = "hd:o:s:n:P:p:C:O:FD";
 const struct option long_options[] = {
   {"help", 0, NULL, 'h'},
   {"devpath", 1, NULL, 'd'},
   {"operate", 1, NULL, 'o'},
   {"startlba", 1, NULL, 's'},
-  {"debug", 0, NULL, 'D'}
+  {"sectors", 1, NULL, 'n'},
+  {"path", 1, NULL, 'P'},
+  {"protocol", 1, NULL, 'p'},
+  {"protocol-cache", 1, NULL, 'C'},
+  {"output", 1, NULL, 'O'},
+  {"bench-sizes", 1, NULL, OPT_BENCH_SIZES},
+  {"bench-depths", 1, NULL, OPT_BENCH_DEPTHS},
+  {"bench-commands", 1, NULL, OPT_BENCH_COMMANDS},
+  {"bench-write", 0, NULL, OPT_BENCH_WRITE},
+  {"fua", 0, NULL, 'F'},
+  {"groups", 1, NULL, OPT_GROUPS},
+  {"blkdev", 1, NULL, OPT_BLKDEV},
+  {"metrics", 1, NULL, OPT_METRICS},
+  {"metrics-socket", 1, NULL, OPT_METRICS_SOCKET},
+  {"link-limit", 1, NULL, OPT_LINK_LIMIT},
+  {"self-test", 1, NULL, OPT_SELF_TEST},
+  {"per-enclosure", 1, NULL, OPT_PER_ENCLOSURE},
+  {"store", 1, NULL, OPT_STORE},
+  {"serial", 1, NULL, OPT_SERIAL},
+  {"range", 1, NULL, OPT_RANGE},
+  {"attr", 1, NULL, OPT_ATTR},
+  {"interval-s", 1, NULL, OPT_INTERVAL_S},
+  {"write-cache", 1, NULL, OPT_WRITE_CACHE},
+  {"slo-us", 1, NULL, OPT_SLO_US},
+  {"max-qd", 1, NULL, OPT_MAX_QD},
+  {"retries", 1, NULL, OPT_RETRIES},
+  {"timeout-ms", 1, NULL, OPT_TIMEOUT_MS},
+  {"regions", 1, NULL, OPT_REGIONS},
+  {"samples", 1, NULL, OPT_SAMPLES},
+  {"heat-verify", 0, NULL, OPT_HEAT_VERIFY},
+  {"precision", 1, NULL, OPT_PRECISION},
+  {"zone-action", 1, NULL, OPT_ZONE_ACTION},
+  {"all-zones", 0, NULL, OPT_ALL_ZONES},
+  {"stream-id", 1, NULL, OPT_STREAM_ID},
+  {"deadline-us", 1, NULL, OPT_DEADLINE_US},
+  {"continuous", 0, NULL, OPT_CONTINUOUS},
+  {"stream-rate", 1, NULL, OPT_STREAM_RATE},
+  {"repeats", 1, NULL, OPT_REPEATS},
+  {"dwell-ms", 1, NULL, OPT_DWELL_MS},
+  {"apm-levels", 1, NULL, OPT_APM_LEVELS},
+  {"debug", 0, NULL, 'D'},
+  {NULL, 0, NULL, 0}
 };
 PARAMETER scsi_param;
-ATA_FEATURE ata_feat;
+DEVICE_CONTEXT scsi_ctx;
 
 extern unsigned int isDebug;
 ///////////////
@@ -84,20 +252,94 @@ int main(int argc, char* argv[])
 
   parse_options(&scsi_param, argc, argv);
 
+  if ((scsi_param.metrics || scsi_param.metrics_socket) && metrics_open(scsi_param.metrics, scsi_param.metrics_socket) != 0)
+    exit(-1);
+
+  // captured IDENTIFY / SMART data, there's no device
+  if (scsi_param.operation == OP_PARSE)
+    return blob_parse(scsi_param.dev_path, scsi_param.output[0] ? scsi_param.output : NULL) == 0 ? 0 : -1;
+  if (scsi_param.operation == OP_SMARTQUERY)
+  {
+    smartquery_data();
+    return 0;
+  }
+
   scsi_dev(scsi_param.dev_path);
 
+  metrics_close();
+
   return 0;
 }
 
 void print_usage(void)
 {
   printf("  -h  --help          Display usage information\n");
-  printf("  -d  --devpath       Specify test scsi device path\n");
-  printf("  -o  --operate=r/w/i Specify read/write operetion\n");
+  printf("  -d  --devpath       Specify test scsi device path, %s[:size=MiB,qd=,serialize=,maxxfer=,bad=,badlen=,flaky=,slow=,slowlen=,zoned=1|2,zonesz=MiB,topo=host0/port-0:0/expander-0:0,selftest=ms] for the emulated drive\n", EMUL_PREFIX);
+  printf("  -o  --operate=r/w/i/v/verify/bench/durable/prio/scan/wipe/heatmap/health/zones/zonewrite/stream/streamwrite/power/cpu/breakdown/multiscan/selftest/parse/smartlog/smartquery Specify read/write/identify/vpd/verify/benchmark/durable write/priority benchmark/scan/wipe/latency heatmap/health check/zone report/zone write/stream read/stream write/power state profile/host cpu cost per command/kernel and device time breakdown/multi-device scan/SMART self-test/captured IDENTIFY and SMART data parse/SMART sampling to a store/store query operetion\n");
   printf("  -s  --startlba      Specify startlba to read/write\n");
+  printf("  -n  --sectors       Specify sectors to read/write, split by the max transfer of the device\n");
+  printf("  -P  --path=ata/sbc  Force ATA pass-through or native SBC commands for data transfer, auto by default\n");
+  printf("  -p  --protocol      pio/multi/dma/dmaq/fpdma protocol on ATA path, auto picks the fastest by calibration\n");
+  printf("  -C  --protocol-cache File of calibrated protocols, %s by default, none to calibrate every time\n", PROTOCOL_CACHE_FILE);
+  printf("  -O  --output        File of the benchmark table (CSV), stdout by default, CSV of parse, which takes a file\n");
+  printf("                      or directory of captured 512-byte IDENTIFY / SMART data as -d\n");
+  printf("      --bench-sizes   Sectors per command of the benchmark, e.g. 1,8,64,256\n");
+  printf("      --bench-depths  Queue depths of the benchmark, e.g. 1,4,32, only queued protocols go beyond 1\n");
+  printf("      --bench-commands Commands per size and depth\n");
+  printf("      --bench-write   Benchmark with writes, it destroys the data\n");
+  printf("      --groups        Writes per FLUSH CACHE of the durable write benchmark, e.g. 1,8,64,256\n");
+  printf("      --blkdev        Block device of the io_uring row of the benchmark, the one of the sg device by default, none to skip it\n");
+  printf("  -F  --fua           Write with FUA, the command completes when the data is on the media\n");
+  printf("      --write-cache=on/off Enable or disable the volatile write cache before the operation\n");
+  printf("      --slo-us        p99 latency target of scan/wipe/verify, the queue depth is adapted to it,\n");
+  printf("                      first I/O latency target of the power profile\n");
+  printf("      --max-qd        Queue depth limit of scan/wipe/verify, the device queue depth by default, queued phase\n");
+  printf("                      depth of the breakdown and per device depth of the multi scan, 8 by default\n");
+  printf("      --retries       Retries of a command which failed with a transient error, 3 by default\n");
+  printf("      --timeout-ms    Timeout of every command, by default it follows the latency of the command class\n");
+  printf("      --regions       LBA regions of the heatmap, 100 by default, strata of the health check, 64 by default\n");
+  printf("      --samples       Commands at random LBAs of the heatmap, it sweeps the whole range by default,\n");
+  printf("                      reads of the health check at most, 100000 by default, commands per stage of the cpu\n");
+  printf("                      cost, 1000000 by default, commands per phase of the breakdown, 2000 by default\n");
+  printf("      --heat-verify   Heatmap with VERIFY instead of READ, no data is transferred\n");
+  printf("      --precision     Health check stops when the mean latency is known within this percent, 5 by default\n");
+  printf("      --zone-action=open/close/finish/reset Zone action on the zone of startlba before the zone report\n");
+  printf("      --all-zones     Zone action on all zones\n");
+  printf("      --stream-id     Stream ID 0 ~ 7 of stream read/write, 0 by default\n");
+  printf("      --deadline-us   Command completion time limit of stream read/write, 50000 by default\n");
+  printf("      --continuous    Stream commands complete in time even if the data isn't perfect (RC / WC)\n");
+  printf("      --stream-rate   MB/s the stream is paced at, as fast as the device goes by default\n");
+  printf("      --repeats       Transitions into every power state of the power profile, 5 by default\n");
+  printf("      --apm-levels    APM levels of the power profile, e.g. 254,128,1, the drive is left alone for --dwell-ms\n");
+  printf("      --dwell-ms      Time under an APM level before the first I/O, 5000 by default\n");
+  printf("      --metrics       OpenMetrics file of command counters and latencies, written at exit and on SIGUSR1\n");
+  printf("      --metrics-socket Unix socket the metrics are served on while commands run, plain or HTTP GET\n");
+  printf("      --link-limit    MB/s limits of links shared by the devices of the multi scan, e.g. expander-2:0=1200,\n");
+  printf("                      port-2:0=2400, -d is given once per device, ports and ATA links run at their link rate\n");
+  printf("      --self-test=short/extended/conveyance SMART self-test of the devices, -d is given once per device, short\n");
+  printf("                      by default\n");
+  printf("      --per-enclosure Self-tests running at once per enclosure, expander or host adapter, 1 by default\n");
+  printf("      --store         Directory of the SMART time series of smartlog and smartquery, -d is given once per device\n");
+  printf("      --interval-s    Seconds between the --samples SMART samples of smartlog, 60 by default, one sample by default\n");
+  printf("      --serial        Drive of smartquery, all drives of the store by default\n");
+  printf("      --range=from:to Time range of smartquery in seconds since the epoch, either may be left out\n");
+  printf("      --attr          Attribute ID of smartquery, all attributes by default, rows go to -O or stdout\n");
   printf("  -D  --debug         print debug info\n");
 }
 
+// APM levels are 01h ~ FEh, refer to ACS-3 section 7.45.6
+static int apm_levels_valid(PARAMETER *param)
+{
+  unsigned int i;
+
+  for (i = 0; i < param->napm; i++)
+  {
+    if (param->apm_levels[i] > 0xFE)
+      return 0;
+  }
+  return 1;
+}
+
 void parse_options(PARAMETER *param, int argc, char **argv)
 {
   int option;
@@ -111,6 +353,42 @@ void parse_options(PARAMETER *param, int argc, char **argv)
 
   param->operation = OP_IDENTIFY;
   param->startlba = 0;
+  param->sectors = 1;
+  param->path = PATH_AUTO;
+  param->protocol = RW_AUTO;
+  strcpy(param->protocol_cache, PROTOCOL_CACHE_FILE);
+  bench_default_config(&param->bench);
+  param->output[0] = 0;
+  param->flags = 0;
+  param->write_cache = -1;
+  param->sectors_given = 0;
+  param->slo_us = 0;
+  param->max_qd = 0;
+  param->regions = 0;
+  param->samples = 0;
+  param->heat_verify = 0;
+  param->precision = 0;
+  param->zone_action = 0;
+  param->all_zones = 0;
+  param->stream_id = 0;
+  param->deadline_us = 0;
+  param->continuous = 0;
+  param->stream_rate = 0;
+  param->repeats = 0;
+  param->dwell_ms = 0;
+  param->napm = 0;
+  param->metrics = NULL;
+  param->metrics_socket = NULL;
+  param->ndevs = 0;
+  param->nlink_limits = 0;
+  param->self_test = SELFTEST_SHORT;
+  param->per_enclosure = 0;
+  param->store = NULL;
+  param->serial = NULL;
+  param->from = 0;
+  param->to = 0;
+  param->attr = 0;
+  param->interval_s = 60;
 
   do
   {
@@ -123,17 +401,66 @@ void parse_options(PARAMETER *param, int argc, char **argv)
 
       case 'd':
         opt_arg = optarg;
-        strcpy(param->dev_path, opt_arg);
+        if (param->ndevs == MULTI_MAX_DEVICES)
+        {
+          printf("at most %u devices can be given\n", MULTI_MAX_DEVICES);
+          exit(0);
+        }
+        if (param->ndevs == 0)
+          strcpy(param->dev_path, opt_arg);
+        strcpy(param->dev_paths[param->ndevs++], opt_arg);
         break;
 
       case 'o':
         opt_arg = optarg;
-        if (*opt_arg == 'r')
+        if (strcmp(opt_arg, "verify") == 0)
+          param->operation = OP_VERIFY;
+        else if (strcmp(opt_arg, "bench") == 0)
+          param->operation = OP_BENCH;
+        else if (strcmp(opt_arg, "durable") == 0)
+          param->operation = OP_DURABLE;
+        else if (strcmp(opt_arg, "prio") == 0)
+          param->operation = OP_PRIORITY;
+        else if (strcmp(opt_arg, "scan") == 0)
+          param->operation = OP_SCAN;
+        else if (strcmp(opt_arg, "wipe") == 0)
+          param->operation = OP_WIPE;
+        else if (strcmp(opt_arg, "heatmap") == 0)
+          param->operation = OP_HEATMAP;
+        else if (strcmp(opt_arg, "health") == 0)
+          param->operation = OP_HEALTH;
+        else if (strcmp(opt_arg, "zones") == 0)
+          param->operation = OP_ZONES;
+        else if (strcmp(opt_arg, "zonewrite") == 0)
+          param->operation = OP_ZONE_WRITE;
+        else if (strcmp(opt_arg, "stream") == 0)
+          param->operation = OP_STREAM;
+        else if (strcmp(opt_arg, "streamwrite") == 0)
+          param->operation = OP_STREAM_WRITE;
+        else if (strcmp(opt_arg, "power") == 0)
+          param->operation = OP_POWER;
+        else if (strcmp(opt_arg, "cpu") == 0)
+          param->operation = OP_CPU;
+        else if (strcmp(opt_arg, "breakdown") == 0)
+          param->operation = OP_BREAKDOWN;
+        else if (strcmp(opt_arg, "multiscan") == 0)
+          param->operation = OP_MULTISCAN;
+        else if (strcmp(opt_arg, "selftest") == 0)
+          param->operation = OP_SELFTEST;
+        else if (strcmp(opt_arg, "parse") == 0)
+          param->operation = OP_PARSE;
+        else if (strcmp(opt_arg, "smartlog") == 0)
+          param->operation = OP_SMARTLOG;
+        else if (strcmp(opt_arg, "smartquery") == 0)
+          param->operation = OP_SMARTQUERY;
+        else if (*opt_arg == 'r')
           param->operation = OP_READ;
         else if (*opt_arg == 'w')
           param->operation = OP_WRITE;
         else if (*opt_arg == 'i')
           param->operation = OP_IDENTIFY;
+        else if (*opt_arg == 'v')
+          param->operation = OP_VPD;
         else
         {
           printf("unsupported operation of option -o\n");
@@ -147,6 +474,255 @@ void parse_options(PARAMETER *param, int argc, char **argv)
         param->startlba = strtol(opt_arg, NULL, 0);
         break;
 
+      case 'n':
+        opt_arg = optarg;
+        param->sectors = strtoul(opt_arg, NULL, 0);
+        if (param->sectors == 0)
+        {
+          printf("sectors of option -n shall not be ZERO\n");
+          exit(0);
+        }
+        param->sectors_given = 1;
+        break;
+
+      case 'P':
+        opt_arg = optarg;
+        if (strcmp(opt_arg, "ata") == 0)
+          param->path = PATH_ATA;
+        else if (strcmp(opt_arg, "sbc") == 0)
+          param->path = PATH_SBC;
+        else if (strcmp(opt_arg, "auto") == 0)
+          param->path = PATH_AUTO;
+        else
+        {
+          printf("unsupported path of option -P\n");
+          print_usage();
+          exit(0);
+        }
+        break;
+
+      case 'p':
+        opt_arg = optarg;
+        param->protocol = rw_protocol_by_name(opt_arg);
+        if (param->protocol == RW_PROTOCOL_NUM)
+        {
+          printf("unsupported protocol of option -p\n");
+          print_usage();
+          exit(0);
+        }
+        break;
+
+      case 'C':
+        opt_arg = optarg;
+        strncpy(param->protocol_cache, opt_arg, sizeof(param->protocol_cache) - 1);
+        break;
+
+      case 'O':
+        opt_arg = optarg;
+        strncpy(param->output, opt_arg, sizeof(param->output) - 1);
+        break;
+
+      case OPT_BENCH_SIZES:
+        if (bench_parse_list(optarg, param->bench.sizes, &param->bench.nsizes) != 0)
+        {
+          printf("invalid list of option --bench-sizes\n");
+          exit(0);
+        }
+        break;
+
+      case OPT_BENCH_DEPTHS:
+        if (bench_parse_list(optarg, param->bench.depths, &param->bench.ndepths) != 0)
+        {
+          printf("invalid list of option --bench-depths\n");
+          exit(0);
+        }
+        break;
+
+      case OPT_BENCH_COMMANDS:
+        param->bench.commands = strtoul(optarg, NULL, 0);
+        if (param->bench.commands == 0)
+        {
+          printf("commands of option --bench-commands shall not be ZERO\n");
+          exit(0);
+        }
+        break;
+
+      case OPT_BENCH_WRITE:
+        param->bench.iswrite = 1;
+        break;
+
+      case OPT_GROUPS:
+        if (bench_parse_list(optarg, param->bench.groups, &param->bench.ngroups) != 0)
+        {
+          printf("invalid list of option --groups\n");
+          exit(0);
+        }
+        break;
+
+      case OPT_BLKDEV:
+        param->bench.blkdev = optarg;
+        break;
+
+      case OPT_METRICS:
+        param->metrics = optarg;
+        break;
+
+      case OPT_METRICS_SOCKET:
+        param->metrics_socket = optarg;
+        break;
+
+      case OPT_LINK_LIMIT:
+        if (topo_parse_limits(optarg, param->link_limits, &param->nlink_limits) != 0)
+        {
+          printf("invalid list of option --link-limit\n");
+          exit(0);
+        }
+        break;
+
+      case OPT_SELF_TEST:
+        if (strcmp(optarg, "short") == 0)
+          param->self_test = SELFTEST_SHORT;
+        else if (strcmp(optarg, "extended") == 0)
+          param->self_test = SELFTEST_EXTENDED;
+        else if (strcmp(optarg, "conveyance") == 0)
+          param->self_test = SELFTEST_CONVEYANCE;
+        else
+        {
+          printf("unsupported value of option --self-test\n");
+          print_usage();
+          exit(0);
+        }
+        break;
+
+      case OPT_PER_ENCLOSURE:
+        param->per_enclosure = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_STORE:
+        param->store = optarg;
+        break;
+
+      case OPT_SERIAL:
+        param->serial = optarg;
+        break;
+
+      case OPT_RANGE:
+        if (sscanf(optarg, "%llu:%llu", &param->from, &param->to) < 1 && sscanf(optarg, ":%llu", &param->to) != 1)
+        {
+          printf("invalid value of option --range\n");
+          exit(0);
+        }
+        break;
+
+      case OPT_ATTR:
+        param->attr = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_INTERVAL_S:
+        param->interval_s = strtoul(optarg, NULL, 0);
+        break;
+
+      case 'F':
+        param->flags |= RW_FLAG_FUA;
+        break;
+
+      case OPT_SLO_US:
+        param->slo_us = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_MAX_QD:
+        param->max_qd = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_RETRIES:
+        policy_set_retries(strtoul(optarg, NULL, 0));
+        break;
+
+      case OPT_TIMEOUT_MS:
+        policy_set_timeout(strtoul(optarg, NULL, 0));
+        break;
+
+      case OPT_REGIONS:
+        param->regions = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_SAMPLES:
+        param->samples = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_HEAT_VERIFY:
+        param->heat_verify = 1;
+        break;
+
+      case OPT_PRECISION:
+        param->precision = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_ZONE_ACTION:
+        param->zone_action = zone_action_by_name(optarg);
+        if (param->zone_action == 0)
+        {
+          printf("unsupported value of option --zone-action\n");
+          print_usage();
+          exit(0);
+        }
+        break;
+
+      case OPT_ALL_ZONES:
+        param->all_zones = 1;
+        break;
+
+      case OPT_STREAM_ID:
+        param->stream_id = strtoul(optarg, NULL, 0);
+        if (param->stream_id > STREAM_MAX_ID)
+        {
+          printf("unsupported value of option --stream-id\n");
+          print_usage();
+          exit(0);
+        }
+        break;
+
+      case OPT_DEADLINE_US:
+        param->deadline_us = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_CONTINUOUS:
+        param->continuous = 1;
+        break;
+
+      case OPT_STREAM_RATE:
+        param->stream_rate = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_REPEATS:
+        param->repeats = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_DWELL_MS:
+        param->dwell_ms = strtoul(optarg, NULL, 0);
+        break;
+
+      case OPT_APM_LEVELS:
+        if (bench_parse_list(optarg, param->apm_levels, &param->napm) != 0 || !apm_levels_valid(param))
+        {
+          printf("invalid list of option --apm-levels\n");
+          exit(0);
+        }
+        break;
+
+      case OPT_WRITE_CACHE:
+        if (strcmp(optarg, "on") == 0)
+          param->write_cache = 1;
+        else if (strcmp(optarg, "off") == 0)
+          param->write_cache = 0;
+        else
+        {
+          printf("unsupported value of option --write-cache\n");
+          print_usage();
+          exit(0);
+        }
+        break;
+
       case 'D':
         isDebug = 1;
         break;
@@ -162,7 +738,41 @@ void parse_options(PARAMETER *param, int argc, char **argv)
   } while (option != -1);
 
   if (isDebug)
-    printf("OPTIONS : dev_path %s, operation %x, startlba %lx\n", param->dev_path, param->operation, param->startlba); 
+    printf("OPTIONS : dev_path %s, operation %x, startlba %lx, sectors %u\n", param->dev_path, param->operation, param->startlba, param->sectors);
+}
+
+// Writable and non-blocking, so that commands can be queued by write() / read() of sg
+int open_device(const char *dev_path)
+{
+  int fd;
+
+  if (emul_is_path(dev_path))
+    fd = emul_open(dev_path);
+  else
+  {
+    fd = open(dev_path, O_RDWR | O_NONBLOCK);
+    if (fd < 0)
+      fd = open(dev_path, O_RDONLY | O_NONBLOCK);
+  }
+  if (fd < 0)
+  {
+    lasterror = errno;
+    printf("Open %s failed (%d) - %s\n", dev_path, lasterror, strerror(lasterror));
+  }
+  return fd;
+}
+
+// The transport and metrics of fd go with it, a device opened later may get the same number
+void close_device(int fd, const char *dev_path)
+{
+  metrics_detach(fd);
+  if (emul_is_path(dev_path))
+    emul_close(fd);
+  else
+  {
+    transport_unregister(fd);
+    close(fd);
+  }
 }
 
 void scsi_dev(char* const dev_path)
@@ -172,13 +782,11 @@ void scsi_dev(char* const dev_path)
 
   printf("SCSI dev : %s\n", dev_path);
 
-  scsi_fd = open(dev_path, O_RDONLY | O_NONBLOCK);
+  scsi_fd = open_device(dev_path);
   if (scsi_fd < 0)
-  {
-    lasterror = errno;
-    printf("Open %s failed (%d) - %s\n", dev_path, lasterror, strerror(lasterror));
     exit(-1);
-  }
+  device_init(&scsi_ctx, scsi_fd, dev_path);
+  metrics_attach(scsi_fd, dev_path);
   
 //  printf("Check file state:\n");
 //  check_file_state(scsi_fd);
@@ -193,32 +801,158 @@ void scsi_dev(char* const dev_path)
 //  get_smartlogdir(scsi_fd);
   if (scsi_param.operation == OP_IDENTIFY)
     list_identifydata(scsi_fd);
+
+  if (scsi_param.operation == OP_VPD)
+    list_vpddata(scsi_fd);
   
   if (scsi_param.operation == OP_READ || scsi_param.operation == OP_WRITE)
   {
-    get_identifydata(scsi_fd);
-    rw_data(scsi_fd);
+    if (open_data_path(&scsi_ctx) == 0)
+      rw_data(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_VERIFY && scsi_param.slo_us == 0)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      verify_data(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_SCAN || scsi_param.operation == OP_WIPE || (scsi_param.operation == OP_VERIFY && scsi_param.slo_us))
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      background_job(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_HEATMAP)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      latency_heatmap(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_HEALTH)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      health_check(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_ZONES)
+    zone_report_data(&scsi_ctx);
+
+  if (scsi_param.operation == OP_ZONE_WRITE)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      zone_write_data(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_STREAM || scsi_param.operation == OP_STREAM_WRITE)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      stream_data(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_POWER)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      power_data(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_CPU)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      cpu_data(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_BREAKDOWN)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      breakdown_data(&scsi_ctx);
   }
 
-  close(scsi_fd);
+  if (scsi_param.operation == OP_MULTISCAN)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      multi_data(&scsi_ctx);
+  }
+
+  if (scsi_param.operation == OP_SELFTEST)
+    selftest_data(&scsi_ctx);
+
+  if (scsi_param.operation == OP_SMARTLOG)
+    smartlog_data(&scsi_ctx);
+
+  if (scsi_param.operation == OP_BENCH || scsi_param.operation == OP_DURABLE || scsi_param.operation == OP_PRIORITY)
+  {
+    if (open_data_path(&scsi_ctx) == 0)
+      bench_data(&scsi_ctx);
+  }
+
+  close_device(scsi_fd, dev_path);
+}
+
+// IDENTIFY the device and choose ATA pass-through or SBC for data transfer
+int open_data_path(DEVICE_CONTEXT *dev)
+{
+  if (scsi_param.path != PATH_SBC)
+    get_identifydata(dev);
+
+  if (device_select_path(dev, scsi_param.path) != 0)
+    return -1;
+
+  if (dev->path == PATH_ATA && !dev->ata_valid)
+  {
+    printf("IDENTIFY DEVICE failed, ATA pass-through can't be used\n");
+    return -1;
+  }
+
+  if (dev->path == PATH_ATA && !dev->ata.ext_feat)
+    dev->isext = 0;
+
+  // The valid SECTOR COUNT differs between USB bridges (0xF0, 1, ...), so the transfer size is discovered
+  // per device and large requests are split into commands of that size
+  device_discover_xfer(dev);
+  printf("sector %u bytes, physical %u bytes, lowest aligned lba %u\n", dev->sector_size,
+         dev->sector_size * dev->phys_sectors, dev->align_lba);
+  printf("max transfer %u sectors (%s)\n", dev->max_sectors, xfer_source_name(dev->max_sectors_src));
+
+  if (dev->path == PATH_ATA)
+  {
+    if (device_select_protocol(dev, scsi_param.protocol, strcmp(scsi_param.protocol_cache, "none") ? scsi_param.protocol_cache : NULL) != 0)
+      return -1;
+    printf("data path %s, protocol %s\n", cmd_path_name(dev->path), rw_protocol_name(dev->protocol));
+  }
+  else
+    printf("data path %s\n", cmd_path_name(dev->path));
+
+  if (scsi_param.write_cache >= 0)
+  {
+    if (device_set_write_cache(dev, scsi_param.write_cache) != 0)
+      return -1;
+  }
+  if (dev->path == PATH_ATA && dev->ata.wcache_feat)
+    printf("write cache %s, FUA %s\n", dev->ata.wcache_enabled ? "enabled" : "disabled",
+           device_fua_native(dev) ? "by command" : "by FLUSH CACHE");
+
+  return 0;
 }
 
-void rw_data(int fd)
+void rw_data(DEVICE_CONTEXT *dev)
 {
   int ret = -1;
   unsigned char *databuffer;
   unsigned long startlba = scsi_param.startlba;
   unsigned int isread = (scsi_param.operation == OP_READ) ? 1 : 0;
- 
-  // user adjustment paramters
-  unsigned int sectors = 1;                // QQQQ For USB storage device, this field is a little weird, different kind of device has differrent max value of this field (0xF0, 1, ...)
-  unsigned int ncqtag  = 3;
-  unsigned int tag     = 3;
-  unsigned int isext   = 1;
-//  unsigned int isext   = 0;
+  unsigned int sectors = scsi_param.sectors;
+  unsigned int i;
+
+  unsigned int size = dev->sector_size;
 
-  databuffer = (char *)malloc(512 * sectors);
-  memset(databuffer, 0, 512 * sectors);
+  databuffer = (char *)malloc((unsigned long)size * sectors);
+  if (databuffer == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return;
+  }
+  memset(databuffer, 0, (unsigned long)size * sectors);
 
   if (isread == 0)
   {
@@ -226,58 +960,432 @@ void rw_data(int fd)
     printf("Wrtie op, it will destroy the current data, press y to continue, or stop with any other key?\n");
     input = getchar();
     if (input != 'y')
+    {
+      free(databuffer);
       return;
+    }
     
-    databuffer[0]  = 0x11;
-    databuffer[2]  = 0x22;
-    databuffer[4]  = 0x44;
-    databuffer[6]  = 0x66;
-    databuffer[8]  = 0x88;
-    databuffer[10] = 0xaa;
+    for (i = 0; i < sectors; i++)
+    {
+      unsigned char *sector = databuffer + i * size;
+
+      sector[0]  = 0x11;
+      sector[2]  = 0x22;
+      sector[4]  = 0x44;
+      sector[6]  = 0x66;
+      sector[8]  = 0x88;
+      sector[10] = 0xaa;
     
-    databuffer[511] = 0xFF;
-    databuffer[509] = 0xEE;
-    databuffer[507] = 0xDD;
-    databuffer[505] = 0xCC;
-    databuffer[503] = 0xBB;
+      sector[size - 1] = 0xFF;
+      sector[size - 3] = 0xEE;
+      sector[size - 5] = 0xDD;
+      sector[size - 7] = 0xCC;
+      sector[size - 9] = 0xBB;
+    }
+  }
+
+  // the protocol is chosen per device by open_data_path(), see device_select_protocol()
+  ret = device_readwrite(dev, isread, scsi_param.flags, startlba, sectors, databuffer);
+
+  if (ret == 0 && isread)
+  {
+    for (i = 0; i < sectors * size; i++)
+    {
+      if (i % size == 0)
+        printf("sector %ld: \n", startlba + i / size);
+      printf("%x ", databuffer[i]);
+      if (i % size == size - 1)
+        printf("\n");
+    }
+  }
+
+  free(databuffer);
+}
+
+void verify_data(DEVICE_CONTEXT *dev)
+{
+  unsigned long startlba = scsi_param.startlba;
+  unsigned int sectors = scsi_param.sectors;
+
+  if (device_verify(dev, startlba, sectors) == 0)
+    printf("verify lba 0x%lx, %u sectors : OK\n", startlba, sectors);
+}
+
+// Scan, wipe or verify with the queue depth adapted to --slo-us
+void background_job(DEVICE_CONTEXT *dev)
+{
+  BG_JOB job;
+
+  memset(&job, 0, sizeof(job));
+  if (scsi_param.operation == OP_WIPE)
+    job.type = BG_WIPE;
+  else if (scsi_param.operation == OP_VERIFY)
+    job.type = BG_VERIFY;
+  else
+    job.type = BG_SCAN;
+  job.startlba = scsi_param.startlba;
+  job.sectors = scsi_param.sectors_given ? scsi_param.sectors : 0;
+  job.max_depth = scsi_param.max_qd;
+  job.target_ns = (unsigned long long)scsi_param.slo_us * 1000;
+
+  if (job.type == BG_WIPE)
+  {
+    unsigned int input;
+    printf("Wipe op, it will destroy the current data, press y to continue, or stop with any other key?\n");
+    input = getchar();
+    if (input != 'y')
+      return;
   }
 
-  if (!ata_feat.ext_feat && isext)
+  bgjob_run(dev, &job);
+}
+
+// Latency by LBA region, --max-qd commands in flight, one by default
+void latency_heatmap(DEVICE_CONTEXT *dev)
+{
+  HEAT_CONFIG config;
+
+  memset(&config, 0, sizeof(config));
+  config.startlba = scsi_param.startlba;
+  config.sectors = scsi_param.sectors_given ? scsi_param.sectors : 0;
+  config.regions = scsi_param.regions;
+  config.samples = scsi_param.samples;
+  config.depth = scsi_param.max_qd;
+  config.isverify = scsi_param.heat_verify;
+  config.output = scsi_param.output[0] ? scsi_param.output : NULL;
+
+  heatmap_run(dev, &config);
+}
+
+// Error rate and latency of the whole device from a stratified sample
+void health_check(DEVICE_CONTEXT *dev)
+{
+  HEALTH_CONFIG config;
+  HEALTH_RESULT result;
+
+  memset(&config, 0, sizeof(config));
+  config.strata = scsi_param.regions;
+  config.max_samples = scsi_param.samples;
+  config.precision = scsi_param.precision;
+  config.max_depth = scsi_param.max_qd;
+
+  health_run(dev, &config, &result);
+}
+
+// Zone table, after --zone-action on the zone of startlba or all zones
+void zone_report_data(DEVICE_CONTEXT *dev)
+{
+  ZONE_TABLE table;
+
+  if (scsi_param.zone_action && zone_action(dev, scsi_param.zone_action, scsi_param.startlba, scsi_param.all_zones) != 0)
+    return;
+
+  if (zone_report(dev, &table) != 0)
   {
-    printf("48-bit feature is NOT supported\n");
+    printf("REPORT ZONES EXT failed, the device isn't zoned?\n");
     return;
   }
+  zone_print(&table);
+  zone_free(&table);
+}
 
-  ret = sectors_readwrite(fd, isread, isext, startlba, sectors, databuffer);
-//  ret = dma_readwrite(fd, isread, isext, startlba, sectors, databuffer);
+// Sequential writes at the write pointers from the zone of startlba on, -n sectors or to the end of the device
+void zone_write_data(DEVICE_CONTEXT *dev)
+{
+  ZONE_TABLE table;
+  ZONE_WRITE job;
+  unsigned int input;
 
-//  if (ata_feat.ext_feat && ata_feat.ncq_feat)
-//    ret = fpdma_readwrite(fd, isread, ncqtag, startlba, sectors, databuffer);
-//  else
-//    printf("Feature NOT support, 48-bit feature %d, NCQ feature %d\n", ata_feat.ext_feat, ata_feat.ncq_feat);
+  if (zone_report(dev, &table) != 0)
+  {
+    printf("REPORT ZONES EXT failed, the device isn't zoned?\n");
+    return;
+  }
 
-//  if (ata_feat.tcq_feat)
-//    ret = dmaqueued_readwrite(fd, isread, isext, tag, startlba, sectors, databuffer);
-//  else
-//    printf("Feature NOT support, TCQ feature %d\n", ata_feat.tcq_feat);
+  printf("Zone write op, it will destroy the current data, press y to continue, or stop with any other key?\n");
+  input = getchar();
+  if (input != 'y')
+  {
+    zone_free(&table);
+    return;
+  }
 
-//  if (ata_feat.secperdrq != -1 && ata_feat != 0)
-//    ret = multi_readwrite(fd, isread, isext, startlba, sectors, databuffer);
-//  else
-//    printf("No valid value of Sectors transferred per DRQ or the value is 0\n");
+  memset(&job, 0, sizeof(job));
+  job.startlba = scsi_param.startlba;
+  job.sectors = scsi_param.sectors_given ? scsi_param.sectors : 0;
+  job.streams = scsi_param.max_qd;
 
-  if (ret == 0 && isread)
+  zone_write_seq(dev, &table, &job);
+  zone_free(&table);
+}
+
+// Stream read/write with a time limit per command, -n sectors or to the end of the device
+void stream_data(DEVICE_CONTEXT *dev)
+{
+  STREAM_CONFIG config;
+  STREAM_RESULT result;
+
+  memset(&config, 0, sizeof(config));
+  config.startlba = scsi_param.startlba;
+  config.sectors = scsi_param.sectors_given ? scsi_param.sectors : 0;
+  config.streamid = scsi_param.stream_id;
+  config.deadline_us = scsi_param.deadline_us;
+  config.rate_mbs = scsi_param.stream_rate;
+  config.continuous = scsi_param.continuous;
+  config.iswrite = scsi_param.operation == OP_STREAM_WRITE;
+
+  if (config.iswrite)
   {
-    int i;
-    printf("sector %ld: \n", startlba);
-    for (i= 0; i < 512; i++)
+    unsigned int input;
+    printf("Stream write op, it will destroy the current data, press y to continue, or stop with any other key?\n");
+    input = getchar();
+    if (input != 'y')
+      return;
+  }
+
+  stream_run(dev, &config, &result);
+}
+
+// Latency of the first I/O out of every power state the drive supports
+void power_data(DEVICE_CONTEXT *dev)
+{
+  POWER_CONFIG config;
+
+  memset(&config, 0, sizeof(config));
+  config.repeats = scsi_param.repeats;
+  config.dwell_ms = scsi_param.dwell_ms;
+  config.apm_levels = scsi_param.apm_levels;
+  config.napm = scsi_param.napm;
+  config.slo_us = scsi_param.slo_us;
+
+  power_profile(dev, &config);
+}
+
+// Host CPU time and instructions per command, the commands go to a null transport
+void cpu_data(DEVICE_CONTEXT *dev)
+{
+  CPU_COST_CONFIG config;
+
+  memset(&config, 0, sizeof(config));
+  config.commands = scsi_param.samples;
+  config.sectors = scsi_param.sectors_given ? scsi_param.sectors : 0;
+
+  cpu_cost_run(dev, &config);
+}
+
+// Where the latency goes: the process, the kernel queue or the device
+void breakdown_data(DEVICE_CONTEXT *dev)
+{
+  BREAKDOWN_CONFIG config;
+
+  memset(&config, 0, sizeof(config));
+  config.commands = scsi_param.samples;
+  config.sectors = scsi_param.sectors_given ? scsi_param.sectors : 0;
+  config.depth = scsi_param.max_qd;
+
+  breakdown_run(dev, &config);
+}
+
+// The first device is open already, the others of -d are opened the same way. devs has the ones which were opened
+// even when it fails
+int open_devices(DEVICE_CONTEXT *dev, DEVICE_CONTEXT **devs, unsigned int *ndevs, int data_path)
+{
+  static DEVICE_CONTEXT others[MULTI_MAX_DEVICES];
+  unsigned int i;
+  int fd;
+
+  devs[0] = dev;
+  *ndevs = 1;
+  for (i = 1; i < scsi_param.ndevs; i++)
+  {
+    printf("SCSI dev : %s\n", scsi_param.dev_paths[i]);
+    fd = open_device(scsi_param.dev_paths[i]);
+    if (fd < 0)
+      return -1;
+    device_init(&others[i], fd, scsi_param.dev_paths[i]);
+    metrics_attach(fd, scsi_param.dev_paths[i]);
+    devs[(*ndevs)++] = &others[i];
+    if (data_path && open_data_path(&others[i]) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+void close_devices(DEVICE_CONTEXT **devs, unsigned int ndevs)
+{
+  unsigned int i;
+
+  for (i = 1; i < ndevs; i++)
+    close_device(devs[i]->fd, devs[i]->dev_path);
+}
+
+// All the devices are read at once
+void multi_data(DEVICE_CONTEXT *dev)
+{
+  DEVICE_CONTEXT *devs[MULTI_MAX_DEVICES];
+  MULTI_CONFIG config;
+  unsigned int ndevs;
+
+  if (open_devices(dev, devs, &ndevs, 1) != 0)
+  {
+    close_devices(devs, ndevs);
+    return;
+  }
+
+  memset(&config, 0, sizeof(config));
+  config.startlba = scsi_param.startlba;
+  config.sectors = scsi_param.sectors_given ? scsi_param.sectors : 0;
+  config.depth = scsi_param.max_qd;
+  config.limits = scsi_param.link_limits;
+  config.nlimits = scsi_param.nlink_limits;
+
+  multi_scan(devs, ndevs, &config);
+  close_devices(devs, ndevs);
+}
+
+// SMART self-tests of all the devices, staggered per enclosure
+void selftest_data(DEVICE_CONTEXT *dev)
+{
+  DEVICE_CONTEXT *devs[MULTI_MAX_DEVICES];
+  SELFTEST_CONFIG config;
+  unsigned int ndevs;
+
+  if (open_devices(dev, devs, &ndevs, 0) != 0)
+  {
+    close_devices(devs, ndevs);
+    return;
+  }
+
+  memset(&config, 0, sizeof(config));
+  config.subcommand = scsi_param.self_test;
+  config.per_domain = scsi_param.per_enclosure;
+
+  selftest_run(devs, ndevs, &config);
+  close_devices(devs, ndevs);
+}
+
+// SMART READ DATA of all the devices to the store, --samples times every --interval-s
+void smartlog_data(DEVICE_CONTEXT *dev)
+{
+  DEVICE_CONTEXT *devs[MULTI_MAX_DEVICES];
+  SMARTDB_WRITER writers[MULTI_MAX_DEVICES];
+  IDENTIFY_INFO iden;
+  SMART_INFO info;
+  unsigned char data[BLOB_SIZE];
+  unsigned int samples = scsi_param.samples ? scsi_param.samples : 1;
+  unsigned int ndevs, i, s;
+  int open[MULTI_MAX_DEVICES];
+
+  if (scsi_param.store == NULL)
+  {
+    printf("smartlog needs --store\n");
+    return;
+  }
+  if (open_devices(dev, devs, &ndevs, 0) != 0)
+  {
+    close_devices(devs, ndevs);
+    return;
+  }
+
+  // the stream of a drive is named by its serial number
+  for (i = 0; i < ndevs; i++)
+  {
+    open[i] = 0;
+    memset(data, 0, sizeof(data));
+    if (identify_func(devs[i]->fd, (char *)data) != 0 || blob_kind(data) != BLOB_IDENTIFY)
     {
-      printf("%x ", databuffer[i]);
+      printf("%s: no IDENTIFY data, skipped\n", devs[i]->dev_path);
+      continue;
     }
-  printf("\n");
+    identify_decode(data, &iden);
+    open[i] = smartdb_open(&writers[i], scsi_param.store, iden.serial, iden.model) == 0;
   }
 
-  free(databuffer);
+  for (s = 0; s < samples; s++)
+  {
+    if (s)
+      sleep(scsi_param.interval_s);
+    for (i = 0; i < ndevs; i++)
+    {
+      if (!open[i])
+        continue;
+      memset(data, 0, sizeof(data));
+      if (smart_readdata(devs[i]->fd, (char *)data) != 0 || blob_kind(data) != BLOB_SMART)
+      {
+        printf("%s: no SMART data\n", devs[i]->dev_path);
+        continue;
+      }
+      smart_decode(data, &info);
+      if (smartdb_append(&writers[i], time(NULL), &info) == 0)
+        printf("%s: %u attributes sampled\n", devs[i]->dev_path, info.nattrs);
+    }
+  }
+
+  for (i = 0; i < ndevs; i++)
+  {
+    if (open[i])
+      smartdb_close(&writers[i]);
+  }
+  close_devices(devs, ndevs);
+}
+
+void smartquery_data(void)
+{
+  SMARTDB_QUERY query;
+
+  if (scsi_param.store == NULL)
+  {
+    printf("smartquery needs --store\n");
+    return;
+  }
+
+  memset(&query, 0, sizeof(query));
+  query.serial = scsi_param.serial;
+  query.from = scsi_param.from;
+  query.to = scsi_param.to;
+  query.attr = scsi_param.attr;
+  query.output = scsi_param.output[0] ? scsi_param.output : NULL;
+
+  smartdb_query(scsi_param.store, &query);
+}
+
+void bench_data(DEVICE_CONTEXT *dev)
+{
+  BENCH_CONFIG *cfg = &scsi_param.bench;
+  unsigned int durable = scsi_param.operation == OP_DURABLE;
+
+  if (cfg->iswrite || durable)
+  {
+    unsigned int input;
+    printf("Wrtie benchmark, it will destroy the current data, press y to continue, or stop with any other key?\n");
+    input = getchar();
+    if (input != 'y')
+      return;
+  }
+
+  if (scsi_param.output[0])
+  {
+    cfg->output = fopen(scsi_param.output, "w");
+    if (cfg->output == NULL)
+    {
+      lasterror = errno;
+      printf("Open %s failed (%d) - %s\n", scsi_param.output, lasterror, strerror(lasterror));
+      return;
+    }
+  }
+
+  if (durable)
+    bench_durable(dev, cfg);
+  else if (scsi_param.operation == OP_PRIORITY)
+    bench_priority(dev, cfg);
+  else
+    bench_protocols(dev, cfg);
+
+  if (cfg->output != stdout)
+  {
+    fclose(cfg->output);
+    printf("benchmark table is written to %s\n", scsi_param.output);
+  }
 }
 
 void get_smartlogdir(int fd)
@@ -320,8 +1428,16 @@ void get_smartdata(int fd)
 
 void parse_smart_data(unsigned char *buffer, unsigned int len)
 {
+  SMART_INFO info;
+  unsigned int i;
 
+  smart_decode(buffer, &info);
   printf("SMART data : \n");
+  printf("Revision %u, checksum %s\n", info.revision, info.checksum_ok ? "good" : "bad");
+  printf(" ID  flags value worst          raw\n");
+  for (i = 0; i < info.nattrs; i++)
+    printf("%3u 0x%04x   %3u   %3u %12llu\n", info.attrs[i].id, info.attrs[i].flags, info.attrs[i].value,
+           info.attrs[i].worst, info.attrs[i].raw);
   printf("Off-line data collection status: 0x%02x\n", buffer[362]);
   printf("Self-test execution status byte: 0x%02x\n", buffer[363]);
   printf("Total time in seconds to complete off-line data collection activity: 0x%02x%02x s\n", buffer[365], buffer[364]);
@@ -330,16 +1446,33 @@ void parse_smart_data(unsigned char *buffer, unsigned int len)
   printf("Conveyance self-test routine recommended polling time in minutes: 0x%02x m \n", buffer[374]);
 }
 
-void get_identifydata(int fd)
+int get_identifydata(DEVICE_CONTEXT *dev)
 {
   char *identifydata;
+  int i;
 
   identifydata = (char *)malloc(512);
   memset(identifydata, 0, 512);
 
-  identify_func(fd, identifydata);
+  dev->ata_valid = 0;
+  if (identify_func(dev->fd, identifydata) == 0)
+  {
+    // some bridges complete ATA PASS-THROUGH with GOOD status but don't fill any data
+    for (i = 0; i < 512; i++)
+    {
+      if (identifydata[i])
+      {
+        dev->ata_valid = 1;
+        break;
+      }
+    }
+  }
   
-  set_ata_feat(identifydata, 512);
+  set_ata_feat(&dev->ata, identifydata, 512);
+  memcpy(dev->identify, identifydata, 512);
+  free(identifydata);
+
+  return dev->ata_valid ? 0 : -1;
 }
 
 void list_identifydata(int fd)
@@ -354,79 +1487,167 @@ void list_identifydata(int fd)
   parse_identify_data(identifydata, 512);
 }
 
-void set_ata_feat(void *buffer, unsigned int len)
+void list_vpddata(int fd)
+{
+  VPD_INFO vpd;
+
+  printf("\nInquiry:\n");
+  if (sg_inquiry(fd) != 0)
+    return;
+
+  printf("\nVPD pages:\n");
+  if (sg_vpd_info(fd, &vpd) == 0)
+    parse_vpd_info(&vpd);
+
+  printf("\nMode sense:\n");
+  sg_mode(fd);
+}
+
+void set_ata_feat(ATA_FEATURE *feat, void *buffer, unsigned int len)
 {
   unsigned short *iden;
 
   iden = (unsigned short*)buffer;
 
-  ata_feat.isata = iden[0] >> 15 ? 0 : 1;
+  feat->isata = iden[0] >> 15 ? 0 : 1;
 
   // PACKET feature set, bit 4 of WORD 82 & 85, 1 : support while 0 : unsupport
   if ((iden[82] & (1 << 4)) && ((iden[85] & (1 << 4))))
-    ata_feat.packet_feat = 1;
+    feat->packet_feat = 1;
   else
-    ata_feat.packet_feat = 0;
+    feat->packet_feat = 0;
 
   // bit 12:8 indicate command set used by PACKET command, valid for ATAPI device
-  if (!ata_feat.isata)
-    ata_feat.cmdset = (iden[0] >> 8) & 0x1F;
+  if (!feat->isata)
+    feat->cmdset = (iden[0] >> 8) & 0x1F;
   else
-    ata_feat.cmdset = -1;
+    feat->cmdset = -1;
   
   // 48-bit Address feature set, bit 10 of WORD 83 & 86, 1 : support while. Only in IDENTIFY DATA
   if ((iden[83] & (1 << 10)) && ((iden[86] & (1 << 10))))
-    ata_feat.ext_feat = 1;
+    feat->ext_feat = 1;
   else
-    ata_feat.ext_feat = 0;
+    feat->ext_feat = 0;
 
-  if (ata_feat.ext_feat)
-    ata_feat.totalsec = ((unsigned long)iden[103] << 48) || ((unsigned long)iden[102] << 32) || (iden[101] << 16) || iden[100];
+  if (feat->ext_feat)
+    feat->totalsec = ((unsigned long long)iden[103] << 48) | ((unsigned long long)iden[102] << 32) | ((unsigned long long)iden[101] << 16) | iden[100];
   else
-    ata_feat.totalsec = (iden[61] << 16) || iden[60];
+    feat->totalsec = ((unsigned long long)iden[61] << 16) | iden[60];
 
   // NCQ(Native Command Queuing) feature set, bit 8 of WORD 76, 1 : support while 0 : unsupport
   if (iden[76] & (1 << 8))
-    ata_feat.ncq_feat = 1;
+    feat->ncq_feat = 1;
+  else
+    feat->ncq_feat = 0;
+
+  // NCQ priority information, bit 12 of WORD 76
+  if (feat->ncq_feat && (iden[76] & (1 << 12)))
+    feat->ncq_prio_feat = 1;
   else
-    ata_feat.ncq_feat = 0;
+    feat->ncq_prio_feat = 0;
+
+  // Zoned capabilities, bit 1:0 of WORD 69
+  feat->zoned = iden[69] & 0x3;
+
+  // APM(Advanced Power Management) feature set, bit 3 of WORD 83 supported and WORD 86 enabled, level in WORD 91
+  feat->apm_feat = (iden[83] & (1 << 3)) ? ((iden[86] & (1 << 3)) ? 2 : 1) : 0;
+  feat->apm_level = feat->apm_feat == 2 ? (iden[91] & 0xFF) : 0;
+
+  // EPC(Extended Power Conditions) feature set, bit 7 of WORD 119 supported and WORD 120 enabled
+  feat->epc_feat = (iden[119] & (1 << 7)) ? ((iden[120] & (1 << 7)) ? 2 : 1) : 0;
 
   // TCQ(Tagged Command Queuing) feature set, bit 1 of WORD 83 & 86, 1 : support while 0 : unsupport. Only in IDENTIFY DATA
   if ((iden[83] & (1 << 1)) && (iden[86] & (1 << 1)))
-    ata_feat.tcq_feat = 1;
+    feat->tcq_feat = 1;
   else
-    ata_feat.tcq_feat = 0;
+    feat->tcq_feat = 0;
 
   // Queue depth for TCQ/NCQ, bit 4:0 of WORD 75
-  if (ata_feat.tcq_feat || ata_feat.ncq_feat)
-    ata_feat.queuedepth = (iden[75] & 0x1F) + 1;
+  if (feat->tcq_feat || feat->ncq_feat)
+    feat->queuedepth = (iden[75] & 0x1F) + 1;
   else
-    ata_feat.queuedepth = -1;
+    feat->queuedepth = -1;
 
   // Streaming feature set, bit 4 of WORD 84, 1 : support while 0 : unsupport. 48-bit address only
   if (iden[84] & (1 << 4))
-    ata_feat.stream_feat = 1;
+    feat->stream_feat = 1;
   else
-    ata_feat.stream_feat = 0;
+    feat->stream_feat = 0;
+
+  // Streaming performance parameters, WORD 95 minimum request size and WORD 98-99 granularity
+  if (feat->stream_feat)
+  {
+    feat->stream_min_req = iden[95];
+    feat->stream_gran = ((unsigned int)iden[99] << 16) | iden[98];
+  }
+  else
+  {
+    feat->stream_min_req = 0;
+    feat->stream_gran = 0;
+  }
+
+  // Sector geometry, WORD 106 is valid with bit 15:14 01b. Bit 13 : several logical sectors per physical sector,
+  // 2^bit 3:0 of them. Bit 12 : the logical sector is longer than 256 words, WORD 117-118 holds its words
+  feat->logical_size = 512;
+  feat->phys_sectors = 1;
+  feat->align_lba = 0;
+  if ((iden[106] & 0xC000) == 0x4000)
+  {
+    if (iden[106] & (1 << 12))
+      feat->logical_size = (((unsigned int)iden[118] << 16) | iden[117]) * 2;
+    if (iden[106] & (1 << 13))
+      feat->phys_sectors = 1 << (iden[106] & 0xF);
+  }
+
+  // Alignment, WORD 209 is valid with bit 15:14 01b, bit 13:0 is the offset of LBA 0 in its physical sector
+  if (feat->phys_sectors > 1 && (iden[209] & 0xC000) == 0x4000)
+    feat->align_lba = (feat->phys_sectors - (iden[209] & 0x3FFF) % feat->phys_sectors) % feat->phys_sectors;
 
   // Multiple read & write, WORD 59
   if (iden[59] & (1 << 8))
-    ata_feat.secperdrq = iden[59] & 0xFF;
+    feat->secperdrq = iden[59] & 0xFF;
+  else
+    feat->secperdrq = -1;
+
+  // DMA, bit 8 of WORD 49, 1 : support while 0 : unsupport
+  if (iden[49] & (1 << 8))
+    feat->dma_feat = 1;
+  else
+    feat->dma_feat = 0;
+
+  // Volatile write cache, bit 5 of WORD 82 supported and bit 5 of WORD 85 enabled
+  feat->wcache_feat = (iden[82] & (1 << 5)) ? 1 : 0;
+  feat->wcache_enabled = (iden[85] & (1 << 5)) ? 1 : 0;
+
+  // FLUSH CACHE EXT, bit 13 of WORD 83 & 86
+  if ((iden[83] & (1 << 13)) && (iden[86] & (1 << 13)))
+    feat->flush_ext_feat = 1;
   else
-    ata_feat.secperdrq = -1;
+    feat->flush_ext_feat = 0;
+
+  // WRITE DMA FUA EXT and WRITE MULTIPLE FUA EXT, bit 6 of WORD 84 & 87
+  if ((iden[84] & (1 << 6)) && (iden[87] & (1 << 6)))
+    feat->fua_feat = 1;
+  else
+    feat->fua_feat = 0;
 }
 
 void parse_identify_data(unsigned char *buffer, unsigned int len)
 {
   unsigned short *iden;
+  IDENTIFY_INFO info;
 
   iden = (unsigned short*)buffer;
+  identify_decode(buffer, &info);
 
   if (isDebug)
     printf("\nDEBUG, word[0] %x\n", iden[0]);
   printf("%s Identify data:\n", iden[0] >> 15 ? "ATAPI" : "ATA");
-  printf("Serial number %s\n", (unsigned char *)(iden + 10));
-  printf("Model number %s\n", (unsigned char *)(iden + 27));
+  printf("Serial number %s\n", info.serial);
+  printf("Model number %s\n", info.model);
+  printf("Firmware revision %s\n", info.firmware);
+  if (!info.checksum_ok)
+    printf("Integrity word is missing or doesn't match\n");
 
   // PACKET feature set, bit 4 of WORD 82 & 85, 1 : support while 0 : unsupport
   if (isDebug)
@@ -454,10 +1675,11 @@ void parse_identify_data(unsigned char *buffer, unsigned int len)
   
   if (isDebug)
     printf("\nDEBUG, word[60] %x, word[61] %x\n", iden[60], iden[61]);
-  printf("Total number of user addressable logical sectors for 28-bit commands %x%x\n", iden[61], iden[60]);
+  printf("Total number of user addressable logical sectors for 28-bit commands %u\n", ((unsigned int)iden[61] << 16) | iden[60]);
   if (isDebug)
     printf("\nDEBUG, word[100] %x, word[101] %x, word[102] %x, word[103] %x\n", iden[100], iden[101], iden[102], iden[103]);
-  printf("Total number of user addressable logical sectors for 48-bit commands %x%x%x%x\n", iden[103], iden[102], iden[101], iden[100]);
+  printf("Total number of user addressable logical sectors for 48-bit commands %llu\n", ((unsigned long long)iden[103] << 48) |
+         ((unsigned long long)iden[102] << 32) | ((unsigned long long)iden[101] << 16) | iden[100]);
 
   // NCQ(Native Command Queuing) feature set, bit 8 of WORD 76, 1 : support while 0 : unsupport
   if (isDebug)
@@ -467,6 +1689,44 @@ void parse_identify_data(unsigned char *buffer, unsigned int len)
   else
     printf("NCQ feature set is NOT support\n");
 
+  // NCQ priority information, bit 12 of WORD 76
+  if (isDebug)
+    printf("\nDEBUG, bit 12 of word[76] %x\n", iden[76]);
+  if ((iden[76] & (1 << 8)) && (iden[76] & (1 << 12)))
+    printf("NCQ priority is support\n");
+  else
+    printf("NCQ priority is NOT support\n");
+
+  // APM(Advanced Power Management) feature set, bit 3 of WORD 83 & 86, level in WORD 91
+  if (isDebug)
+    printf("\nDEBUG, bit 3 of word[83] %x, bit 3 of word[86] %x, word[91] %x\n", iden[83], iden[86], iden[91]);
+  if ((iden[83] & (1 << 3)) && (iden[86] & (1 << 3)))
+    printf("APM feature set is enabled, level %x\n", iden[91] & 0xFF);
+  else if (iden[83] & (1 << 3))
+    printf("APM feature set is support, disabled\n");
+  else
+    printf("APM feature set is NOT support\n");
+
+  // EPC(Extended Power Conditions) feature set, bit 7 of WORD 119 & 120
+  if (isDebug)
+    printf("\nDEBUG, bit 7 of word[119] %x, bit 7 of word[120] %x\n", iden[119], iden[120]);
+  if ((iden[119] & (1 << 7)) && (iden[120] & (1 << 7)))
+    printf("EPC feature set is enabled\n");
+  else if (iden[119] & (1 << 7))
+    printf("EPC feature set is support, disabled\n");
+  else
+    printf("EPC feature set is NOT support\n");
+
+  // Zoned capabilities, bit 1:0 of WORD 69
+  if (isDebug)
+    printf("\nDEBUG, bit 1:0 of word[69] %x\n", iden[69]);
+  if ((iden[69] & 0x3) == 1)
+    printf("Zoned : host aware\n");
+  else if ((iden[69] & 0x3) == 2)
+    printf("Zoned : device managed\n");
+  else
+    printf("Zoned : not reported\n");
+
   // TCQ(Tagged Command Queuing) feature set, bit 1 of WORD 83 & 86, 1 : support while 0 : unsupport. Only in IDENTIFY DATA
   if (isDebug)
     printf("\nDEBUG, bit 1 of word[83] %x, bit 1 of word[86] %x\n", iden[83], iden[86]);
@@ -488,6 +1748,32 @@ void parse_identify_data(unsigned char *buffer, unsigned int len)
   else
     printf("Streaming feature set is NOT support\n");
 
+  // Streaming performance parameters, WORD 95 ~ 99
+  if (iden[84] & (1 << 4))
+  {
+    unsigned int gran = ((unsigned int)iden[99] << 16) | iden[98];
+
+    if (isDebug)
+      printf("\nDEBUG, word[95] %x, word[96] %x, word[97] %x, word[98] %x, word[99] %x\n", iden[95], iden[96], iden[97], iden[98], iden[99]);
+    printf("Stream minimum request size %u sectors\n", iden[95]);
+    printf("Streaming performance granularity %u us, access latency %u us\n", gran, iden[97] * gran);
+  }
+
+  // Sector geometry, WORD 106, 117-118 and 209
+  if (isDebug)
+    printf("\nDEBUG, word[106] %x, word[117] %x, word[118] %x, word[209] %x\n", iden[106], iden[117], iden[118], iden[209]);
+  if ((iden[106] & 0xC000) == 0x4000)
+  {
+    unsigned int logical = (iden[106] & (1 << 12)) ? (((unsigned int)iden[118] << 16) | iden[117]) * 2 : 512;
+    unsigned int phys = (iden[106] & (1 << 13)) ? 1 << (iden[106] & 0xF) : 1;
+
+    printf("Logical sector size %u bytes, physical sector size %u bytes\n", logical, logical * phys);
+    if (phys > 1 && (iden[209] & 0xC000) == 0x4000)
+      printf("Logical sector 0 is at offset %u of its physical sector\n", (iden[209] & 0x3FFF) % phys);
+  }
+  else
+    printf("Logical sector size 512 bytes, physical sector size is NOT reported\n");
+
   // Multiple read & write, WORD 59
   if (isDebug)
     printf("\nDEBUG, bit 4 of word[59] %x\n", iden[59]);
@@ -496,6 +1782,21 @@ void parse_identify_data(unsigned char *buffer, unsigned int len)
   else
     printf("Multiple logical sector setting is valid");
 
+  // Volatile write cache, bit 5 of WORD 82 & 85
+  if (isDebug)
+    printf("\nDEBUG, bit 5 of word[82] %x, bit 5 of word[85] %x\n", iden[82], iden[85]);
+  if (iden[82] & (1 << 5))
+    printf("Volatile write cache is supported, %s\n", (iden[85] & (1 << 5)) ? "enabled" : "disabled");
+  else
+    printf("Volatile write cache is NOT supported\n");
+
+  // WRITE DMA FUA EXT and WRITE MULTIPLE FUA EXT, bit 6 of WORD 84 & 87
+  if (isDebug)
+    printf("\nDEBUG, bit 6 of word[84] %x, bit 6 of word[87] %x\n", iden[84], iden[87]);
+  if ((iden[84] & (1 << 6)) && (iden[87] & (1 << 6)))
+    printf("FUA EXT commands are supported\n");
+  else
+    printf("FUA EXT commands are NOT supported\n");
 }
 
 int check_file_state(int fd)
@@ -0,0 +1,460 @@
+//
+// Per-device metrics.
+// The transport calls in here for every request of a device which is attached: commands and bytes by opcode, and by
+// the ATA command of ATA PASS-THROUGH, CHECK CONDITION by sense key, transport errors, time outs and the latency
+// histogram. Latency of a synchronous request is taken around execute, of an asynchronous one from submit to
+// receive by its pack_id. The counters are plain adds of the thread which sends the commands, no atomics, no locks.
+// The text in the OpenMetrics format, refer to https://openmetrics.io, is written:
+//   to the file at exit and on SIGUSR1, through a temporary file and rename(), so a scraper never reads half of it
+//   to whoever connects to the unix socket, checked between commands, with an HTTP header when the client sent GET
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+#include "transport.h"
+#include "retry.h"
+#include "sense.h"
+#include "stats.h"
+
+#define METRICS_PREFIX     "scsidevinfo_"
+#define METRICS_POLL_NS    100000000ULL    // socket checks between commands, at most every 100 ms
+#define METRICS_WAIT_MS    20              // for the request line of a client
+#define METRICS_MAX_DEVICES 256
+
+// host_status and driver_status of sg, refer to include/scsi/scsi.h of linux
+#define DID_TIME_OUT       0x03
+#define DRIVER_TIMEOUT     0x06
+
+///////////////
+// PROTOTYPE
+///////////////
+static void metrics_poll(void);
+
+///////////////
+// LOCALS
+///////////////
+int metrics_enabled = 0;
+
+static int lasterror;
+static DEVICE_METRICS *fd_devices[MAX_TRANSPORT_FD];     // by fd while it's attached
+static DEVICE_METRICS *devices[METRICS_MAX_DEVICES];      // every device attached so far, closed ones included
+static unsigned int ndevices;
+static char metrics_file[256];
+static int listen_fd = -1;
+static unsigned long long last_poll_ns;
+static volatile sig_atomic_t dump_requested;
+
+// upper bounds of the latency buckets in nanoseconds, the last one is +Inf
+static const unsigned long long bucket_ns[METRICS_BUCKETS - 1] = {
+  10000ULL, 25000ULL, 50000ULL, 100000ULL, 250000ULL, 500000ULL,
+  1000000ULL, 2500000ULL, 5000000ULL, 10000000ULL, 25000000ULL, 50000000ULL,
+  100000000ULL, 250000000ULL, 500000000ULL, 1000000000ULL, 2500000000ULL, 10000000000ULL,
+  30000000000ULL
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static void metrics_signal(int sig)
+{
+  dump_requested = 1;
+}
+
+static DEVICE_METRICS *metrics_get(int fd)
+{
+  if (fd < 0 || fd >= MAX_TRANSPORT_FD)
+    return NULL;
+  return fd_devices[fd];
+}
+
+static int metrics_listen(const char *socket_path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(socket_path) >= sizeof(addr.sun_path))
+  {
+    printf("ERROR, %s: socket path %s is too long\n", __func__, socket_path);
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    lasterror = errno;
+    printf("ERROR, %s: socket failed (%d) - %s\n", __func__, lasterror, strerror(lasterror));
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+  unlink(socket_path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+  {
+    lasterror = errno;
+    printf("ERROR, %s: %s can't be listened on (%d) - %s\n", __func__, socket_path, lasterror, strerror(lasterror));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+// Export to the file and over the socket, NULL when not wanted
+int metrics_open(const char *file, const char *socket_path)
+{
+  struct sigaction sa;
+
+  if (file)
+  {
+    snprintf(metrics_file, sizeof(metrics_file), "%s", file);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = metrics_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+  }
+  if (socket_path)
+  {
+    listen_fd = metrics_listen(socket_path);
+    if (listen_fd < 0)
+      return -1;
+  }
+
+  metrics_enabled = file != NULL || socket_path != NULL;
+  return 0;
+}
+
+void metrics_close(void)
+{
+  unsigned int i;
+
+  if (!metrics_enabled)
+    return;
+
+  if (metrics_file[0])
+    metrics_write(metrics_file);
+  if (listen_fd >= 0)
+    close(listen_fd);
+  listen_fd = -1;
+
+  for (i = 0; i < ndevices; i++)
+    free(devices[i]);
+  ndevices = 0;
+  memset(fd_devices, 0, sizeof(fd_devices));
+  metrics_enabled = 0;
+}
+
+// Count the requests of fd under name from now on, a device which was closed goes on with its counters
+void metrics_attach(int fd, const char *name)
+{
+  DEVICE_METRICS *m;
+  unsigned int i;
+
+  if (!metrics_enabled || fd < 0 || fd >= MAX_TRANSPORT_FD || fd_devices[fd])
+    return;
+
+  for (i = 0; i < ndevices; i++)
+  {
+    if (strncmp(devices[i]->name, name, sizeof(devices[i]->name) - 1) == 0)
+    {
+      fd_devices[fd] = devices[i];
+      return;
+    }
+  }
+
+  if (ndevices >= METRICS_MAX_DEVICES || posix_memalign((void **)&m, METRICS_LINE, sizeof(DEVICE_METRICS)) != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return;
+  }
+  memset(m, 0, sizeof(DEVICE_METRICS));
+  snprintf(m->name, sizeof(m->name), "%s", name);
+  devices[ndevices++] = m;
+  fd_devices[fd] = m;
+}
+
+// fd is closed, its counters stay for the export but a new fd of the same number isn't counted to them
+void metrics_detach(int fd)
+{
+  if (fd >= 0 && fd < MAX_TRANSPORT_FD)
+    fd_devices[fd] = NULL;
+}
+
+static void metrics_opcode(DEVICE_METRICS *m, struct sg_io_hdr *io_hdr)
+{
+  unsigned char *cmd = io_hdr->cmdp;
+  unsigned char ata = 0;
+  METRICS_OPCODE *op = NULL;
+  unsigned int i;
+
+  if (cmd[0] == 0x85 && io_hdr->cmd_len >= 16)
+    ata = cmd[14];
+  else if (cmd[0] == 0xA1 && io_hdr->cmd_len >= 12)
+    ata = cmd[9];
+
+  for (i = 0; i < m->nopcodes; i++)
+  {
+    if (m->opcodes[i].opcode == cmd[0] && m->opcodes[i].ata == ata)
+    {
+      op = &m->opcodes[i];
+      break;
+    }
+  }
+  if (op == NULL)
+  {
+    // the last slot takes everything beyond the table
+    op = &m->opcodes[m->nopcodes < METRICS_MAX_OPCODES ? m->nopcodes++ : METRICS_MAX_OPCODES - 1];
+    if (op->commands == 0)
+    {
+      op->opcode = cmd[0];
+      op->ata = ata;
+    }
+  }
+
+  op->commands++;
+  if (io_hdr->dxfer_len > (unsigned int)io_hdr->resid && io_hdr->resid >= 0)
+    op->bytes += io_hdr->dxfer_len - io_hdr->resid;
+}
+
+// A request of fd completed, ns is its latency as the host saw it
+void metrics_complete(int fd, struct sg_io_hdr *io_hdr, unsigned long long ns)
+{
+  DEVICE_METRICS *m = metrics_get(fd);
+  SENSE_INFO sense;
+  unsigned int b;
+
+  if (m == NULL)
+    return;
+
+  metrics_opcode(m, io_hdr);
+
+  // a time out is counted once, as a time out and not as a transport error
+  if (io_hdr->host_status == DID_TIME_OUT || (io_hdr->driver_status & 0x0F) == DRIVER_TIMEOUT)
+    m->timeouts++;
+  else if (io_hdr->host_status != 0 || (io_hdr->driver_status & 0x0F) != 0)
+    m->transport_errors++;
+  // ATA PASS-THROUGH with CK_COND returns the registers by RECOVERED ERROR 00/1D, that isn't an error
+  if (io_hdr->status == 2 && sense_decode(io_hdr->sbp, io_hdr->sb_len_wr, &sense) == 0 &&
+      !(sense.sk == SK_RECOVERED_ERROR && sense.asc == 0x00 && sense.ascq == 0x1D))
+    m->sense[sense.sk & 0x0F]++;
+
+  for (b = 0; b < METRICS_BUCKETS - 1 && ns > bucket_ns[b]; b++)
+    ;
+  m->buckets[b]++;
+  m->latency_ns += ns;
+
+  metrics_poll();
+}
+
+void metrics_submit(int fd, struct sg_io_hdr *io_hdr)
+{
+  DEVICE_METRICS *m = metrics_get(fd);
+
+  if (m)
+    m->submit_ns[io_hdr->pack_id & (METRICS_MAX_TAGS - 1)] = now_ns();
+}
+
+void metrics_receive(int fd, struct sg_io_hdr *io_hdr)
+{
+  DEVICE_METRICS *m = metrics_get(fd);
+  unsigned long long start;
+
+  if (m == NULL)
+    return;
+
+  start = m->submit_ns[io_hdr->pack_id & (METRICS_MAX_TAGS - 1)];
+  metrics_complete(fd, io_hdr, start ? now_ns() - start : 0);
+}
+
+void metrics_retry(int fd)
+{
+  DEVICE_METRICS *m = metrics_get(fd);
+
+  if (m)
+    m->retries++;
+}
+
+static void metrics_family(FILE *fp, const char *name, const char *type, const char *unit, const char *help)
+{
+  fprintf(fp, "# TYPE " METRICS_PREFIX "%s %s\n", name, type);
+  if (unit)
+    fprintf(fp, "# UNIT " METRICS_PREFIX "%s %s\n", name, unit);
+  fprintf(fp, "# HELP " METRICS_PREFIX "%s %s\n", name, help);
+}
+
+// One counter of every device
+static void metrics_device_counter(FILE *fp, const char *name, const char *help, size_t offset)
+{
+  unsigned int i;
+
+  metrics_family(fp, name, "counter", NULL, help);
+  for (i = 0; i < ndevices; i++)
+  {
+    if (devices[i])
+      fprintf(fp, METRICS_PREFIX "%s_total{device=\"%s\"} %llu\n", name, devices[i]->name,
+              *(unsigned long long *)((char *)devices[i] + offset));
+  }
+}
+
+static void metrics_text(FILE *fp)
+{
+  DEVICE_METRICS *m;
+  unsigned char cmd[16];
+  unsigned long long count;
+  unsigned int i, j;
+
+  memset(cmd, 0, sizeof(cmd));
+  metrics_family(fp, "commands", "counter", NULL, "Commands completed, ata is the ATA command of ATA PASS-THROUGH");
+  for (i = 0; i < ndevices; i++)
+  {
+    for (j = 0; (m = devices[i]) != NULL && j < m->nopcodes; j++)
+    {
+      cmd[0] = m->opcodes[j].opcode;
+      cmd[9] = cmd[14] = 0;
+      cmd[cmd[0] == 0xA1 ? 9 : 14] = m->opcodes[j].ata;
+      fprintf(fp, METRICS_PREFIX "commands_total{device=\"%s\",opcode=\"0x%02x\",ata=\"0x%02x\",class=\"%s\"} %llu\n",
+              m->name, m->opcodes[j].opcode, m->opcodes[j].ata, cmd_class_name(cmd_class(cmd)), m->opcodes[j].commands);
+    }
+  }
+
+  metrics_family(fp, "transfer_bytes", "counter", "bytes", "Bytes transferred, the residual excluded");
+  for (i = 0; i < ndevices; i++)
+  {
+    for (j = 0; (m = devices[i]) != NULL && j < m->nopcodes; j++)
+      fprintf(fp, METRICS_PREFIX "transfer_bytes_total{device=\"%s\",opcode=\"0x%02x\",ata=\"0x%02x\"} %llu\n",
+              m->name, m->opcodes[j].opcode, m->opcodes[j].ata, m->opcodes[j].bytes);
+  }
+
+  metrics_family(fp, "sense", "counter", NULL, "CHECK CONDITION by sense key");
+  for (i = 0; i < ndevices; i++)
+  {
+    for (j = 0; (m = devices[i]) != NULL && j < 16; j++)
+    {
+      if (m->sense[j])
+        fprintf(fp, METRICS_PREFIX "sense_total{device=\"%s\",key=\"%s\"} %llu\n", m->name, sense_key_string(j),
+                m->sense[j]);
+    }
+  }
+
+  metrics_device_counter(fp, "transport_errors", "Requests failed by the host adapter or the driver, time outs excluded",
+                         offsetof(DEVICE_METRICS, transport_errors));
+  metrics_device_counter(fp, "timeouts", "Requests timed out", offsetof(DEVICE_METRICS, timeouts));
+  metrics_device_counter(fp, "retries", "Requests sent again by the retry policy", offsetof(DEVICE_METRICS, retries));
+
+  metrics_family(fp, "command_latency_seconds", "histogram", "seconds", "Latency of commands as the host sees it");
+  for (i = 0; i < ndevices; i++)
+  {
+    if ((m = devices[i]) == NULL)
+      continue;
+    for (j = 0, count = 0; j < METRICS_BUCKETS; j++)
+    {
+      count += m->buckets[j];
+      if (j < METRICS_BUCKETS - 1)
+        fprintf(fp, METRICS_PREFIX "command_latency_seconds_bucket{device=\"%s\",le=\"%g\"} %llu\n", m->name,
+                bucket_ns[j] / 1e9, count);
+      else
+        fprintf(fp, METRICS_PREFIX "command_latency_seconds_bucket{device=\"%s\",le=\"+Inf\"} %llu\n", m->name, count);
+    }
+    fprintf(fp, METRICS_PREFIX "command_latency_seconds_sum{device=\"%s\"} %.9f\n", m->name, m->latency_ns / 1e9);
+    fprintf(fp, METRICS_PREFIX "command_latency_seconds_count{device=\"%s\"} %llu\n", m->name, count);
+  }
+
+  fprintf(fp, "# EOF\n");
+}
+
+// Write the metrics to file, readers see the old or the new text
+int metrics_write(const char *file)
+{
+  char tmp[300];
+  FILE *fp;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  fp = fopen(tmp, "w");
+  if (fp == NULL)
+  {
+    lasterror = errno;
+    printf("ERROR, %s: %s can't be written (%d) - %s\n", __func__, tmp, lasterror, strerror(lasterror));
+    return -1;
+  }
+  metrics_text(fp);
+  if (fclose(fp) != 0 || rename(tmp, file) != 0)
+  {
+    lasterror = errno;
+    printf("ERROR, %s: %s can't be written (%d) - %s\n", __func__, file, lasterror, strerror(lasterror));
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+}
+
+// A client of the socket gets the text and the connection is closed, a GET gets an HTTP response around it
+static void metrics_serve(int client)
+{
+  struct pollfd pfd;
+  char request[512];
+  char *text = NULL;
+  size_t len = 0;
+  ssize_t n = 0;
+  size_t off;
+  FILE *fp;
+
+  pfd.fd = client;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, METRICS_WAIT_MS) > 0)
+    n = read(client, request, sizeof(request) - 1);
+
+  fp = open_memstream(&text, &len);
+  if (fp == NULL)
+    return;
+  if (n >= 4 && strncmp(request, "GET ", 4) == 0)
+    fprintf(fp, "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n\r\n");
+  metrics_text(fp);
+  fclose(fp);
+
+  for (off = 0; off < len; off += n)
+  {
+    n = send(client, text + off, len - off, MSG_NOSIGNAL);
+    if (n <= 0)
+      break;
+  }
+  free(text);
+}
+
+// Between commands: a dump requested by SIGUSR1, clients waiting on the socket
+static void metrics_poll(void)
+{
+  unsigned long long now;
+  int client;
+
+  if (dump_requested)
+  {
+    dump_requested = 0;
+    metrics_write(metrics_file);
+  }
+
+  if (listen_fd < 0)
+    return;
+  now = now_ns();
+  if (now - last_poll_ns < METRICS_POLL_NS)
+    return;
+  last_poll_ns = now;
+
+  while ((client = accept(listen_fd, NULL, NULL)) >= 0)
+  {
+    metrics_serve(client);
+    close(client);
+  }
+}
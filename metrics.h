@@ -0,0 +1,50 @@
+//
+// Per-device command counters and latency histograms, exported in the OpenMetrics text format
+// to a file or over a local socket
+//
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <scsi/sg.h>
+
+#define METRICS_MAX_OPCODES   32          // distinct opcode / ATA command pairs of a device
+#define METRICS_MAX_TAGS      256         // pack_ids tracked between submit and receive
+#define METRICS_BUCKETS       20          // latency histogram, the last bucket is +Inf
+#define METRICS_LINE          64          // bytes of a cache line
+
+typedef struct _METRICS_OPCODE {
+  unsigned char opcode;
+  unsigned char ata;                      // ATA command of ATA PASS-THROUGH, ZERO otherwise
+  unsigned long long commands;
+  unsigned long long bytes;               // transferred, residual excluded
+} METRICS_OPCODE;
+
+// Written by the one thread which sends the commands of the device, each on its own cache lines,
+// so that a device never shares a line with another
+typedef struct _DEVICE_METRICS {
+  char name[128];
+  METRICS_OPCODE opcodes[METRICS_MAX_OPCODES];
+  unsigned int nopcodes;
+  unsigned long long sense[16];           // CHECK CONDITION by sense key
+  unsigned long long transport_errors;    // host or driver status, time outs excluded
+  unsigned long long timeouts;
+  unsigned long long retries;
+  unsigned long long buckets[METRICS_BUCKETS];
+  unsigned long long latency_ns;          // sum
+  unsigned long long submit_ns[METRICS_MAX_TAGS];
+} __attribute__((aligned(METRICS_LINE))) DEVICE_METRICS;
+
+extern int metrics_enabled;
+
+int  metrics_open(const char *file, const char *socket_path);
+void metrics_close(void);
+void metrics_attach(int fd, const char *name);
+void metrics_detach(int fd);
+void metrics_submit(int fd, struct sg_io_hdr *io_hdr);
+void metrics_complete(int fd, struct sg_io_hdr *io_hdr, unsigned long long ns);
+void metrics_receive(int fd, struct sg_io_hdr *io_hdr);
+void metrics_retry(int fd);
+int  metrics_write(const char *file);
+
+#endif
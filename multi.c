@@ -0,0 +1,303 @@
+//
+// Multi-device scan.
+// Every device has its own IO queue and they are all served by one loop: commands go out round robin, one per
+// device per round, starting from the next device every round, as long as every link on the path of the device
+// has tokens, and completions are reaped from whichever queue has them. Devices behind a link which is full wait
+// together and get the link in turn, so every one of them gets its share and a device which can't use its share
+// leaves it to the others. Without limits, e.g. devices with no topology, it is a plain parallel scan
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "multi.h"
+#include "queue.h"
+#include "stats.h"
+
+#define MULTI_CHUNK        256         // 128 KiB
+#define MULTI_DEPTH        8
+#define MULTI_IDLE_NS      50000ULL    // longest sleep while nothing can go and nothing completed
+#define MULTI_REPORT_NS    1000000000ULL
+
+typedef struct _MULTI_DRIVE {
+  DEVICE_CONTEXT *dev;
+  int has_path;
+  TOPO_PATH path;
+  IO_QUEUE q;
+  char *buffers;
+  unsigned int chunk;
+  unsigned long long next;
+  unsigned long long end;
+  unsigned long long bytes;
+  unsigned int errors;
+  int done;
+  double seconds;                 // from the start until the last command completed
+} MULTI_DRIVE;
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static int drive_setup(MULTI_DRIVE *d, DEVICE_CONTEXT *dev, MULTI_CONFIG *config, unsigned int depth)
+{
+  unsigned long long capacity = device_capacity(dev);
+  unsigned int chunk = config->chunk ? config->chunk : MULTI_CHUNK;
+
+  memset(d, 0, sizeof(MULTI_DRIVE));
+  d->dev = dev;
+  d->chunk = device_align_sectors(dev, chunk);
+  if (d->chunk == 0)
+  {
+    printf("ERROR, %s: %u sectors per command can't hold a physical sector of %u\n", __func__, dev->max_sectors,
+           dev->phys_sectors);
+    return -1;
+  }
+  d->next = config->startlba;
+  d->end = config->sectors && config->startlba + config->sectors < capacity ? config->startlba + config->sectors : capacity;
+  if (d->next >= d->end)
+  {
+    printf("ERROR, %s: lba 0x%llx is beyond %s\n", __func__, d->next, dev->dev_path);
+    return -1;
+  }
+
+  if (ioq_init(&d->q, dev, depth) != 0)
+    return -1;
+  d->buffers = (char *)malloc((unsigned long)depth * d->chunk * dev->sector_size);
+  if (d->buffers == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+  return 0;
+}
+
+// Next command of the drive when its links let it go
+static int drive_send(MULTI_DRIVE *d, TOPOLOGY *t)
+{
+  IO_REQUEST *req;
+  unsigned int sectors;
+
+  if (d->next >= d->end || d->q.nfree == 0)
+    return 0;
+  if (d->has_path && !topo_admit(t, &d->path))
+    return 0;
+
+  sectors = d->end - d->next < d->chunk ? d->end - d->next : d->chunk;
+  req = ioq_get(&d->q);
+  req->isread = 1;
+  req->startlba = d->next;
+  req->sectors = sectors;
+  req->databuffer = d->buffers + (unsigned long)req->tag * d->chunk * d->dev->sector_size;
+  d->next += sectors;
+
+  if (ioq_submit(&d->q, req) != 0)
+  {
+    printf("ERROR, %s: lba 0x%lx, sectors %u can't be sent\n", d->dev->dev_path, req->startlba, sectors);
+    d->errors++;
+    ioq_put(&d->q, req);
+    return 1;
+  }
+  if (d->has_path)
+    topo_charge(t, &d->path, (unsigned long long)sectors * d->dev->sector_size);
+  return 1;
+}
+
+static unsigned int drive_reap(MULTI_DRIVE *d)
+{
+  IO_REQUEST *req;
+  unsigned int reaped = 0;
+
+  while (ioq_ready(&d->q))
+  {
+    req = ioq_reap(&d->q);
+    if (req == NULL)
+    {
+      // the drive stopped completing commands, what is in flight and what is left fails
+      printf("ERROR, %s: receive failed, the drive is given up\n", d->dev->dev_path);
+      d->errors += ioq_abandon(&d->q) + (d->end - d->next + d->chunk - 1) / d->chunk;
+      d->next = d->end;
+      break;
+    }
+
+    if (req->status != 0)
+    {
+      d->errors++;
+      printf("ERROR, %s: lba 0x%lx, sectors %u\n", d->dev->dev_path, req->startlba, req->sectors);
+    }
+    else
+      d->bytes += (unsigned long long)req->sectors * d->dev->sector_size;
+    ioq_put(&d->q, req);
+    reaped++;
+  }
+  return reaped;
+}
+
+// Jain's fairness index of the throughput of the drives behind the link, 1 : all the same
+static double link_fairness(MULTI_DRIVE *drives, unsigned int n, unsigned int link)
+{
+  double sum = 0, sum2 = 0, x;
+  unsigned int users = 0;
+  unsigned int i, j;
+
+  for (i = 0; i < n; i++)
+  {
+    for (j = 0; drives[i].has_path && j < drives[i].path.nlinks; j++)
+    {
+      if (drives[i].path.links[j] != link)
+        continue;
+      x = drives[i].seconds > 0 ? drives[i].bytes / drives[i].seconds : 0;
+      sum += x;
+      sum2 += x * x;
+      users++;
+    }
+  }
+  return users && sum2 > 0 ? sum * sum / (users * sum2) : 1;
+}
+
+int multi_scan(DEVICE_CONTEXT **devs, unsigned int ndevs, MULTI_CONFIG *config)
+{
+  MULTI_DRIVE *drives;
+  TOPOLOGY *t;
+  unsigned int depth = config->depth ? config->depth : MULTI_DEPTH;
+  unsigned int active = ndevs;
+  unsigned int rr = 0;
+  unsigned int burst = 0;
+  unsigned int i, k, sent, progress;
+  unsigned long long start, now, wait, ns, last_report, total = 0;
+  double seconds;
+  int ret = 0;
+
+  if (depth > IOQ_MAX_DEPTH)
+    depth = IOQ_MAX_DEPTH;
+
+  drives = (MULTI_DRIVE *)calloc(ndevs, sizeof(MULTI_DRIVE));
+  t = (TOPOLOGY *)malloc(sizeof(TOPOLOGY));
+  if (drives == NULL || t == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(drives);
+    free(t);
+    return -1;
+  }
+
+  topo_init(t);
+  for (i = 0; i < ndevs; i++)
+  {
+    if (drive_setup(&drives[i], devs[i], config, depth) != 0)
+    {
+      ret = -1;
+      goto out;
+    }
+    drives[i].has_path = topo_add_device(t, devs[i], &drives[i].path) == 0;
+    if (drives[i].chunk * devs[i]->sector_size > burst)
+      burst = drives[i].chunk * devs[i]->sector_size;
+  }
+  topo_apply_limits(t, config->limits, config->nlimits, burst);
+
+  printf("topology\n");
+  for (i = 0; i < ndevs; i++)
+  {
+    if (drives[i].has_path)
+      topo_print(t, &drives[i].path, devs[i]->dev_path);
+    else
+      printf("%s: no topology, not limited\n", devs[i]->dev_path);
+  }
+  printf("multi scan of %u devices, %u commands in flight each\n", ndevs, depth);
+
+  start = now_ns();
+  last_report = start;
+  while (active)
+  {
+    now = now_ns();
+    topo_refill(t, now);
+    progress = 0;
+
+    do
+    {
+      sent = 0;
+      for (k = 0; k < ndevs; k++)
+        sent += drive_send(&drives[(rr + k) % ndevs], t);
+      rr = (rr + 1) % ndevs;
+      progress += sent;
+    } while (sent);
+
+    for (i = 0; i < ndevs; i++)
+    {
+      progress += drive_reap(&drives[i]);
+      if (!drives[i].done && drives[i].next >= drives[i].end && drives[i].q.inflight == 0)
+      {
+        drives[i].done = 1;
+        drives[i].seconds = (now_ns() - start) / 1e9;
+        active--;
+      }
+    }
+
+    now = now_ns();
+    if (now - last_report >= MULTI_REPORT_NS)
+    {
+      for (i = 0, total = 0; i < ndevs; i++)
+        total += drives[i].bytes;
+      printf("%.1f s, %.1f MB/s in total\n", (now - start) / 1e9, total / ((now - start) / 1e9) / 1e6);
+      last_report = now;
+    }
+
+    if (progress == 0)
+    {
+      // nothing went and nothing came back, sleep until a link has tokens or a command may have completed
+      wait = MULTI_IDLE_NS;
+      for (i = 0; i < ndevs; i++)
+      {
+        if (drives[i].has_path && drives[i].next < drives[i].end && drives[i].q.nfree)
+        {
+          ns = topo_wait_ns(t, &drives[i].path);
+          if (ns && ns < wait)
+            wait = ns;
+        }
+      }
+      sleep_ns(wait);
+    }
+  }
+  seconds = (now_ns() - start) / 1e9;
+
+  printf("%-32s %10s %8s %8s\n", "device", "MB/s", "seconds", "errors");
+  for (i = 0, total = 0; i < ndevs; i++)
+  {
+    total += drives[i].bytes;
+    printf("%-32s %10.1f %8.2f %8u\n", devs[i]->dev_path,
+           drives[i].seconds > 0 ? drives[i].bytes / drives[i].seconds / 1e6 : 0, drives[i].seconds, drives[i].errors);
+    if (drives[i].errors)
+      ret = -1;
+  }
+  printf("%-32s %10.1f %8.2f\n", "total", seconds > 0 ? total / seconds / 1e6 : 0, seconds);
+
+  printf("%-20s %-9s %7s %10s %10s %6s %9s\n", "link", "type", "devices", "limit MB/s", "MB/s", "util", "fairness");
+  for (i = 0; i < t->nlinks; i++)
+  {
+    TOPO_LINK *link = &t->links[i];
+
+    printf("%-20s %-9s %7u", link->name, link_type_name(link->type), link->users);
+    if (link->rate > 0)
+      printf(" %10.0f %10.1f %5.1f%%", link->rate / 1e6, link->bytes / seconds / 1e6,
+             100.0 * link->bytes / seconds / link->rate);
+    else
+      printf(" %10s %10.1f %6s", "-", link->bytes / seconds / 1e6, "-");
+    printf(" %9.3f\n", link_fairness(drives, ndevs, i));
+  }
+
+out:
+  for (i = 0; i < ndevs; i++)
+  {
+    if (drives[i].q.dev)
+      ioq_drain(&drives[i].q);
+    free(drives[i].buffers);
+  }
+  free(drives);
+  free(t);
+  return ret;
+}
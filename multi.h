@@ -0,0 +1,24 @@
+//
+// Multi-device scan, many drives read at once within the bandwidth of the links they share
+//
+
+#ifndef _MULTI_H_
+#define _MULTI_H_
+
+#include "device.h"
+#include "topo.h"
+
+#define MULTI_MAX_DEVICES  16
+
+typedef struct _MULTI_CONFIG {
+  unsigned long long startlba;
+  unsigned long long sectors;     // per device, ZERO : to the end of every device
+  unsigned int chunk;             // sectors per command, ZERO : MULTI_CHUNK
+  unsigned int depth;             // commands in flight per device, ZERO : MULTI_DEPTH
+  const TOPO_LIMIT *limits;       // throughput limits of links by name
+  unsigned int nlimits;
+} MULTI_CONFIG;
+
+int multi_scan(DEVICE_CONTEXT **devs, unsigned int ndevs, MULTI_CONFIG *config);
+
+#endif
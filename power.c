@@ -0,0 +1,278 @@
+//
+// Power state transition profiler.
+// Every state is entered repeats times: the drive is woken with a read, put into the state by STANDBY IMMEDIATE,
+// IDLE IMMEDIATE, EPC Go To Power Condition or left alone under an APM level, CHECK POWER MODE tells where it went
+// without waking it, then a read of a random LBA is timed. That first I/O carries the spin-up or head load of
+// the state. Reads go out once with a long timeout, a retry of a read which waits for spin-up would hide it.
+// The APM level and EPC settings of the drive are restored at the end
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "power.h"
+#include "command.h"
+#include "transport.h"
+#include "stats.h"
+
+#define POWER_REPEATS         5
+#define POWER_SETTLE_MS       100         // after an immediate command, before CHECK POWER MODE
+#define POWER_APM_DWELL_MS    5000
+#define POWER_CHUNK           8           // 4 KiB reads
+#define POWER_IO_TIMEOUT_MS   60000       // spin-up of a large drive takes 10 ~ 20 s
+#define POWER_MAX_APM         16
+#define POWER_MAX_STATES      (8 + POWER_MAX_APM)
+
+typedef enum _POWER_METHOD {
+  PM_ACTIVE = 0,         // no transition, the baseline
+  PM_IDLE,               // IDLE IMMEDIATE
+  PM_STANDBY,            // STANDBY IMMEDIATE
+  PM_EPC,                // EPC Go To Power Condition
+  PM_APM                 // APM level and dwell
+} POWER_METHOD;
+
+typedef struct _POWER_STATE {
+  char name[24];
+  POWER_METHOD method;
+  unsigned int arg;               // power condition ID of EPC, APM level
+  LAT_STATS first;                // first I/O out of the state
+  LAT_STATS enter;                // the command which entered the state
+  unsigned int modes[256];        // CHECK POWER MODE before the first I/O
+  unsigned int errors;
+} POWER_STATE;
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+const char *power_mode_name(unsigned int mode)
+{
+  switch (mode)
+  {
+    case POWER_MODE_STANDBY_Z: return "standby";
+    case POWER_MODE_STANDBY_Y: return "standby_y";
+    case POWER_MODE_IDLE:      return "idle";
+    case POWER_MODE_IDLE_A:    return "idle_a";
+    case POWER_MODE_IDLE_B:    return "idle_b";
+    case POWER_MODE_IDLE_C:    return "idle_c";
+    case POWER_MODE_ACTIVE:    return "active";
+    default:                   return "unknown";
+  }
+}
+
+// One read at a random LBA, ns is its latency
+static int power_read(DEVICE_CONTEXT *dev, char *buffer, unsigned long long *ns)
+{
+  struct sg_io_hdr io_hdr;
+  unsigned char cmd[16];
+  unsigned char sense_b[64];
+  unsigned long long lba = device_align_down(dev, stats_random() % (device_capacity(dev) - POWER_CHUNK));
+  unsigned long long start;
+  int cmdsize;
+
+  cmdsize = device_rw_cdb(dev, 1, 0, 0, lba, POWER_CHUNK, cmd);
+  sg_io_setup(&io_hdr, cmd, cmdsize, 1, buffer, POWER_CHUNK * dev->sector_size, sense_b, sizeof(sense_b),
+              POWER_IO_TIMEOUT_MS);
+
+  start = now_ns();
+  if (sg_execute(dev->fd, &io_hdr) < 0)
+    return -1;
+  *ns = now_ns() - start;
+
+  return sg_io_check(&io_hdr);
+}
+
+// Put the drive into the state, ns is the latency of the command which did it
+static int power_enter(DEVICE_CONTEXT *dev, POWER_STATE *state, unsigned int dwell_ms, unsigned long long *ns)
+{
+  unsigned long long start = now_ns();
+  int ret = 0;
+
+  switch (state->method)
+  {
+    case PM_IDLE:
+      ret = power_immediate(dev->fd, 0);
+      break;
+    case PM_STANDBY:
+      ret = power_immediate(dev->fd, 1);
+      break;
+    case PM_EPC:
+      ret = epc_set_features(dev->fd, EPC_GO_TO_CONDITION, state->arg);
+      break;
+    case PM_APM:
+      ret = set_features(dev->fd, SF_ENABLE_APM, state->arg);
+      break;
+    default:
+      break;
+  }
+  *ns = now_ns() - start;
+  if (ret != 0)
+    return -1;
+
+  sleep_ns((state->method == PM_APM ? dwell_ms : (state->method == PM_ACTIVE ? 0 : POWER_SETTLE_MS)) * 1000000ULL);
+  return 0;
+}
+
+static void power_add_state(POWER_STATE *states, unsigned int *nstates, const char *name, POWER_METHOD method,
+                            unsigned int arg)
+{
+  POWER_STATE *state = &states[*nstates];
+
+  memset(state, 0, sizeof(POWER_STATE));
+  snprintf(state->name, sizeof(state->name), "%s", name);
+  state->method = method;
+  state->arg = arg;
+  stats_reset(&state->first);
+  stats_reset(&state->enter);
+  (*nstates)++;
+}
+
+// Mode most often seen before the first I/O
+static unsigned int power_common_mode(POWER_STATE *state)
+{
+  unsigned int mode = POWER_MODE_ACTIVE;
+  unsigned int i;
+
+  for (i = 0; i < 256; i++)
+  {
+    if (state->modes[i] > state->modes[mode])
+      mode = i;
+  }
+  return mode;
+}
+
+int power_profile(DEVICE_CONTEXT *dev, POWER_CONFIG *config)
+{
+  POWER_STATE *states;
+  char *buffer;
+  char name[24];
+  unsigned int nstates = 0;
+  unsigned int repeats = config->repeats ? config->repeats : POWER_REPEATS;
+  unsigned int dwell_ms = config->dwell_ms ? config->dwell_ms : POWER_APM_DWELL_MS;
+  unsigned long long ns, active_p50;
+  unsigned int mode;
+  unsigned int i, r;
+
+  if (!dev->ata_valid || device_capacity(dev) <= POWER_CHUNK)
+  {
+    printf("ERROR, %s: power states are set by ATA commands, the device doesn't take them\n", __func__);
+    return -1;
+  }
+  if (config->napm && !dev->ata.apm_feat)
+  {
+    printf("ERROR, %s: the device doesn't support APM\n", __func__);
+    return -1;
+  }
+
+  states = (POWER_STATE *)malloc(POWER_MAX_STATES * sizeof(POWER_STATE));
+  buffer = (char *)malloc(POWER_CHUNK * dev->sector_size);
+  if (states == NULL || buffer == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(states);
+    free(buffer);
+    return -1;
+  }
+
+  power_add_state(states, &nstates, "active", PM_ACTIVE, 0);
+  power_add_state(states, &nstates, "idle immediate", PM_IDLE, 0);
+  power_add_state(states, &nstates, "standby immediate", PM_STANDBY, 0);
+  if (dev->ata.epc_feat == 2)
+  {
+    power_add_state(states, &nstates, "epc idle_a", PM_EPC, POWER_MODE_IDLE_A);
+    power_add_state(states, &nstates, "epc idle_b", PM_EPC, POWER_MODE_IDLE_B);
+    power_add_state(states, &nstates, "epc idle_c", PM_EPC, POWER_MODE_IDLE_C);
+    power_add_state(states, &nstates, "epc standby_y", PM_EPC, POWER_MODE_STANDBY_Y);
+    power_add_state(states, &nstates, "epc standby_z", PM_EPC, POWER_MODE_STANDBY_Z);
+  }
+  else if (dev->ata.epc_feat)
+    printf("EPC is supported but disabled, EPC states are skipped\n");
+  for (i = 0; i < config->napm && i < POWER_MAX_APM; i++)
+  {
+    snprintf(name, sizeof(name), "apm %u", config->apm_levels[i]);
+    power_add_state(states, &nstates, name, PM_APM, config->apm_levels[i]);
+  }
+
+  printf("power profile of %u states, %u transitions each", nstates, repeats);
+  if (config->napm)
+    printf(", APM dwell %u ms", dwell_ms);
+  printf("\n");
+
+  for (i = 0; i < nstates; i++)
+  {
+    POWER_STATE *state = &states[i];
+
+    for (r = 0; r < repeats; r++)
+    {
+      // start from active, then enter the state
+      if (power_read(dev, buffer, &ns) != 0 || power_enter(dev, state, dwell_ms, &ns) != 0)
+      {
+        state->errors++;
+        continue;
+      }
+      stats_add(&state->enter, ns);
+
+      mode = POWER_MODE_ACTIVE;
+      if (check_power_mode(dev->fd, &mode) == 0)
+        state->modes[mode & 0xFF]++;
+
+      if (power_read(dev, buffer, &ns) != 0)
+      {
+        state->errors++;
+        continue;
+      }
+      stats_add(&state->first, ns);
+
+      if (isDebug)
+        printf("DEBUG, %s #%u: mode %s, first I/O %.1f us\n", state->name, r, power_mode_name(mode), ns / 1e3);
+    }
+
+    printf("%s done, first I/O p50 %.1f ms\n", state->name, stats_percentile(&state->first, 50) / 1e6);
+  }
+
+  // back to the settings of the drive
+  if (config->napm)
+  {
+    if (dev->ata.apm_feat == 2)
+      set_features(dev->fd, SF_ENABLE_APM, dev->ata.apm_level);
+    else
+      set_features(dev->fd, SF_DISABLE_APM, 0);
+  }
+  if (dev->ata.epc_feat == 2)
+    epc_set_features(dev->fd, EPC_RESTORE, 0xFF);
+  power_read(dev, buffer, &ns);
+
+  active_p50 = stats_percentile(&states[0].first, 50);
+  printf("%-18s %-10s %10s %10s %10s %10s %8s%s\n", "state", "mode", "enter ms", "p50 ms", "p99 ms", "max ms",
+         "x active", config->slo_us ? "  slo" : "");
+  for (i = 0; i < nstates; i++)
+  {
+    POWER_STATE *state = &states[i];
+    unsigned long long p50 = stats_percentile(&state->first, 50);
+
+    if (state->first.count == 0)
+    {
+      printf("%-18s failed, %u errors\n", state->name, state->errors);
+      continue;
+    }
+
+    printf("%-18s %-10s %10.3f %10.3f %10.3f %10.3f %8.1f", state->name, power_mode_name(power_common_mode(state)),
+           stats_mean(&state->enter) / 1e6, p50 / 1e6, stats_percentile(&state->first, 99) / 1e6,
+           state->first.max / 1e6, active_p50 ? (double)p50 / active_p50 : 0);
+    if (config->slo_us)
+      printf("  %s", state->first.max <= (unsigned long long)config->slo_us * 1000 ? "safe" : "UNSAFE");
+    if (state->errors)
+      printf("  %u errors", state->errors);
+    printf("\n");
+  }
+
+  free(states);
+  free(buffer);
+  return 0;
+}
@@ -0,0 +1,21 @@
+//
+// Power state transition profiler, latency of the first I/O out of every power state
+//
+
+#ifndef _POWER_H_
+#define _POWER_H_
+
+#include "device.h"
+
+typedef struct _POWER_CONFIG {
+  unsigned int repeats;           // transitions per state, ZERO : POWER_REPEATS
+  unsigned int dwell_ms;          // time left alone under an APM level, ZERO : POWER_APM_DWELL_MS
+  const unsigned int *apm_levels; // APM levels to profile, the device goes down by its own timers
+  unsigned int napm;
+  unsigned int slo_us;            // first I/O latency target, ZERO : none
+} POWER_CONFIG;
+
+int power_profile(DEVICE_CONTEXT *dev, POWER_CONFIG *config);
+const char *power_mode_name(unsigned int mode);
+
+#endif
@@ -0,0 +1,79 @@
+//
+// Adaptive queue depth.
+// Every window of completions the p99 latency of the window is compared with the target: under it the depth
+// goes up by one, over it the depth is cut by QDC_DECREASE. The window grows with the depth, so that a
+// decision always sees a few completions of every slot. The window after a cut is not judged, its commands
+// were sent before the cut. Latency of the own commands is the signal, when the
+// device is shared it rises together with the latency the other users see
+//
+#include <stdio.h>
+#include <string.h>
+
+#include "qdctl.h"
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+void qdc_init(QD_CONTROL *c, unsigned int min_depth, unsigned int max_depth, unsigned long long target_ns)
+{
+  memset(c, 0, sizeof(QD_CONTROL));
+  c->min_depth = min_depth ? min_depth : 1;
+  c->max_depth = max_depth > c->min_depth ? max_depth : c->min_depth;
+  c->depth = c->min_depth;
+  c->target_ns = target_ns;
+}
+
+unsigned int qdc_depth(QD_CONTROL *c)
+{
+  return (unsigned int)c->depth;
+}
+
+// Account a completion, return 1 when the depth is changed
+int qdc_complete(QD_CONTROL *c, unsigned long long lat_ns)
+{
+  unsigned int window = QDC_MIN_WINDOW;
+  unsigned int old = qdc_depth(c);
+
+  if (c->target_ns == 0)
+    return 0;
+
+  if (window < old * 4)
+    window = old * 4;
+
+  stats_add(&c->lat, lat_ns);
+  if (++c->window < window)
+    return 0;
+
+  c->last_p99 = stats_percentile(&c->lat, 99);
+  if (c->holdoff)
+    c->holdoff = 0;
+  else if (c->last_p99 > c->target_ns)
+  {
+    c->depth *= QDC_DECREASE;
+    if (c->depth < c->min_depth)
+      c->depth = c->min_depth;
+    c->decreases++;
+    c->holdoff = 1;
+  }
+  else if (c->depth < c->max_depth)
+  {
+    c->depth += 1;
+    if (c->depth > c->max_depth)
+      c->depth = c->max_depth;
+    c->increases++;
+  }
+
+  c->window = 0;
+  stats_reset(&c->lat);
+
+  if (isDebug && qdc_depth(c) != old)
+    printf("DEBUG, p99 %llu us, target %llu us, depth %u -> %u\n", c->last_p99 / 1000, c->target_ns / 1000, old, qdc_depth(c));
+
+  return qdc_depth(c) != old;
+}
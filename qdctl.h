@@ -0,0 +1,30 @@
+//
+// Adaptive queue depth, additive increase / multiplicative decrease on the p99 completion latency
+//
+
+#ifndef _QDCTL_H_
+#define _QDCTL_H_
+
+#include "stats.h"
+
+#define QDC_MIN_WINDOW   16      // completions per decision at least
+#define QDC_DECREASE     0.5     // depth is multiplied by it when the target is missed
+
+typedef struct _QD_CONTROL {
+  unsigned int min_depth;
+  unsigned int max_depth;
+  double depth;                   // fractional, commands in flight is the integer part
+  unsigned long long target_ns;   // p99 completion latency target
+  unsigned int window;            // completions of the current window
+  LAT_STATS lat;                  // latency of the current window
+  unsigned long long last_p99;
+  unsigned int holdoff;           // 1 : the window after a cut, its commands were sent at the old depth
+  unsigned int increases;
+  unsigned int decreases;
+} QD_CONTROL;
+
+void qdc_init(QD_CONTROL *c, unsigned int min_depth, unsigned int max_depth, unsigned long long target_ns);
+int  qdc_complete(QD_CONTROL *c, unsigned long long lat_ns);
+unsigned int qdc_depth(QD_CONTROL *c);
+
+#endif
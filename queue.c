@@ -0,0 +1,329 @@
+//
+// Queued data transfer.
+// A request owns a tag from the moment it is taken by ioq_get() until it is given back by ioq_put(),
+// the tag goes into the command block of DMA QUEUED / FPDMA QUEUED and is the pack_id of the sg request.
+// When the transport takes batches, ioq_submit() only holds the request, ioq_reap() sends everything held
+// by one system call and receives every completed request by another.
+// A retry waits for its backoff in the queue, not in ioq_reap(), so the other commands in flight are reaped meanwhile
+//
+#include <stdio.h>
+#include <string.h>
+
+#include "queue.h"
+#include "transport.h"
+#include "stats.h"
+#include "retry.h"
+#include "metrics.h"
+
+///////////////
+// PROTOTYPE
+///////////////
+static int ioq_send(IO_QUEUE *q, IO_REQUEST *req);
+static void ioq_resend(IO_QUEUE *q);
+static int ioq_wait(IO_QUEUE *q);
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+int ioq_init(IO_QUEUE *q, DEVICE_CONTEXT *dev, unsigned int depth)
+{
+  unsigned int i;
+
+  if (depth == 0 || depth > IOQ_MAX_DEPTH)
+  {
+    printf("queue depth %u is out of 1 ~ %d\n", depth, IOQ_MAX_DEPTH);
+    return -1;
+  }
+
+  memset(q, 0, sizeof(IO_QUEUE));
+  q->dev = dev;
+  q->depth = depth;
+  q->async = sg_async_supported(dev->fd);
+  q->batch = q->async && sg_batch_supported(dev->fd);
+
+  // the last tag is taken first, so that tag 0 goes out first
+  for (i = 0; i < depth; i++)
+    q->freetags[i] = depth - 1 - i;
+  q->nfree = depth;
+
+  if (!q->async && depth > 1 && isDebug)
+    printf("DEBUG, %s has no asynchronous interface, commands go one by one\n", dev->dev_path);
+
+  return 0;
+}
+
+IO_REQUEST *ioq_get(IO_QUEUE *q)
+{
+  IO_REQUEST *req;
+  unsigned int tag;
+
+  if (q->nfree == 0)
+    return NULL;
+
+  tag = q->freetags[--q->nfree];
+  req = &q->reqs[tag];
+  memset(req, 0, sizeof(IO_REQUEST));
+  req->tag = tag;
+
+  return req;
+}
+
+void ioq_put(IO_QUEUE *q, IO_REQUEST *req)
+{
+  q->freetags[q->nfree++] = req->tag;
+}
+
+// Build the command of isread/flags/startlba/sectors/databuffer for the protocol of the device and send it
+int ioq_submit(IO_QUEUE *q, IO_REQUEST *req)
+{
+  DEVICE_CONTEXT *dev = q->dev;
+  int cmdsize;
+
+  if (req->isverify)
+  {
+    cmdsize = device_verify_cdb(dev, req->startlba, req->sectors, req->cmd);
+    sg_io_setup(&req->io_hdr, req->cmd, cmdsize, 0, NULL, 0, req->sense_b, sizeof(req->sense_b), 0);
+  }
+  else
+  {
+    cmdsize = device_rw_cdb(dev, req->isread, req->tag, req->flags, req->startlba, req->sectors, req->cmd);
+    sg_io_setup(&req->io_hdr, req->cmd, cmdsize, req->isread, req->databuffer, req->sectors * dev->sector_size,
+                req->sense_b, sizeof(req->sense_b), 0);
+  }
+  req->io_hdr.pack_id = req->tag;
+  req->io_hdr.usr_ptr = req;
+  req->attempt = 0;
+
+  req->submit_ns = now_ns();
+  q->inflight++;
+
+  if (!q->async)
+  {
+    req->status = sg_command(dev->fd, &req->io_hdr);
+    req->complete_ns = now_ns();
+    q->done[q->ndone++] = req;
+    return 0;
+  }
+
+  if (ioq_send(q, req) != 0)
+  {
+    q->inflight--;
+    return -1;
+  }
+
+  return 0;
+}
+
+// Send the request as it is set up, again when it is retried
+static int ioq_send(IO_QUEUE *q, IO_REQUEST *req)
+{
+  req->io_hdr.timeout = policy_timeout(req->cmd, req->attempt);
+  req->io_hdr.sb_len_wr = 0;
+  req->send_ns = now_ns();
+
+  if (q->batch)
+  {
+    q->held[q->nheld++] = &req->io_hdr;
+    return 0;
+  }
+
+  return sg_submit(q->dev->fd, &req->io_hdr);
+}
+
+// Send the retries whose backoff is over, those which couldn't be sent complete as failed
+static void ioq_resend(IO_QUEUE *q)
+{
+  unsigned long long now = now_ns();
+  IO_REQUEST *req;
+  unsigned int i = 0;
+
+  while (i < q->ndelayed)
+  {
+    req = q->delayed[i];
+    if (req->resend_ns > now)
+    {
+      i++;
+      continue;
+    }
+
+    q->delayed[i] = q->delayed[--q->ndelayed];
+    if (ioq_send(q, req) != 0)
+    {
+      req->status = -1;
+      req->complete_ns = now_ns();
+      q->done[q->ndone++] = req;
+    }
+  }
+}
+
+// Wait for a completion until the next retry is due, 1 : one is there to be received
+static int ioq_wait(IO_QUEUE *q)
+{
+  unsigned long long now = now_ns();
+  unsigned long long due = ~0ULL;
+  unsigned int i;
+
+  for (i = 0; i < q->ndelayed; i++)
+  {
+    if (q->delayed[i]->resend_ns < due)
+      due = q->delayed[i]->resend_ns;
+  }
+  if (due <= now)
+    return 0;
+
+  // nothing but retries in flight
+  if (q->inflight == q->ndelayed + q->ndone)
+  {
+    policy_backoff((due - now + 999999) / 1000000);
+    return 0;
+  }
+
+  return sg_wait(q->dev->fd, (due - now + 999999) / 1000000);
+}
+
+// Send the held requests by one batch, those which couldn't be sent complete as failed
+void ioq_flush(IO_QUEUE *q)
+{
+  IO_REQUEST *req;
+  unsigned int i;
+
+  if (q->nheld == 0)
+    return;
+
+  for (i = sg_submit_batch(q->dev->fd, q->held, q->nheld); i < q->nheld; i++)
+  {
+    req = (IO_REQUEST *)q->held[i]->usr_ptr;
+    req->status = -1;
+    req->complete_ns = now_ns();
+    q->done[q->ndone++] = req;
+  }
+  q->nheld = 0;
+}
+
+// Wait for any command in flight, NULL when there is none
+IO_REQUEST *ioq_reap(IO_QUEUE *q)
+{
+  struct sg_io_hdr io_hdr;
+  IO_REQUEST *req;
+  ERR_ACTION action = ACT_FAIL;
+  unsigned int backoff_ms;
+  int sent = 1;
+  int n;
+
+  if (q->inflight == 0)
+    return NULL;
+
+  ioq_flush(q);
+  if (!q->async || q->ndone)
+  {
+    req = q->done[0];
+    memmove(q->done, q->done + 1, (q->ndone - 1) * sizeof(IO_REQUEST *));
+    q->ndone--;
+    q->inflight--;
+    return req;
+  }
+
+  // a request which is retried goes back in flight, wait for the next one
+  while (1)
+  {
+    if (q->readypos == q->nready)
+    {
+      ioq_resend(q);
+      ioq_flush(q);
+      if (q->ndone)
+        return ioq_reap(q);         // a retry which couldn't be sent
+      if (q->ndelayed && !ioq_wait(q))
+        continue;
+      n = sg_receive_batch(q->dev->fd, q->ready, q->inflight - q->ndelayed);
+      if (n <= 0)
+        return NULL;
+      q->nready = n;
+      q->readypos = 0;
+    }
+    io_hdr = q->ready[q->readypos++];
+
+    req = (IO_REQUEST *)io_hdr.usr_ptr;
+    req->complete_ns = now_ns();
+    req->io_hdr.status = io_hdr.status;
+    req->io_hdr.host_status = io_hdr.host_status;
+    req->io_hdr.driver_status = io_hdr.driver_status;
+    req->io_hdr.masked_status = io_hdr.masked_status;
+    req->io_hdr.sb_len_wr = io_hdr.sb_len_wr;
+    req->io_hdr.resid = io_hdr.resid;
+    req->io_hdr.duration = io_hdr.duration;
+    req->io_hdr.info = io_hdr.info;
+
+    action = policy_decide(&req->io_hdr, cmd_class(req->cmd), req->attempt, &backoff_ms);
+    policy_observe(&req->io_hdr, action, req->complete_ns - req->send_ns);
+    if (action != ACT_RETRY)
+      break;
+
+    if (isDebug)
+      printf("DEBUG, retry %u of tag %u lba 0x%lx after %u ms\n", req->attempt + 1, req->tag, req->startlba, backoff_ms);
+    if (metrics_enabled)
+      metrics_retry(q->dev->fd);
+    req->attempt++;
+    if (backoff_ms)
+    {
+      req->resend_ns = req->complete_ns + backoff_ms * 1000000ULL;
+      q->delayed[q->ndelayed++] = req;
+    }
+    else if (ioq_send(q, req) != 0)
+    {
+      sent = 0;
+      break;
+    }
+  }
+
+  req->status = sent ? sg_io_check(&req->io_hdr) : -1;
+  q->inflight--;
+
+  return req;
+}
+
+// ioq_reap() returns without waiting, for callers which serve many queues
+int ioq_ready(IO_QUEUE *q)
+{
+  if (q->inflight == 0)
+    return 0;
+
+  ioq_resend(q);
+  ioq_flush(q);
+  return !q->async || q->ndone || q->readypos < q->nready || sg_ready(q->dev->fd);
+}
+
+// Wait for every command in flight and give the tags back, those which can't be received any more are given up
+void ioq_drain(IO_QUEUE *q)
+{
+  IO_REQUEST *req;
+  unsigned int lost;
+
+  while ((req = ioq_reap(q)) != NULL)
+    ioq_put(q, req);
+
+  lost = ioq_abandon(q);
+  if (lost)
+    printf("ERROR, %s: %u commands of %s are lost\n", __func__, lost, q->dev->dev_path);
+}
+
+// ioq_reap() returned NULL with commands in flight, the device doesn't complete them any more. They are given up,
+// their tags stay taken since the driver may still own their buffers. Returns how many
+unsigned int ioq_abandon(IO_QUEUE *q)
+{
+  unsigned int lost = q->inflight;
+
+  q->inflight = 0;
+  q->ndone = 0;
+  q->ndelayed = 0;
+  q->nheld = 0;
+  q->nready = 0;
+  q->readypos = 0;
+
+  return lost;
+}
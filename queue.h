@@ -0,0 +1,65 @@
+//
+// Queued data transfer, up to depth commands in flight on one device
+//
+
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include <scsi/sg.h>
+
+#include "device.h"
+
+#define IOQ_MAX_DEPTH  32       // 5-bit tag of DMA QUEUED and FPDMA QUEUED
+
+typedef struct _IO_REQUEST {
+  unsigned int  isread;
+  unsigned int  flags;          // RW_FLAG_*
+  unsigned int  isverify;       // 1 : verify on the media, no data
+  unsigned long startlba;
+  unsigned int  sectors;
+  char         *databuffer;
+  unsigned int  tag;
+  int           status;         // 0 : GOOD, -1 : failed
+  unsigned int  attempt;        // retries so far
+  unsigned long long submit_ns;
+  unsigned long long send_ns;   // last time it was sent, differs from submit_ns after a retry
+  unsigned long long resend_ns; // a retry isn't sent before its backoff is over
+  unsigned long long complete_ns;
+  void         *priv;           // owner's cookie
+
+  unsigned char cmd[16];
+  unsigned char sense_b[64];
+  struct sg_io_hdr io_hdr;
+} IO_REQUEST;
+
+typedef struct _IO_QUEUE {
+  DEVICE_CONTEXT *dev;
+  unsigned int depth;
+  unsigned int inflight;
+  int async;                    // 0 : transport takes one command at a time, a command completes on submit
+  int batch;                    // 1 : submits are held and sent together by the next ioq_reap()
+  IO_REQUEST reqs[IOQ_MAX_DEPTH];
+  unsigned int freetags[IOQ_MAX_DEPTH];
+  unsigned int nfree;
+  IO_REQUEST *done[IOQ_MAX_DEPTH];   // completed but not reaped, without async or failed to be sent by a batch
+  unsigned int ndone;
+  IO_REQUEST *delayed[IOQ_MAX_DEPTH];   // retries waiting for their backoff, not sent
+  unsigned int ndelayed;
+  struct sg_io_hdr *held[IOQ_MAX_DEPTH];   // submitted but not sent yet
+  unsigned int nheld;
+  struct sg_io_hdr ready[IOQ_MAX_DEPTH];   // received by one batch, not reaped yet
+  unsigned int nready;
+  unsigned int readypos;
+} IO_QUEUE;
+
+int  ioq_init(IO_QUEUE *q, DEVICE_CONTEXT *dev, unsigned int depth);
+IO_REQUEST *ioq_get(IO_QUEUE *q);
+int  ioq_submit(IO_QUEUE *q, IO_REQUEST *req);
+IO_REQUEST *ioq_reap(IO_QUEUE *q);
+void ioq_put(IO_QUEUE *q, IO_REQUEST *req);
+void ioq_drain(IO_QUEUE *q);
+unsigned int ioq_abandon(IO_QUEUE *q);
+void ioq_flush(IO_QUEUE *q);
+int  ioq_ready(IO_QUEUE *q);
+
+#endif
@@ -0,0 +1,368 @@
+//
+// Timeout and retry policy.
+// The timeout of a command class follows the latency seen so far: once POLICY_WARMUP commands of about the same
+// transfer size completed it is POLICY_TIMEOUT_FACTOR times their p99.9 latency, bounded by the minimum and the
+// default of the class. A command which timed out counts with the time it was given, so that the latency isn't
+// cut off at the timeout and the timeout grows when too many hit it. It is sent again with the default timeout.
+// Errors are sorted by sense key and ASC/ASCQ, refer to SPC-4 section 4.5.6 and annex D: transient ones are
+// retried with exponential backoff, errors of the media or of the command fail at once, the drive has already
+// done its own retries by then
+//
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "retry.h"
+#include "command.h"
+#include "transport.h"
+#include "stats.h"
+#include "sense.h"
+#include "metrics.h"
+
+#define POLICY_WARMUP          64
+#define POLICY_TIMEOUT_FACTOR  8
+#define POLICY_BACKOFF_MS      10      // first backoff, doubled every retry
+#define POLICY_BACKOFF_MAX_MS  1000
+#define POLICY_RETRIES         3
+#define POLICY_SIZE_BUCKETS    8       // 1, 4, 16, ... 16384 sectors and more
+
+// host_status of sg, refer to include/scsi/scsi.h of linux
+#define DID_NO_CONNECT   0x01
+#define DID_BUS_BUSY     0x02
+#define DID_TIME_OUT     0x03
+#define DID_RESET        0x08
+#define DID_SOFT_ERROR   0x0B
+#define DID_IMM_RETRY    0x0C
+#define DID_REQUEUE      0x0D
+
+// SCSI status, refer to SAM-5 section 5.3
+#define SAM_STAT_BUSY           0x08
+#define SAM_STAT_TASK_SET_FULL  0x28
+
+typedef struct _CLASS_POLICY {
+  const char *name;
+  unsigned int min_ms;
+  unsigned int default_ms;              // before warm up, and the upper bound
+  LAT_STATS lat[POLICY_SIZE_BUCKETS];   // by transfer size
+} CLASS_POLICY;
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+static CLASS_POLICY policies[CC_NUM] = {
+  { "data",    1000,  20 * 1000 },
+  { "verify",  2000,  60 * 1000 },
+  { "flush",   5000,  60 * 1000 },
+  { "control", 1000,  60 * 1000 },
+};
+static unsigned int max_retries = POLICY_RETRIES;
+static unsigned int fixed_timeout_ms;  // ZERO : adaptive
+static CMD_TIMING *timing;             // NULL : not collected
+static RETRY_COUNTERS counters;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+// Class by operation code, the ATA command of ATA PASS-THROUGH(16) or (12)
+CMD_CLASS cmd_class(const unsigned char *cmd)
+{
+  if (cmd[0] == 0x85 || cmd[0] == 0xA1)
+  {
+    switch (cmd[0] == 0xA1 ? cmd[9] : cmd[14])
+    {
+      case 0x20: case 0x24: case 0x30: case 0x34:     // READ/WRITE SECTORS (EXT)
+      case 0xC4: case 0x29: case 0xC5: case 0x39:     // READ/WRITE MULTIPLE (EXT)
+      case 0xC8: case 0x25: case 0xCA: case 0x35:     // READ/WRITE DMA (EXT)
+      case 0xC7: case 0x26: case 0xCC: case 0x36:     // READ/WRITE DMA QUEUED (EXT)
+      case 0x60: case 0x61:                           // READ/WRITE FPDMA QUEUED
+      case 0x3D: case 0x3E: case 0xCE:                // FUA EXT
+      case 0x2A: case 0x3A:                           // READ/WRITE STREAM DMA EXT
+        return CC_DATA;
+      case 0x40: case 0x42:
+        return CC_VERIFY;
+      case 0xE7: case 0xEA:
+        return CC_FLUSH;
+      default:
+        return CC_CONTROL;
+    }
+  }
+
+  switch (cmd[0])
+  {
+    case 0x28: case 0x2A: case 0x88: case 0x8A:       // READ/WRITE(10), (16)
+      return CC_DATA;
+    case 0x2F: case 0x8F:                             // VERIFY(10), (16)
+      return CC_VERIFY;
+    case 0x35: case 0x91:                             // SYNCHRONIZE CACHE(10), (16)
+      return CC_FLUSH;
+    default:
+      return CC_CONTROL;
+  }
+}
+
+// Transfer length of data and verify commands in sectors, ZERO : other commands
+unsigned int cmd_sectors(const unsigned char *cmd)
+{
+  unsigned int ext;
+  unsigned int count;
+
+  if (cmd[0] == 0x85)
+  {
+    if (cmd_class(cmd) != CC_DATA && cmd_class(cmd) != CC_VERIFY)
+      return 0;
+
+    ext = cmd[1] & 1;
+    switch (cmd[14])
+    {
+      case 0xC7: case 0x26: case 0xCC: case 0x36:     // DMA QUEUED, count in FEATURES
+      case 0x60: case 0x61:
+        count = ext ? (cmd[3] << 8) | cmd[4] : cmd[4];
+        break;
+      default:
+        count = ext ? (cmd[5] << 8) | cmd[6] : cmd[6];
+        break;
+    }
+    if (count == 0)
+      count = ext ? 65536 : 256;
+    return count;
+  }
+
+  switch (cmd[0])
+  {
+    case 0x28: case 0x2A: case 0x2F:                  // READ/WRITE/VERIFY(10)
+      return (cmd[7] << 8) | cmd[8];
+    case 0x88: case 0x8A: case 0x8F:                  // READ/WRITE/VERIFY(16)
+      return ((unsigned int)cmd[10] << 24) | (cmd[11] << 16) | (cmd[12] << 8) | cmd[13];
+    default:
+      return 0;
+  }
+}
+
+// The latency of 4 times the sectors goes to the next bucket
+static LAT_STATS *policy_lat(const unsigned char *cmd)
+{
+  unsigned int sectors = cmd_sectors(cmd);
+  unsigned int bucket = 0;
+
+  while (sectors >= 4 && bucket < POLICY_SIZE_BUCKETS - 1)
+  {
+    sectors >>= 2;
+    bucket++;
+  }
+
+  return &policies[cmd_class(cmd)].lat[bucket];
+}
+
+const char *cmd_class_name(CMD_CLASS cls)
+{
+  return cls < CC_NUM ? policies[cls].name : "unknown";
+}
+
+void policy_set_retries(unsigned int retries)
+{
+  max_retries = retries;
+}
+
+void policy_set_timeout(unsigned int timeout_ms)
+{
+  fixed_timeout_ms = timeout_ms;
+}
+
+void policy_counters(RETRY_COUNTERS *c)
+{
+  *c = counters;
+}
+
+// Collect the time of every command of sg_command() into t from now on, NULL stops
+void policy_timing(CMD_TIMING *t)
+{
+  timing = t;
+}
+
+// Timeout in milliseconds of the attempt, attempt ZERO is the first one
+unsigned int policy_timeout(const unsigned char *cmd, unsigned int attempt)
+{
+  CLASS_POLICY *policy = &policies[cmd_class(cmd)];
+  LAT_STATS *lat = policy_lat(cmd);
+  unsigned long long timeout;
+
+  if (fixed_timeout_ms)
+    return fixed_timeout_ms;
+
+  if (attempt > 0 || lat->count < POLICY_WARMUP)
+    return policy->default_ms;
+
+  timeout = stats_percentile(lat, 99.9) * POLICY_TIMEOUT_FACTOR / 1000000;
+  if (timeout < policy->min_ms)
+    timeout = policy->min_ms;
+  if (timeout > policy->default_ms)
+    timeout = policy->default_ms;
+
+  return timeout;
+}
+
+// Latency of an attempt of the command which completed or timed out, others say nothing of the device
+void policy_observe(struct sg_io_hdr *io_hdr, ERR_ACTION action, unsigned long long ns)
+{
+  if (action == ACT_DONE || io_hdr->host_status == DID_TIME_OUT)
+    stats_add(policy_lat(io_hdr->cmdp), ns);
+}
+
+static ERR_ACTION decide_sense(unsigned int sk, unsigned int asc, unsigned int ascq)
+{
+  switch (sk)
+  {
+    case SK_NO_SENSE:
+    case SK_RECOVERED_ERROR:
+      return ACT_DONE;
+
+    case SK_NOT_READY:
+      if (asc == 0x04 && (ascq == 0x02 || ascq == 0x03))
+        return ACT_FAIL;        // initializing command required, manual intervention required
+      if (asc == 0x3A)
+        return ACT_FAIL;        // medium not present
+      return ACT_RETRY;         // becoming ready, operation in progress, ...
+
+    case SK_MEDIUM_ERROR:
+      if (asc == 0x0C)
+        return ACT_RETRY;       // write error, the drive may reallocate on the next write
+      return ACT_FAIL;          // unrecovered read error, the drive has already retried
+
+    case SK_UNIT_ATTENTION:     // reset, parameters changed, ...
+      return ACT_RETRY;
+
+    case SK_ABORTED_COMMAND:
+      if (asc == 0x47 || asc == 0x4B || asc == 0x4E || asc == 0x0C)
+        return ACT_RETRY;       // parity / data phase error, overlapped commands
+      if (asc == 0x00 && ascq == 0x00)
+        return ACT_FAIL;        // ATA ABRT, the device doesn't take the command
+      return ACT_RETRY;
+
+    case SK_HARDWARE_ERROR:
+    case SK_ILLEGAL_REQUEST:
+    case SK_DATA_PROTECT:
+    default:
+      return ACT_FAIL;
+  }
+}
+
+// What to do with a completed command. backoff_ms is the wait before the retry
+ERR_ACTION policy_decide(struct sg_io_hdr *io_hdr, CMD_CLASS cls, unsigned int attempt, unsigned int *backoff_ms)
+{
+  ERR_ACTION action;
+  unsigned int sk, asc, ascq;
+
+  *backoff_ms = 0;
+  if (attempt == 0)
+    counters.commands++;
+
+  if (io_hdr->host_status != 0)
+  {
+    switch (io_hdr->host_status)
+    {
+      case DID_TIME_OUT:
+        counters.timeouts++;
+        action = ACT_RETRY;
+        break;
+      case DID_BUS_BUSY:
+      case DID_RESET:
+      case DID_SOFT_ERROR:
+      case DID_IMM_RETRY:
+      case DID_REQUEUE:
+        action = ACT_RETRY;
+        break;
+      case DID_NO_CONNECT:
+      default:
+        action = ACT_FAIL;
+        break;
+    }
+  }
+  else if (io_hdr->status == SAM_STAT_BUSY || io_hdr->status == SAM_STAT_TASK_SET_FULL)
+    action = ACT_RETRY;
+  else if (sg_sense(io_hdr, &sk, &asc, &ascq) == 0)
+  {
+    action = decide_sense(sk, asc, ascq);
+    if (isDebug && action != ACT_DONE)
+      printf("DEBUG, %s command, %s, asc/ascq %02x/%02x %s : %s\n", cmd_class_name(cls), sense_key_string(sk), asc, ascq,
+             sense_asc_string(asc, ascq) ? sense_asc_string(asc, ascq) : "", action == ACT_RETRY ? "retry" : "fail");
+  }
+  else if (io_hdr->status != 0 || io_hdr->driver_status != 0)
+    action = ACT_FAIL;
+  else
+    action = ACT_DONE;
+
+  if (action == ACT_RETRY)
+  {
+    if (attempt >= max_retries)
+      return ACT_FAIL;
+
+    // UNIT ATTENTION is reported once, the command can go again at once
+    if (!(io_hdr->sb_len_wr && sg_sense(io_hdr, &sk, &asc, &ascq) == 0 && sk == SK_UNIT_ATTENTION))
+    {
+      *backoff_ms = POLICY_BACKOFF_MS << attempt;
+      if (*backoff_ms > POLICY_BACKOFF_MAX_MS)
+        *backoff_ms = POLICY_BACKOFF_MAX_MS;
+    }
+    counters.retries++;
+  }
+  else if (action == ACT_FAIL && attempt == 0)
+    counters.fastfails++;
+
+  return action;
+}
+
+void policy_backoff(unsigned int backoff_ms)
+{
+  struct timespec ts;
+
+  if (backoff_ms == 0)
+    return;
+
+  ts.tv_sec = backoff_ms / 1000;
+  ts.tv_nsec = (backoff_ms % 1000) * 1000000L;
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    ;
+}
+
+// Execute a request with the timeout of its class, retry it by the policy. The status is checked like sg_io_check()
+int sg_command(int fd, struct sg_io_hdr *io_hdr)
+{
+  CMD_CLASS cls = cmd_class(io_hdr->cmdp);
+  unsigned long long start, end;
+  unsigned int attempt;
+  unsigned int backoff_ms;
+  ERR_ACTION action;
+
+  for (attempt = 0; ; attempt++)
+  {
+    io_hdr->timeout = policy_timeout(io_hdr->cmdp, attempt);
+    io_hdr->sb_len_wr = 0;
+
+    start = now_ns();
+    if (sg_execute(fd, io_hdr) != 0)
+      return -1;
+    end = now_ns();
+
+    action = policy_decide(io_hdr, cls, attempt, &backoff_ms);
+    policy_observe(io_hdr, action, end - start);
+    if (action != ACT_RETRY)
+      break;
+
+    if (isDebug)
+      printf("DEBUG, retry %u of %s command after %u ms\n", attempt + 1, cmd_class_name(cls), backoff_ms);
+    policy_backoff(backoff_ms);
+    if (metrics_enabled)
+      metrics_retry(fd);
+  }
+
+  if (timing != NULL)
+  {
+    stats_add(&timing->host, end - start);
+    timing->driver_ms += io_hdr->duration;
+  }
+
+  return sg_io_check(io_hdr);
+}
@@ -0,0 +1,53 @@
+//
+// Timeout and retry policy of SCSI / ATA PASS-THROUGH commands
+//
+
+#ifndef _RETRY_H_
+#define _RETRY_H_
+
+#include <scsi/sg.h>
+
+#include "stats.h"
+
+// Commands are grouped by what their latency depends on
+typedef enum _CMD_CLASS {
+  CC_DATA = 0,           // READ / WRITE
+  CC_VERIFY,             // READ VERIFY, VERIFY(16)
+  CC_FLUSH,              // FLUSH CACHE, SYNCHRONIZE CACHE
+  CC_CONTROL,            // IDENTIFY, INQUIRY, MODE SENSE, SMART, SET FEATURES, ...
+  CC_NUM
+} CMD_CLASS;
+
+typedef enum _ERR_ACTION {
+  ACT_DONE = 0,          // GOOD or recovered
+  ACT_RETRY,             // transient, send it again after the backoff
+  ACT_FAIL               // retrying won't help
+} ERR_ACTION;
+
+typedef struct _RETRY_COUNTERS {
+  unsigned long long commands;
+  unsigned long long retries;
+  unsigned long long timeouts;
+  unsigned long long fastfails;
+} RETRY_COUNTERS;
+
+// Time of the commands of sg_command() as the process sees it and as the driver reports it, of the last attempt
+typedef struct _CMD_TIMING {
+  LAT_STATS host;                 // around sg_execute()
+  unsigned long long driver_ms;   // sum of io_hdr.duration, the driver counts in jiffies
+} CMD_TIMING;
+
+CMD_CLASS  cmd_class(const unsigned char *cmd);
+unsigned int cmd_sectors(const unsigned char *cmd);
+const char *cmd_class_name(CMD_CLASS cls);
+unsigned int policy_timeout(const unsigned char *cmd, unsigned int attempt);
+void policy_observe(struct sg_io_hdr *io_hdr, ERR_ACTION action, unsigned long long ns);
+ERR_ACTION policy_decide(struct sg_io_hdr *io_hdr, CMD_CLASS cls, unsigned int attempt, unsigned int *backoff_ms);
+void policy_set_retries(unsigned int retries);
+void policy_set_timeout(unsigned int timeout_ms);
+void policy_counters(RETRY_COUNTERS *counters);
+void policy_backoff(unsigned int backoff_ms);
+void policy_timing(CMD_TIMING *timing);
+int  sg_command(int fd, struct sg_io_hdr *io_hdr);
+
+#endif
@@ -0,0 +1,89 @@
+//
+// Priority classes on top of the request queue.
+// A drive with NCQ priority orders the commands itself, foreground ones are tagged high priority.
+// Without it the only thing the host can do is to keep tags free for foreground, so that a foreground
+// command never waits behind a full queue of background commands on the host side
+//
+#include <stdio.h>
+#include <string.h>
+
+#include "sched.h"
+
+///////////////
+// LOCALS
+///////////////
+static const char *io_class_names[IOC_NUM] = {
+  "foreground",
+  "background"
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+const char *io_class_name(IO_CLASS cls)
+{
+  return cls < IOC_NUM ? io_class_names[cls] : "unknown";
+}
+
+void sched_init(IO_SCHED *s, IO_QUEUE *q, unsigned int use_prio, unsigned int reserve)
+{
+  memset(s, 0, sizeof(IO_SCHED));
+  s->q = q;
+  s->use_prio = use_prio;
+  s->reserve = reserve < q->depth ? reserve : q->depth - 1;
+}
+
+// A free request of the class, NULL when the class has to wait
+IO_REQUEST *sched_get(IO_SCHED *s, IO_CLASS cls)
+{
+  IO_REQUEST *req;
+
+  if (cls == IOC_BACKGROUND && s->q->nfree <= s->reserve)
+    return NULL;
+
+  req = ioq_get(s->q);
+  if (req == NULL)
+    return NULL;
+
+  req->priv = (void *)(unsigned long)cls;
+  return req;
+}
+
+int sched_submit(IO_SCHED *s, IO_REQUEST *req)
+{
+  IO_CLASS cls = (IO_CLASS)(unsigned long)req->priv;
+
+  if (cls == IOC_FOREGROUND && s->use_prio)
+    req->flags |= RW_FLAG_HIPRI;
+
+  if (ioq_submit(s->q, req) != 0)
+    return -1;
+
+  s->inflight[cls]++;
+  return 0;
+}
+
+// Wait for any command and account its latency to its class
+IO_REQUEST *sched_reap(IO_SCHED *s)
+{
+  IO_REQUEST *req;
+  IO_CLASS cls;
+
+  req = ioq_reap(s->q);
+  if (req == NULL)
+    return NULL;
+
+  cls = (IO_CLASS)(unsigned long)req->priv;
+  s->inflight[cls]--;
+  stats_add(&s->lat[cls], req->complete_ns - req->submit_ns);
+  if (req->status != 0)
+    s->errors[cls]++;
+
+  return req;
+}
+
+void sched_put(IO_SCHED *s, IO_REQUEST *req)
+{
+  ioq_put(s->q, req);
+}
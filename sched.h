@@ -0,0 +1,33 @@
+//
+// Priority classes on top of the request queue, foreground commands go ahead of background scans and scrubs
+//
+
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include "queue.h"
+#include "stats.h"
+
+typedef enum _IO_CLASS {
+  IOC_FOREGROUND = 0,    // latency critical, NCQ high priority when the device has it
+  IOC_BACKGROUND,        // scan, scrub, verify, normal priority
+  IOC_NUM
+} IO_CLASS;
+
+typedef struct _IO_SCHED {
+  IO_QUEUE *q;
+  unsigned int use_prio;          // 1 : tag foreground commands with NCQ high priority
+  unsigned int reserve;           // tags background commands can't take, kept free for foreground
+  unsigned int inflight[IOC_NUM];
+  LAT_STATS lat[IOC_NUM];
+  unsigned int errors[IOC_NUM];
+} IO_SCHED;
+
+void sched_init(IO_SCHED *s, IO_QUEUE *q, unsigned int use_prio, unsigned int reserve);
+IO_REQUEST *sched_get(IO_SCHED *s, IO_CLASS cls);
+int  sched_submit(IO_SCHED *s, IO_REQUEST *req);
+IO_REQUEST *sched_reap(IO_SCHED *s);
+void sched_put(IO_SCHED *s, IO_REQUEST *req);
+const char *io_class_name(IO_CLASS cls);
+
+#endif
@@ -0,0 +1,333 @@
+//
+// SMART self-test orchestrator.
+// A self-test in off-line mode runs inside the drive while it serves commands, but it competes with them for the
+// heads, and an extended test on every drive of an enclosure at once shows in the latency of all of them. The
+// tests are started a few at a time per enclosure (or per expander or host adapter when the enclosure isn't known,
+// see topo_domain()) and the next drive of the enclosure starts when one finishes.
+// Nothing is busy-polled: a drive is asked for its self-test execution status about SELFTEST_POLLS times over the
+// polling time it recommends in SMART READ DATA, sooner when the percent remaining says the end is near, never
+// more often than every SELFTEST_MIN_POLL_MS. In between the process sleeps until the earliest poll is due.
+// A test which was running already when the orchestrator started is waited for and counts against the limit of
+// its enclosure, a test which runs far beyond its polling time is aborted
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "selftest.h"
+#include "command.h"
+#include "topo.h"
+#include "stats.h"
+
+#define SELFTEST_POLLS        10
+#define SELFTEST_MIN_POLL_MS  5000ULL
+#define SELFTEST_OVERRUN      3          // times the polling time a test may run before it's aborted
+#define SELFTEST_GRACE_MS     600000ULL  // on top of the overrun, for drives which recommend a minute
+
+typedef enum _SELFTEST_STATE {
+  SELFTEST_WAITING = 0,
+  SELFTEST_RUNNING,
+  SELFTEST_DONE
+} SELFTEST_STATE;
+
+typedef struct _SELFTEST_DRIVE {
+  DEVICE_CONTEXT *dev;
+  char domain[64];                // empty : shares nothing known, never waits for other drives
+  SELFTEST_STATE state;
+  int adopted;                    // the test was running before, it wasn't started here
+  unsigned long long expected_ms; // recommended polling time
+  unsigned long long start_ns;
+  unsigned long long poll_ns;     // next poll
+  unsigned long long end_ns;
+  unsigned int status;            // self-test execution status at the end
+  unsigned int polls;
+  unsigned long long lba;         // first failing LBA from the self-test log, ~0 : none
+  const char *result;             // why there is no status, NULL : the status is the result
+} SELFTEST_DRIVE;
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+static const char *status_names[] = {
+  "passed", "aborted by host", "interrupted by reset", "fatal error", "unknown element failed",
+  "electrical element failed", "servo element failed", "read element failed", "handling damage"
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static const char *selftest_name(unsigned int subcommand)
+{
+  if (subcommand == SELFTEST_SHORT)
+    return "short";
+  if (subcommand == SELFTEST_EXTENDED)
+    return "extended";
+  if (subcommand == SELFTEST_CONVEYANCE)
+    return "conveyance";
+  return "unknown";
+}
+
+static const char *status_name(unsigned int status)
+{
+  status >>= 4;
+  if (status < sizeof(status_names) / sizeof(status_names[0]))
+    return status_names[status];
+  return status == SELFTEST_IN_PROGRESS ? "in progress" : "reserved";
+}
+
+// Recommended polling time of the test in minutes, ZERO : not supported
+static unsigned int selftest_minutes(unsigned char *data, unsigned int subcommand)
+{
+  if (!(data[SMART_OFFLINE_CAP] & (1 << 4)))
+    return 0;
+  if (subcommand == SELFTEST_SHORT)
+    return data[SMART_SHORT_MINUTES] ? data[SMART_SHORT_MINUTES] : 1;
+  if (subcommand == SELFTEST_CONVEYANCE)
+  {
+    if (!(data[SMART_OFFLINE_CAP] & (1 << 5)))
+      return 0;
+    return data[SMART_CONV_MINUTES] ? data[SMART_CONV_MINUTES] : 1;
+  }
+  if (data[SMART_EXT_MINUTES] == 0xFF)
+    return data[SMART_EXT_MINUTES_W] | data[SMART_EXT_MINUTES_W + 1] << 8;
+  return data[SMART_EXT_MINUTES] ? data[SMART_EXT_MINUTES] : 1;
+}
+
+// Sooner when the drive says it's nearly done, about SELFTEST_POLLS polls over the polling time otherwise
+static void schedule_poll(SELFTEST_DRIVE *d, unsigned long long now, unsigned int tenths)
+{
+  unsigned long long longest = d->expected_ms / SELFTEST_POLLS;
+  unsigned long long ms = d->expected_ms * tenths / 10;
+
+  if (longest < SELFTEST_MIN_POLL_MS)
+    longest = SELFTEST_MIN_POLL_MS;
+  if (ms > longest)
+    ms = longest;
+  if (ms < SELFTEST_MIN_POLL_MS)
+    ms = SELFTEST_MIN_POLL_MS;
+  d->poll_ns = now + ms * 1000000;
+}
+
+static void drive_done(SELFTEST_DRIVE *d, unsigned long long now, const char *result)
+{
+  d->state = SELFTEST_DONE;
+  d->end_ns = now;
+  d->result = result;
+}
+
+// The drive takes part when it supports the test, a test running already is waited for
+static void drive_prepare(SELFTEST_DRIVE *d, unsigned int subcommand)
+{
+  unsigned char data[512];
+  unsigned long long now = now_ns();
+  unsigned int minutes;
+
+  d->lba = ~0ULL;
+  memset(data, 0, sizeof(data));
+  if (smart_readdata(d->dev->fd, (char *)data) != 0)
+  {
+    drive_done(d, now, "no SMART");
+    return;
+  }
+
+  minutes = selftest_minutes(data, subcommand);
+  if (minutes == 0)
+  {
+    drive_done(d, now, "not supported");
+    return;
+  }
+  d->expected_ms = minutes * 60000ULL;
+
+  if ((data[SMART_SELFTEST_STATUS] >> 4) == SELFTEST_IN_PROGRESS)
+  {
+    printf("%s: a self-test is running already, %u%% remaining, it's waited for\n", d->dev->dev_path,
+           (data[SMART_SELFTEST_STATUS] & 0xF) * 10);
+    d->state = SELFTEST_RUNNING;
+    d->adopted = 1;
+    d->start_ns = now;
+    schedule_poll(d, now, data[SMART_SELFTEST_STATUS] & 0xF);
+  }
+}
+
+static void drive_start(SELFTEST_DRIVE *d, unsigned int subcommand)
+{
+  unsigned long long now = now_ns();
+
+  if (smart_offline_immediate(d->dev->fd, subcommand) != 0)
+  {
+    drive_done(d, now, "not started");
+    return;
+  }
+  printf("%s: %s self-test started in %s, recommended polling time %llu min\n", d->dev->dev_path,
+         selftest_name(subcommand), d->domain[0] ? d->domain : "no enclosure", d->expected_ms / 60000);
+  d->state = SELFTEST_RUNNING;
+  d->start_ns = now;
+  schedule_poll(d, now, 10);
+}
+
+// First failing LBA of the latest descriptor of the self-test log
+static void failing_lba(SELFTEST_DRIVE *d)
+{
+  unsigned char log[512];
+  unsigned char *desc;
+
+  memset(log, 0, sizeof(log));
+  if (smart_readwritelog(d->dev->fd, 1, SMART_LOG_SELFTEST, log, 1) != 0 || log[508] == 0 || log[508] > 21)
+    return;
+  desc = log + 2 + (log[508] - 1) * 24;
+  d->lba = desc[5] | desc[6] << 8 | desc[7] << 16 | (unsigned long long)desc[8] << 24;
+  if (d->lba == 0xFFFFFFFFULL)
+    d->lba = ~0ULL;
+}
+
+static void drive_poll(SELFTEST_DRIVE *d)
+{
+  unsigned char data[512];
+  unsigned long long now = now_ns();
+  unsigned int status;
+
+  d->polls++;
+  memset(data, 0, sizeof(data));
+  if (smart_readdata(d->dev->fd, (char *)data) != 0)
+  {
+    // the drive may be busy or resetting, the overrun ends it if it never answers again
+    if (now - d->start_ns > (SELFTEST_OVERRUN * d->expected_ms + SELFTEST_GRACE_MS) * 1000000)
+      drive_done(d, now, "no answer");
+    else
+      schedule_poll(d, now, 10);
+    return;
+  }
+
+  status = data[SMART_SELFTEST_STATUS];
+  if ((status >> 4) != SELFTEST_IN_PROGRESS)
+  {
+    d->status = status;
+    drive_done(d, now, NULL);
+    if ((status >> 4) >= 3 && (status >> 4) <= 8)
+      failing_lba(d);
+    printf("%s: self-test %s after %.1f min\n", d->dev->dev_path, status_name(status), (now - d->start_ns) / 60e9);
+    return;
+  }
+
+  if (now - d->start_ns > (SELFTEST_OVERRUN * d->expected_ms + SELFTEST_GRACE_MS) * 1000000)
+  {
+    smart_offline_immediate(d->dev->fd, SELFTEST_ABORT);
+    drive_done(d, now, "overrun, aborted");
+    return;
+  }
+
+  if (isDebug)
+    printf("%s: %u%% remaining\n", d->dev->dev_path, (status & 0xF) * 10);
+  schedule_poll(d, now, status & 0xF);
+}
+
+// Whether the drive waits and its enclosure has room for one more test
+static int can_start(SELFTEST_DRIVE *drives, unsigned int n, SELFTEST_DRIVE *d, unsigned int per_domain)
+{
+  unsigned int i, running = 0;
+
+  if (d->state != SELFTEST_WAITING)
+    return 0;
+  if (d->domain[0] == 0)
+    return 1;
+  for (i = 0; i < n; i++)
+  {
+    if (drives[i].state == SELFTEST_RUNNING && strcmp(drives[i].domain, d->domain) == 0)
+      running++;
+  }
+  return running < per_domain;
+}
+
+int selftest_run(DEVICE_CONTEXT **devs, unsigned int ndevs, SELFTEST_CONFIG *config)
+{
+  SELFTEST_DRIVE *drives;
+  SELFTEST_DRIVE *d;
+  TOPOLOGY *t;
+  TOPO_PATH path;
+  const char *domain;
+  unsigned int per_domain = config->per_domain ? config->per_domain : SELFTEST_PER_DOMAIN;
+  unsigned int i, pending, polls = 0;
+  unsigned long long start, now, next;
+  int ret = 0;
+
+  drives = (SELFTEST_DRIVE *)calloc(ndevs, sizeof(SELFTEST_DRIVE));
+  t = (TOPOLOGY *)malloc(sizeof(TOPOLOGY));
+  if (drives == NULL || t == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(drives);
+    free(t);
+    return -1;
+  }
+
+  topo_init(t);
+  for (i = 0; i < ndevs; i++)
+  {
+    d = &drives[i];
+    d->dev = devs[i];
+    if (topo_add_device(t, devs[i], &path) == 0 && (domain = topo_domain(t, &path)) != NULL)
+      snprintf(d->domain, sizeof(d->domain), "%s", domain);
+    drive_prepare(d, config->subcommand);
+  }
+  printf("%s self-test of %u devices, %u at a time per enclosure\n", selftest_name(config->subcommand), ndevs,
+         per_domain);
+
+  start = now_ns();
+  do
+  {
+    // waiting drives start in their order when their enclosure has room
+    for (i = 0; i < ndevs; i++)
+    {
+      if (can_start(drives, ndevs, &drives[i], per_domain))
+        drive_start(&drives[i], config->subcommand);
+    }
+
+    now = now_ns();
+    next = ~0ULL;
+    pending = 0;
+    for (i = 0; i < ndevs; i++)
+    {
+      d = &drives[i];
+      if (d->state == SELFTEST_RUNNING && d->poll_ns <= now)
+        drive_poll(d);
+      if (d->state == SELFTEST_RUNNING && d->poll_ns < next)
+        next = d->poll_ns;
+      if (d->state != SELFTEST_DONE)
+        pending++;
+    }
+
+    // a drive which finished may let a waiting one start, otherwise nothing happens before the next poll
+    now = now_ns();
+    for (i = 0; i < ndevs && !can_start(drives, ndevs, &drives[i], per_domain); i++)
+      ;
+    if (pending && i == ndevs && next > now)
+      sleep_ns(next - now);
+  } while (pending);
+
+  printf("%-32s %-16s %-26s %8s %6s %12s\n", "device", "enclosure", "result", "minutes", "polls", "failing LBA");
+  for (i = 0; i < ndevs; i++)
+  {
+    d = &drives[i];
+    polls += d->polls;
+    printf("%-32s %-16s %-26s", d->dev->dev_path, d->domain[0] ? d->domain : "-",
+           d->result ? d->result : status_name(d->status));
+    if (d->start_ns)
+      printf(" %8.1f %6u", (d->end_ns - d->start_ns) / 60e9, d->polls);
+    else
+      printf(" %8s %6s", "-", "-");
+    if (d->lba != ~0ULL)
+      printf(" %12llu", d->lba);
+    printf("%s\n", d->adopted ? " (running before)" : "");
+    if (d->result || d->status != 0)
+      ret = -1;
+  }
+  printf("%.1f min, %u polls in total\n", (now_ns() - start) / 60e9, polls);
+
+  free(drives);
+  free(t);
+  return ret;
+}
@@ -0,0 +1,19 @@
+//
+// SMART self-tests of many drives, a few at a time per enclosure
+//
+
+#ifndef _SELFTEST_H_
+#define _SELFTEST_H_
+
+#include "device.h"
+
+#define SELFTEST_PER_DOMAIN  1
+
+typedef struct _SELFTEST_CONFIG {
+  unsigned int subcommand;        // SELFTEST_SHORT / EXTENDED / CONVEYANCE
+  unsigned int per_domain;        // tests running at once per enclosure, ZERO : SELFTEST_PER_DOMAIN
+} SELFTEST_CONFIG;
+
+int selftest_run(DEVICE_CONTEXT **devs, unsigned int ndevs, SELFTEST_CONFIG *config);
+
+#endif
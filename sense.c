@@ -0,0 +1,335 @@
+//
+// Sense data decoder.
+// Descriptor format is walked descriptor by descriptor, the Information and the ATA Status Return descriptors are
+// decoded. Fixed format carries the ATA registers instead of the INFORMATION field when ASC/ASCQ is ATA PASS-THROUGH
+// INFORMATION AVAILABLE, refer to SAT-3 section 12.2.2.7.
+// ASC/ASCQ text comes from a table sorted by ASC << 8 | ASCQ, looked up by binary search
+//
+#include <stdio.h>
+#include <string.h>
+
+#include "sense.h"
+
+typedef struct _ASC_ENTRY {
+  unsigned short code;            // ASC << 8 | ASCQ
+  const char *text;
+} ASC_ENTRY;
+
+///////////////
+// LOCALS
+///////////////
+
+static const char *sense_keys[16] = {
+  "NO SENSE", "RECOVERED ERROR", "NOT READY", "MEDIUM ERROR",
+  "HARDWARE ERROR", "ILLEGAL REQUEST", "UNIT ATTENTION", "DATA PROTECT",
+  "BLANK CHECK", "VENDOR SPECIFIC", "COPY ABORTED", "ABORTED COMMAND",
+  "RESERVED", "VOLUME OVERFLOW", "MISCOMPARE", "COMPLETED",
+};
+
+// Refer to spc-4 annex D.2, the ones a disk reports. Keep it sorted
+static const ASC_ENTRY asc_table[] = {
+  { 0x0000, "NO ADDITIONAL SENSE INFORMATION" },
+  { 0x0006, "I/O PROCESS TERMINATED" },
+  { 0x0016, "OPERATION IN PROGRESS" },
+  { 0x0017, "CLEANING REQUESTED" },
+  { 0x001D, "ATA PASS THROUGH INFORMATION AVAILABLE" },
+  { 0x001E, "CONFLICTING SA CREATION REQUEST" },
+  { 0x0100, "NO INDEX/SECTOR SIGNAL" },
+  { 0x0200, "NO SEEK COMPLETE" },
+  { 0x0300, "PERIPHERAL DEVICE WRITE FAULT" },
+  { 0x0400, "LOGICAL UNIT NOT READY, CAUSE NOT REPORTABLE" },
+  { 0x0401, "LOGICAL UNIT IS IN PROCESS OF BECOMING READY" },
+  { 0x0402, "LOGICAL UNIT NOT READY, INITIALIZING COMMAND REQUIRED" },
+  { 0x0403, "LOGICAL UNIT NOT READY, MANUAL INTERVENTION REQUIRED" },
+  { 0x0404, "LOGICAL UNIT NOT READY, FORMAT IN PROGRESS" },
+  { 0x0407, "LOGICAL UNIT NOT READY, OPERATION IN PROGRESS" },
+  { 0x0409, "LOGICAL UNIT NOT READY, SELF-TEST IN PROGRESS" },
+  { 0x0411, "LOGICAL UNIT NOT READY, NOTIFY (ENABLE SPINUP) REQUIRED" },
+  { 0x0412, "LOGICAL UNIT NOT READY, OFFLINE" },
+  { 0x0414, "LOGICAL UNIT NOT READY, SPACE ALLOCATION IN PROGRESS" },
+  { 0x041B, "LOGICAL UNIT NOT READY, SANITIZE IN PROGRESS" },
+  { 0x041C, "LOGICAL UNIT NOT READY, ADDITIONAL POWER USE NOT YET GRANTED" },
+  { 0x0500, "LOGICAL UNIT DOES NOT RESPOND TO SELECTION" },
+  { 0x0800, "LOGICAL UNIT COMMUNICATION FAILURE" },
+  { 0x0801, "LOGICAL UNIT COMMUNICATION TIME-OUT" },
+  { 0x0802, "LOGICAL UNIT COMMUNICATION PARITY ERROR" },
+  { 0x0900, "TRACK FOLLOWING ERROR" },
+  { 0x0904, "HEAD SELECT FAULT" },
+  { 0x0A00, "ERROR LOG OVERFLOW" },
+  { 0x0B00, "WARNING" },
+  { 0x0B01, "WARNING - SPECIFIED TEMPERATURE EXCEEDED" },
+  { 0x0C00, "WRITE ERROR" },
+  { 0x0C02, "WRITE ERROR - AUTO REALLOCATION FAILED" },
+  { 0x0C03, "WRITE ERROR - RECOMMEND REASSIGNMENT" },
+  { 0x1000, "ID CRC OR ECC ERROR" },
+  { 0x1001, "LOGICAL BLOCK GUARD CHECK FAILED" },
+  { 0x1002, "LOGICAL BLOCK APPLICATION TAG CHECK FAILED" },
+  { 0x1003, "LOGICAL BLOCK REFERENCE TAG CHECK FAILED" },
+  { 0x1100, "UNRECOVERED READ ERROR" },
+  { 0x1101, "READ RETRIES EXHAUSTED" },
+  { 0x1102, "ERROR TOO LONG TO CORRECT" },
+  { 0x1104, "UNRECOVERED READ ERROR - AUTO REALLOCATE FAILED" },
+  { 0x110B, "UNRECOVERED READ ERROR - RECOMMEND REASSIGNMENT" },
+  { 0x110C, "UNRECOVERED READ ERROR - RECOMMEND REWRITE THE DATA" },
+  { 0x1114, "READ ERROR - LBA MARKED BAD BY APPLICATION CLIENT" },
+  { 0x1200, "ADDRESS MARK NOT FOUND FOR ID FIELD" },
+  { 0x1400, "RECORDED ENTITY NOT FOUND" },
+  { 0x1401, "RECORD NOT FOUND" },
+  { 0x1500, "RANDOM POSITIONING ERROR" },
+  { 0x1501, "MECHANICAL POSITIONING ERROR" },
+  { 0x1600, "DATA SYNCHRONIZATION MARK ERROR" },
+  { 0x1700, "RECOVERED DATA WITH NO ERROR CORRECTION APPLIED" },
+  { 0x1701, "RECOVERED DATA WITH RETRIES" },
+  { 0x1800, "RECOVERED DATA WITH ERROR CORRECTION APPLIED" },
+  { 0x1802, "RECOVERED DATA - DATA AUTO-REALLOCATED" },
+  { 0x1900, "DEFECT LIST ERROR" },
+  { 0x1A00, "PARAMETER LIST LENGTH ERROR" },
+  { 0x1D00, "MISCOMPARE DURING VERIFY OPERATION" },
+  { 0x2000, "INVALID COMMAND OPERATION CODE" },
+  { 0x2100, "LOGICAL BLOCK ADDRESS OUT OF RANGE" },
+  { 0x2101, "INVALID ELEMENT ADDRESS" },
+  { 0x2104, "UNALIGNED WRITE COMMAND" },
+  { 0x2105, "WRITE BOUNDARY VIOLATION" },
+  { 0x2106, "ATTEMPT TO READ INVALID DATA" },
+  { 0x2107, "READ BOUNDARY VIOLATION" },
+  { 0x2400, "INVALID FIELD IN CDB" },
+  { 0x2500, "LOGICAL UNIT NOT SUPPORTED" },
+  { 0x2600, "INVALID FIELD IN PARAMETER LIST" },
+  { 0x2601, "PARAMETER NOT SUPPORTED" },
+  { 0x2602, "PARAMETER VALUE INVALID" },
+  { 0x2700, "WRITE PROTECTED" },
+  { 0x2701, "HARDWARE WRITE PROTECTED" },
+  { 0x2702, "LOGICAL UNIT SOFTWARE WRITE PROTECTED" },
+  { 0x2707, "SPACE ALLOCATION FAILED WRITE PROTECT" },
+  { 0x2800, "NOT READY TO READY CHANGE, MEDIUM MAY HAVE CHANGED" },
+  { 0x2900, "POWER ON, RESET, OR BUS DEVICE RESET OCCURRED" },
+  { 0x2901, "POWER ON OCCURRED" },
+  { 0x2902, "SCSI BUS RESET OCCURRED" },
+  { 0x2903, "BUS DEVICE RESET FUNCTION OCCURRED" },
+  { 0x2904, "DEVICE INTERNAL RESET" },
+  { 0x2907, "I_T NEXUS LOSS OCCURRED" },
+  { 0x2A00, "PARAMETERS CHANGED" },
+  { 0x2A01, "MODE PARAMETERS CHANGED" },
+  { 0x2A02, "LOG PARAMETERS CHANGED" },
+  { 0x2A09, "CAPACITY DATA HAS CHANGED" },
+  { 0x2C00, "COMMAND SEQUENCE ERROR" },
+  { 0x2F00, "COMMANDS CLEARED BY ANOTHER INITIATOR" },
+  { 0x3000, "INCOMPATIBLE MEDIUM INSTALLED" },
+  { 0x3100, "MEDIUM FORMAT CORRUPTED" },
+  { 0x3101, "FORMAT COMMAND FAILED" },
+  { 0x3200, "NO DEFECT SPARE LOCATION AVAILABLE" },
+  { 0x3201, "DEFECT LIST UPDATE FAILURE" },
+  { 0x3700, "ROUNDED PARAMETER" },
+  { 0x3900, "SAVING PARAMETERS NOT SUPPORTED" },
+  { 0x3A00, "MEDIUM NOT PRESENT" },
+  { 0x3E00, "LOGICAL UNIT HAS NOT SELF-CONFIGURED YET" },
+  { 0x3E01, "LOGICAL UNIT FAILURE" },
+  { 0x3E02, "TIMEOUT ON LOGICAL UNIT" },
+  { 0x3E03, "LOGICAL UNIT FAILED SELF-TEST" },
+  { 0x3F01, "MICROCODE HAS BEEN CHANGED" },
+  { 0x3F03, "INQUIRY DATA HAS CHANGED" },
+  { 0x3F0E, "REPORTED LUNS DATA HAS CHANGED" },
+  { 0x4000, "RAM FAILURE" },
+  { 0x4400, "INTERNAL TARGET FAILURE" },
+  { 0x4500, "SELECT OR RESELECT FAILURE" },
+  { 0x4700, "SCSI PARITY ERROR" },
+  { 0x4703, "INFORMATION UNIT iuCRC ERROR DETECTED" },
+  { 0x4800, "INITIATOR DETECTED ERROR MESSAGE RECEIVED" },
+  { 0x4900, "INVALID MESSAGE ERROR" },
+  { 0x4B00, "DATA PHASE ERROR" },
+  { 0x4B04, "NAK RECEIVED" },
+  { 0x4C00, "LOGICAL UNIT FAILED SELF-CONFIGURATION" },
+  { 0x4E00, "OVERLAPPED COMMANDS ATTEMPTED" },
+  { 0x5300, "MEDIA LOAD OR EJECT FAILED" },
+  { 0x5500, "SYSTEM RESOURCE FAILURE" },
+  { 0x5D00, "FAILURE PREDICTION THRESHOLD EXCEEDED" },
+  { 0x5DFF, "FAILURE PREDICTION THRESHOLD EXCEEDED (FALSE)" },
+  { 0x5E00, "LOW POWER CONDITION ON" },
+  { 0x5E01, "IDLE CONDITION ACTIVATED BY TIMER" },
+  { 0x5E02, "STANDBY CONDITION ACTIVATED BY TIMER" },
+  { 0x5E03, "IDLE CONDITION ACTIVATED BY COMMAND" },
+  { 0x5E04, "STANDBY CONDITION ACTIVATED BY COMMAND" },
+  { 0x5E41, "POWER STATE CHANGE TO ACTIVE" },
+  { 0x5E43, "POWER STATE CHANGE TO IDLE" },
+  { 0x5E45, "POWER STATE CHANGE TO STANDBY" },
+  { 0x6500, "VOLTAGE FAULT" },
+  { 0x6700, "CONFIGURATION FAILURE" },
+  { 0x6F00, "COPY PROTECTION KEY EXCHANGE FAILURE - AUTHENTICATION FAILURE" },
+  { 0x7400, "SECURITY ERROR" },
+  { 0x7471, "LOGICAL UNIT ACCESS NOT AUTHORIZED" },
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static unsigned long long get_be(const unsigned char *p, unsigned int n)
+{
+  unsigned long long value = 0;
+  unsigned int i;
+
+  for (i = 0; i < n; i++)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+// ATA Status Return descriptor, refer to SAT-3 section 12.2.2.6
+static void decode_ata_desc(const unsigned char *desc, SENSE_INFO *info)
+{
+  info->ata_valid = 1;
+  info->ata_error = desc[3];
+  info->ata_count = desc[5];
+  info->ata_lba = desc[7] | (desc[9] << 8) | ((unsigned long long)desc[11] << 16);
+  if (desc[2] & 1)                // EXTEND
+  {
+    info->ata_count |= desc[4] << 8;
+    info->ata_lba |= ((unsigned long long)desc[6] << 24) | ((unsigned long long)desc[8] << 32) |
+                     ((unsigned long long)desc[10] << 40);
+  }
+  info->ata_device = desc[12];
+  info->ata_status = desc[13];
+}
+
+// Decode len bytes of sense data, return -1 when the format is unknown. Fields which aren't reported are ZERO
+int sense_decode(const unsigned char *sense_b, unsigned int len, SENSE_INFO *info)
+{
+  unsigned int end, pos;
+
+  memset(info, 0, sizeof(SENSE_INFO));
+  if (len < 8)
+    return -1;
+
+  info->response_code = sense_b[0] & 0x7F;
+  switch (info->response_code)
+  {
+    // Fixed format sense data, refer to spc-4 section 4.5.3
+    case 0x70:
+    case 0x71:
+      info->sk = sense_b[2] & 0xF;
+      if (len >= 14)
+      {
+        info->asc = sense_b[12];
+        info->ascq = sense_b[13];
+      }
+
+      if (info->asc == 0x00 && info->ascq == 0x1D && len >= 12)
+      {
+        // ATA registers in INFORMATION and COMMAND-SPECIFIC INFORMATION, LBA up to 24 bits
+        info->ata_valid = 1;
+        info->ata_error = sense_b[3];
+        info->ata_status = sense_b[4];
+        info->ata_device = sense_b[5];
+        info->ata_count = sense_b[6];
+        info->ata_lba = sense_b[9] | (sense_b[10] << 8) | (sense_b[11] << 16);
+      }
+      else if (sense_b[0] & 0x80)
+      {
+        info->info_valid = 1;
+        info->info = get_be(sense_b + 3, 4);
+      }
+      return 0;
+
+    // Descriptor format sense data, refer to spc-4 section 4.5.2
+    case 0x72:
+    case 0x73:
+      info->sk = sense_b[1] & 0xF;
+      info->asc = sense_b[2];
+      info->ascq = sense_b[3];
+
+      end = 8 + sense_b[7];
+      if (end > len)
+        end = len;
+      for (pos = 8; pos + 2 <= end; pos += 2 + sense_b[pos + 1])
+      {
+        const unsigned char *desc = sense_b + pos;
+
+        if (pos + 2 + desc[1] > end)
+          break;
+
+        switch (desc[0])
+        {
+          case 0x00:              // Information
+            if (desc[1] >= 0x0A && (desc[2] & 0x80))
+            {
+              info->info_valid = 1;
+              info->info = get_be(desc + 4, 8);
+            }
+            break;
+
+          case 0x09:              // ATA Status Return
+            if (desc[1] >= 0x0C)
+              decode_ata_desc(desc, info);
+            break;
+
+          default:
+            break;
+        }
+      }
+      return 0;
+
+    default:
+      return -1;
+  }
+}
+
+const char *sense_key_string(unsigned int sk)
+{
+  return sense_keys[sk & 0xF];
+}
+
+// NULL when ASC/ASCQ isn't in the table
+const char *sense_asc_string(unsigned int asc, unsigned int ascq)
+{
+  unsigned int code = (asc << 8) | ascq;
+  int lo = 0;
+  int hi = sizeof(asc_table) / sizeof(asc_table[0]) - 1;
+
+  while (lo <= hi)
+  {
+    int mid = (lo + hi) / 2;
+
+    if (asc_table[mid].code == code)
+      return asc_table[mid].text;
+    if (asc_table[mid].code < code)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+
+  return NULL;
+}
+
+// First LBA in error, the INFORMATION field or the LBA register of a failed ATA command. Return -1 when neither is there
+int sense_error_lba(const SENSE_INFO *info, unsigned long long *lba)
+{
+  if (info->info_valid)
+  {
+    *lba = info->info;
+    return 0;
+  }
+  if (info->ata_valid && (info->ata_status & ATA_STATUS_ERR))
+  {
+    *lba = info->ata_lba;
+    return 0;
+  }
+
+  return -1;
+}
+
+void sense_print(const SENSE_INFO *info)
+{
+  const char *text = sense_asc_string(info->asc, info->ascq);
+
+  printf("sense code : response code %x | sense key %x %s | asc/ascq %02x/%02x ", info->response_code, info->sk,
+         sense_key_string(info->sk), info->asc, info->ascq);
+  if (text)
+    printf("%s\n", text);
+  else
+    printf("\n");
+
+  if (info->info_valid)
+    printf("information 0x%llx\n", info->info);
+  if (info->ata_valid)
+    printf("ata status %02x | error %02x | device %02x | count %x | lba 0x%llx\n", info->ata_status, info->ata_error,
+           info->ata_device, info->ata_count, info->ata_lba);
+}
@@ -0,0 +1,54 @@
+//
+// Sense data decoder, fixed and descriptor formats with the ATA registers of ATA PASS-THROUGH
+//
+
+#ifndef _SENSE_H_
+#define _SENSE_H_
+
+// Sense keys, refer to spc-4 section 4.5.6
+#define SK_NO_SENSE         0x0
+#define SK_RECOVERED_ERROR  0x1
+#define SK_NOT_READY        0x2
+#define SK_MEDIUM_ERROR     0x3
+#define SK_HARDWARE_ERROR   0x4
+#define SK_ILLEGAL_REQUEST  0x5
+#define SK_UNIT_ATTENTION   0x6
+#define SK_DATA_PROTECT     0x7
+#define SK_ABORTED_COMMAND  0xB
+
+// ATA status and error registers, refer to ACS-3 section 6.1 and 6.2
+#define ATA_STATUS_ERR      0x01
+#define ATA_STATUS_DF       0x20
+#define ATA_STATUS_SE       0x20          // Stream Error of the Streaming commands, DF otherwise
+#define ATA_STATUS_DRDY     0x40
+#define ATA_STATUS_BSY      0x80
+#define ATA_ERROR_CCTO      0x01          // Command Completion Time Out of the Streaming commands
+#define ATA_ERROR_ABRT      0x04
+#define ATA_ERROR_IDNF      0x10
+#define ATA_ERROR_UNC       0x40
+#define ATA_ERROR_ICRC      0x80
+
+typedef struct _SENSE_INFO {
+  unsigned int response_code;
+  unsigned int sk;
+  unsigned int asc;
+  unsigned int ascq;
+  int info_valid;
+  unsigned long long info;          // INFORMATION field, the first LBA in error of a medium error
+
+  // ATA Status Return descriptor of descriptor format, or ATA PASS-THROUGH fixed format, refer to SAT-3 section 12.2.2.6
+  int ata_valid;
+  unsigned int ata_status;
+  unsigned int ata_error;
+  unsigned int ata_device;
+  unsigned int ata_count;
+  unsigned long long ata_lba;
+} SENSE_INFO;
+
+int  sense_decode(const unsigned char *sense_b, unsigned int len, SENSE_INFO *info);
+const char *sense_key_string(unsigned int sk);
+const char *sense_asc_string(unsigned int asc, unsigned int ascq);
+int  sense_error_lba(const SENSE_INFO *info, unsigned long long *lba);
+void sense_print(const SENSE_INFO *info);
+
+#endif
@@ -0,0 +1,537 @@
+//
+// SMART time series store.
+// A SMART READ DATA page is 512 bytes but from one poll to the next only a few raw values move, the power-on
+// hours, the temperature, maybe a counter. Every drive has two files in the store directory, named by serial:
+//   <serial>.dat  a header, then samples back to back, in blocks of SMARTDB_BLOCK_SAMPLES
+//   <serial>.idx  a SMARTDB_INDEX per block, time range, offset and length in the data file
+// A sample is the time as a delta from the previous sample, a flag byte, the attribute IDs when they aren't the
+// same as before, a bitmap of the attributes which changed, and for each of those the deltas of normalized, worst
+// and raw value. Deltas are zigzag varints, so a sample where the hours and the temperature moved takes about a
+// dozen bytes. The first sample of a block, or of a new set of IDs, is a delta from ZERO, so every block decodes
+// on its own and a query only decodes the blocks of its time range, found by a binary search of the index.
+// Both files are only appended to, except the index entry of the open block, which is rewritten as the block
+// grows. The data is synced before the index, and what the index doesn't cover is dropped when the store is opened again
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "smartdb.h"
+
+#define SMARTDB_MAGIC      "SMARTDB1"
+#define SMARTDB_IDS        0x01        // flag, the attribute IDs follow
+#define SMARTDB_MAX_SAMPLE (12 + 1 + 1 + SMART_MAX_ATTRS + 4 + SMART_MAX_ATTRS * 3 * 10)
+
+typedef struct _SMARTDB_HEADER {
+  char magic[8];
+  char serial[24];
+  char model[48];
+} SMARTDB_HEADER;
+
+// Samples of a block one after the other
+typedef struct _SMARTDB_CURSOR {
+  const unsigned char *p;
+  const unsigned char *end;
+  unsigned long long ts;
+  SMART_INFO cur;
+} SMARTDB_CURSOR;
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+static int lasterror;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static unsigned char *put_varint(unsigned char *p, unsigned long long v)
+{
+  while (v >= 0x80)
+  {
+    *p++ = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+// ZERO : the varint runs over the end or is longer than 64 bits
+static int get_varint(SMARTDB_CURSOR *c, unsigned long long *v)
+{
+  unsigned int shift = 0;
+
+  *v = 0;
+  while (c->p < c->end && shift < 64)
+  {
+    *v |= (unsigned long long)(*c->p & 0x7F) << shift;
+    if (!(*c->p++ & 0x80))
+      return 1;
+    shift += 7;
+  }
+  return 0;
+}
+
+static unsigned long long zigzag(long long v)
+{
+  return ((unsigned long long)v << 1) ^ (unsigned long long)(v >> 63);
+}
+
+static long long unzigzag(unsigned long long v)
+{
+  return (long long)(v >> 1) ^ -(long long)(v & 1);
+}
+
+static int same_ids(const SMART_INFO *a, const SMART_INFO *b)
+{
+  unsigned int i;
+
+  if (a->nattrs != b->nattrs)
+    return 0;
+  for (i = 0; i < a->nattrs; i++)
+  {
+    if (a->attrs[i].id != b->attrs[i].id)
+      return 0;
+  }
+  return 1;
+}
+
+// The sample as deltas from prev, a keyframe when prev has no attributes, returns its length
+static unsigned int encode_sample(unsigned char *buf, unsigned long long ts, unsigned long long prev_ts,
+                                  const SMART_INFO *info, SMART_INFO *prev, int keyframe)
+{
+  unsigned char *p = buf;
+  unsigned char *bitmap;
+  const SMART_ATTR *a;
+  SMART_ATTR *b;
+  unsigned int i;
+
+  p = put_varint(p, zigzag((long long)(ts - prev_ts)));
+  if (keyframe || !same_ids(info, prev))
+  {
+    // deltas of a new set of IDs are taken from ZERO
+    *p++ = SMARTDB_IDS;
+    *p++ = info->nattrs;
+    memset(prev, 0, sizeof(SMART_INFO));
+    for (i = 0; i < info->nattrs; i++)
+    {
+      *p++ = info->attrs[i].id;
+      prev->attrs[i].id = info->attrs[i].id;
+    }
+    prev->nattrs = info->nattrs;
+  }
+  else
+    *p++ = 0;
+
+  bitmap = p;
+  memset(bitmap, 0, (info->nattrs + 7) / 8);
+  p += (info->nattrs + 7) / 8;
+  for (i = 0; i < info->nattrs; i++)
+  {
+    a = &info->attrs[i];
+    b = &prev->attrs[i];
+    if (a->value == b->value && a->worst == b->worst && a->raw == b->raw)
+      continue;
+    bitmap[i / 8] |= 1 << (i % 8);
+    p = put_varint(p, zigzag((long long)a->value - b->value));
+    p = put_varint(p, zigzag((long long)a->worst - b->worst));
+    p = put_varint(p, zigzag((long long)(a->raw - b->raw)));
+    *b = *a;
+  }
+  return p - buf;
+}
+
+// 1 : the next sample is in c->ts and c->cur, ZERO : end of the block, -1 : corrupt
+static int next_sample(SMARTDB_CURSOR *c)
+{
+  const unsigned char *bitmap;
+  unsigned long long v, dvalue, dworst, draw;
+  SMART_ATTR *a;
+  unsigned int i, n;
+
+  if (c->p >= c->end)
+    return 0;
+
+  if (!get_varint(c, &v) || c->p >= c->end)
+    return -1;
+  c->ts += unzigzag(v);
+
+  if (*c->p++ & SMARTDB_IDS)
+  {
+    if (c->p >= c->end || *c->p > SMART_MAX_ATTRS || c->end - c->p < 1 + *c->p)
+      return -1;
+    n = *c->p++;
+    memset(&c->cur, 0, sizeof(SMART_INFO));
+    for (i = 0; i < n; i++)
+      c->cur.attrs[i].id = *c->p++;
+    c->cur.nattrs = n;
+  }
+
+  n = c->cur.nattrs;
+  if (c->end - c->p < (long)(n + 7) / 8)
+    return -1;
+  bitmap = c->p;
+  c->p += (n + 7) / 8;
+  for (i = 0; i < n; i++)
+  {
+    if (!(bitmap[i / 8] & (1 << (i % 8))))
+      continue;
+    if (!get_varint(c, &dvalue) || !get_varint(c, &dworst) || !get_varint(c, &draw))
+      return -1;
+    a = &c->cur.attrs[i];
+    a->value += unzigzag(dvalue);
+    a->worst += unzigzag(dworst);
+    a->raw += unzigzag(draw);
+  }
+  return 1;
+}
+
+// Serial numbers are file names, anything but letters, digits, '-' and '.' becomes '_'
+static void store_path(char *path, unsigned int len, const char *dir, const char *serial, const char *suffix)
+{
+  char name[64];
+  unsigned int i;
+
+  for (i = 0; serial[i] && i < sizeof(name) - 1; i++)
+  {
+    if ((serial[i] >= '0' && serial[i] <= '9') || (serial[i] >= 'A' && serial[i] <= 'Z') ||
+        (serial[i] >= 'a' && serial[i] <= 'z') || serial[i] == '-' || serial[i] == '.')
+      name[i] = serial[i];
+    else
+      name[i] = '_';
+  }
+  name[i] = 0;
+  snprintf(path, len, "%s/%s%s", dir, name, suffix);
+}
+
+static int open_file(const char *path, int flags)
+{
+  int fd;
+
+  fd = open(path, flags, 0644);
+  if (fd < 0)
+  {
+    lasterror = errno;
+    printf("Open %s failed (%d) - %s\n", path, lasterror, strerror(lasterror));
+  }
+  return fd;
+}
+
+// The open block is decoded again so that the next sample is a delta from its last one
+static int restore_block(SMARTDB_WRITER *w)
+{
+  SMARTDB_CURSOR c;
+  unsigned char *buf;
+  int ret;
+
+  w->prev_ts = 0;
+  memset(&w->prev, 0, sizeof(SMART_INFO));
+  if (w->block.length == 0)
+    return 0;
+
+  buf = (unsigned char *)malloc(w->block.length);
+  if (buf == NULL || pread(w->dat_fd, buf, w->block.length, w->block.offset) != w->block.length)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(buf);
+    return -1;
+  }
+
+  memset(&c, 0, sizeof(c));
+  c.p = buf;
+  c.end = buf + w->block.length;
+  while ((ret = next_sample(&c)) == 1)
+    ;
+  free(buf);
+  if (ret < 0)
+  {
+    printf("ERROR, %s: the last block at %llu is corrupt\n", __func__, w->block.offset);
+    return -1;
+  }
+
+  w->prev_ts = c.ts;
+  w->prev = c.cur;
+  return 0;
+}
+
+int smartdb_open(SMARTDB_WRITER *w, const char *dir, const char *serial, const char *model)
+{
+  char path[PATH_MAX];
+  SMARTDB_HEADER header;
+  struct stat f_stat;
+  off_t end;
+
+  memset(w, 0, sizeof(SMARTDB_WRITER));
+  w->dat_fd = -1;
+  w->idx_fd = -1;
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+  {
+    lasterror = errno;
+    printf("Create %s failed (%d) - %s\n", dir, lasterror, strerror(lasterror));
+    return -1;
+  }
+
+  store_path(path, sizeof(path), dir, serial, ".dat");
+  w->dat_fd = open_file(path, O_RDWR | O_CREAT);
+  store_path(path, sizeof(path), dir, serial, ".idx");
+  w->idx_fd = open_file(path, O_RDWR | O_CREAT);
+  if (w->dat_fd < 0 || w->idx_fd < 0 || fstat(w->idx_fd, &f_stat) != 0)
+    goto fail;
+
+  // a partial entry at the end of the index is a write which didn't complete
+  w->nblocks = f_stat.st_size / sizeof(SMARTDB_INDEX);
+  if (w->nblocks &&
+      pread(w->idx_fd, &w->block, sizeof(SMARTDB_INDEX), (w->nblocks - 1) * sizeof(SMARTDB_INDEX)) != sizeof(SMARTDB_INDEX))
+    goto fail;
+
+  memset(&header, 0, sizeof(header));
+  if (pread(w->dat_fd, &header, sizeof(header), 0) == sizeof(header))
+  {
+    if (memcmp(header.magic, SMARTDB_MAGIC, sizeof(header.magic)) != 0)
+    {
+      printf("%s isn't a SMART time series\n", path);
+      goto fail;
+    }
+  }
+  else
+  {
+    memcpy(header.magic, SMARTDB_MAGIC, sizeof(header.magic));
+    snprintf(header.serial, sizeof(header.serial), "%s", serial);
+    snprintf(header.model, sizeof(header.model), "%s", model);
+    if (pwrite(w->dat_fd, &header, sizeof(header), 0) != sizeof(header))
+      goto fail;
+  }
+
+  // samples which were written but never made it into the index are dropped
+  end = w->nblocks ? w->block.offset + w->block.length : sizeof(SMARTDB_HEADER);
+  if (ftruncate(w->dat_fd, end) != 0 || ftruncate(w->idx_fd, w->nblocks * sizeof(SMARTDB_INDEX)) != 0)
+    goto fail;
+
+  if (w->nblocks && restore_block(w) != 0)
+    goto fail;
+  return 0;
+
+fail:
+  printf("ERROR, %s: %s can't be opened\n", __func__, serial);
+  smartdb_close(w);
+  return -1;
+}
+
+int smartdb_append(SMARTDB_WRITER *w, unsigned long long ts, const SMART_INFO *info)
+{
+  unsigned char buf[SMARTDB_MAX_SAMPLE];
+  unsigned int len;
+  int keyframe = 0;
+
+  if (w->nblocks == 0 || w->block.samples == SMARTDB_BLOCK_SAMPLES)
+  {
+    // a new block, the data goes on from where the last one ends
+    w->block.offset = w->nblocks ? w->block.offset + w->block.length : sizeof(SMARTDB_HEADER);
+    w->block.length = 0;
+    w->block.samples = 0;
+    w->block.first_ts = ts;
+    w->nblocks++;
+    w->prev_ts = 0;
+    keyframe = 1;
+  }
+
+  len = encode_sample(buf, ts, w->prev_ts, info, &w->prev, keyframe);
+  if (pwrite(w->dat_fd, buf, len, w->block.offset + w->block.length) != len || fdatasync(w->dat_fd) != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  w->prev_ts = ts;
+  w->block.length += len;
+  w->block.samples++;
+  w->block.last_ts = ts;
+  if (pwrite(w->idx_fd, &w->block, sizeof(SMARTDB_INDEX), (w->nblocks - 1) * sizeof(SMARTDB_INDEX)) !=
+      sizeof(SMARTDB_INDEX))
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+  return 0;
+}
+
+void smartdb_close(SMARTDB_WRITER *w)
+{
+  if (w->dat_fd >= 0)
+    close(w->dat_fd);
+  if (w->idx_fd >= 0)
+    close(w->idx_fd);
+  w->dat_fd = -1;
+  w->idx_fd = -1;
+}
+
+// Samples of one drive in the time range of the query, CSV rows serial,time,id,value,worst,raw
+static int query_drive(FILE *fp, const char *dir, const char *serial, SMARTDB_QUERY *query,
+                       unsigned long long *samples, unsigned long long *stored, unsigned long long *bytes)
+{
+  char path[PATH_MAX];
+  struct stat dat_stat, idx_stat;
+  SMARTDB_INDEX *index;
+  SMARTDB_CURSOR c;
+  unsigned char *data;
+  unsigned long long nblocks, lo, hi, b;
+  unsigned int i;
+  int dat_fd, idx_fd;
+  int ret = 0;
+
+  store_path(path, sizeof(path), dir, serial, ".idx");
+  idx_fd = open_file(path, O_RDONLY);
+  store_path(path, sizeof(path), dir, serial, ".dat");
+  dat_fd = open_file(path, O_RDONLY);
+  if (idx_fd < 0 || dat_fd < 0 || fstat(idx_fd, &idx_stat) != 0 || fstat(dat_fd, &dat_stat) != 0)
+  {
+    if (idx_fd >= 0)
+      close(idx_fd);
+    if (dat_fd >= 0)
+      close(dat_fd);
+    return -1;
+  }
+
+  nblocks = idx_stat.st_size / sizeof(SMARTDB_INDEX);
+  *bytes += dat_stat.st_size + idx_stat.st_size;
+  if (nblocks == 0 || dat_stat.st_size == 0)
+  {
+    close(idx_fd);
+    close(dat_fd);
+    return 0;
+  }
+
+  index = (SMARTDB_INDEX *)mmap(NULL, idx_stat.st_size, PROT_READ, MAP_SHARED, idx_fd, 0);
+  data = (unsigned char *)mmap(NULL, dat_stat.st_size, PROT_READ, MAP_SHARED, dat_fd, 0);
+  close(idx_fd);
+  close(dat_fd);
+  if (index == MAP_FAILED || data == MAP_FAILED)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    if (index != MAP_FAILED)
+      munmap(index, idx_stat.st_size);
+    if (data != MAP_FAILED)
+      munmap(data, dat_stat.st_size);
+    return -1;
+  }
+
+  for (b = 0; b < nblocks; b++)
+    *stored += index[b].samples;
+
+  // first block which ends at or after from
+  lo = 0;
+  hi = nblocks;
+  while (lo < hi)
+  {
+    b = (lo + hi) / 2;
+    if (index[b].last_ts < query->from)
+      lo = b + 1;
+    else
+      hi = b;
+  }
+
+  for (b = lo; b < nblocks && (query->to == 0 || index[b].first_ts <= query->to); b++)
+  {
+    if (index[b].offset + index[b].length > (unsigned long long)dat_stat.st_size)
+    {
+      printf("ERROR, %s: block %llu of %s is beyond the data\n", __func__, b, serial);
+      ret = -1;
+      break;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.p = data + index[b].offset;
+    c.end = c.p + index[b].length;
+    while ((ret = next_sample(&c)) == 1)
+    {
+      if (c.ts < query->from || (query->to && c.ts > query->to))
+        continue;
+      (*samples)++;
+      for (i = 0; i < c.cur.nattrs; i++)
+      {
+        if (query->attr == 0 || query->attr == c.cur.attrs[i].id)
+          fprintf(fp, "%s,%llu,%u,%u,%u,%llu\n", serial, c.ts, c.cur.attrs[i].id, c.cur.attrs[i].value,
+                  c.cur.attrs[i].worst, c.cur.attrs[i].raw);
+      }
+    }
+    if (ret < 0)
+    {
+      printf("ERROR, %s: block %llu of %s is corrupt\n", __func__, b, serial);
+      break;
+    }
+  }
+
+  munmap(index, idx_stat.st_size);
+  munmap(data, dat_stat.st_size);
+  return ret < 0 ? -1 : 0;
+}
+
+// The drive of the query, or every drive with an index in the store
+int smartdb_query(const char *dir, SMARTDB_QUERY *query)
+{
+  char serial[PATH_MAX];
+  struct dirent *entry;
+  unsigned long long samples = 0, stored = 0, bytes = 0;
+  unsigned int drives = 0;
+  unsigned int len;
+  FILE *fp = stdout;
+  DIR *d;
+  int ret = 0;
+
+  if (query->output)
+  {
+    fp = fopen(query->output, "w");
+    if (fp == NULL)
+    {
+      lasterror = errno;
+      printf("Open %s failed (%d) - %s\n", query->output, lasterror, strerror(lasterror));
+      return -1;
+    }
+  }
+  fprintf(fp, "serial,time,id,value,worst,raw\n");
+
+  if (query->serial)
+  {
+    drives = 1;
+    ret = query_drive(fp, dir, query->serial, query, &samples, &stored, &bytes);
+  }
+  else
+  {
+    d = opendir(dir);
+    if (d == NULL)
+    {
+      lasterror = errno;
+      printf("Open %s failed (%d) - %s\n", dir, lasterror, strerror(lasterror));
+      ret = -1;
+    }
+    while (d && (entry = readdir(d)) != NULL)
+    {
+      len = strlen(entry->d_name);
+      if (len <= 4 || strcmp(entry->d_name + len - 4, ".idx") != 0)
+        continue;
+      snprintf(serial, sizeof(serial), "%.*s", len - 4, entry->d_name);
+      drives++;
+      if (query_drive(fp, dir, serial, query, &samples, &stored, &bytes) != 0)
+        ret = -1;
+    }
+    if (d)
+      closedir(d);
+  }
+
+  if (query->output)
+    fclose(fp);
+  else
+    fflush(fp);
+
+  printf("%u drives, %llu samples in range, %llu samples in %llu bytes stored, %.1f bytes per sample against %u\n",
+         drives, samples, stored, bytes, stored ? (double)bytes / stored : 0, BLOB_SIZE);
+  return ret;
+}
@@ -0,0 +1,43 @@
+//
+// Time series store of SMART attributes, one delta encoded stream per drive
+//
+
+#ifndef _SMARTDB_H_
+#define _SMARTDB_H_
+
+#include "blob.h"
+
+#define SMARTDB_BLOCK_SAMPLES  256    // samples per block, every block starts with the full values
+
+// A block of the data file, the index file is an array of them in time order
+typedef struct _SMARTDB_INDEX {
+  unsigned long long first_ts;    // seconds since the epoch
+  unsigned long long last_ts;
+  unsigned long long offset;      // in the data file
+  unsigned int length;            // bytes
+  unsigned int samples;
+} SMARTDB_INDEX;
+
+typedef struct _SMARTDB_WRITER {
+  int dat_fd;
+  int idx_fd;
+  SMARTDB_INDEX block;            // the block samples go to
+  unsigned long long nblocks;     // in the index, the last one is block
+  unsigned long long prev_ts;
+  SMART_INFO prev;                // the last sample, deltas are taken from it
+} SMARTDB_WRITER;
+
+typedef struct _SMARTDB_QUERY {
+  const char *serial;             // NULL : every drive of the store
+  unsigned long long from;        // seconds since the epoch, ZERO : from the first sample
+  unsigned long long to;          // ZERO : up to the last sample
+  unsigned int attr;              // attribute ID, ZERO : all of them
+  const char *output;             // CSV file, NULL : stdout
+} SMARTDB_QUERY;
+
+int  smartdb_open(SMARTDB_WRITER *w, const char *dir, const char *serial, const char *model);
+int  smartdb_append(SMARTDB_WRITER *w, unsigned long long ts, const SMART_INFO *info);
+void smartdb_close(SMARTDB_WRITER *w);
+int  smartdb_query(const char *dir, SMARTDB_QUERY *query);
+
+#endif
@@ -0,0 +1,146 @@
+//
+// Latency statistics, a fixed size histogram so that adding a sample costs a few instructions
+//
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "stats.h"
+
+///////////////
+// LOCALS
+///////////////
+
+static unsigned long long stats_seed = 0x9E3779B97F4A7C15ULL;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+unsigned long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The whole of ns even when a signal interrupts the sleep
+void sleep_ns(unsigned long long ns)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+    ;
+}
+
+// xorshift64 with a fixed seed, the same LBAs on every run so that results of two runs can be compared
+unsigned long long stats_random(void)
+{
+  stats_seed ^= stats_seed << 13;
+  stats_seed ^= stats_seed >> 7;
+  stats_seed ^= stats_seed << 17;
+  return stats_seed;
+}
+
+void stats_reset(LAT_STATS *stats)
+{
+  memset(stats, 0, sizeof(LAT_STATS));
+}
+
+// Values below LAT_SUB_BUCKETS have a bucket each, above that the bucket is
+// (position of the highest bit) * LAT_SUB_BUCKETS + the next LAT_SUB_BITS bits
+unsigned int lat_bucket(unsigned long long ns)
+{
+  unsigned int msb;
+
+  if (ns < LAT_SUB_BUCKETS)
+    return ns;
+
+  msb = 63 - __builtin_clzll(ns);
+  return (msb - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS + ((ns >> (msb - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1));
+}
+
+// Lower bound of the bucket
+unsigned long long lat_bucket_value(unsigned int bucket)
+{
+  unsigned int msb;
+
+  if (bucket < LAT_SUB_BUCKETS)
+    return bucket;
+
+  msb = bucket / LAT_SUB_BUCKETS + LAT_SUB_BITS - 1;
+  return (1ULL << msb) | ((unsigned long long)(bucket % LAT_SUB_BUCKETS) << (msb - LAT_SUB_BITS));
+}
+
+void stats_add(LAT_STATS *stats, unsigned long long ns)
+{
+  if (stats->count == 0 || ns < stats->min)
+    stats->min = ns;
+  if (ns > stats->max)
+    stats->max = ns;
+
+  stats->count++;
+  stats->sum += ns;
+  stats->buckets[lat_bucket(ns)]++;
+}
+
+void stats_merge(LAT_STATS *dst, LAT_STATS *src)
+{
+  int i;
+
+  if (src->count == 0)
+    return;
+
+  if (dst->count == 0 || src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+
+  dst->count += src->count;
+  dst->sum += src->sum;
+  for (i = 0; i < LAT_BUCKETS; i++)
+    dst->buckets[i] += src->buckets[i];
+}
+
+unsigned long long stats_percentile(LAT_STATS *stats, double percent)
+{
+  unsigned long long rank;
+  unsigned long long seen = 0;
+  int i;
+
+  if (stats->count == 0)
+    return 0;
+
+  rank = (unsigned long long)(stats->count * percent / 100.0);
+  if (rank >= stats->count)
+    rank = stats->count - 1;
+
+  for (i = 0; i < LAT_BUCKETS; i++)
+  {
+    seen += stats->buckets[i];
+    if (seen > rank)
+    {
+      unsigned long long value = lat_bucket_value(i);
+
+      // the bucket bound may be out of the observed range
+      if (value < stats->min)
+        value = stats->min;
+      if (value > stats->max)
+        value = stats->max;
+      return value;
+    }
+  }
+
+  return stats->max;
+}
+
+double stats_mean(LAT_STATS *stats)
+{
+  if (stats->count == 0)
+    return 0;
+
+  return (double)stats->sum / stats->count;
+}
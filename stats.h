@@ -0,0 +1,33 @@
+//
+// Latency statistics
+//
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+// Log-linear histogram, every power of 2 of nanoseconds is split into LAT_SUB_BUCKETS buckets,
+// so a percentile is within 1/LAT_SUB_BUCKETS of the real value
+#define LAT_SUB_BITS     3
+#define LAT_SUB_BUCKETS  (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS      (64 * LAT_SUB_BUCKETS)
+
+typedef struct _LAT_STATS {
+  unsigned long long count;
+  unsigned long long sum;          // nanoseconds
+  unsigned long long min;
+  unsigned long long max;
+  unsigned int buckets[LAT_BUCKETS];
+} LAT_STATS;
+
+unsigned long long now_ns(void);
+void sleep_ns(unsigned long long ns);
+unsigned long long stats_random(void);
+void stats_reset(LAT_STATS *stats);
+void stats_add(LAT_STATS *stats, unsigned long long ns);
+void stats_merge(LAT_STATS *dst, LAT_STATS *src);
+unsigned long long stats_percentile(LAT_STATS *stats, double percent);
+double stats_mean(LAT_STATS *stats);
+unsigned int lat_bucket(unsigned long long ns);
+unsigned long long lat_bucket_value(unsigned int bucket);
+
+#endif
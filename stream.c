@@ -0,0 +1,229 @@
+//
+// Streaming workload.
+// Every command carries a COMMAND COMPLETION TIME LIMIT, in units of the streaming performance granularity of
+// IDENTIFY word 98-99. Without the continuous option a command which can't finish in time is aborted with CCTO,
+// with it the device completes in time with the data it has and reports a stream error (SE) instead, which is
+// what a video ingest wants: a glitch in one frame rather than a stall of the stream.
+// Commands are sent one at a time and never retried, a retry can't meet the deadline anyway. The host checks the
+// deadline too, the device only counts from when it starts the command
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "stream.h"
+#include "command.h"
+#include "transport.h"
+#include "retry.h"
+#include "stats.h"
+#include "sense.h"
+
+#define STREAM_CHUNK        256           // 128 KiB
+#define STREAM_DEADLINE_US  50000
+#define STREAM_MAX_CCTL     255
+#define STREAM_REPORT_NS    1000000000ULL
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static void sleep_until(unsigned long long ns)
+{
+  struct timespec ts;
+
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  // clock_nanosleep() returns the error rather than setting errno
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+// COMMAND COMPLETION TIME LIMIT of deadline_us, ZERO when the device doesn't report the granularity
+static unsigned int stream_cctl(DEVICE_CONTEXT *dev, unsigned int deadline_us)
+{
+  unsigned int cctl;
+
+  if (dev->ata.stream_gran == 0)
+    return 0;
+
+  cctl = (deadline_us + dev->ata.stream_gran - 1) / dev->ata.stream_gran;
+  if (cctl == 0)
+    cctl = 1;
+  if (cctl > STREAM_MAX_CCTL)
+    cctl = STREAM_MAX_CCTL;
+  return cctl;
+}
+
+int stream_run(DEVICE_CONTEXT *dev, STREAM_CONFIG *config, STREAM_RESULT *result)
+{
+  struct sg_io_hdr io_hdr;
+  unsigned char cmd[16];
+  unsigned char sense_b[64];
+  SENSE_INFO sense;
+  LAT_STATS lat;
+  char *buffer;
+  unsigned long long capacity = device_capacity(dev);
+  unsigned long long lba = config->startlba;
+  unsigned long long end;
+  unsigned long long deadline_ns;
+  unsigned long long start, last_report, now, due, ns;
+  unsigned long long worst_ns = 0;
+  unsigned int chunk = config->chunk ? config->chunk : STREAM_CHUNK;
+  unsigned int deadline_us = config->deadline_us ? config->deadline_us : STREAM_DEADLINE_US;
+  unsigned int options = config->continuous ? STREAM_OPT_CONTINUOUS : 0;
+  unsigned int isread = !config->iswrite;
+  unsigned int cctl, sectors;
+  int configured;
+
+  memset(result, 0, sizeof(STREAM_RESULT));
+
+  if (dev->path != PATH_ATA || !dev->ata.stream_feat || !dev->ata.ext_feat)
+  {
+    printf("ERROR, %s: the device doesn't support the Streaming feature set on the ATA path\n", __func__);
+    return -1;
+  }
+  if (config->streamid > STREAM_MAX_ID || lba >= capacity)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+
+  // a multiple of the stream minimum request size, within one command
+  if (dev->ata.stream_min_req > 1)
+    chunk = (chunk + dev->ata.stream_min_req - 1) / dev->ata.stream_min_req * dev->ata.stream_min_req;
+  chunk = device_align_sectors(dev, chunk);
+  if (chunk == 0)
+  {
+    printf("ERROR, %s: %u sectors per command can't hold a physical sector of %u\n", __func__, dev->max_sectors,
+           dev->phys_sectors);
+    return -1;
+  }
+  end = config->sectors && lba + config->sectors < capacity ? lba + config->sectors : capacity;
+
+  cctl = stream_cctl(dev, deadline_us);
+  if (cctl)
+    printf("time limit %u us, CCTL %u x %u us\n", cctl * dev->ata.stream_gran, cctl, dev->ata.stream_gran);
+  else
+    printf("the device doesn't report the streaming granularity, it uses its default time limit\n");
+  deadline_ns = (unsigned long long)deadline_us * 1000;
+
+  // the stream's default time limit and allocation unit, the commands carry the limit anyway
+  configured = configure_stream(dev->fd, config->streamid, 1, cctl, chunk) == 0;
+  if (!configured)
+    printf("CONFIGURE STREAM failed, stream %u goes with the device defaults\n", config->streamid);
+
+  buffer = (char *)calloc(chunk, dev->sector_size);
+  if (buffer == NULL)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    return -1;
+  }
+  stats_reset(&lat);
+
+  printf("stream %u %s lba 0x%llx ~ 0x%llx, %u sectors per command, deadline %u us%s", config->streamid,
+         isread ? "read" : "write", lba, end, chunk, deadline_us, config->continuous ? ", continuous" : "");
+  if (config->rate_mbs)
+    printf(", %u MB/s", config->rate_mbs);
+  printf("\n");
+
+  start = now_ns();
+  last_report = start;
+  while (lba < end)
+  {
+    sectors = end - lba < chunk ? end - lba : chunk;
+
+    // a paced stream sends every command at its time, a command which starts late has lost its deadline already
+    if (config->rate_mbs)
+    {
+      due = start + result->sectors * dev->sector_size * 1000 / config->rate_mbs;
+      now = now_ns();
+      if (now > due + deadline_ns)
+        result->late_starts++;
+      else if (now < due)
+        sleep_until(due);
+    }
+
+    stream_cdb(cmd, isread, config->streamid, cctl, options, lba, sectors);
+    if (isDebug)
+      printf("DEBUG, stream lba 0x%llx, sectors %u\n", lba, sectors);
+
+    // no retry, the time limit of the device is much shorter than the timeout
+    sg_io_setup(&io_hdr, cmd, sizeof(cmd), isread, buffer, sectors * dev->sector_size, sense_b, sizeof(sense_b),
+                policy_timeout(cmd, 0));
+    now = now_ns();
+    if (sg_execute(dev->fd, &io_hdr) < 0)
+    {
+      printf("ERROR, %s: lba 0x%llx, sectors %u can't be sent\n", __func__, lba, sectors);
+      break;
+    }
+    ns = now_ns() - now;
+    stats_add(&lat, ns);
+    result->commands++;
+
+    if (ns > deadline_ns)
+    {
+      result->misses++;
+      if (ns > worst_ns)
+        worst_ns = ns;
+    }
+
+    memset(&sense, 0, sizeof(sense));
+    if (io_hdr.status == 2)
+      sense_decode(sense_b, io_hdr.sb_len_wr, &sense);
+    if (sense.ata_valid && (sense.ata_error & ATA_ERROR_CCTO))
+      result->timeouts++;
+
+    if (sg_io_check(&io_hdr) != 0)
+    {
+      result->failures++;
+      printf("ERROR, lba 0x%llx, sectors %u", lba, sectors);
+      if (sense.response_code)
+        printf(", %s, status %02x error %02x", sense_key_string(sense.sk), sense.ata_status, sense.ata_error);
+      printf("\n");
+    }
+    else
+    {
+      if (sense.ata_valid && (sense.ata_status & ATA_STATUS_SE))
+      {
+        result->stream_errors++;
+        if (isDebug)
+          printf("DEBUG, stream error at lba 0x%llx, error %02x\n", lba, sense.ata_error);
+      }
+      result->sectors += sectors;
+    }
+    lba += sectors;
+
+    now = now_ns();
+    if (now - last_report >= STREAM_REPORT_NS)
+    {
+      printf("stream %llu commands, %llu deadline misses, %.1f MB/s\n", result->commands, result->misses,
+             result->sectors * dev->sector_size / ((now - start) / 1e9) / 1e6);
+      last_report = now;
+    }
+  }
+  result->seconds = (now_ns() - start) / 1e9;
+  free(buffer);
+
+  if (configured)
+    configure_stream(dev->fd, config->streamid, 0, 0, 0);
+
+  printf("stream done, %llu commands, %llu sectors in %.3f s, %.1f MB/s\n", result->commands, result->sectors,
+         result->seconds, result->seconds > 0 ? result->sectors * dev->sector_size / result->seconds / 1e6 : 0);
+  printf("deadline misses %llu (%.3f%%), worst %.1f us, device time outs %llu, stream errors %llu, failures %llu",
+         result->misses, result->commands ? 100.0 * result->misses / result->commands : 0, worst_ns / 1e3,
+         result->timeouts, result->stream_errors, result->failures);
+  if (config->rate_mbs)
+    printf(", late starts %llu", result->late_starts);
+  printf("\n");
+  printf("latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", stats_percentile(&lat, 50) / 1e3,
+         stats_percentile(&lat, 99) / 1e3, stats_percentile(&lat, 99.9) / 1e3, lat.max / 1e3);
+
+  return result->failures ? -1 : 0;
+}
@@ -0,0 +1,34 @@
+//
+// Streaming workload, READ / WRITE STREAM DMA EXT with a command completion time limit
+//
+
+#ifndef _STREAM_H_
+#define _STREAM_H_
+
+#include "device.h"
+
+typedef struct _STREAM_CONFIG {
+  unsigned long long startlba;
+  unsigned long long sectors;     // ZERO : to the end of the device
+  unsigned int chunk;             // sectors per command, ZERO : STREAM_CHUNK
+  unsigned int streamid;
+  unsigned int deadline_us;       // time limit of every command, ZERO : STREAM_DEADLINE_US
+  unsigned int rate_mbs;          // MB/s the stream is paced at, ZERO : as fast as the device goes
+  int continuous;                 // 1 : RC / WC, the device completes in time with the data it has
+  int iswrite;
+} STREAM_CONFIG;
+
+typedef struct _STREAM_RESULT {
+  unsigned long long commands;
+  unsigned long long sectors;
+  unsigned long long misses;      // completed after the deadline as seen by the host
+  unsigned long long timeouts;    // CCTO reported by the device
+  unsigned long long stream_errors;   // SE, completed but the data may not be perfect
+  unsigned long long failures;    // no data at all
+  unsigned long long late_starts; // the paced stream fell behind its schedule by more than a deadline
+  double seconds;
+} STREAM_RESULT;
+
+int stream_run(DEVICE_CONTEXT *dev, STREAM_CONFIG *config, STREAM_RESULT *result);
+
+#endif
@@ -0,0 +1,417 @@
+//
+// Topology map and link throughput limits.
+// The sysfs device of an sg or block device is a path from the PCI function of the host adapter down to the
+// logical unit, e.g. /sys/devices/pci0000:00/0000:00:03.0/0000:02:00.0/host2/port-2:0/expander-2:0/port-2:0:5/
+// end_device-2:0:5/target2:0:5/2:0:5:0. Every hostN, port-*, expander-* and ataN on the way is a link, drives
+// which share a link share its bandwidth. A port carries the sum of its phys, 8b/10b encoded up to 12 Gbit,
+// 128b/150b for 22.5 Gbit SAS-4. Hosts and expanders have no rate of their own, they are limited by name.
+// Every link with a rate is a token bucket in bytes: a command goes when every link on its path has tokens left
+// and takes its bytes from all of them, so a bucket may go below ZERO by one command, which is paid back before the
+// next. Nothing ever waits for a large command to fit
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "topo.h"
+#include "command.h"
+#include "emul.h"
+#include "stats.h"
+
+#define TOPO_BURST_MS      10          // bucket depth in time at the link rate
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+static const char *link_type_names[] = {
+  "host", "port", "expander", "ata"
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+const char *link_type_name(LINK_TYPE type)
+{
+  return type <= LINK_ATA ? link_type_names[type] : "unknown";
+}
+
+void topo_init(TOPOLOGY *t)
+{
+  memset(t, 0, sizeof(TOPOLOGY));
+}
+
+// Bytes per second of a serial link of gbit line rate
+static double link_bytes(double gbit)
+{
+  if (gbit >= 22.5)
+    return gbit * 1e9 * 128 / 150 / 8;
+  return gbit * 1e9 / 10;
+}
+
+static double read_gbit(const char *path)
+{
+  char line[64];
+  double gbit = 0;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return 0;
+  if (fgets(line, sizeof(line), fp) == NULL || sscanf(line, "%lf", &gbit) != 1)
+    gbit = 0;
+  fclose(fp);
+  return gbit;
+}
+
+// A SAS port is as fast as its phys together, refer to /sys/class/sas_phy
+static void port_rate(TOPO_LINK *link, const char *portdir)
+{
+  char path[PATH_MAX];
+  struct dirent *entry;
+  unsigned int nphys = 0;
+  double gbit, max = 0;
+  DIR *dir;
+
+  dir = opendir(portdir);
+  if (dir == NULL)
+    return;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (strncmp(entry->d_name, "phy-", 4) != 0)
+      continue;
+    snprintf(path, sizeof(path), "/sys/class/sas_phy/%s/negotiated_linkrate", entry->d_name);
+    gbit = read_gbit(path);
+    if (gbit <= 0)
+      continue;
+    link->rate += link_bytes(gbit);
+    if (gbit > max)
+      max = gbit;
+    nphys++;
+  }
+  closedir(dir);
+
+  if (nphys)
+    snprintf(link->info, sizeof(link->info), "%u x %.1f Gbit", nphys, max);
+}
+
+static unsigned int topo_link(TOPOLOGY *t, const char *name, LINK_TYPE type)
+{
+  TOPO_LINK *link;
+  unsigned int i;
+
+  for (i = 0; i < t->nlinks; i++)
+  {
+    if (strcmp(t->links[i].name, name) == 0)
+      return i;
+  }
+  if (t->nlinks == TOPO_MAX_LINKS)
+    return TOPO_MAX_LINKS;
+
+  link = &t->links[t->nlinks];
+  memset(link, 0, sizeof(TOPO_LINK));
+  snprintf(link->name, sizeof(link->name), "%s", name);
+  link->type = type;
+  return t->nlinks++;
+}
+
+// sysfs directory of the SCSI device of the fd, -1 when it isn't a SCSI device
+static int scsi_sysfs_dir(int fd, char *dir)
+{
+  struct stat f_stat;
+  char path[128];
+
+  if (fstat(fd, &f_stat) < 0)
+    return -1;
+
+  if (S_ISCHR(f_stat.st_mode))
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device", major(f_stat.st_rdev), minor(f_stat.st_rdev));
+  else if (S_ISBLK(f_stat.st_mode))
+  {
+    // a partition has no device of its own, its disk has
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/device", major(f_stat.st_rdev), minor(f_stat.st_rdev));
+    if (access(path, F_OK) != 0)
+      snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../device", major(f_stat.st_rdev), minor(f_stat.st_rdev));
+  }
+  else
+    return -1;
+
+  return realpath(path, dir) != NULL ? 0 : -1;
+}
+
+// Enclosure and slot of the device by the enclosure_device:<slot> link of ses, it points to
+// /sys/class/enclosure/<enclosure>/<slot>
+static void topo_enclosure(const char *devdir, TOPO_PATH *path)
+{
+  char link[PATH_MAX];
+  char target[PATH_MAX];
+  struct dirent *entry;
+  char *slash;
+  DIR *dir;
+
+  dir = opendir(devdir);
+  if (dir == NULL)
+    return;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (strncmp(entry->d_name, "enclosure_device:", 17) == 0)
+    {
+      snprintf(path->slot, sizeof(path->slot), "%s", entry->d_name + 17);
+      snprintf(link, sizeof(link), "%s/%s", devdir, entry->d_name);
+      if (realpath(link, target) != NULL && (slash = strrchr(target, '/')) != NULL)
+      {
+        *slash = 0;
+        slash = strrchr(target, '/');
+        snprintf(path->enclosure, sizeof(path->enclosure), "%.63s", slash ? slash + 1 : target);
+      }
+      break;
+    }
+  }
+  closedir(dir);
+}
+
+// Links from the host adapter down to the device, the device is counted as a user of every one of them
+int topo_add_device(TOPOLOGY *t, DEVICE_CONTEXT *dev, TOPO_PATH *path)
+{
+  char devdir[PATH_MAX];
+  char prefix[PATH_MAX];
+  char gbitpath[128];
+  char *component, *save;
+  unsigned int id, n;
+  unsigned int len = 0;
+  int end;
+  double gbit;
+  int emulated = emul_is_path(dev->dev_path);
+  LINK_TYPE type;
+  TOPO_LINK *link;
+
+  memset(path, 0, sizeof(TOPO_PATH));
+  if (emulated)
+  {
+    if (emul_topology(dev->fd, devdir, sizeof(devdir)) != 0)
+      return -1;
+  }
+  else if (scsi_sysfs_dir(dev->fd, devdir) != 0)
+    return -1;
+  else
+    topo_enclosure(devdir, path);
+
+  prefix[0] = 0;
+  for (component = strtok_r(devdir, "/", &save); component; component = strtok_r(NULL, "/", &save))
+  {
+    len += snprintf(prefix + len, sizeof(prefix) - len, "/%s", component);
+    if (len >= sizeof(prefix))
+      break;
+
+    if (sscanf(component, "host%u%n", &n, &end) == 1 && component[end] == 0)
+      type = LINK_HOST;
+    else if (strncmp(component, "port-", 5) == 0)
+      type = LINK_PORT;
+    else if (strncmp(component, "expander-", 9) == 0)
+      type = LINK_EXPANDER;
+    else if (sscanf(component, "ata%u%n", &n, &end) == 1 && component[end] == 0)
+      type = LINK_ATA;
+    else
+      continue;
+
+    id = topo_link(t, component, type);
+    if (id == TOPO_MAX_LINKS || path->nlinks == TOPO_MAX_PATH)
+    {
+      printf("ERROR, %s: the topology of %s has too many links\n", __func__, dev->dev_path);
+      return -1;
+    }
+    path->links[path->nlinks++] = id;
+    link = &t->links[id];
+
+    if (link->users++ || emulated)
+      continue;
+
+    // what a link is and how fast it goes is found once, by the first device behind it
+    if (type == LINK_HOST)
+      probe_host(dev->fd, link->info, sizeof(link->info));
+    else if (type == LINK_PORT)
+      port_rate(link, prefix);
+    else if (type == LINK_ATA)
+    {
+      snprintf(gbitpath, sizeof(gbitpath), "/sys/class/ata_link/link%u/sata_spd", n);
+      gbit = read_gbit(gbitpath);
+      if (gbit > 0)
+      {
+        link->rate = link_bytes(gbit);
+        snprintf(link->info, sizeof(link->info), "%.1f Gbps", gbit);
+      }
+    }
+  }
+
+  return path->nlinks ? 0 : -1;
+}
+
+// name=MB/s,name=MB/s, ...
+int topo_parse_limits(const char *str, TOPO_LIMIT *limits, unsigned int *num)
+{
+  const char *p = str;
+  int n;
+
+  *num = 0;
+  while (*p)
+  {
+    if (*num == TOPO_MAX_LIMITS || sscanf(p, "%63[^=]=%u%n", limits[*num].name, &limits[*num].mbs, &n) != 2)
+      return -1;
+    (*num)++;
+    p += n;
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return -1;
+  }
+  return 0;
+}
+
+// A limit by name takes over the rate found in sysfs, every bucket starts full
+void topo_apply_limits(TOPOLOGY *t, const TOPO_LIMIT *limits, unsigned int num, unsigned int burst_bytes)
+{
+  TOPO_LINK *link;
+  unsigned int i, j;
+
+  for (i = 0; i < t->nlinks; i++)
+  {
+    link = &t->links[i];
+    for (j = 0; j < num; j++)
+    {
+      if (strcmp(link->name, limits[j].name) == 0)
+        link->rate = limits[j].mbs * 1e6;
+    }
+
+    link->burst = link->rate * TOPO_BURST_MS / 1000;
+    if (link->burst < burst_bytes)
+      link->burst = burst_bytes;
+    link->tokens = link->burst;
+    link->refill_ns = now_ns();
+  }
+
+  for (j = 0; j < num; j++)
+  {
+    for (i = 0; i < t->nlinks && strcmp(t->links[i].name, limits[j].name) != 0; i++)
+      ;
+    if (i == t->nlinks)
+      printf("no link %s in the topology, its limit is ignored\n", limits[j].name);
+  }
+}
+
+void topo_refill(TOPOLOGY *t, unsigned long long now)
+{
+  TOPO_LINK *link;
+  unsigned int i;
+
+  for (i = 0; i < t->nlinks; i++)
+  {
+    link = &t->links[i];
+    if (link->rate > 0 && now > link->refill_ns)
+    {
+      link->tokens += link->rate * (now - link->refill_ns) / 1e9;
+      if (link->tokens > link->burst)
+        link->tokens = link->burst;
+    }
+    link->refill_ns = now;
+  }
+}
+
+// Whether a command of the device may go now
+int topo_admit(TOPOLOGY *t, TOPO_PATH *path)
+{
+  TOPO_LINK *link;
+  unsigned int i;
+
+  for (i = 0; i < path->nlinks; i++)
+  {
+    link = &t->links[path->links[i]];
+    if (link->rate > 0 && link->tokens <= 0)
+      return 0;
+  }
+  return 1;
+}
+
+void topo_charge(TOPOLOGY *t, TOPO_PATH *path, unsigned long long bytes)
+{
+  TOPO_LINK *link;
+  unsigned int i;
+
+  for (i = 0; i < path->nlinks; i++)
+  {
+    link = &t->links[path->links[i]];
+    link->bytes += bytes;
+    if (link->rate > 0)
+      link->tokens -= bytes;
+  }
+}
+
+// Time until every link of the path has tokens again
+unsigned long long topo_wait_ns(TOPOLOGY *t, TOPO_PATH *path)
+{
+  TOPO_LINK *link;
+  unsigned long long ns, wait = 0;
+  unsigned int i;
+
+  for (i = 0; i < path->nlinks; i++)
+  {
+    link = &t->links[path->links[i]];
+    if (link->rate > 0 && link->tokens <= 0)
+    {
+      ns = (unsigned long long)((1 - link->tokens) / link->rate * 1e9);
+      if (ns > wait)
+        wait = ns;
+    }
+  }
+  return wait;
+}
+
+void topo_print(TOPOLOGY *t, TOPO_PATH *path, const char *dev_path)
+{
+  TOPO_LINK *link;
+  unsigned int i;
+
+  printf("%s:", dev_path);
+  for (i = 0; i < path->nlinks; i++)
+  {
+    link = &t->links[path->links[i]];
+    printf("%s %s", i ? " >" : "", link->name);
+    if (link->info[0] || link->rate > 0)
+    {
+      printf(" (%s", link->info);
+      if (link->rate > 0)
+        printf("%s%.0f MB/s", link->info[0] ? ", " : "", link->rate / 1e6);
+      printf(")");
+    }
+  }
+  if (path->slot[0])
+    printf(", enclosure %s slot %s", path->enclosure, path->slot);
+  printf("\n");
+}
+
+// What the devices of one enclosure share: the enclosure, otherwise the expander closest to the device, which is
+// the backplane of most enclosures, otherwise the host adapter. NULL : the device shares nothing known
+const char *topo_domain(TOPOLOGY *t, TOPO_PATH *path)
+{
+  unsigned int i;
+
+  if (path->enclosure[0])
+    return path->enclosure;
+  for (i = path->nlinks; i > 0; i--)
+  {
+    if (t->links[path->links[i - 1]].type == LINK_EXPANDER)
+      return t->links[path->links[i - 1]].name;
+  }
+  for (i = 0; i < path->nlinks; i++)
+  {
+    if (t->links[path->links[i]].type == LINK_HOST)
+      return t->links[path->links[i]].name;
+  }
+  return NULL;
+}
@@ -0,0 +1,63 @@
+//
+// Topology of SCSI devices, host adapters, ports and expanders from sysfs, with a token bucket on every link
+//
+
+#ifndef _TOPO_H_
+#define _TOPO_H_
+
+#include "device.h"
+
+#define TOPO_MAX_LINKS     64
+#define TOPO_MAX_PATH      8           // links between the host and a device
+#define TOPO_MAX_LIMITS    16
+
+typedef enum _LINK_TYPE {
+  LINK_HOST = 0,         // host adapter, hostN
+  LINK_PORT,             // SAS port, narrow or wide, port-H:N[:M]
+  LINK_EXPANDER,         // expander-H:N
+  LINK_ATA               // SATA link of a libata port, ataN
+} LINK_TYPE;
+
+typedef struct _TOPO_LINK {
+  char name[64];
+  LINK_TYPE type;
+  char info[64];                  // driver of a host adapter, link rates of a port
+  double rate;                    // bytes per second, ZERO : not limited
+  double tokens;                  // bytes which may go now, below ZERO : owed
+  double burst;
+  unsigned long long refill_ns;
+  unsigned int users;             // devices behind the link
+  unsigned long long bytes;       // through the link
+} TOPO_LINK;
+
+typedef struct _TOPO_PATH {
+  unsigned int links[TOPO_MAX_PATH];   // from the host down to the device
+  unsigned int nlinks;
+  char enclosure[64];             // SES device of the enclosure, empty when not in an enclosure
+  char slot[64];
+} TOPO_PATH;
+
+// A throughput limit by link name, e.g. expander-2:0=1200
+typedef struct _TOPO_LIMIT {
+  char name[64];
+  unsigned int mbs;
+} TOPO_LIMIT;
+
+typedef struct _TOPOLOGY {
+  TOPO_LINK links[TOPO_MAX_LINKS];
+  unsigned int nlinks;
+} TOPOLOGY;
+
+void topo_init(TOPOLOGY *t);
+int  topo_add_device(TOPOLOGY *t, DEVICE_CONTEXT *dev, TOPO_PATH *path);
+int  topo_parse_limits(const char *str, TOPO_LIMIT *limits, unsigned int *num);
+void topo_apply_limits(TOPOLOGY *t, const TOPO_LIMIT *limits, unsigned int num, unsigned int burst_bytes);
+void topo_refill(TOPOLOGY *t, unsigned long long now);
+int  topo_admit(TOPOLOGY *t, TOPO_PATH *path);
+void topo_charge(TOPOLOGY *t, TOPO_PATH *path, unsigned long long bytes);
+unsigned long long topo_wait_ns(TOPOLOGY *t, TOPO_PATH *path);
+void topo_print(TOPOLOGY *t, TOPO_PATH *path, const char *dev_path);
+const char *topo_domain(TOPOLOGY *t, TOPO_PATH *path);
+const char *link_type_name(LINK_TYPE type);
+
+#endif
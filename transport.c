@@ -0,0 +1,580 @@
+//
+// Transport of sg_io_hdr requests.
+// sg character devices take asynchronous requests by write()/read() of sg_io_hdr, refer to the SCSI Generic HOWTO,
+// other devices, e.g. /dev/sdX, only take the SG_IO ioctl.
+// bsg devices only take struct sg_io_v4 by SG_IO. The sg v4 driver (version 4.0 and later) takes it by
+// SG_IOSUBMIT / SG_IORECEIVE too, and with SGV4_FLAG_MULTIPLE_REQS one ioctl carries an array of requests.
+// Callers always hand sg_io_hdr, it is converted to and from sg_io_v4 here. A v4 transport which the kernel
+// rejects falls back to v3 for the fd
+//
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <scsi/sg.h>
+#include <linux/bsg.h>
+
+#include "transport.h"
+#include "metrics.h"
+#include "stats.h"
+
+#define SG_CHAR_MAJOR  21      // SCSI_GENERIC_MAJOR
+#define SG_V4_VERSION  40000   // SG_GET_VERSION_NUM of the sg v4 driver
+#define SG_MAX_BATCH   64
+
+// sg v4 driver interface, not in the headers of kernels without it
+#ifndef SG_IOSUBMIT
+#define SG_IOSUBMIT              _IOWR(0x22, 0x41, struct sg_io_v4)
+#define SG_IORECEIVE             _IOWR(0x22, 0x42, struct sg_io_v4)
+#endif
+#ifndef SGV4_FLAG_MULTIPLE_REQS
+#define SGV4_FLAG_IMMED          0x400       // don't wait, the submit of a batch returns once it is queued
+#define SGV4_FLAG_MULTIPLE_REQS  0x40000     // the control object carries an array of requests
+#endif
+
+///////////////
+// PROTOTYPE
+///////////////
+static int sg_v3_execute(int fd, struct sg_io_hdr *io_hdr);
+static int sg_v3_submit(int fd, struct sg_io_hdr *io_hdr);
+static int sg_v3_receive(int fd, struct sg_io_hdr *io_hdr);
+static int sg_v4_execute(int fd, struct sg_io_hdr *io_hdr);
+static int sg_v4_submit(int fd, struct sg_io_hdr *io_hdr);
+static int sg_v4_receive(int fd, struct sg_io_hdr *io_hdr);
+static int sg_v4_submit_batch(int fd, struct sg_io_hdr **io_hdrs, unsigned int n);
+static int sg_v4_receive_batch(int fd, struct sg_io_hdr *io_hdrs, unsigned int max);
+
+///////////////
+// LOCALS
+///////////////
+static int lasterror;
+static const SG_TRANSPORT *fd_transport[MAX_TRANSPORT_FD];
+
+static const SG_TRANSPORT sg_v3_sync = {
+  "sg v3 ioctl", sg_v3_execute, NULL, NULL
+};
+
+static const SG_TRANSPORT sg_v3_async = {
+  "sg v3 async", sg_v3_execute, sg_v3_submit, sg_v3_receive
+};
+
+static const SG_TRANSPORT bsg_v4_sync = {
+  "bsg v4 ioctl", sg_v4_execute, NULL, NULL
+};
+
+static const SG_TRANSPORT sg_v4_async = {
+  "sg v4 async", sg_v4_execute, sg_v4_submit, sg_v4_receive, sg_v4_submit_batch, sg_v4_receive_batch
+};
+
+static const SG_TRANSPORT sg_v4_single = {
+  "sg v4 async", sg_v4_execute, sg_v4_submit, sg_v4_receive
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+void sg_io_setup(struct sg_io_hdr *io_hdr, unsigned char *cmd, unsigned int cmdsize, unsigned int isread,
+                 void *databuffer, unsigned int buffersize, unsigned char *sense_b, unsigned int sense_len, unsigned int timeout)
+{
+  memset(io_hdr, 0, sizeof(struct sg_io_hdr));
+  memset(sense_b, 0, sense_len);
+
+  io_hdr->cmdp = cmd;
+  io_hdr->cmd_len = cmdsize;
+  io_hdr->dxferp = databuffer;
+  io_hdr->dxfer_len = buffersize;
+  if (buffersize == 0)
+    io_hdr->dxfer_direction = SG_DXFER_NONE;
+  else
+    io_hdr->dxfer_direction = isread ? SG_DXFER_FROM_DEV : SG_DXFER_TO_DEV;
+
+  io_hdr->interface_id = 'S';     // means SCSI Generic driver interface
+  io_hdr->mx_sb_len = sense_len;
+  io_hdr->sbp = sense_b;
+  io_hdr->timeout = timeout;      // milliseconds
+}
+
+int transport_register(int fd, const SG_TRANSPORT *transport)
+{
+  if (fd < 0 || fd >= MAX_TRANSPORT_FD)
+    return -1;
+
+  fd_transport[fd] = transport;
+  return 0;
+}
+
+void transport_unregister(int fd)
+{
+  if (fd >= 0 && fd < MAX_TRANSPORT_FD)
+    fd_transport[fd] = NULL;
+}
+
+// Whether the character device is of the bsg class, its major number is dynamic
+static int is_bsg(struct stat *f_stat)
+{
+  char path[128];
+  char link[256];
+  ssize_t len;
+
+  snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/subsystem", major(f_stat->st_rdev), minor(f_stat->st_rdev));
+  len = readlink(path, link, sizeof(link) - 1);
+  if (len <= 0)
+    return 0;
+  link[len] = 0;
+
+  return len >= 4 && strcmp(link + len - 4, "/bsg") == 0;
+}
+
+// The transport of a fd which isn't registered is chosen by the device type
+const SG_TRANSPORT *transport_get(int fd)
+{
+  struct stat f_stat;
+  const SG_TRANSPORT *transport = &sg_v3_sync;
+  int version = 0;
+
+  if (fd >= 0 && fd < MAX_TRANSPORT_FD && fd_transport[fd])
+    return fd_transport[fd];
+
+  if (fstat(fd, &f_stat) == 0 && S_ISCHR(f_stat.st_mode))
+  {
+    if (major(f_stat.st_rdev) == SG_CHAR_MAJOR)
+    {
+      transport = &sg_v3_async;
+      if (ioctl(fd, SG_GET_VERSION_NUM, &version) == 0 && version >= SG_V4_VERSION)
+        transport = &sg_v4_async;
+    }
+    else if (is_bsg(&f_stat))
+      transport = &bsg_v4_sync;
+  }
+
+  transport_register(fd, transport);
+  return transport;
+}
+
+int sg_execute(int fd, struct sg_io_hdr *io_hdr)
+{
+  unsigned long long start;
+  int ret;
+
+  if (!metrics_enabled)
+    return transport_get(fd)->execute(fd, io_hdr);
+
+  start = now_ns();
+  ret = transport_get(fd)->execute(fd, io_hdr);
+  if (ret == 0)
+    metrics_complete(fd, io_hdr, now_ns() - start);
+  return ret;
+}
+
+int sg_submit(int fd, struct sg_io_hdr *io_hdr)
+{
+  const SG_TRANSPORT *transport = transport_get(fd);
+
+  if (transport->submit == NULL)
+    return -1;
+
+  if (metrics_enabled)
+    metrics_submit(fd, io_hdr);
+  return transport->submit(fd, io_hdr);
+}
+
+int sg_receive(int fd, struct sg_io_hdr *io_hdr)
+{
+  const SG_TRANSPORT *transport = transport_get(fd);
+
+  if (transport->receive == NULL)
+    return -1;
+
+  if (transport->receive(fd, io_hdr) != 0)
+    return -1;
+  if (metrics_enabled)
+    metrics_receive(fd, io_hdr);
+  return 0;
+}
+
+// A submitted request has completed, receive takes it without waiting
+int sg_ready(int fd)
+{
+  const SG_TRANSPORT *transport = transport_get(fd);
+  struct pollfd pfd;
+
+  if (transport->ready)
+    return transport->ready(fd);
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+// Wait up to timeout_ms for a submitted request to complete, 1 : receive takes it without waiting
+int sg_wait(int fd, unsigned int timeout_ms)
+{
+  const SG_TRANSPORT *transport = transport_get(fd);
+  unsigned long long end = now_ns() + timeout_ms * 1000000ULL;
+  struct timespec ts;
+  struct pollfd pfd;
+
+  // a transport without a fd to poll is asked every 100 us
+  if (transport->ready)
+  {
+    ts.tv_sec = 0;
+    ts.tv_nsec = 100000;
+    while (!transport->ready(fd))
+    {
+      if (now_ns() >= end)
+        return 0;
+      nanosleep(&ts, NULL);
+    }
+    return 1;
+  }
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+  return poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN);
+}
+
+int sg_async_supported(int fd)
+{
+  return transport_get(fd)->submit != NULL;
+}
+
+int sg_batch_supported(int fd)
+{
+  return transport_get(fd)->submit_batch != NULL;
+}
+
+// Submit n requests, one by one when the transport has no batch. Returns how many are sent, from the first on
+int sg_submit_batch(int fd, struct sg_io_hdr **io_hdrs, unsigned int n)
+{
+  const SG_TRANSPORT *transport = transport_get(fd);
+  unsigned int i, sent = 0;
+  int ret;
+
+  if (transport->submit_batch)
+  {
+    ret = transport->submit_batch(fd, io_hdrs, n);
+    if (ret > 0)
+      sent = ret;
+  }
+
+  // a failed batch may have fallen back to a transport without batch, the rest goes one by one after the requests
+  // the batch has sent
+  transport = transport_get(fd);
+  while (sent < n && transport->submit && transport->submit(fd, io_hdrs[sent]) == 0)
+    sent++;
+
+  for (i = 0; metrics_enabled && i < sent; i++)
+    metrics_submit(fd, io_hdrs[i]);
+  return sent;
+}
+
+// Wait for one completed request at least and take up to max of them, the number taken or -1
+int sg_receive_batch(int fd, struct sg_io_hdr *io_hdrs, unsigned int max)
+{
+  const SG_TRANSPORT *transport = transport_get(fd);
+  int i, n;
+
+  if (max == 0)
+    return -1;
+  if (transport->receive_batch)
+    n = transport->receive_batch(fd, io_hdrs, max);
+  else if (transport->receive == NULL)
+    return -1;
+  else
+    n = transport->receive(fd, io_hdrs) == 0 ? 1 : -1;
+
+  for (i = 0; metrics_enabled && i < n; i++)
+    metrics_receive(fd, &io_hdrs[i]);
+  return n;
+}
+
+static int sg_v3_execute(int fd, struct sg_io_hdr *io_hdr)
+{
+  int ret;
+
+  ret = ioctl(fd, SG_IO, io_hdr);
+  if (ret < 0)
+  {
+    lasterror = errno;
+    printf("ret %d, Send command failed (%d) - %s\n", ret, lasterror, strerror(lasterror));
+    return -1;
+  }
+
+  return 0;
+}
+
+static int sg_v3_submit(int fd, struct sg_io_hdr *io_hdr)
+{
+  if (write(fd, io_hdr, sizeof(struct sg_io_hdr)) < 0)
+  {
+    lasterror = errno;
+    printf("Submit command failed (%d) - %s\n", lasterror, strerror(lasterror));
+    return -1;
+  }
+
+  return 0;
+}
+
+// pack_id -1 takes the oldest completed request. fd is opened with O_NONBLOCK, so wait by poll first
+static int sg_v3_receive(int fd, struct sg_io_hdr *io_hdr)
+{
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  while (1)
+  {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+    {
+      lasterror = errno;
+      printf("Poll failed (%d) - %s\n", lasterror, strerror(lasterror));
+      return -1;
+    }
+
+    memset(io_hdr, 0, sizeof(struct sg_io_hdr));
+    io_hdr->interface_id = 'S';
+    io_hdr->pack_id = -1;
+    if (read(fd, io_hdr, sizeof(struct sg_io_hdr)) >= 0)
+      return 0;
+
+    if (errno != EAGAIN && errno != EINTR)
+    {
+      lasterror = errno;
+      printf("Receive command failed (%d) - %s\n", lasterror, strerror(lasterror));
+      return -1;
+    }
+  }
+}
+
+static void sg_v3_to_v4(struct sg_io_hdr *io_hdr, struct sg_io_v4 *v4)
+{
+  memset(v4, 0, sizeof(struct sg_io_v4));
+  v4->guard = 'Q';
+  v4->protocol = BSG_PROTOCOL_SCSI;
+  v4->subprotocol = BSG_SUB_PROTOCOL_SCSI_CMD;
+  v4->request_len = io_hdr->cmd_len;
+  v4->request = (unsigned long)io_hdr->cmdp;
+  v4->max_response_len = io_hdr->mx_sb_len;
+  v4->response = (unsigned long)io_hdr->sbp;
+  if (io_hdr->dxfer_direction == SG_DXFER_TO_DEV)
+  {
+    v4->dout_xfer_len = io_hdr->dxfer_len;
+    v4->dout_xferp = (unsigned long)io_hdr->dxferp;
+  }
+  else if (io_hdr->dxfer_direction == SG_DXFER_FROM_DEV)
+  {
+    v4->din_xfer_len = io_hdr->dxfer_len;
+    v4->din_xferp = (unsigned long)io_hdr->dxferp;
+  }
+  v4->timeout = io_hdr->timeout;
+  v4->request_extra = io_hdr->pack_id;
+  v4->usr_ptr = (unsigned long)io_hdr;    // the header the result goes back to
+}
+
+static void sg_v4_to_v3(struct sg_io_v4 *v4, struct sg_io_hdr *io_hdr)
+{
+  io_hdr->status = v4->device_status;
+  io_hdr->masked_status = (v4->device_status >> 1) & 0x7F;
+  io_hdr->host_status = v4->transport_status;
+  io_hdr->driver_status = v4->driver_status;
+  io_hdr->sb_len_wr = v4->response_len;
+  io_hdr->resid = io_hdr->dxfer_direction == SG_DXFER_TO_DEV ? v4->dout_resid : v4->din_resid;
+  io_hdr->duration = v4->duration;
+  io_hdr->info = v4->info;
+  if (io_hdr->status || io_hdr->host_status || io_hdr->driver_status)
+    io_hdr->info |= SG_INFO_CHECK;
+}
+
+// A kernel without the v4 interface on this fd, go on with v3
+static int sg_v4_rejected(int fd, int err)
+{
+  if (err != ENOTTY && err != EINVAL && err != EOPNOTSUPP)
+    return 0;
+
+  transport_register(fd, transport_get(fd)->submit ? &sg_v3_async : &sg_v3_sync);
+  return 1;
+}
+
+static int sg_v4_execute(int fd, struct sg_io_hdr *io_hdr)
+{
+  struct sg_io_v4 v4;
+  int ret;
+
+  sg_v3_to_v4(io_hdr, &v4);
+  ret = ioctl(fd, SG_IO, &v4);
+  if (ret < 0)
+  {
+    lasterror = errno;
+    if (sg_v4_rejected(fd, lasterror))
+      return sg_v3_execute(fd, io_hdr);
+    printf("ret %d, Send command failed (%d) - %s\n", ret, lasterror, strerror(lasterror));
+    return -1;
+  }
+
+  sg_v4_to_v3(&v4, io_hdr);
+  return 0;
+}
+
+static int sg_v4_submit(int fd, struct sg_io_hdr *io_hdr)
+{
+  struct sg_io_v4 v4;
+
+  sg_v3_to_v4(io_hdr, &v4);
+  if (ioctl(fd, SG_IOSUBMIT, &v4) < 0)
+  {
+    lasterror = errno;
+    if (sg_v4_rejected(fd, lasterror))
+      return sg_v3_submit(fd, io_hdr);
+    printf("Submit command failed (%d) - %s\n", lasterror, strerror(lasterror));
+    return -1;
+  }
+
+  return 0;
+}
+
+// Like sg_v3_receive(), the header returned is a copy of the submitted one with the status filled in
+static int sg_v4_receive(int fd, struct sg_io_hdr *io_hdr)
+{
+  struct sg_io_v4 v4;
+  struct sg_io_hdr *src;
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  while (1)
+  {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+    {
+      lasterror = errno;
+      printf("Poll failed (%d) - %s\n", lasterror, strerror(lasterror));
+      return -1;
+    }
+
+    memset(&v4, 0, sizeof(v4));
+    v4.guard = 'Q';
+    v4.request_extra = -1;                // any request
+    if (ioctl(fd, SG_IORECEIVE, &v4) >= 0)
+      break;
+
+    if (errno != EAGAIN && errno != EINTR)
+    {
+      lasterror = errno;
+      printf("Receive command failed (%d) - %s\n", lasterror, strerror(lasterror));
+      return -1;
+    }
+  }
+
+  src = (struct sg_io_hdr *)(unsigned long)v4.usr_ptr;
+  sg_v4_to_v3(&v4, src);
+  *io_hdr = *src;
+  return 0;
+}
+
+// One SG_IOSUBMIT for all of them, the control object points to the array of requests. When it fails the driver
+// reports in info how many it took before the error
+static int sg_v4_submit_batch(int fd, struct sg_io_hdr **io_hdrs, unsigned int n)
+{
+  struct sg_io_v4 reqs[SG_MAX_BATCH];
+  struct sg_io_v4 ctl;
+  unsigned int i;
+
+  if (n > SG_MAX_BATCH)
+    return -1;
+
+  for (i = 0; i < n; i++)
+    sg_v3_to_v4(io_hdrs[i], &reqs[i]);
+
+  memset(&ctl, 0, sizeof(ctl));
+  ctl.guard = 'Q';
+  ctl.flags = SGV4_FLAG_MULTIPLE_REQS | SGV4_FLAG_IMMED;
+  ctl.dout_xferp = (unsigned long)reqs;
+  ctl.dout_xfer_len = n * sizeof(struct sg_io_v4);
+  if (ioctl(fd, SG_IOSUBMIT, &ctl) < 0)
+  {
+    // the driver takes v4 but not an array, requests go one by one from now on
+    lasterror = errno;
+    if (lasterror == EINVAL || lasterror == EOPNOTSUPP)
+      transport_register(fd, &sg_v4_single);
+    else
+      printf("Submit batch failed (%d) - %s\n", lasterror, strerror(lasterror));
+    return ctl.info <= n ? (int)ctl.info : 0;
+  }
+
+  return n;
+}
+
+// One SG_IORECEIVE for every request which is completed, the driver writes them to the response array
+static int sg_v4_receive_batch(int fd, struct sg_io_hdr *io_hdrs, unsigned int max)
+{
+  struct sg_io_v4 rsps[SG_MAX_BATCH];
+  struct sg_io_v4 ctl;
+  struct sg_io_hdr *src;
+  struct pollfd pfd;
+  unsigned int i, n;
+
+  if (max > SG_MAX_BATCH)
+    max = SG_MAX_BATCH;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  while (1)
+  {
+    if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+    {
+      lasterror = errno;
+      printf("Poll failed (%d) - %s\n", lasterror, strerror(lasterror));
+      return -1;
+    }
+
+    memset(rsps, 0, max * sizeof(struct sg_io_v4));
+    memset(&ctl, 0, sizeof(ctl));
+    ctl.guard = 'Q';
+    ctl.flags = SGV4_FLAG_MULTIPLE_REQS | SGV4_FLAG_IMMED;
+    ctl.din_xferp = (unsigned long)rsps;
+    ctl.din_xfer_len = max * sizeof(struct sg_io_v4);
+    if (ioctl(fd, SG_IORECEIVE, &ctl) >= 0)
+      break;
+
+    if (errno == EINVAL || errno == EOPNOTSUPP)
+    {
+      transport_register(fd, &sg_v4_single);
+      return sg_v4_receive(fd, io_hdrs) == 0 ? 1 : -1;
+    }
+    if (errno != EAGAIN && errno != EINTR)
+    {
+      lasterror = errno;
+      printf("Receive batch failed (%d) - %s\n", lasterror, strerror(lasterror));
+      return -1;
+    }
+  }
+
+  // responses are written from the start of the array, the driver reports how many in info and the entries it
+  // left unused in din_resid
+  n = ctl.info;
+  if (n == 0 || n > max)
+    n = (unsigned int)ctl.din_resid < max ? max - ctl.din_resid : 0;
+
+  for (i = 0; i < n; i++)
+  {
+    src = (struct sg_io_hdr *)(unsigned long)rsps[i].usr_ptr;
+    if (src == NULL)
+      break;
+    sg_v4_to_v3(&rsps[i], src);
+    io_hdrs[i] = *src;
+  }
+
+  return i ? (int)i : -1;
+}
@@ -0,0 +1,41 @@
+//
+// Transport of sg_io_hdr requests, the SG_IO ioctl by default, sg v4 on bsg and the sg v4 driver
+//
+
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <scsi/sg.h>
+
+#define MAX_TRANSPORT_FD  1024
+
+// A transport executes sg_io_hdr requests for a fd. submit and receive are the asynchronous interface,
+// submit is NULL when the transport can only execute one request at a time.
+// submit_batch and receive_batch move many requests per system call, NULL when the transport can't.
+// ready tells whether receive would return without waiting, NULL : poll() of the fd does
+typedef struct _SG_TRANSPORT {
+  const char *name;
+  int (*execute)(int fd, struct sg_io_hdr *io_hdr);
+  int (*submit)(int fd, struct sg_io_hdr *io_hdr);
+  int (*receive)(int fd, struct sg_io_hdr *io_hdr);     // wait for any request submitted before
+  int (*submit_batch)(int fd, struct sg_io_hdr **io_hdrs, unsigned int n);     // how many are submitted, from the first
+  int (*receive_batch)(int fd, struct sg_io_hdr *io_hdrs, unsigned int max);   // wait for one at least, how many
+  int (*ready)(int fd);
+} SG_TRANSPORT;
+
+void sg_io_setup(struct sg_io_hdr *io_hdr, unsigned char *cmd, unsigned int cmdsize, unsigned int isread,
+                 void *databuffer, unsigned int buffersize, unsigned char *sense_b, unsigned int sense_len, unsigned int timeout);
+int  transport_register(int fd, const SG_TRANSPORT *transport);
+void transport_unregister(int fd);
+const SG_TRANSPORT *transport_get(int fd);
+int  sg_execute(int fd, struct sg_io_hdr *io_hdr);
+int  sg_submit(int fd, struct sg_io_hdr *io_hdr);
+int  sg_receive(int fd, struct sg_io_hdr *io_hdr);
+int  sg_async_supported(int fd);
+int  sg_batch_supported(int fd);
+int  sg_submit_batch(int fd, struct sg_io_hdr **io_hdrs, unsigned int n);
+int  sg_receive_batch(int fd, struct sg_io_hdr *io_hdrs, unsigned int max);
+int  sg_ready(int fd);
+int  sg_wait(int fd, unsigned int timeout_ms);
+
+#endif
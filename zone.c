@@ -0,0 +1,463 @@
+//
+// Zoned ATA devices.
+// The zone table is read with REPORT ZONES EXT a buffer at a time, descriptors are little endian, refer to ZAC
+// section 6.4.
+// The sequential writer keeps one write in flight per zone and as many zones in flight as streams, so that every
+// write starts at the write pointer of its zone whatever order the device completes queued commands in. That is
+// what host managed zones require and what host aware zones need to avoid the read-modify-write penalty
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zone.h"
+#include "command.h"
+#include "queue.h"
+#include "stats.h"
+#include "sense.h"
+
+#define ZONE_REPORT_PAGES   64        // 32 KiB, 511 zones per REPORT ZONES EXT
+#define ZONE_CHUNK          2048      // 1 MiB writes
+#define ZONE_STREAMS        8         // host managed drives limit the open zones, often to 128 or less
+#define ZONE_REPORT_NS      1000000000ULL
+
+typedef struct _ZONE_STREAM {
+  int zone;                       // -1 : idle
+  unsigned long long lba;         // next write, the write pointer once the writes in flight complete
+  unsigned long long end;
+  int busy;
+} ZONE_STREAM;
+
+///////////////
+// LOCALS
+///////////////
+extern unsigned int isDebug;
+
+static const struct {
+  const char *name;
+  unsigned int action;
+} zone_actions[] = {
+  { "close",  ZAC_CLOSE_ZONE },
+  { "finish", ZAC_FINISH_ZONE },
+  { "open",   ZAC_OPEN_ZONE },
+  { "reset",  ZAC_RESET_WP },
+};
+
+///////////////
+// FUNCTIONS
+///////////////
+
+static unsigned long long get_le64(const unsigned char *p)
+{
+  unsigned long long value = 0;
+  int i;
+
+  for (i = 7; i >= 0; i--)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+const char *zone_type_name(unsigned int type)
+{
+  switch (type)
+  {
+    case ZONE_TYPE_CONVENTIONAL: return "conventional";
+    case ZONE_TYPE_SWR:          return "seq required";
+    case ZONE_TYPE_SWP:          return "seq preferred";
+    default:                     return "unknown";
+  }
+}
+
+const char *zone_cond_name(unsigned int cond)
+{
+  switch (cond)
+  {
+    case ZONE_COND_NOT_WP:    return "not wp";
+    case ZONE_COND_EMPTY:     return "empty";
+    case ZONE_COND_IMP_OPEN:  return "implicit open";
+    case ZONE_COND_EXP_OPEN:  return "explicit open";
+    case ZONE_COND_CLOSED:    return "closed";
+    case ZONE_COND_READ_ONLY: return "read only";
+    case ZONE_COND_FULL:      return "full";
+    case ZONE_COND_OFFLINE:   return "offline";
+    default:                  return "unknown";
+  }
+}
+
+// ZAC action of open/close/finish/reset, ZERO when the name is unknown
+unsigned int zone_action_by_name(const char *name)
+{
+  unsigned int i;
+
+  for (i = 0; i < sizeof(zone_actions) / sizeof(zone_actions[0]); i++)
+  {
+    if (strcmp(name, zone_actions[i].name) == 0)
+      return zone_actions[i].action;
+  }
+  return 0;
+}
+
+static int zone_grow(ZONE_TABLE *table, unsigned int nzones)
+{
+  ZONE *zones = (ZONE *)realloc(table->zones, nzones * sizeof(ZONE));
+  unsigned char *type = (unsigned char *)realloc(table->type, nzones);
+  unsigned char *cond = (unsigned char *)realloc(table->cond, nzones);
+
+  if (zones)
+    table->zones = zones;
+  if (type)
+    table->type = type;
+  if (cond)
+    table->cond = cond;
+  return zones && type && cond ? 0 : -1;
+}
+
+// Read the zone table of the whole device, -1 when the device isn't zoned
+int zone_report(DEVICE_CONTEXT *dev, ZONE_TABLE *table)
+{
+  unsigned char *buffer;
+  unsigned long long lba = 0;
+  unsigned long long listlen;
+  unsigned int capacity = 0;
+  unsigned int n, i;
+
+  memset(table, 0, sizeof(ZONE_TABLE));
+  buffer = (unsigned char *)malloc(ZONE_REPORT_PAGES * 512);
+  if (buffer == NULL)
+    return -1;
+
+  while (1)
+  {
+    if (report_zones_ext(dev->fd, lba, 0, 1, buffer, ZONE_REPORT_PAGES) != 0)
+    {
+      free(buffer);
+      zone_free(table);
+      return -1;
+    }
+
+    listlen = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((unsigned long long)buffer[3] << 24);
+    table->max_lba = get_le64(buffer + 8);
+    n = listlen / 64;
+    if (n > ZONE_REPORT_PAGES * 512 / 64 - 1)
+      n = ZONE_REPORT_PAGES * 512 / 64 - 1;
+    if (n == 0)
+      break;
+
+    if (table->nzones + n > capacity)
+    {
+      capacity = (table->nzones + n) * 2;
+      if (zone_grow(table, capacity) != 0)
+      {
+        printf("ERROR, %s: line %d\n", __func__, __LINE__);
+        free(buffer);
+        zone_free(table);
+        return -1;
+      }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+      unsigned char *desc = buffer + 64 + i * 64;
+      ZONE *zone = &table->zones[table->nzones];
+
+      table->type[table->nzones] = desc[0] & 0xF;
+      table->cond[table->nzones] = desc[1] >> 4;
+      zone->length = get_le64(desc + 8);
+      zone->start = get_le64(desc + 16);
+      zone->wp = get_le64(desc + 24);
+      table->nzones++;
+    }
+
+    lba = table->zones[table->nzones - 1].start + table->zones[table->nzones - 1].length;
+    if (lba > table->max_lba || table->zones[table->nzones - 1].length == 0)
+      break;
+  }
+
+  free(buffer);
+  return table->nzones ? 0 : -1;
+}
+
+void zone_free(ZONE_TABLE *table)
+{
+  free(table->zones);
+  free(table->type);
+  free(table->cond);
+  memset(table, 0, sizeof(ZONE_TABLE));
+}
+
+// Index of the zone of lba, zones are in LBA order. -1 when it is beyond the last zone
+int zone_find(ZONE_TABLE *table, unsigned long long lba)
+{
+  int lo = 0;
+  int hi = table->nzones - 1;
+
+  while (lo <= hi)
+  {
+    int mid = (lo + hi) / 2;
+    ZONE *zone = &table->zones[mid];
+
+    if (lba < zone->start)
+      hi = mid - 1;
+    else if (lba >= zone->start + zone->length)
+      lo = mid + 1;
+    else
+      return mid;
+  }
+
+  return -1;
+}
+
+// Count of zones by type and condition, every zone with -D or when there are few
+void zone_print(ZONE_TABLE *table)
+{
+  unsigned int types[16], conds[16];
+  unsigned int i;
+
+  memset(types, 0, sizeof(types));
+  memset(conds, 0, sizeof(conds));
+  for (i = 0; i < table->nzones; i++)
+  {
+    types[table->type[i]]++;
+    conds[table->cond[i]]++;
+  }
+
+  printf("%u zones, max lba 0x%llx\n", table->nzones, table->max_lba);
+  for (i = 0; i < 16; i++)
+  {
+    if (types[i])
+      printf("  %-14s %u zones\n", zone_type_name(i), types[i]);
+  }
+  for (i = 0; i < 16; i++)
+  {
+    if (conds[i])
+      printf("  %-14s %u zones\n", zone_cond_name(i), conds[i]);
+  }
+
+  if (!isDebug && table->nzones > 64)
+    return;
+
+  for (i = 0; i < table->nzones; i++)
+  {
+    ZONE *zone = &table->zones[i];
+
+    printf("zone %u start 0x%llx length 0x%llx %s %s", i, zone->start, zone->length, zone_type_name(table->type[i]),
+           zone_cond_name(table->cond[i]));
+    if (table->type[i] != ZONE_TYPE_CONVENTIONAL)
+      printf(" wp 0x%llx (%.1f%%)", zone->wp, zone->length ? 100.0 * (zone->wp - zone->start) / zone->length : 0);
+    printf("\n");
+  }
+}
+
+int zone_action(DEVICE_CONTEXT *dev, unsigned int action, unsigned long long zonelba, unsigned int all)
+{
+  return zac_management_out(dev->fd, action, zonelba, all);
+}
+
+static int zone_writable(ZONE_TABLE *table, int index)
+{
+  unsigned int cond = table->cond[index];
+
+  return table->type[index] != ZONE_TYPE_CONVENTIONAL && cond != ZONE_COND_FULL && cond != ZONE_COND_READ_ONLY &&
+         cond != ZONE_COND_OFFLINE;
+}
+
+static int zone_queued(DEVICE_CONTEXT *dev)
+{
+  return dev->path == PATH_SBC || dev->protocol == RW_DMA_QUEUED || dev->protocol == RW_FPDMA;
+}
+
+// Give the stream the next zone which can be written from startlba on, explicitly opened. -1 when there is none
+static int stream_next(DEVICE_CONTEXT *dev, ZONE_TABLE *table, ZONE_STREAM *stream, int *next)
+{
+  while (*next >= 0 && *next < (int)table->nzones)
+  {
+    int index = (*next)++;
+
+    if (!zone_writable(table, index))
+      continue;
+
+    if (zone_action(dev, ZAC_OPEN_ZONE, table->zones[index].start, 0) != 0)
+    {
+      printf("zone %d can't be opened, too many open zones?\n", index);
+      (*next)--;
+      return -1;
+    }
+    table->cond[index] = ZONE_COND_EXP_OPEN;
+    stream->zone = index;
+    stream->lba = table->zones[index].wp;
+    stream->end = table->zones[index].start + table->zones[index].length;
+    return 0;
+  }
+
+  stream->zone = -1;
+  return -1;
+}
+
+// Stream writes of ZERO at the write pointer of the zones from the zone of startlba on
+int zone_write_seq(DEVICE_CONTEXT *dev, ZONE_TABLE *table, ZONE_WRITE *job)
+{
+  IO_QUEUE *q;
+  IO_REQUEST *req;
+  ZONE_STREAM *streams;
+  LAT_STATS lat;
+  SENSE_INFO sense;
+  char *buffer;
+  unsigned long long remaining = job->sectors ? job->sectors : ~0ULL;
+  unsigned long long done = 0;
+  unsigned long long start, last_report, now;
+  unsigned int chunk = job->chunk ? job->chunk : ZONE_CHUNK;
+  unsigned int nstreams = job->streams ? job->streams : ZONE_STREAMS;
+  unsigned int active = 0, filled = 0, errors = 0;
+  unsigned int i;
+  int next = zone_find(table, job->startlba);
+  double seconds;
+
+  if (next < 0)
+  {
+    printf("ERROR, %s: lba 0x%llx is beyond the last zone\n", __func__, job->startlba);
+    return -1;
+  }
+  chunk = device_align_sectors(dev, chunk);   // whole physical sectors within one command
+  if (chunk == 0)
+  {
+    printf("ERROR, %s: %u sectors per command can't hold a physical sector of %u\n", __func__, dev->max_sectors,
+           dev->phys_sectors);
+    return -1;
+  }
+  if (!zone_queued(dev))
+    nstreams = 1;
+  if (nstreams > IOQ_MAX_DEPTH)
+    nstreams = IOQ_MAX_DEPTH;
+
+  q = (IO_QUEUE *)malloc(sizeof(IO_QUEUE));
+  streams = (ZONE_STREAM *)calloc(nstreams, sizeof(ZONE_STREAM));
+  buffer = (char *)calloc(chunk, dev->sector_size);      // every write sends the same ZERO data
+  if (q == NULL || streams == NULL || buffer == NULL || ioq_init(q, dev, nstreams) != 0)
+  {
+    printf("ERROR, %s: line %d\n", __func__, __LINE__);
+    free(q);
+    free(streams);
+    free(buffer);
+    return -1;
+  }
+  stats_reset(&lat);
+
+  for (i = 0; i < nstreams; i++)
+  {
+    if (stream_next(dev, table, &streams[i], &next) != 0)
+      break;
+    active++;
+  }
+  nstreams = active ? active : 1;
+  printf("zone write from zone %d, %u zones at a time, %u sectors per write\n",
+         zone_find(table, job->startlba), active, chunk);
+
+  start = now_ns();
+  last_report = start;
+  while (active)
+  {
+    for (i = 0; i < nstreams; i++)
+    {
+      ZONE_STREAM *stream = &streams[i];
+
+      if (stream->zone < 0 || stream->busy || remaining == 0 || (req = ioq_get(q)) == NULL)
+        continue;
+
+      req->isread = 0;
+      req->startlba = stream->lba;
+      req->sectors = stream->end - stream->lba < chunk ? stream->end - stream->lba : chunk;
+      if (req->sectors > remaining)
+        req->sectors = remaining;
+      req->databuffer = buffer;
+      req->priv = stream;
+      if (ioq_submit(q, req) != 0)
+      {
+        printf("ERROR, %s: lba 0x%lx, sectors %u can't be sent\n", __func__, req->startlba, req->sectors);
+        ioq_put(q, req);
+        errors++;
+        stream->zone = -1;
+        active--;
+        continue;
+      }
+      stream->busy = 1;
+      stream->lba += req->sectors;
+      remaining -= req->sectors;
+    }
+
+    req = ioq_reap(q);
+    if (req == NULL)
+    {
+      // out of budget, close the zones which are left open
+      for (i = 0; i < nstreams; i++)
+      {
+        if (streams[i].zone >= 0)
+        {
+          zone_action(dev, ZAC_CLOSE_ZONE, table->zones[streams[i].zone].start, 0);
+          table->cond[streams[i].zone] = ZONE_COND_CLOSED;
+          streams[i].zone = -1;
+        }
+      }
+      break;
+    }
+
+    {
+      ZONE_STREAM *stream = (ZONE_STREAM *)req->priv;
+      ZONE *zone = &table->zones[stream->zone];
+
+      stream->busy = 0;
+      stats_add(&lat, req->complete_ns - req->submit_ns);
+      if (req->status != 0)
+      {
+        printf("ERROR, zone %d: lba 0x%lx, sectors %u", stream->zone, req->startlba, req->sectors);
+        if (sense_decode(req->sense_b, req->io_hdr.sb_len_wr, &sense) == 0)
+          printf(", %s %02x/%02x", sense_key_string(sense.sk), sense.asc, sense.ascq);
+        printf("\n");
+        errors++;
+        zone_action(dev, ZAC_CLOSE_ZONE, zone->start, 0);
+        table->cond[stream->zone] = ZONE_COND_CLOSED;
+        if (remaining == 0 || stream_next(dev, table, stream, &next) != 0)
+        {
+          stream->zone = -1;
+          active--;
+        }
+      }
+      else
+      {
+        zone->wp = req->startlba + req->sectors;
+        done += req->sectors;
+        if (zone->wp == zone->start + zone->length)
+        {
+          table->cond[stream->zone] = ZONE_COND_FULL;
+          filled++;
+          if (remaining == 0 || stream_next(dev, table, stream, &next) != 0)
+          {
+            stream->zone = -1;
+            active--;
+          }
+        }
+      }
+    }
+    ioq_put(q, req);
+
+    now = now_ns();
+    if (now - last_report >= ZONE_REPORT_NS)
+    {
+      printf("zone write %llu sectors, %u zones full, %.1f MB/s\n", done, filled,
+             done * dev->sector_size / ((now - start) / 1e9) / 1e6);
+      last_report = now;
+    }
+  }
+  seconds = (now_ns() - start) / 1e9;
+
+  ioq_drain(q);
+  free(q);
+  free(streams);
+  free(buffer);
+
+  printf("zone write done, %llu sectors, %u zones full, %u errors, %.3f s, %.1f MB/s\n", done, filled, errors, seconds,
+         seconds > 0 ? done * dev->sector_size / seconds / 1e6 : 0);
+  printf("latency avg %.1f us, p99 %.1f us, max %.1f us\n", stats_mean(&lat) / 1e3, stats_percentile(&lat, 99) / 1e3,
+         lat.max / 1e3);
+
+  return errors ? -1 : 0;
+}
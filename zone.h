@@ -0,0 +1,56 @@
+//
+// Zoned ATA devices (ZAC), zone table and sequential writer
+//
+
+#ifndef _ZONE_H_
+#define _ZONE_H_
+
+#include "device.h"
+
+// Zone types and conditions, refer to ZAC section 6.4.3
+#define ZONE_TYPE_CONVENTIONAL  0x1
+#define ZONE_TYPE_SWR           0x2       // sequential write required, host managed
+#define ZONE_TYPE_SWP           0x3       // sequential write preferred, host aware
+
+#define ZONE_COND_NOT_WP        0x0
+#define ZONE_COND_EMPTY         0x1
+#define ZONE_COND_IMP_OPEN      0x2
+#define ZONE_COND_EXP_OPEN      0x3
+#define ZONE_COND_CLOSED        0x4
+#define ZONE_COND_READ_ONLY     0xD
+#define ZONE_COND_FULL          0xE
+#define ZONE_COND_OFFLINE       0xF
+
+// 24 bytes per zone, a 20 TB drive of 256 MiB zones fits in 2 MiB
+typedef struct _ZONE {
+  unsigned long long start;
+  unsigned long long length;
+  unsigned long long wp;
+} ZONE;
+
+typedef struct _ZONE_TABLE {
+  unsigned int nzones;
+  ZONE *zones;
+  unsigned char *type;            // type and condition are kept apart so that ZONE stays 3 words
+  unsigned char *cond;
+  unsigned long long max_lba;
+} ZONE_TABLE;
+
+typedef struct _ZONE_WRITE {
+  unsigned long long startlba;    // writing starts in the zone of startlba
+  unsigned long long sectors;     // ZERO : to the end of the device
+  unsigned int chunk;             // sectors per write, ZERO : ZONE_CHUNK
+  unsigned int streams;           // zones written at the same time, ZERO : ZONE_STREAMS
+} ZONE_WRITE;
+
+int  zone_report(DEVICE_CONTEXT *dev, ZONE_TABLE *table);
+void zone_free(ZONE_TABLE *table);
+int  zone_find(ZONE_TABLE *table, unsigned long long lba);
+void zone_print(ZONE_TABLE *table);
+int  zone_action(DEVICE_CONTEXT *dev, unsigned int action, unsigned long long zonelba, unsigned int all);
+int  zone_write_seq(DEVICE_CONTEXT *dev, ZONE_TABLE *table, ZONE_WRITE *job);
+const char *zone_type_name(unsigned int type);
+const char *zone_cond_name(unsigned int cond);
+unsigned int zone_action_by_name(const char *name);
+
+#endif